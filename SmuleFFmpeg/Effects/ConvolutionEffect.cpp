@@ -0,0 +1,514 @@
+//
+//  ConvolutionEffect.cpp
+//  SmuleFFmpeg
+//
+
+#include "ConvolutionEffect.hpp"
+#include "SimdOps.hpp"
+#include <string.h>
+#include <math.h>
+
+extern "C" {
+	#include <libavcodec/avfft.h>
+	#include <libavutil/mem.h>
+}
+
+// acc[i] += src[i] * gain
+static void conv_accumulate(float* acc, const float* src, float gain, int num_frames) {
+	simd_float vgain = simd_set1(gain);
+	int i = 0;
+	for (; i + SIMD_WIDTH <= num_frames; i += SIMD_WIDTH)
+		simd_store(acc + i, simd_add(simd_load(acc + i), simd_mul(simd_load(src + i), vgain)));
+	for (; i < num_frames; ++i)
+		acc[i] = acc[i] + src[i] * gain;
+}
+
+// output[i] = effect[i] * wet + input[i] * (1 - wet)
+static void conv_mix(float* output, const float* effect, const float* input, float wet, int num_frames) {
+	simd_float vwet = simd_set1(wet);
+	simd_float vdry = simd_set1(1.0f - wet);
+	int i = 0;
+	for (; i + SIMD_WIDTH <= num_frames; i += SIMD_WIDTH)
+		simd_store(output + i, simd_add(simd_mul(simd_load(effect + i), vwet), simd_mul(simd_load(input + i), vdry)));
+	for (; i < num_frames; ++i)
+		output[i] = effect[i] * wet + input[i] * (1.0f - wet);
+}
+
+// acc += x * h over n bins of split complex spectra
+static void conv_complex_mac(float* accRe, float* accIm, const float* xRe, const float* xIm,
+							 const float* hRe, const float* hIm, int n) {
+	// bin 0 packs the DC and Nyquist values, both real, they multiply on their own
+	float dc = accRe[0] + xRe[0] * hRe[0];
+	float nyquist = accIm[0] + xIm[0] * hIm[0];
+	int i = 0;
+	for (; i + SIMD_WIDTH <= n; i += SIMD_WIDTH) {
+		simd_float xr = simd_load(xRe + i), xi = simd_load(xIm + i);
+		simd_float hr = simd_load(hRe + i), hi = simd_load(hIm + i);
+		simd_store(accRe + i, simd_add(simd_load(accRe + i), simd_sub(simd_mul(xr, hr), simd_mul(xi, hi))));
+		simd_store(accIm + i, simd_add(simd_load(accIm + i), simd_add(simd_mul(xr, hi), simd_mul(xi, hr))));
+	}
+	for (; i < n; ++i) {
+		float re = xRe[i] * hRe[i] - xIm[i] * hIm[i];
+		float im = xRe[i] * hIm[i] + xIm[i] * hRe[i];
+		accRe[i] += re;
+		accIm[i] += im;
+	}
+	accRe[0] = dc;
+	accIm[0] = nyquist;
+}
+
+// packed FFT output (re, im pairs) to split real and imaginary parts, and back
+static void conv_split(float* re, float* im, const float* packed, int n) {
+	for (int i = 0; i < n; ++i) {
+		re[i] = packed[2 * i];
+		im[i] = packed[2 * i + 1];
+	}
+}
+
+static void conv_interleave(float* packed, const float* re, const float* im, int n) {
+	for (int i = 0; i < n; ++i) {
+		packed[2 * i] = re[i];
+		packed[2 * i + 1] = im[i];
+	}
+}
+
+static int conv_log2(int n) {
+	int bits = 0;
+	while ((1 << bits) < n)
+		++bits;
+	return bits;
+}
+
+// deterministic noise for the presets, from -1 to 1
+static float conv_noise(unsigned int& seed) {
+	seed = seed * 1664525u + 1013904223u;
+	return (float)(seed >> 8) / 8388608.0f - 1.0f;
+}
+
+ConvolutionKernel::ConvolutionKernel() : numChannels(1), useFFT(0), maxDelay(0), ringCapacity(0), blockSize(0),
+										numPartitions(0), shift(0), forward(NULL), inverse(NULL), fftBuffer(NULL) {
+}
+
+ConvolutionKernel::~ConvolutionKernel() {
+	if (forward)
+		av_rdft_end(forward);
+	if (inverse)
+		av_rdft_end(inverse);
+	av_free(fftBuffer);
+}
+
+ConvolutionEffect::ConvolutionEffect() : BaseEffect(),
+								preset(ConvolutionPresetNone),
+								blockSize(CONV_DEFAULT_BLOCK_SIZE),
+								engine(ConvolutionEngineAuto),
+								publishedUseFFT(0),
+								publishedLatency(0),
+								publishedKernelBytes(0),
+								kernel(NULL),
+								ringHead(0),
+								blockFill(0),
+								spectrumHead(0),
+								wasEnabled(1),
+								resetRequested(0),
+								numChannels(1)
+{
+	parameters.add(ConvolutionParameterPreset, "Preset", EffectParameterUnitChoice, ConvolutionPresetNone, ConvolutionPresetLargeHall, ConvolutionPresetNone);
+	parameters.add(ConvolutionParameterBlockSize, "Block Size", EffectParameterUnitSamples, CONV_MIN_BLOCK_SIZE, CONV_MAX_BLOCK_SIZE, CONV_DEFAULT_BLOCK_SIZE);
+	parameters.add(ConvolutionParameterEngine, "Engine", EffectParameterUnitChoice, ConvolutionEngineAuto, ConvolutionEngineFFT, ConvolutionEngineAuto);
+	parameters.read(renderParameters);
+	// there is no render thread yet, take the kernel right away
+	kernel = buildKernel();
+}
+
+ConvolutionEffect::~ConvolutionEffect() {
+	delete kernel;
+}
+
+void ConvolutionEffect::process(float *input, float *output, int num_frames) {
+	processPlanar(&input, &output, 1, num_frames);
+}
+
+void ConvolutionEffect::processPlanar(float **input, float **output, int num_channels, int num_frames) {
+	// pick up the latest parameters, the kernel built from them and a pending
+	// reset, only at block boundaries
+	ConvolutionKernel* next = syncParameters(kernelExchange);
+	if (next) {
+		ConvolutionKernel* previous = kernel;
+		// a new kernel comes with cleared state
+		kernel = next;
+		ringHead = 0;
+		blockFill = 0;
+		spectrumHead = 0;
+		kernelExchange.retire(previous);
+	}
+	// nothing runs while disabled, so the state is stale when enabled again
+	if (resetRequested.exchange(0) || (enabled && !wasEnabled))
+		clearState();
+	wasEnabled = enabled;
+
+	// channels past the kernel's, or all of them while disabled, pass through
+	int channels = num_channels < kernel->numChannels ? num_channels : kernel->numChannels;
+	if (!enabled)
+		channels = 0;
+	for (int c = channels; c < num_channels; ++c)
+		if (output[c] != input[c])
+			memcpy(output[c], input[c], num_frames * sizeof(float));
+	if (channels == 0)
+		return;
+	if (kernel->useFFT)
+		processFFT(input, output, channels, num_frames);
+	else
+		processDirect(input, output, channels, num_frames);
+}
+
+void ConvolutionEffect::processInterleaved(float *input, float *output, int num_channels, int num_frames) {
+	// channels past CONV_MAX_CHANNELS pass through, the stride stays the caller's
+	int channels = num_channels < CONV_MAX_CHANNELS ? num_channels : CONV_MAX_CHANNELS;
+	float* planar[CONV_MAX_CHANNELS];
+	for (int c = 0; c < channels; ++c)
+		planar[c] = interleaveScratch[c];
+	for (int offset = 0; offset < num_frames; offset += CONV_DIRECT_BLOCK_SIZE) {
+		int frames = num_frames - offset < CONV_DIRECT_BLOCK_SIZE ? num_frames - offset : CONV_DIRECT_BLOCK_SIZE;
+		const float* in = input + offset * num_channels;
+		for (int i = 0; i < frames; ++i)
+			for (int c = 0; c < channels; ++c)
+				interleaveScratch[c][i] = in[i * num_channels + c];
+		processPlanar(planar, planar, channels, frames);
+		float* out = output + offset * num_channels;
+		for (int i = 0; i < frames; ++i) {
+			for (int c = 0; c < channels; ++c)
+				out[i * num_channels + c] = interleaveScratch[c][i];
+			for (int c = channels; c < num_channels; ++c)
+				out[i * num_channels + c] = in[i * num_channels + c];
+		}
+	}
+}
+
+void ConvolutionEffect::processDirect(float **input, float **output, int num_channels, int num_frames) {
+	ConvolutionKernel* k = kernel;
+	int capacity = k->ringCapacity;
+	int mask = capacity - 1;
+	std::size_t numTaps = k->delays.size();
+	float acc[CONV_DIRECT_BLOCK_SIZE];
+	for (int offset = 0; offset < num_frames; offset += CONV_DIRECT_BLOCK_SIZE) {
+		int frames = num_frames - offset < CONV_DIRECT_BLOCK_SIZE ? num_frames - offset : CONV_DIRECT_BLOCK_SIZE;
+		int head = ringHead;
+		for (int c = 0; c < num_channels; ++c) {
+			float* ring = &k->ring[c * capacity];
+			const float* in = input[c] + offset;
+			// write the input first, so a tap at delay 0 reads the current block
+			int span = capacity - head;
+			if (span > frames)
+				span = frames;
+			memcpy(ring + head, in, span * sizeof(float));
+			memcpy(ring, in + span, (frames - span) * sizeof(float));
+
+			memset(acc, 0, frames * sizeof(float));
+			// each tap is read as at most two contiguous spans of the ring
+			for (std::size_t t = 0; t < numTaps; ++t) {
+				int start = (head - k->delays[t]) & mask;
+				span = capacity - start;
+				if (span > frames)
+					span = frames;
+				conv_accumulate(acc, ring + start, k->gains[t], span);
+				conv_accumulate(acc + span, ring, k->gains[t], frames - span);
+			}
+			conv_mix(output[c] + offset, acc, in, wetMix, frames);
+		}
+		ringHead = (head + frames) & mask;
+	}
+}
+
+void ConvolutionEffect::processFFT(float **input, float **output, int num_channels, int num_frames) {
+	ConvolutionKernel* k = kernel;
+	int block = k->blockSize;
+	int offset = 0;
+	while (offset < num_frames) {
+		int frames = block - blockFill;
+		if (frames > num_frames - offset)
+			frames = num_frames - offset;
+		for (int c = 0; c < num_channels; ++c) {
+			float* blocks = &k->inputBlocks[2 * c * block];
+			// the output of the previous block plays while the current one fills up
+			memcpy(blocks + block + blockFill, input[c] + offset, frames * sizeof(float));
+			// the dry signal lags by the latency too, it is still in the input blocks
+			conv_mix(output[c] + offset, &k->outputBlocks[c * block + blockFill], blocks + k->shift + blockFill, wetMix, frames);
+		}
+		blockFill += frames;
+		offset += frames;
+		if (blockFill == block) {
+			for (int c = 0; c < num_channels; ++c)
+				computeBlock(c);
+			spectrumHead = spectrumHead + 1 < k->numPartitions ? spectrumHead + 1 : 0;
+			blockFill = 0;
+		}
+	}
+}
+
+void ConvolutionEffect::computeBlock(int channel) {
+	ConvolutionKernel* k = kernel;
+	int block = k->blockSize;
+	int size = 2 * block;
+	int numPartitions = k->numPartitions;
+	float* blocks = &k->inputBlocks[channel * size];
+	float* fft = k->fftBuffer;
+
+	// overlap-save, transform the previous and the current block together
+	memcpy(fft, blocks, size * sizeof(float));
+	av_rdft_calc(k->forward, fft);
+	float* spectrum = &k->spectra[(channel * numPartitions + spectrumHead) * size];
+	conv_split(spectrum, spectrum + block, fft, block);
+
+	// partition p of the response meets the input from p blocks ago
+	float* accRe = &k->accumulator[0];
+	float* accIm = accRe + block;
+	memset(accRe, 0, size * sizeof(float));
+	for (std::size_t i = 0; i < k->activePartitions.size(); ++i) {
+		int p = k->activePartitions[i];
+		const float* h = &k->partitions[i * size];
+		int slot = spectrumHead - p;
+		if (slot < 0)
+			slot += numPartitions;
+		const float* x = &k->spectra[(channel * numPartitions + slot) * size];
+		conv_complex_mac(accRe, accIm, x, x + block, h, h + block, block);
+	}
+	conv_interleave(fft, accRe, accIm, block);
+	av_rdft_calc(k->inverse, fft);
+	// the first half wrapped around, the second half is the output of this block
+	memcpy(&k->outputBlocks[channel * block], fft + block, block * sizeof(float));
+	memcpy(blocks, blocks + block, block * sizeof(float));
+}
+
+void ConvolutionEffect::clearState() {
+	ConvolutionKernel* k = kernel;
+	memset(k->ring.data(), 0, k->ring.size() * sizeof(float));
+	memset(k->spectra.data(), 0, k->spectra.size() * sizeof(float));
+	memset(k->inputBlocks.data(), 0, k->inputBlocks.size() * sizeof(float));
+	memset(k->outputBlocks.data(), 0, k->outputBlocks.size() * sizeof(float));
+	ringHead = 0;
+	blockFill = 0;
+	spectrumHead = 0;
+}
+
+void ConvolutionEffect::reset() {
+	resetRequested.store(1);
+}
+
+void ConvolutionEffect::setFrequency(float newFrequency) {
+	frequency = newFrequency;
+	// the response in samples stays as it is, taps and presets follow the frequency
+	if (preset != ConvolutionPresetNone)
+		generatePreset();
+	else if (!tapDelay.empty())
+		setTaps(std::vector<float>(tapDelay), std::vector<float>(tapGains));
+	else
+		publishKernel();
+}
+
+void ConvolutionEffect::setImpulseResponse(const float* ir, int length) {
+	int maxLength = (int)(CONV_MAX_IMPULSE_RESPONSE_SECONDS * frequency);
+	if (length > maxLength)
+		length = maxLength;
+	impulseResponse.assign(ir, ir + (length > 0 ? length : 0));
+	tapDelay.clear();
+	tapGains.clear();
+	parameters.beginBatch();
+	preset = ConvolutionPresetNone;
+	parameters.write(ConvolutionParameterPreset, preset);
+	publishKernel();
+	parameters.endBatch();
+}
+
+void ConvolutionEffect::setTaps(const std::vector<float>& delayMilliseconds, const std::vector<float>& gains) {
+	std::size_t numTaps = delayMilliseconds.size() < gains.size() ? delayMilliseconds.size() : gains.size();
+	int maxLength = (int)(CONV_MAX_IMPULSE_RESPONSE_SECONDS * frequency);
+	int length = 0;
+	for (std::size_t t = 0; t < numTaps; ++t) {
+		int delay = (int)(delayMilliseconds[t] * frequency / 1000.0f);
+		if (delay >= 0 && delay < maxLength && delay + 1 > length)
+			length = delay + 1;
+	}
+	// taps landing on the same sample add up
+	impulseResponse.assign(length, 0.0f);
+	for (std::size_t t = 0; t < numTaps; ++t) {
+		int delay = (int)(delayMilliseconds[t] * frequency / 1000.0f);
+		if (delay >= 0 && delay < length)
+			impulseResponse[delay] += gains[t];
+	}
+	tapDelay.assign(delayMilliseconds.begin(), delayMilliseconds.begin() + numTaps);
+	tapGains.assign(gains.begin(), gains.begin() + numTaps);
+	parameters.beginBatch();
+	preset = ConvolutionPresetNone;
+	parameters.write(ConvolutionParameterPreset, preset);
+	publishKernel();
+	parameters.endBatch();
+}
+
+void ConvolutionEffect::generatePreset() {
+	ConvolutionPreset current = preset;
+	parameters.beginBatch();
+	unsigned int seed = 0x5eed;
+	if (current == ConvolutionPresetDiffuseEcho) {
+		// echoes spread at random over 20 to 1500 ms, fading to -60 dB
+		const int numTaps = 600;
+		std::vector<float> delays(numTaps), gains(numTaps);
+		for (int t = 0; t < numTaps; ++t) {
+			delays[t] = 20.0f + (conv_noise(seed) * .5f + .5f) * 1480.0f;
+			float sign = conv_noise(seed) < 0.0f ? -1.0f : 1.0f;
+			gains[t] = sign * 0.25f * powf(10.0f, -3.0f * delays[t] / 1500.0f);
+		}
+		setTaps(delays, gains);
+	}
+	else if (current == ConvolutionPresetSmallRoom || current == ConvolutionPresetLargeHall) {
+		// exponentially decaying noise after a short pre-delay, normalized to half of the input energy
+		float rt60 = current == ConvolutionPresetSmallRoom ? 0.6f : 2.5f;
+		float predelay = current == ConvolutionPresetSmallRoom ? 0.005f : 0.02f;
+		int start = (int)(predelay * frequency);
+		int length = start + (int)(rt60 * frequency);
+		std::vector<float> ir(length, 0.0f);
+		double energy = 0.0;
+		for (int i = start; i < length; ++i) {
+			// -60 dB after rt60 seconds
+			ir[i] = conv_noise(seed) * expf(-6.9078f * (float)(i - start) / (rt60 * frequency));
+			energy += (double)ir[i] * ir[i];
+		}
+		float scale = energy > 0.0 ? (float)(0.5 / sqrt(energy)) : 0.0f;
+		for (int i = start; i < length; ++i)
+			ir[i] *= scale;
+		setImpulseResponse(ir.data(), length);
+	}
+	else
+		publishKernel();
+	// setTaps() and setImpulseResponse() mark the response custom, it is the preset's
+	preset = current;
+	parameters.write(ConvolutionParameterPreset, preset);
+	parameters.endBatch();
+}
+
+void ConvolutionEffect::parametersChanged(const int* ids, int count) {
+	bool presetChanged = false;
+	bool kernelChanged = false;
+	for (int i = 0; i < count; ++i) {
+		switch (ids[i]) {
+			case ConvolutionParameterPreset:
+				preset = (ConvolutionPreset)(int)parameters.get(ConvolutionParameterPreset);
+				presetChanged = true;
+				break;
+			case ConvolutionParameterBlockSize: {
+				int size = (int)parameters.get(ConvolutionParameterBlockSize);
+				blockSize = CONV_MIN_BLOCK_SIZE;
+				while (blockSize < size && blockSize < CONV_MAX_BLOCK_SIZE)
+					blockSize <<= 1;
+				parameters.write(ConvolutionParameterBlockSize, (float)blockSize);
+				kernelChanged = true;
+				break;
+			}
+			case ConvolutionParameterEngine:
+				engine = (ConvolutionEngine)(int)parameters.get(ConvolutionParameterEngine);
+				kernelChanged = true;
+				break;
+		}
+	}
+	// a new preset builds its kernel with the rest of the changes
+	if (presetChanged)
+		generatePreset();
+	else if (kernelChanged)
+		publishKernel();
+}
+
+void ConvolutionEffect::setNumChannels(int channels) {
+	numChannels = CLIP(channels, 1, CONV_MAX_CHANNELS);
+	publishKernel();
+}
+
+float ConvolutionEffect::directCost(int numTaps) {
+	// one vectorized multiply-add per tap, plus the mix
+	return (float)numTaps + 1.0f;
+}
+
+float ConvolutionEffect::fftCost(int numPartitions, int size) {
+	// Two real transforms of 2 * size points per block, about 5 * log2(size)
+	// multiply-adds per frame, a complex multiply-add per bin and partition,
+	// and the packing and mixing around them.
+	return 5.0f * (float)conv_log2(size) + 4.0f * (float)numPartitions + 6.0f;
+}
+
+ConvolutionKernel* ConvolutionEffect::buildKernel() {
+	ConvolutionKernel* next = new ConvolutionKernel();
+	parameters.snapshot(&next->parameters);
+	int channels = numChannels;
+	next->numChannels = channels;
+	int length = (int)impulseResponse.size();
+	for (int i = 0; i < length; ++i) {
+		if (impulseResponse[i] != 0.0f) {
+			next->delays.push_back(i);
+			next->gains.push_back(impulseResponse[i]);
+		}
+	}
+	int numTaps = (int)next->delays.size();
+	if (numTaps > 0) {
+		// The silence before the first tap is dropped, up to a block of it, which
+		// takes that much off the latency. Partitions without a tap are skipped.
+		next->shift = next->delays[0] < blockSize ? next->delays[0] : blockSize;
+		for (int t = 0; t < numTaps; ++t) {
+			int p = (next->delays[t] - next->shift) / blockSize;
+			if (next->activePartitions.empty() || next->activePartitions.back() != p)
+				next->activePartitions.push_back(p);
+		}
+		if (engine == ConvolutionEngineFFT)
+			next->useFFT = 1;
+		else if (engine == ConvolutionEngineAuto)
+			next->useFFT = fftCost((int)next->activePartitions.size(), blockSize) < directCost(numTaps);
+	}
+
+	std::size_t bytes = sizeof(ConvolutionKernel);
+	if (next->useFFT) {
+		int block = blockSize;
+		int size = 2 * block;
+		next->blockSize = block;
+		next->numPartitions = (length - next->shift + block - 1) / block;
+		next->forward = av_rdft_init(conv_log2(size), DFT_R2C);
+		next->inverse = av_rdft_init(conv_log2(size), IDFT_C2R);
+		next->fftBuffer = (float*)av_malloc(size * sizeof(float));
+		next->partitions.resize(next->activePartitions.size() * size);
+		// the inverse transform comes out size / 2 times too large, scale the partitions instead
+		float scale = 1.0f / (float)block;
+		for (std::size_t i = 0; i < next->activePartitions.size(); ++i) {
+			int p = next->activePartitions[i];
+			memset(next->fftBuffer, 0, size * sizeof(float));
+			int start = next->shift + p * block;
+			int count = length - start < block ? length - start : block;
+			for (int j = 0; j < count; ++j)
+				next->fftBuffer[j] = impulseResponse[start + j] * scale;
+			av_rdft_calc(next->forward, next->fftBuffer);
+			float* partition = &next->partitions[i * size];
+			conv_split(partition, partition + block, next->fftBuffer, block);
+		}
+		next->spectra.assign(channels * next->numPartitions * size, 0.0f);
+		next->inputBlocks.assign(channels * size, 0.0f);
+		next->outputBlocks.assign(channels * block, 0.0f);
+		next->accumulator.assign(size, 0.0f);
+		bytes += (next->partitions.size() + next->spectra.size() + next->inputBlocks.size() +
+				  next->outputBlocks.size() + next->accumulator.size() + size) * sizeof(float);
+		publishedLatency = block - next->shift;
+	}
+	else {
+		next->maxDelay = numTaps > 0 ? next->delays.back() : 0;
+		// the longest delay plus one block of room, rounded up to a power of 2
+		int capacity = 1024;
+		while (capacity < next->maxDelay + CONV_DIRECT_BLOCK_SIZE)
+			capacity <<= 1;
+		next->ringCapacity = capacity;
+		next->ring.assign(channels * capacity, 0.0f);
+		bytes += next->ring.size() * sizeof(float) + numTaps * (sizeof(int) + sizeof(float));
+		publishedLatency = 0;
+	}
+	publishedUseFFT = next->useFFT;
+	publishedKernelBytes = bytes + impulseResponse.capacity() * sizeof(float);
+	return next;
+}
+
+void ConvolutionEffect::publishKernel() {
+	// a kernel the render thread has not picked up yet is simply replaced
+	delete kernelExchange.publish(buildKernel());
+}
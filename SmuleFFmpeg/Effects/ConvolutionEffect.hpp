@@ -0,0 +1,174 @@
+//
+//  ConvolutionEffect.hpp
+//  SmuleFFmpeg
+//
+//  Convolves the input with an arbitrary impulse response, given either as
+//  samples or as a set of sparse taps (hundreds or thousands of them).
+//
+//  y[n] = h[0] * x[n] + h[1] * x[n - 1] + ... h[L - 1] * x[n - L + 1]
+//
+//  Two engines run the convolution and the cheaper one is picked for each
+//  impulse response:
+//  - direct form, one vectorized multiply-add per nonzero tap and sample,
+//    no latency
+//  - uniformly partitioned overlap-save FFT. The response is cut into
+//    partitions of the block size. Every block of input is transformed once
+//    and multiplied with all partitions in the frequency domain, so the cost
+//    grows with the response length and not with the number of taps. The
+//    output comes one block late, minus the silence at the start of the
+//    response, see getLatency(). The dry signal is delayed as much, so the
+//    mix stays aligned, and it restarts from silence with a new kernel or
+//    when enabled again.
+//
+
+#ifndef ConvolutionEffect_hpp
+#define ConvolutionEffect_hpp
+
+#include <vector>
+#include <atomic>
+#include "Effect.hpp"
+#include "SnapshotExchange.hpp"
+
+struct RDFTContext;
+
+// longest impulse response accepted
+#define CONV_MAX_IMPULSE_RESPONSE_SECONDS	10
+// FFT block size limits, always a power of 2
+#define CONV_MIN_BLOCK_SIZE					64
+#define CONV_MAX_BLOCK_SIZE					8192
+#define CONV_DEFAULT_BLOCK_SIZE				256
+// number of frames the direct form kernel processes in one pass
+#define CONV_DIRECT_BLOCK_SIZE				256
+// channels of a planar stream kept apart
+#define CONV_MAX_CHANNELS					8
+
+enum ConvolutionEngine {
+	ConvolutionEngineAuto = 0,		// pick by the cost of the impulse response
+	ConvolutionEngineDirect,
+	ConvolutionEngineFFT
+};
+
+enum ConvolutionPreset {
+	ConvolutionPresetNone = -1,
+	ConvolutionPresetDiffuseEcho = 0,	// a cloud of 600 decaying echoes over 1.5 seconds
+	ConvolutionPresetSmallRoom,			// 0.6 seconds of decay
+	ConvolutionPresetLargeHall			// 2.5 seconds of decay
+};
+
+// Everything the render thread needs for one impulse response, built on the
+// control thread and handed over as a whole, like MultiTapDelayTable.
+// The render state lives here too, so a new response starts from silence.
+struct ConvolutionKernel {
+	ConvolutionKernel();
+	~ConvolutionKernel();
+	ConvolutionKernel(const ConvolutionKernel&) = delete;
+	ConvolutionKernel& operator=(const ConvolutionKernel&) = delete;
+
+	EffectParameterSnapshot		parameters;		// the values the kernel was built from
+	int							numChannels;
+	int							useFFT;
+	// direct form: nonzero taps and a ring of ringCapacity (power of 2) samples per channel
+	std::vector<int>			delays;
+	std::vector<float>			gains;
+	int							maxDelay;
+	int							ringCapacity;
+	std::vector<float>			ring;
+	// FFT: partitions of blockSize samples, each transformed at twice the size
+	// and split into blockSize real and blockSize imaginary parts. The DC and
+	// Nyquist bins are real, they sit in the first real and imaginary slots.
+	int							blockSize;
+	int							numPartitions;
+	int							shift;			// leading silence dropped from the response, up to one block
+	RDFTContext*				forward;
+	RDFTContext*				inverse;
+	std::vector<int>			activePartitions;	// the ones not all zero, sparse taps leave many out
+	std::vector<float>			partitions;		// 2 * blockSize for each of activePartitions
+	std::vector<float>			spectra;		// the last numPartitions input spectra of each channel
+	std::vector<float>			inputBlocks;	// previous and current input block of each channel
+	std::vector<float>			outputBlocks;	// output of the last computed block of each channel
+	std::vector<float>			accumulator;	// 2 * blockSize, sum of the partition products
+	float*						fftBuffer;		// 2 * blockSize, aligned for the FFT
+};
+
+// All setters run on the control thread, process() runs on the render thread.
+class ConvolutionEffect : public BaseEffect {
+public:
+	ConvolutionEffect();
+	~ConvolutionEffect();
+	ConvolutionEffect(const ConvolutionEffect&) = delete;
+	ConvolutionEffect& operator=(const ConvolutionEffect&) = delete;
+
+	void 			process(float *input, float *output, int num_frames);
+	// channels past getNumChannels() are passed through
+	void			processPlanar(float **input, float **output, int num_channels, int num_frames);
+	// num_frames frames of num_channels interleaved samples
+	void			processInterleaved(float *input, float *output, int num_channels, int num_frames);
+	// the convolution state is cleared at the start of the next processed block
+	void 			reset();
+
+	void 			setFrequency(float newFrequency);
+
+	// impulse response in samples at the current frequency
+	void			setImpulseResponse(const float* impulseResponse, int length);
+	// sparse taps, delays in milliseconds
+	void			setTaps(const std::vector<float>& delayMilliseconds, const std::vector<float>& tapGains);
+	// the setters and getters below go through the parameters
+	void			setPreset(ConvolutionPreset preset) {setParameter(ConvolutionParameterPreset, (float)preset);}
+	ConvolutionPreset getPreset() {return (ConvolutionPreset)(int)getParameter(ConvolutionParameterPreset);}
+	// FFT block size, rounded up to a power of 2 between CONV_MIN_BLOCK_SIZE and CONV_MAX_BLOCK_SIZE
+	void			setBlockSize(int blockSize) {setParameter(ConvolutionParameterBlockSize, (float)blockSize);}
+	int				getBlockSize() {return (int)getParameter(ConvolutionParameterBlockSize);}
+	void			setEngine(ConvolutionEngine engine) {setParameter(ConvolutionParameterEngine, (float)engine);}
+	ConvolutionEngine getEngine() {return (ConvolutionEngine)(int)getParameter(ConvolutionParameterEngine);}
+	// engine picked for the current response
+	int				isUsingFFT() {return publishedUseFFT;}
+	// frames the output, wet and dry, lags behind the input
+	int				getLatency() {return publishedLatency;}
+	void			setNumChannels(int channels);
+	int				getNumChannels() {return numChannels;}
+	int				getImpulseResponseLength() {return (int)impulseResponse.size();}
+	// bytes used by this instance, including the kernel
+	std::size_t		getMemoryFootprint() {return sizeof(*this) + publishedKernelBytes;}
+
+	// Rough cost per frame in multiply-adds, what the automatic engine choice compares.
+	static float	directCost(int numTaps);
+	// numPartitions counts the partitions holding some of the response
+	static float	fftCost(int numPartitions, int blockSize);
+protected:
+	void			parametersChanged(const int* ids, int count);
+private:
+	void			generatePreset();
+	// builds the kernel for the current response, engine and channels
+	ConvolutionKernel*	buildKernel();
+	void			publishKernel();
+	// render thread
+	void			processDirect(float **input, float **output, int num_channels, int num_frames);
+	void			processFFT(float **input, float **output, int num_channels, int num_frames);
+	void			computeBlock(int channel);
+	void			clearState();
+private:
+	// control thread state
+	std::vector<float>			impulseResponse;
+	std::vector<float>			tapDelay;		// sparse taps in milliseconds, empty when the response is given in samples
+	std::vector<float>			tapGains;
+	// these follow the parameters
+	ConvolutionPreset			preset;
+	int							blockSize;
+	ConvolutionEngine			engine;
+	int							publishedUseFFT;
+	int							publishedLatency;
+	std::size_t					publishedKernelBytes;
+	// render thread state
+	ConvolutionKernel*			kernel;
+	int							ringHead;
+	int							blockFill;		// frames of the current input block
+	int							spectrumHead;	// slot of the latest input spectrum
+	int							wasEnabled;
+	float						interleaveScratch[CONV_MAX_CHANNELS][CONV_DIRECT_BLOCK_SIZE];
+	// shared
+	SnapshotExchange<ConvolutionKernel> kernelExchange;
+	std::atomic<int>			resetRequested;
+	std::atomic<int>			numChannels;	// read by processInterleaved callers on the render thread
+};
+
+#endif /* ConvolutionEffect_hpp */
@@ -0,0 +1,175 @@
+//
+//  ConvolutionEffect_c_bridge.cpp
+//  SmuleFFmpeg
+//
+
+#include "ConvolutionEffect_c_bridge.h"
+#include "ConvolutionEffect.hpp"
+#include <vector>
+
+
+void* conv_init(void) {
+	ConvolutionEffect* effect = new ConvolutionEffect();
+	effect->setPreset(ConvolutionPresetDiffuseEcho);
+	return effect;
+}
+
+void conv_destroy(void* conv_handle) {
+	delete static_cast<ConvolutionEffect*>(conv_handle);
+}
+
+void conv_set_frequency(void* conv_handle, float new_frequency) {
+	ConvolutionEffect* effect = static_cast<ConvolutionEffect*>(conv_handle);
+	effect->setFrequency(new_frequency);
+}
+
+void conv_set_impulse_response(void* conv_handle, const float *impulse_response, int length) {
+	ConvolutionEffect* effect = static_cast<ConvolutionEffect*>(conv_handle);
+	if (impulse_response && length > 0)
+		effect->setImpulseResponse(impulse_response, length);
+}
+
+void conv_set_taps(void* conv_handle, const float *delay_ms, const float *gains, int number_of_taps) {
+	ConvolutionEffect* effect = static_cast<ConvolutionEffect*>(conv_handle);
+	if (delay_ms && gains && number_of_taps > 0) {
+		std::vector<float> delays(delay_ms, delay_ms + number_of_taps);
+		std::vector<float> tapGains(gains, gains + number_of_taps);
+		effect->setTaps(delays, tapGains);
+	}
+}
+
+void conv_set_preset(void* conv_handle, int preset) {
+	ConvolutionEffect* effect = static_cast<ConvolutionEffect*>(conv_handle);
+	if (preset >= ConvolutionPresetDiffuseEcho && preset <= ConvolutionPresetLargeHall)
+		effect->setPreset((ConvolutionPreset)preset);
+}
+
+int conv_get_preset(void* conv_handle) {
+	ConvolutionEffect* effect = static_cast<ConvolutionEffect*>(conv_handle);
+	return effect->getPreset();
+}
+
+void conv_set_block_size(void* conv_handle, int block_size) {
+	ConvolutionEffect* effect = static_cast<ConvolutionEffect*>(conv_handle);
+	effect->setBlockSize(block_size);
+}
+
+int conv_get_block_size(void* conv_handle) {
+	ConvolutionEffect* effect = static_cast<ConvolutionEffect*>(conv_handle);
+	return effect->getBlockSize();
+}
+
+void conv_set_engine(void* conv_handle, int engine) {
+	ConvolutionEffect* effect = static_cast<ConvolutionEffect*>(conv_handle);
+	if (engine >= ConvolutionEngineAuto && engine <= ConvolutionEngineFFT)
+		effect->setEngine((ConvolutionEngine)engine);
+}
+
+int conv_is_using_fft(void* conv_handle) {
+	ConvolutionEffect* effect = static_cast<ConvolutionEffect*>(conv_handle);
+	return effect->isUsingFFT();
+}
+
+int conv_get_latency(void* conv_handle) {
+	ConvolutionEffect* effect = static_cast<ConvolutionEffect*>(conv_handle);
+	return effect->getLatency();
+}
+
+int conv_get_impulse_response_length(void* conv_handle) {
+	ConvolutionEffect* effect = static_cast<ConvolutionEffect*>(conv_handle);
+	return effect->getImpulseResponseLength();
+}
+
+void conv_set_wet(void* conv_handle, float wet_value) {
+	ConvolutionEffect* effect = static_cast<ConvolutionEffect*>(conv_handle);
+	effect->setMix(wet_value);
+}
+
+float conv_get_wet(void* conv_handle) {
+	ConvolutionEffect* effect = static_cast<ConvolutionEffect*>(conv_handle);
+	return effect->getMix();
+}
+
+void conv_set_enabled(void* conv_handle, int enabled) {
+	ConvolutionEffect* effect = static_cast<ConvolutionEffect*>(conv_handle);
+	effect->setEnabled(enabled);
+}
+
+int conv_get_enabled(void* conv_handle) {
+	ConvolutionEffect* effect = static_cast<ConvolutionEffect*>(conv_handle);
+	return effect->isEnabled();
+}
+
+void conv_set_channels(void* conv_handle, int num_channels) {
+	ConvolutionEffect* effect = static_cast<ConvolutionEffect*>(conv_handle);
+	effect->setNumChannels(num_channels);
+}
+
+int conv_get_channels(void* conv_handle) {
+	ConvolutionEffect* effect = static_cast<ConvolutionEffect*>(conv_handle);
+	return effect->getNumChannels();
+}
+
+size_t conv_get_memory_footprint(void* conv_handle) {
+	ConvolutionEffect* effect = static_cast<ConvolutionEffect*>(conv_handle);
+	return effect->getMemoryFootprint();
+}
+
+void conv_process(void* conv_handle, float *input, float *output, int num_frames) {
+	ConvolutionEffect* effect = static_cast<ConvolutionEffect*>(conv_handle);
+	effect->process(input, output, num_frames);
+}
+
+void conv_process_planar(void* conv_handle, float **input, float **output, int num_channels, int num_frames) {
+	ConvolutionEffect* effect = static_cast<ConvolutionEffect*>(conv_handle);
+	effect->processPlanar(input, output, num_channels, num_frames);
+}
+
+void conv_process_interleaved(void* conv_handle, float *input, float *output, int num_samples) {
+	ConvolutionEffect* effect = static_cast<ConvolutionEffect*>(conv_handle);
+	int channels = effect->getNumChannels();
+	effect->processInterleaved(input, output, channels, num_samples / channels);
+}
+
+void conv_reset(void* conv_handle) {
+	ConvolutionEffect* effect = static_cast<ConvolutionEffect*>(conv_handle);
+	effect->reset();
+}
+
+int conv_set_parameters(void* conv_handle, const int *ids, const float *values, int count) {
+	ConvolutionEffect* effect = static_cast<ConvolutionEffect*>(conv_handle);
+	return ids && values && count > 0 ? effect->setParameters(ids, values, count) : 0;
+}
+
+int conv_set_parameter(void* conv_handle, int id, float value) {
+	ConvolutionEffect* effect = static_cast<ConvolutionEffect*>(conv_handle);
+	return effect->setParameter(id, value);
+}
+
+float conv_get_parameter(void* conv_handle, int id) {
+	ConvolutionEffect* effect = static_cast<ConvolutionEffect*>(conv_handle);
+	return effect->getParameter(id);
+}
+
+int conv_get_parameter_count(void* conv_handle) {
+	ConvolutionEffect* effect = static_cast<ConvolutionEffect*>(conv_handle);
+	return effect->getParameterRegistry().size();
+}
+
+int conv_get_parameter_info(void* conv_handle, int index, EffectParameterInfo *info) {
+	ConvolutionEffect* effect = static_cast<ConvolutionEffect*>(conv_handle);
+	const EffectParameterInfo* parameter = effect->getParameterRegistry().infoAt(index);
+	if (!parameter || !info)
+		return -1;
+	*info = *parameter;
+	return 0;
+}
+
+void* conv_get_effect(void* conv_handle) {
+	ConvolutionEffect* effect = static_cast<ConvolutionEffect*>(conv_handle);
+	return static_cast<BaseEffect*>(effect);
+}
+
+void* conv_get_audio_file_filter_callback() {
+	return (void*)conv_process_interleaved;
+}
@@ -0,0 +1,64 @@
+//
+//  ConvolutionEffect_c_bridge.h
+//  SmuleFFmpeg
+//
+//	This is C bridge to ConvolutionEffect required for Swift interoperability
+//
+
+#ifndef ConvolutionEffect_c_bridge_h
+#define ConvolutionEffect_c_bridge_h
+
+#include <stddef.h>
+#include "EffectParameter.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+void*			conv_init(void);
+void			conv_destroy(void* conv_handle);
+void			conv_set_frequency(void* conv_handle, float new_frequency);
+// impulse response samples at the current frequency
+void			conv_set_impulse_response(void* conv_handle, const float *impulse_response, int length);
+// sparse taps, delays in milliseconds
+void			conv_set_taps(void* conv_handle, const float *delay_ms, const float *gains, int number_of_taps);
+void			conv_set_preset(void* conv_handle, int preset); // 0 diffuse echo, 1 small room, 2 large hall
+int				conv_get_preset(void* conv_handle);
+void			conv_set_block_size(void* conv_handle, int block_size); // FFT block size, 64 to 8192
+int				conv_get_block_size(void* conv_handle);
+void			conv_set_engine(void* conv_handle, int engine); // 0 automatic, 1 direct form, 2 FFT
+int				conv_is_using_fft(void* conv_handle);
+int				conv_get_latency(void* conv_handle); // in frames
+int				conv_get_impulse_response_length(void* conv_handle);
+void			conv_set_wet(void* conv_handle, float wet_value);
+float			conv_get_wet(void* conv_handle);
+void			conv_set_enabled(void* conv_handle, int enabled);
+int				conv_get_enabled(void* conv_handle);
+void			conv_set_channels(void* conv_handle, int num_channels);
+int				conv_get_channels(void* conv_handle);
+size_t			conv_get_memory_footprint(void* conv_handle); // in bytes, including the kernel
+void 			conv_process(void* conv_handle, float *input, float *output, int num_frames);
+// input[c] and output[c] hold num_frames samples of channel c
+void 			conv_process_planar(void* conv_handle, float **input, float **output, int num_channels, int num_frames);
+// interleaved samples of the channels set with conv_set_channels, this is the audio file filter
+void 			conv_process_interleaved(void* conv_handle, float *input, float *output, int num_samples);
+void			conv_reset(void* conv_handle);
+// Parameters by ID, ConvolutionParameter* and EffectParameter* in EffectParameter.h.
+// A batch reaches the render thread as a whole, at the start of a block.
+// Unknown IDs are skipped, returns the number of values taken.
+int				conv_set_parameters(void* conv_handle, const int *ids, const float *values, int count);
+int				conv_set_parameter(void* conv_handle, int id, float value);
+float			conv_get_parameter(void* conv_handle, int id);
+int				conv_get_parameter_count(void* conv_handle);
+// description of the parameter at index, 0 to count - 1. Returns 0 on success, -1 past the end
+int				conv_get_parameter_info(void* conv_handle, int index, EffectParameterInfo *info);
+void*			conv_get_audio_file_filter_callback();
+
+// handle of the effect for effect_chain_add, the chain owns the effect then
+void*			conv_get_effect(void* conv_handle);
+
+#ifdef __cplusplus
+}
+#endif //__cplusplus
+
+#endif /* ConvolutionEffect_c_bridge_h */
@@ -9,6 +9,7 @@
 #define Effect_hpp
 
 #include <stdio.h>
+#include "EffectParameterRegistry.hpp"
 
 #define CLIP(x, min, max)				(x) < (min) ? (min) : ((x) > (max) ? (max) : x)
 
@@ -19,32 +20,99 @@ public:
 				frequency(22050.0f),
 				wetMix(0.5f)
 	{
+		parameters.add(EffectParameterEnabled, "Enabled", EffectParameterUnitBoolean, 0.0f, 1.0f, 1.0f);
+		parameters.add(EffectParameterWet, "Mix", EffectParameterUnitRatio, 0.0f, 1.0f, 0.5f);
+		parameters.read(renderParameters);
 	}
 	// it is virtual, to allow propper destruction of the
 	// child classes through the base class pointer
 	virtual ~BaseEffect() {};
 	// effect processing
 	virtual void process(float *input, float *output, int num_frames) = 0;
+	// planar multichannel processing, input[c] and output[c] hold num_frames samples of channel c
+	virtual void processPlanar(float **input, float **output, int num_channels, int num_frames) = 0;
 	// on frequency change
 	virtual void setFrequency(float newFrequency) = 0;
-	// effect specific parameter change
-	// the caller should know the format
-	// Unfortunatlly there is no time for this assignment for better solution
-	// Should be parameter structure with type definitions
-	virtual void setParameters(void* parameterBuffer, int buferLength) = 0;
+	// channels kept apart by planar and interleaved processing
+	virtual void setNumChannels(int channels) = 0;
+	virtual int getNumChannels() = 0;
 	// Resets for start of a new stream, clear all the buffers
 	// from the current stream
 	virtual void reset() = 0;
-	
+
+	// Typed parameters, IDs in EffectParameter.h. Values are clamped to the
+	// range of the parameter, unknown IDs are skipped. The render thread sees
+	// all values of one call together, at the start of a block.
+	// Returns the number of values taken.
+	int			setParameters(const int* ids, const float* values, int count) {
+		int taken = 0;
+		parameters.beginBatch();
+		for (int i = 0; i < count; ++i) {
+			if (parameters.contains(ids[i])) {
+				parameters.write(ids[i], values[i]);
+				++taken;
+			}
+		}
+		if (taken > 0)
+			parametersChanged(ids, count);
+		parameters.endBatch();
+		return taken;
+	}
+	int			setParameter(int id, float value) {return setParameters(&id, &value, 1);}
+	float		getParameter(int id) {return parameters.get(id);}
+	const EffectParameterRegistry& getParameterRegistry() {return parameters;}
+
 	float		getFrequency() 	{return frequency;}
-	void		setMix(float mix) { wetMix = CLIP(mix, 0.0f, 1.0f); }
-	float		getMix() 		{return wetMix;}
-	void		setEnabled(int enabled) {this->enabled = enabled;}
-	int 		isEnabled() {return enabled;}
+	void		setMix(float mix) {setParameter(EffectParameterWet, mix);}
+	float		getMix() 		{return parameters.get(EffectParameterWet);}
+	void		setEnabled(int enabled) {setParameter(EffectParameterEnabled, enabled ? 1.0f : 0.0f);}
+	int 		isEnabled() {return parameters.get(EffectParameterEnabled) != 0.0f;}
+protected:
+	// Control thread, called by setParameters() before the render thread can
+	// see the new values. Brings whatever depends on them up to date, snapshots
+	// published from here reach the render thread no later than the values.
+	// ids may hold IDs the effect doesn't have.
+	virtual void parametersChanged(const int* /*ids*/, int /*count*/) {}
+	// Render thread, at the start of a block: takes the latest values into
+	// renderParameters, enabled and wetMix. Returns false, keeping the previous
+	// values, while setParameters() is writing.
+	bool		syncParameters() {
+		float copy[EFFECT_MAX_PARAMETERS];
+		if (!parameters.read(copy))
+			return false;
+		applyParameters(copy);
+		return true;
+	}
+	// Render thread, at the start of a block, for an effect that publishes
+	// snapshots built from its values through exchange, each with an
+	// EffectParameterSnapshot named parameters. Takes the latest snapshot after
+	// the values, and a snapshot published in between brings the values of its
+	// batch, so a snapshot and the values always come from the same batch or
+	// the values are newer. Returns the snapshot taken, or NULL.
+	template <class Exchange>
+	auto		syncParameters(Exchange& exchange) -> decltype(exchange.take()) {
+		float copy[EFFECT_MAX_PARAMETERS];
+		unsigned sequence = 0;
+		bool read = parameters.read(copy, &sequence);
+		auto next = exchange.take();
+		if (next && (!read || (int)(sequence - next->parameters.sequence) < 0))
+			applyParameters(next->parameters.values);
+		// a snapshot that can't be taken yet may be from the batch of the values
+		else if (read && (next || !exchange.hasPending()))
+			applyParameters(copy);
+		return next;
+	}
+	void		applyParameters(const float* values) {
+		memcpy(renderParameters, values, sizeof(renderParameters));
+		enabled = renderParameters[EffectParameterEnabled] != 0.0f;
+		wetMix = renderParameters[EffectParameterWet];
+	}
 protected:
-	int 						enabled;
+	EffectParameterRegistry		parameters;
+	float						renderParameters[EFFECT_MAX_PARAMETERS];	// render thread copy, indexed by ID
+	int 						enabled;	// render thread copy
 	float						frequency;
-	float						wetMix;	// 0 - dry, 1 - wet
+	float						wetMix;	// 0 - dry, 1 - wet, render thread copy
 };
 
 
@@ -0,0 +1,274 @@
+//
+//  EffectChain.cpp
+//  SmuleFFmpeg
+//
+
+#include "EffectChain.hpp"
+#include "SimdOps.hpp"
+#include <string.h>
+#include <algorithm>
+
+// output[i] = input[i] + (effect[i] - input[i]) * wet, output may be input
+static void chain_mix(float* output, const float* effect, const float* input, float wet, int num_frames) {
+	simd_float vwet = simd_set1(wet);
+	int i = 0;
+	for (; i + SIMD_WIDTH <= num_frames; i += SIMD_WIDTH) {
+		simd_float dry = simd_load(input + i);
+		simd_store(output + i, simd_add(dry, simd_mul(simd_sub(simd_load(effect + i), dry), vwet)));
+	}
+	for (; i < num_frames; ++i)
+		output[i] = input[i] + (effect[i] - input[i]) * wet;
+}
+
+EffectChainList::~EffectChainList() {
+	for (BaseEffect* effect : removed)
+		delete effect;
+	delete[] scratch;
+}
+
+EffectChain::EffectChain() : 	preparedChannels(0),
+								preparedFrames(0),
+								scratchChanged(false),
+								list(NULL),
+								scratch(NULL),
+								scratchChannels(0),
+								scratchFrames(0),
+								numRunning(0),
+								numChannels(1)
+{
+	// a chain adds nothing of its own, the signal goes through it fully wet
+	parameters.setDefault(EffectParameterWet, 1.0f);
+	parameters.read(renderParameters);
+	wetMix = renderParameters[EffectParameterWet];
+	prepare(2, EFFECT_CHAIN_DEFAULT_FRAMES);
+	// there is no render thread yet, take the list right away
+	adoptList(listExchange.take());
+}
+
+EffectChain::~EffectChain() {
+	delete list;
+	delete[] scratch;
+	for (BaseEffect* effect : effects)
+		delete effect;
+	for (BaseEffect* effect : removed)
+		delete effect;
+}
+
+void EffectChain::process(float *input, float *output, int num_frames) {
+	processPlanar(&input, &output, 1, num_frames);
+}
+
+void EffectChain::beginBlock() {
+	// pick up the latest parameters and the list built from them only at block boundaries
+	EffectChainList* next = syncParameters() ? listExchange.take() : NULL;
+	if (next)
+		adoptList(next);
+	EffectChainList* l = list;
+	numRunning = 0;
+	for (int i = 0; i < l->numEffects; ++i) {
+		BaseEffect* effect = l->effects[i];
+		int on = enabled && effect->isEnabled();
+		// a skipped effect missed the signal, it starts over
+		if (on && !l->wasEnabled[i])
+			effect->reset();
+		l->wasEnabled[i] = on;
+		if (on)
+			running[numRunning++] = effect;
+	}
+}
+
+float** EffectChain::runEffects(float **input, float **output, int num_channels, int num_frames) {
+	bool aliased = false;
+	for (int c = 0; output && c < num_channels; ++c)
+		aliased = aliased || output[c] == input[c];
+	float** source = input;
+	for (int k = 0; k < numRunning; ++k) {
+		float** destination = source == scratchA ? scratchB : scratchA;
+		// the dry signal is needed after the last effect unless fully wet,
+		// and the effects don't have to work in place
+		if (k == numRunning - 1 && output && wetMix >= 1.0f && (k > 0 || !aliased))
+			destination = output;
+		running[k]->processPlanar(source, destination, num_channels, num_frames);
+		source = destination;
+	}
+	return source;
+}
+
+void EffectChain::processPlanar(float **input, float **output, int num_channels, int num_frames) {
+	beginBlock();
+	int channels = num_channels < scratchChannels ? num_channels : scratchChannels;
+	for (int c = numRunning > 0 ? channels : 0; c < num_channels; ++c)
+		if (output[c] != input[c])
+			memcpy(output[c], input[c], num_frames * sizeof(float));
+	if (numRunning == 0)
+		return;
+
+	float* in[EFFECT_CHAIN_MAX_CHANNELS];
+	float* out[EFFECT_CHAIN_MAX_CHANNELS];
+	for (int offset = 0; offset < num_frames; offset += scratchFrames) {
+		int frames = num_frames - offset < scratchFrames ? num_frames - offset : scratchFrames;
+		for (int c = 0; c < channels; ++c) {
+			in[c] = input[c] + offset;
+			out[c] = output[c] + offset;
+		}
+		float** result = runEffects(in, out, channels, frames);
+		if (result == out)
+			continue;
+		for (int c = 0; c < channels; ++c) {
+			if (wetMix >= 1.0f)
+				memcpy(out[c], result[c], frames * sizeof(float));
+			else
+				chain_mix(out[c], result[c], in[c], wetMix, frames);
+		}
+	}
+}
+
+void EffectChain::processInterleaved(float *input, float *output, int num_channels, int num_frames) {
+	beginBlock();
+	if (numRunning == 0) {
+		if (output != input)
+			memcpy(output, input, num_frames * num_channels * sizeof(float));
+		return;
+	}
+	int channels = num_channels < scratchChannels ? num_channels : scratchChannels;
+	for (int offset = 0; offset < num_frames; offset += scratchFrames) {
+		int frames = num_frames - offset < scratchFrames ? num_frames - offset : scratchFrames;
+		const float* in = input + offset * num_channels;
+		for (int i = 0; i < frames; ++i)
+			for (int c = 0; c < channels; ++c)
+				scratchA[c][i] = in[i * num_channels + c];
+		float** result = runEffects(scratchA, NULL, channels, frames);
+		// in place too, each sample is read before it is written
+		float* out = output + offset * num_channels;
+		for (int i = 0; i < frames; ++i) {
+			for (int c = 0; c < channels; ++c) {
+				float dry = in[i * num_channels + c];
+				out[i * num_channels + c] = wetMix >= 1.0f ? result[c][i] : dry + (result[c][i] - dry) * wetMix;
+			}
+			for (int c = channels; c < num_channels; ++c)
+				out[i * num_channels + c] = in[i * num_channels + c];
+		}
+	}
+}
+
+void EffectChain::reset() {
+	for (BaseEffect* effect : effects)
+		effect->reset();
+}
+
+void EffectChain::setFrequency(float newFrequency) {
+	frequency = newFrequency;
+	for (BaseEffect* effect : effects)
+		effect->setFrequency(newFrequency);
+}
+
+void EffectChain::setNumChannels(int channels) {
+	numChannels = CLIP(channels, 1, EFFECT_CHAIN_MAX_CHANNELS);
+	for (BaseEffect* effect : effects)
+		effect->setNumChannels(numChannels);
+	if (numChannels > preparedChannels)
+		prepare(numChannels, preparedFrames);
+}
+
+void EffectChain::prepare(int maxChannels, int maxFrames) {
+	maxChannels = CLIP(maxChannels, 1, EFFECT_CHAIN_MAX_CHANNELS);
+	if (maxFrames < 1)
+		maxFrames = 1;
+	if (maxChannels == preparedChannels && maxFrames == preparedFrames)
+		return;
+	preparedChannels = maxChannels;
+	preparedFrames = maxFrames;
+	scratchChanged = true;
+	publishList();
+}
+
+bool EffectChain::insert(BaseEffect* effect, int index) {
+	if (!effect || effect == this || (int)effects.size() >= EFFECT_CHAIN_MAX_EFFECTS || indexOf(effect) >= 0)
+		return false;
+	effect->setFrequency(frequency);
+	effect->setNumChannels(numChannels);
+	if (index < 0 || index > (int)effects.size())
+		index = (int)effects.size();
+	effects.insert(effects.begin() + index, effect);
+	publishList();
+	return true;
+}
+
+bool EffectChain::remove(BaseEffect* effect) {
+	int index = indexOf(effect);
+	if (index < 0)
+		return false;
+	effects.erase(effects.begin() + index);
+	removed.push_back(effect);
+	publishList();
+	return true;
+}
+
+int EffectChain::indexOf(BaseEffect* effect) {
+	std::vector<BaseEffect*>::iterator it = std::find(effects.begin(), effects.end(), effect);
+	return it == effects.end() ? -1 : (int)(it - effects.begin());
+}
+
+void EffectChain::publishList() {
+	EffectChainList* next = new EffectChainList();
+	next->numEffects = (int)effects.size();
+	for (int i = 0; i < next->numEffects; ++i) {
+		next->effects[i] = effects[i];
+		next->wasEnabled[i] = 1;
+	}
+	next->removed.swap(removed);
+	if (scratchChanged) {
+		next->scratchChannels = preparedChannels;
+		next->scratchFrames = preparedFrames;
+		next->scratch = new float[2 * preparedChannels * preparedFrames]();
+		scratchChanged = false;
+	}
+	// A list the render thread never took hands over what it carried: the
+	// render thread may still run the effects it removed, and it still
+	// needs its scratch unless this list has a newer one.
+	EffectChainList* skipped = listExchange.reclaim();
+	if (skipped) {
+		next->removed.insert(next->removed.end(), skipped->removed.begin(), skipped->removed.end());
+		skipped->removed.clear();
+		if (skipped->scratch && !next->scratch) {
+			next->scratch = skipped->scratch;
+			next->scratchChannels = skipped->scratchChannels;
+			next->scratchFrames = skipped->scratchFrames;
+			skipped->scratch = NULL;
+		}
+		delete skipped;
+	}
+	listExchange.publish(next);
+}
+
+void EffectChain::adoptList(EffectChainList* next) {
+	EffectChainList* previous = list;
+	if (next->scratch) {
+		float* buffer = next->scratch;
+		next->scratch = NULL;
+		// the old scratch goes away with the retired list
+		if (previous)
+			previous->scratch = scratch;
+		else
+			delete[] scratch;
+		scratch = buffer;
+		scratchChannels = next->scratchChannels;
+		scratchFrames = next->scratchFrames;
+		for (int c = 0; c < scratchChannels; ++c) {
+			scratchA[c] = scratch + c * scratchFrames;
+			scratchB[c] = scratch + (scratchChannels + c) * scratchFrames;
+		}
+	}
+	if (previous) {
+		// effects that were not reset yet stay that way
+		for (int i = 0; i < next->numEffects; ++i)
+			for (int j = 0; j < previous->numEffects; ++j)
+				if (previous->effects[j] == next->effects[i])
+					next->wasEnabled[i] = previous->wasEnabled[j];
+		// the removed effects go away with the retired list, which holds them
+		previous->removed.swap(next->removed);
+	}
+	list = next;
+	if (previous)
+		listExchange.retire(previous);
+}
@@ -0,0 +1,125 @@
+//
+//  EffectChain.hpp
+//  SmuleFFmpeg
+//
+//  Runs an ordered list of effects on a stream, the output of one effect
+//  is the input of the next.
+//
+//  The effects pass the signal through two planar scratch buffers in turn,
+//  allocated when the chain is prepared, so a block goes through the whole
+//  chain with one call, no copy between the effects and no allocation.
+//  The first effect reads the caller's input and, where it can, the last one
+//  writes straight into the caller's output. Disabled effects are skipped,
+//  the signal stays where it is. An effect is reset when it is enabled again,
+//  since it missed the signal meanwhile.
+//
+
+#ifndef EffectChain_hpp
+#define EffectChain_hpp
+
+#include <vector>
+#include <atomic>
+#include "Effect.hpp"
+#include "SnapshotExchange.hpp"
+
+// effects a chain holds at most
+#define EFFECT_CHAIN_MAX_EFFECTS			16
+// channels of a planar stream kept apart, the ones past it are passed through
+#define EFFECT_CHAIN_MAX_CHANNELS			8
+// scratch size of a new chain, longer blocks are processed in parts
+#define EFFECT_CHAIN_DEFAULT_FRAMES			512
+
+// The effects and scratch buffers of the chain, built on the control thread
+// and handed to the render thread as a whole, like MultiTapDelayTable.
+struct EffectChainList {
+	EffectChainList() : numEffects(0), scratch(NULL), scratchChannels(0), scratchFrames(0) {}
+	// deletes the effects removed from the chain and a replaced scratch buffer
+	~EffectChainList();
+
+	int							numEffects;
+	BaseEffect*					effects[EFFECT_CHAIN_MAX_EFFECTS];
+	int							wasEnabled[EFFECT_CHAIN_MAX_EFFECTS];	// render thread state
+	// Effects no longer in the chain. The render thread moves them to the list
+	// it retires, so they are deleted once it can't run them any more.
+	std::vector<BaseEffect*>	removed;
+	// New scratch, allocated only when the size changes: scratchChannels
+	// planar buffers of scratchFrames samples, twice. As with the delay line
+	// of MultiTapDelayTable, the render thread leaves the old scratch here
+	// instead, so it is freed together with the retired list.
+	float*						scratch;
+	int							scratchChannels;
+	int							scratchFrames;
+};
+
+// All setters run on the control thread, process() runs on the render thread.
+// The chain owns its effects and deletes them when they are removed or the
+// chain is destroyed.
+class EffectChain : public BaseEffect {
+public:
+	EffectChain();
+	~EffectChain();
+	EffectChain(const EffectChain&) = delete;
+	EffectChain& operator=(const EffectChain&) = delete;
+
+	void 			process(float *input, float *output, int num_frames);
+	// channels past the prepared ones are passed through
+	void			processPlanar(float **input, float **output, int num_channels, int num_frames);
+	// num_frames frames of num_channels interleaved samples
+	void			processInterleaved(float *input, float *output, int num_channels, int num_frames);
+	// resets all effects
+	void 			reset();
+
+	// applied to the effects as well
+	void 			setFrequency(float newFrequency);
+	void			setNumChannels(int channels);
+	int				getNumChannels() {return numChannels;}
+	// Scratch for blocks of up to maxFrames frames of maxChannels channels.
+	// Longer blocks work too, in parts.
+	void			prepare(int maxChannels, int maxFrames);
+
+	// Inserts the effect before the one at index, at the end for index -1 or
+	// past the end. The chain takes it over and sets its frequency and
+	// channels. Returns false, leaving the effect to the caller, when the
+	// chain is full or already holds it.
+	bool			insert(BaseEffect* effect, int index);
+	bool			add(BaseEffect* effect) {return insert(effect, -1);}
+	// The effect is deleted once the render thread is done with it.
+	// Returns false if the chain doesn't hold it.
+	bool			remove(BaseEffect* effect);
+	int				size() {return (int)effects.size();}
+	BaseEffect*		getEffect(int index) {return index >= 0 && index < (int)effects.size() ? effects[index] : NULL;}
+	int				indexOf(BaseEffect* effect);
+private:
+	// hands the current effects and any new scratch to the render thread
+	void			publishList();
+	// render thread, switches to a newly published list
+	void			adoptList(EffectChainList* next);
+	// render thread, at the start of a block: takes a new list and lists the
+	// effects to run in running
+	void			beginBlock();
+	// Runs the effects in running on num_frames frames, at most the scratch
+	// size. The last one writes into output if there is one and it can.
+	// Returns where the result is: input, output or a scratch buffer.
+	float**			runEffects(float **input, float **output, int num_channels, int num_frames);
+private:
+	// control thread state
+	std::vector<BaseEffect*>	effects;
+	std::vector<BaseEffect*>	removed;		// since the last published list
+	int							preparedChannels;
+	int							preparedFrames;
+	bool						scratchChanged;	// the next published list carries a new scratch
+	// render thread state
+	EffectChainList*			list;
+	float*						scratch;
+	int							scratchChannels;
+	int							scratchFrames;
+	float*						scratchA[EFFECT_CHAIN_MAX_CHANNELS];	// the two halves of scratch, per channel
+	float*						scratchB[EFFECT_CHAIN_MAX_CHANNELS];
+	BaseEffect*					running[EFFECT_CHAIN_MAX_EFFECTS];		// enabled effects of the block
+	int							numRunning;
+	// shared
+	SnapshotExchange<EffectChainList> listExchange;
+	std::atomic<int>			numChannels;	// read by processInterleaved callers on the render thread
+};
+
+#endif /* EffectChain_hpp */
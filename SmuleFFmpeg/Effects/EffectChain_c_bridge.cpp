@@ -0,0 +1,106 @@
+//
+//  EffectChain_c_bridge.cpp
+//  SmuleFFmpeg
+//
+
+#include "EffectChain_c_bridge.h"
+#include "EffectChain.hpp"
+
+void* effect_chain_init(void) {
+	EffectChain* chain = new EffectChain();
+	return chain;
+}
+
+void effect_chain_destroy(void* chain_handle) {
+	delete static_cast<EffectChain*>(chain_handle);
+}
+
+void effect_chain_set_frequency(void* chain_handle, float new_frequency) {
+	EffectChain* chain = static_cast<EffectChain*>(chain_handle);
+	chain->setFrequency(new_frequency);
+}
+
+void effect_chain_set_channels(void* chain_handle, int num_channels) {
+	EffectChain* chain = static_cast<EffectChain*>(chain_handle);
+	chain->setNumChannels(num_channels);
+}
+
+int effect_chain_get_channels(void* chain_handle) {
+	EffectChain* chain = static_cast<EffectChain*>(chain_handle);
+	return chain->getNumChannels();
+}
+
+void effect_chain_prepare(void* chain_handle, int max_channels, int max_frames) {
+	EffectChain* chain = static_cast<EffectChain*>(chain_handle);
+	chain->prepare(max_channels, max_frames);
+}
+
+int effect_chain_add(void* chain_handle, void* effect) {
+	EffectChain* chain = static_cast<EffectChain*>(chain_handle);
+	return chain->add(static_cast<BaseEffect*>(effect)) ? 0 : -1;
+}
+
+int effect_chain_insert(void* chain_handle, void* effect, int index) {
+	EffectChain* chain = static_cast<EffectChain*>(chain_handle);
+	return chain->insert(static_cast<BaseEffect*>(effect), index) ? 0 : -1;
+}
+
+int effect_chain_remove(void* chain_handle, void* effect) {
+	EffectChain* chain = static_cast<EffectChain*>(chain_handle);
+	return chain->remove(static_cast<BaseEffect*>(effect)) ? 0 : -1;
+}
+
+int effect_chain_get_count(void* chain_handle) {
+	EffectChain* chain = static_cast<EffectChain*>(chain_handle);
+	return chain->size();
+}
+
+int effect_chain_index_of(void* chain_handle, void* effect) {
+	EffectChain* chain = static_cast<EffectChain*>(chain_handle);
+	return chain->indexOf(static_cast<BaseEffect*>(effect));
+}
+
+void effect_chain_set_enabled(void* chain_handle, int enabled) {
+	EffectChain* chain = static_cast<EffectChain*>(chain_handle);
+	chain->setEnabled(enabled);
+}
+
+int effect_chain_get_enabled(void* chain_handle) {
+	EffectChain* chain = static_cast<EffectChain*>(chain_handle);
+	return chain->isEnabled();
+}
+
+void effect_chain_set_wet(void* chain_handle, float wet_value) {
+	EffectChain* chain = static_cast<EffectChain*>(chain_handle);
+	chain->setMix(wet_value);
+}
+
+float effect_chain_get_wet(void* chain_handle) {
+	EffectChain* chain = static_cast<EffectChain*>(chain_handle);
+	return chain->getMix();
+}
+
+void effect_chain_process(void* chain_handle, float *input, float *output, int num_frames) {
+	EffectChain* chain = static_cast<EffectChain*>(chain_handle);
+	chain->process(input, output, num_frames);
+}
+
+void effect_chain_process_planar(void* chain_handle, float **input, float **output, int num_channels, int num_frames) {
+	EffectChain* chain = static_cast<EffectChain*>(chain_handle);
+	chain->processPlanar(input, output, num_channels, num_frames);
+}
+
+void effect_chain_process_interleaved(void* chain_handle, float *input, float *output, int num_samples) {
+	EffectChain* chain = static_cast<EffectChain*>(chain_handle);
+	int channels = chain->getNumChannels();
+	chain->processInterleaved(input, output, channels, num_samples / channels);
+}
+
+void effect_chain_reset(void* chain_handle) {
+	EffectChain* chain = static_cast<EffectChain*>(chain_handle);
+	chain->reset();
+}
+
+void* effect_chain_get_audio_file_filter_callback(void) {
+	return (void*)effect_chain_process_interleaved;
+}
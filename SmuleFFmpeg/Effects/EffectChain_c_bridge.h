@@ -0,0 +1,53 @@
+//
+//  EffectChain_c_bridge.h
+//  SmuleFFmpeg
+//
+//	This is C bridge to EffectChain required for Swift interoperability
+//
+
+#ifndef EffectChain_c_bridge_h
+#define EffectChain_c_bridge_h
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+void*			effect_chain_init(void);
+// deletes the effects of the chain too
+void			effect_chain_destroy(void* chain_handle);
+void			effect_chain_set_frequency(void* chain_handle, float new_frequency);
+// applied to the effects of the chain as well
+void			effect_chain_set_channels(void* chain_handle, int num_channels);
+int				effect_chain_get_channels(void* chain_handle);
+// scratch for blocks of up to max_frames frames, longer blocks are processed in parts
+void			effect_chain_prepare(void* chain_handle, int max_channels, int max_frames);
+// Effect handles come from mt_delay_get_effect() and conv_get_effect(). The
+// chain owns the effect once added and deletes it when it is removed, don't
+// destroy it any more. Returns 0 on success, -1 if the chain is full or
+// already holds the effect.
+int				effect_chain_add(void* chain_handle, void* effect);
+// before the effect at index, at the end for -1
+int				effect_chain_insert(void* chain_handle, void* effect, int index);
+// the effect handle is invalid afterwards, returns -1 if the chain doesn't hold it
+int				effect_chain_remove(void* chain_handle, void* effect);
+int				effect_chain_get_count(void* chain_handle);
+int				effect_chain_index_of(void* chain_handle, void* effect);
+// 0 passes the signal through
+void			effect_chain_set_enabled(void* chain_handle, int enabled);
+int				effect_chain_get_enabled(void* chain_handle);
+// mix of the chain output with its input, 1 by default
+void			effect_chain_set_wet(void* chain_handle, float wet_value);
+float			effect_chain_get_wet(void* chain_handle);
+void 			effect_chain_process(void* chain_handle, float *input, float *output, int num_frames);
+// input[c] and output[c] hold num_frames samples of channel c
+void 			effect_chain_process_planar(void* chain_handle, float **input, float **output, int num_channels, int num_frames);
+// interleaved samples of the channels set with effect_chain_set_channels, this is the audio file filter
+void 			effect_chain_process_interleaved(void* chain_handle, float *input, float *output, int num_samples);
+void			effect_chain_reset(void* chain_handle);
+void*			effect_chain_get_audio_file_filter_callback(void);
+
+#ifdef __cplusplus
+}
+#endif //__cplusplus
+
+#endif /* EffectChain_c_bridge_h */
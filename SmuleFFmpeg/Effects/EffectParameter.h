@@ -0,0 +1,53 @@
+//
+//  EffectParameter.h
+//  SmuleFFmpeg
+//
+//	Parameter IDs, units and descriptions of the effects, shared by the
+//	effects, their C bridges and Swift.
+//
+
+#ifndef EffectParameter_h
+#define EffectParameter_h
+
+typedef enum {
+	EffectParameterUnitBoolean = 0,		// 0 or 1
+	EffectParameterUnitRatio,			// fraction of full scale
+	EffectParameterUnitMilliseconds,
+	EffectParameterUnitCount,			// whole number
+	EffectParameterUnitSamples,			// whole number of samples
+	EffectParameterUnitChoice			// index into a list, see the effect
+} EffectParameterUnit;
+
+// every effect has these
+enum {
+	EffectParameterEnabled = 0,
+	EffectParameterWet,
+	EffectParameterFirstCustom
+};
+
+// MultiTapDelayEffect
+enum {
+	MultiTapDelayParameterTapNumber = EffectParameterFirstCustom,	// evenly spaced taps
+	MultiTapDelayParameterTotalDelay,	// the taps split it in tap number + 1 equal steps
+	MultiTapDelayParameterAttenuation,	// progressive attenuation of the taps
+	MultiTapDelayParameterCompressor,
+	MultiTapDelayParameterSpread		// taps alternate left and right
+};
+
+// ConvolutionEffect
+enum {
+	ConvolutionParameterPreset = EffectParameterFirstCustom,	// ConvolutionPreset, -1 for a custom response
+	ConvolutionParameterBlockSize,		// FFT block size
+	ConvolutionParameterEngine			// ConvolutionEngine
+};
+
+typedef struct {
+	int					id;
+	const char*			name;
+	EffectParameterUnit	unit;
+	float				minValue;
+	float				maxValue;
+	float				defaultValue;
+} EffectParameterInfo;
+
+#endif /* EffectParameter_h */
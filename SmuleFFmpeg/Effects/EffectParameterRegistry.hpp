@@ -0,0 +1,144 @@
+//
+//  EffectParameterRegistry.hpp
+//  SmuleFFmpeg
+//
+//  The typed parameters of an effect: ID, name, unit, range and default,
+//  with the current values in atomics so any thread can read them.
+//
+//  Only the control thread writes, in batches. The render thread copies all
+//  values at the start of a block, and a sequence counter, odd while a batch
+//  is being written, tells it whether the copy is consistent. If it is not,
+//  the render thread keeps its previous copy and tries again at the next
+//  block. Values written in one batch are always seen together, and neither
+//  side ever waits for the other.
+//
+
+#ifndef EffectParameterRegistry_hpp
+#define EffectParameterRegistry_hpp
+
+#include <atomic>
+#include <string.h>
+#include <math.h>
+#include "EffectParameter.h"
+
+// parameter IDs of an effect are below this
+#define EFFECT_MAX_PARAMETERS				16
+
+// The values a snapshot for the render thread was built from, and the
+// sequence at which the render thread reads them. The snapshot brings them
+// along, so that it is never used with values from before its batch.
+struct EffectParameterSnapshot {
+	unsigned					sequence;
+	float						values[EFFECT_MAX_PARAMETERS];
+};
+
+class EffectParameterRegistry {
+public:
+	EffectParameterRegistry() : count(0), batchDepth(0), sequence(0) {
+		for (int id = 0; id < EFFECT_MAX_PARAMETERS; ++id) {
+			indexOfId[id] = -1;
+			values[id].store(0.0f, std::memory_order_relaxed);
+		}
+	}
+	EffectParameterRegistry(const EffectParameterRegistry&) = delete;
+	EffectParameterRegistry& operator=(const EffectParameterRegistry&) = delete;
+
+	// While the effect is constructed, before other threads can see it.
+	void add(int id, const char* name, EffectParameterUnit unit, float minValue, float maxValue, float defaultValue) {
+		if (id < 0 || id >= EFFECT_MAX_PARAMETERS || indexOfId[id] >= 0)
+			return;
+		EffectParameterInfo& info = infos[count];
+		info.id = id;
+		info.name = name;
+		info.unit = unit;
+		info.minValue = minValue;
+		info.maxValue = maxValue;
+		info.defaultValue = defaultValue;
+		indexOfId[id] = count++;
+		values[id].store(defaultValue, std::memory_order_relaxed);
+	}
+
+	// While the effect is constructed, for a subclass with another default.
+	void setDefault(int id, float defaultValue) {
+		if (!contains(id))
+			return;
+		infos[indexOfId[id]].defaultValue = defaultValue;
+		values[id].store(defaultValue, std::memory_order_relaxed);
+	}
+
+	int							size() const {return count;}
+	// index from 0 to size() - 1, NULL past the end
+	const EffectParameterInfo*	infoAt(int index) const {return index >= 0 && index < count ? &infos[index] : NULL;}
+	// NULL for an ID the effect doesn't have
+	const EffectParameterInfo*	info(int id) const {return contains(id) ? &infos[indexOfId[id]] : NULL;}
+	bool						contains(int id) const {return id >= 0 && id < EFFECT_MAX_PARAMETERS && indexOfId[id] >= 0;}
+
+	// Any thread.
+	float get(int id) const {
+		return contains(id) ? values[id].load(std::memory_order_relaxed) : 0.0f;
+	}
+
+	// Control thread. Batches may nest, the outermost one publishes.
+	void beginBatch() {
+		if (batchDepth++ == 0) {
+			sequence.store(sequence.load(std::memory_order_relaxed) + 1, std::memory_order_relaxed);
+			std::atomic_thread_fence(std::memory_order_release);
+		}
+	}
+	// clamps the value to the range and rounds whole number units, returns what is stored
+	float write(int id, float value) {
+		if (!contains(id))
+			return 0.0f;
+		const EffectParameterInfo& p = infos[indexOfId[id]];
+		if (value != value)
+			return values[id].load(std::memory_order_relaxed);
+		if (p.unit != EffectParameterUnitRatio && p.unit != EffectParameterUnitMilliseconds)
+			value = roundf(value);
+		if (value < p.minValue)
+			value = p.minValue;
+		if (value > p.maxValue)
+			value = p.maxValue;
+		values[id].store(value, std::memory_order_relaxed);
+		return value;
+	}
+	void endBatch() {
+		if (--batchDepth == 0)
+			sequence.store(sequence.load(std::memory_order_relaxed) + 1, std::memory_order_release);
+	}
+	// Control thread. The current values, with the sequence they are read at
+	// once the batch being written ends.
+	void snapshot(EffectParameterSnapshot* s) const {
+		s->sequence = (sequence.load(std::memory_order_relaxed) + 1) & ~1u;
+		for (int id = 0; id < EFFECT_MAX_PARAMETERS; ++id)
+			s->values[id] = values[id].load(std::memory_order_relaxed);
+	}
+
+	// Render thread. Copies all values, indexed by ID, unless a batch is being
+	// written. Returns false and leaves copy untouched then. readSequence, if
+	// not NULL, is set to the sequence of the copy.
+	bool read(float* copy, unsigned* readSequence = NULL) const {
+		unsigned before = sequence.load(std::memory_order_acquire);
+		if (before & 1)
+			return false;
+		float snapshot[EFFECT_MAX_PARAMETERS];
+		for (int id = 0; id < EFFECT_MAX_PARAMETERS; ++id)
+			snapshot[id] = values[id].load(std::memory_order_relaxed);
+		std::atomic_thread_fence(std::memory_order_acquire);
+		if (sequence.load(std::memory_order_relaxed) != before)
+			return false;
+		memcpy(copy, snapshot, sizeof(snapshot));
+		if (readSequence)
+			*readSequence = before;
+		return true;
+	}
+
+private:
+	EffectParameterInfo			infos[EFFECT_MAX_PARAMETERS];
+	int							indexOfId[EFFECT_MAX_PARAMETERS];
+	int							count;
+	int							batchDepth;
+	std::atomic<float>			values[EFFECT_MAX_PARAMETERS];
+	std::atomic<unsigned>		sequence;
+};
+
+#endif /* EffectParameterRegistry_hpp */
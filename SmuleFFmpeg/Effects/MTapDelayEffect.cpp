@@ -6,13 +6,194 @@
 //
 
 #include "MTapDelayEffect.hpp"
+#include "SimdOps.hpp"
+#include <string.h>
+#include <math.h>
+#include <limits.h>
+
+// The vector kernels below must produce exactly the same output as the
+// scalar path, so the compiler is not allowed to fuse multiply and add.
+#ifdef __clang__
+#pragma STDC FP_CONTRACT OFF
+#endif
+
+// acc[i] += src[i] * gain
+static void mtd_accumulate(float* acc, const float* src, float gain, int num_frames) {
+	simd_float vgain = simd_set1(gain);
+	int i = 0;
+	for (; i + SIMD_WIDTH <= num_frames; i += SIMD_WIDTH)
+		simd_store(acc + i, simd_add(simd_load(acc + i), simd_mul(simd_load(src + i), vgain)));
+	for (; i < num_frames; ++i)
+		acc[i] = acc[i] + src[i] * gain;
+}
+
+// output[i] = src[i] * gain
+static void mtd_scale(float* output, const float* src, float gain, int num_frames) {
+	if (gain == 1.0f) {
+		if (output != src)
+			memcpy(output, src, num_frames * sizeof(float));
+		return;
+	}
+	simd_float vgain = simd_set1(gain);
+	int i = 0;
+	for (; i + SIMD_WIDTH <= num_frames; i += SIMD_WIDTH)
+		simd_store(output + i, simd_mul(simd_load(src + i), vgain));
+	for (; i < num_frames; ++i)
+		output[i] = src[i] * gain;
+}
+
+// output[i] = (first[i] + acc[i] * compensation) * wet * .5 + input[i] * dry
+static void mtd_mix(float* output, const float* first, const float* acc, const float* input,
+					float compensation, float wet, float dry, int num_frames) {
+	simd_float vcomp = simd_set1(compensation);
+	simd_float vwet = simd_set1(wet);
+	simd_float vhalf = simd_set1(.5f);
+	simd_float vdry = simd_set1(dry);
+	int i = 0;
+	for (; i + SIMD_WIDTH <= num_frames; i += SIMD_WIDTH) {
+		simd_float effect = acc ? simd_add(simd_load(first + i), simd_mul(simd_load(acc + i), vcomp)) : simd_load(first + i);
+		effect = simd_mul(simd_mul(effect, vwet), vhalf);
+		simd_store(output + i, simd_add(effect, simd_mul(simd_load(input + i), vdry)));
+	}
+	for (; i < num_frames; ++i) {
+		float effect = acc ? first[i] + acc[i] * compensation : first[i];
+		output[i] = effect * wet * .5f + input[i] * dry;
+	}
+}
+
+// number of zero samples at the end of src, scanned backwards so sound stops it right away
+static int mtd_trailing_zeros(const float* src, int num_frames) {
+	int i = num_frames;
+	// 16 samples at a time, the sign bit aside any set bit is sound
+	while (i >= 16) {
+		uint32_t bits = 0;
+		for (int j = i - 16; j < i; ++j) {
+			uint32_t sample;
+			memcpy(&sample, src + j, sizeof(sample));
+			bits |= sample;
+		}
+		if (bits & 0x7fffffff)
+			break;
+		i -= 16;
+	}
+	while (i > 0 && src[i - 1] == 0.0f)
+		--i;
+	return num_frames - i;
+}
+
+// Sum of src[K] * gains[K] for taps K to NumTaps - 1, added to acc in tap order.
+// The recursion unrolls it completely, the sources and gains stay in registers.
+template <int K, int NumTaps>
+struct MtdTapSum {
+	static inline simd_float vector(simd_float acc, const float* const* src, const simd_float* gains, int i) {
+		return MtdTapSum<K + 1, NumTaps>::vector(simd_add(acc, simd_mul(simd_load(src[K] + i), gains[K])), src, gains, i);
+	}
+	static inline float scalar(float acc, const float* const* src, const float* gains, int i) {
+		return MtdTapSum<K + 1, NumTaps>::scalar(acc + src[K][i] * gains[K], src, gains, i);
+	}
+};
+
+template <int NumTaps>
+struct MtdTapSum<NumTaps, NumTaps> {
+	static inline simd_float vector(simd_float acc, const float* const*, const simd_float*, int) { return acc; }
+	static inline float scalar(float acc, const float* const*, const float*, int) { return acc; }
+};
+
+// mtd_scale, mtd_accumulate and mtd_mix in one pass for NumTaps contiguous sources,
+// the same operations in the same order
+template <int NumTaps>
+static void mtd_mix_taps(float* output, const float* input, const float* const* src, const float* gains,
+						 float compensation, float wet, float dry, int num_frames) {
+	simd_float vgains[NumTaps];
+	for (int k = 0; k < NumTaps; ++k)
+		vgains[k] = simd_set1(gains[k]);
+	simd_float vcomp = simd_set1(compensation);
+	simd_float vwet = simd_set1(wet);
+	simd_float vhalf = simd_set1(.5f);
+	simd_float vdry = simd_set1(dry);
+	int i = 0;
+	for (; i + SIMD_WIDTH <= num_frames; i += SIMD_WIDTH) {
+		simd_float effect = simd_mul(simd_load(src[0] + i), vgains[0]);
+		if (NumTaps > 1)
+			effect = simd_add(effect, simd_mul(MtdTapSum<1, NumTaps>::vector(simd_zero(), src, vgains, i), vcomp));
+		effect = simd_mul(simd_mul(effect, vwet), vhalf);
+		simd_store(output + i, simd_add(effect, simd_mul(simd_load(input + i), vdry)));
+	}
+	for (; i < num_frames; ++i) {
+		float effect = src[0][i] * gains[0];
+		if (NumTaps > 1)
+			effect = effect + MtdTapSum<1, NumTaps>::scalar(0.0f, src, gains, i) * compensation;
+		output[i] = effect * wet * .5f + input[i] * dry;
+	}
+}
+
+// Block path of one channel for exactly NumTaps taps. The block is split where
+// a tap wraps around the ring, so every run reads all taps contiguously.
+template <int NumTaps>
+static void mtd_block_kernel(float* output, const float* input, const float* ring, int capacity, int head,
+							 const int* taps, const float* gains, float compensation, float wet, float dry, int num_frames) {
+	int mask = capacity - 1;
+	int offsets[NumTaps];
+	float tapGains[NumTaps];
+	for (int k = 0; k < NumTaps; ++k) {
+		offsets[k] = (head - taps[k]) & mask;
+		tapGains[k] = gains[k];
+	}
+	const float* src[NumTaps];
+	int i = 0;
+	while (i < num_frames) {
+		int run = num_frames - i;
+		for (int k = 0; k < NumTaps; ++k) {
+			if (capacity - offsets[k] < run)
+				run = capacity - offsets[k];
+			src[k] = ring + offsets[k];
+		}
+		mtd_mix_taps<NumTaps>(output + i, input + i, src, tapGains, compensation, wet, dry, run);
+		for (int k = 0; k < NumTaps; ++k)
+			offsets[k] = (offsets[k] + run) & mask;
+		i += run;
+	}
+}
+
+// indexed by the number of taps, picked when the tap table is built
+static const MultiTapDelayKernel mtd_block_kernels[MTD_MAX_UNROLLED_TAPS + 1] = {
+	NULL,
+	mtd_block_kernel<1>, mtd_block_kernel<2>, mtd_block_kernel<3>, mtd_block_kernel<4>,
+	mtd_block_kernel<5>, mtd_block_kernel<6>, mtd_block_kernel<7>, mtd_block_kernel<8>,
+	mtd_block_kernel<9>, mtd_block_kernel<10>, mtd_block_kernel<11>, mtd_block_kernel<12>,
+	mtd_block_kernel<13>, mtd_block_kernel<14>, mtd_block_kernel<15>, mtd_block_kernel<16>
+};
 
 MultiTapDelayEffect::MultiTapDelayEffect() : BaseEffect(),
+								attenuation(0.5f),
+								spread(0.0f),
+								publishedBufferCapacity(0),
+								publishedChannels(0),
+								publishedCombCapacity(0),
+								table(NULL),
 								delayBufferNumSamples(0),
 								delayBufferHead(0),
-								attenuation(0.5f),
+								delayBufferCapacity(0),
+								delayBufferMask(0),
+								delayBuffer(NULL),
+								delayBufferChannels(0),
+								combHead(0),
+								combFilled(0),
+								silentFrames(INT_MAX),
+								resetRequested(0),
+								numChannels(1),
+								processedFrames(0),
+								idleFrames(0),
 								enableCompressor(0)
 {
+	parameters.add(MultiTapDelayParameterTapNumber, "Taps", EffectParameterUnitCount, 1.0f, MTD_MAX_TAP_NUMBER, 1.0f);
+	parameters.add(MultiTapDelayParameterTotalDelay, "Delay", EffectParameterUnitMilliseconds, 1.0f, MAX_TAP_DELAY_MILLISECONDS, 400.0f);
+	parameters.add(MultiTapDelayParameterAttenuation, "Fade", EffectParameterUnitRatio, 0.25f, 1.0f, 0.5f);
+	parameters.add(MultiTapDelayParameterCompressor, "Compressor", EffectParameterUnitBoolean, 0.0f, 1.0f, 0.0f);
+	parameters.add(MultiTapDelayParameterSpread, "Spread", EffectParameterUnitRatio, 0.0f, 1.0f, 0.0f);
+	parameters.read(renderParameters);
+	// there is no render thread yet, take the table right away
+	adoptTable(buildTable());
 }
 
 MultiTapDelayEffect::MultiTapDelayEffect(std::vector<int> tapSampleOffset) : MultiTapDelayEffect() {
@@ -23,63 +204,353 @@ MultiTapDelayEffect::MultiTapDelayEffect(std::vector<int> tapSampleOffset) : Mul
 		delay_ms = (float)tap * 1000.0 / frequency;
 		tapDelay.push_back(delay_ms);
 	}
+	parameters.beginBatch();
+	updateTapParameters();
+	publishTable();
+	parameters.endBatch();
 }
 
 MultiTapDelayEffect::MultiTapDelayEffect(std::vector<float>& tapDelay) : MultiTapDelayEffect() {
-	this->tapDelay = tapDelay;
-	recalculateTaps();
+	setTapDelays(tapDelay);
+}
+
+MultiTapDelayEffect::~MultiTapDelayEffect() {
+	delete table;
+	delete[] delayBuffer;
 }
 
 void MultiTapDelayEffect::process(float *input, float *output, int num_frames) {
+	processPlanar(&input, &output, 1, num_frames);
+}
+
+void MultiTapDelayEffect::processPlanar(float **input, float **output, int num_channels, int num_frames) {
+	// pick up the latest parameters, the tap table built from them and a pending
+	// reset, only at block boundaries
+	MultiTapDelayTable* next = syncParameters(tableExchange);
+	if (next)
+		adoptTable(next);
+	enableCompressor = renderParameters[MultiTapDelayParameterCompressor] != 0.0f;
+	if (resetRequested.exchange(0)) {
+		delayBufferNumSamples = 0;
+		combFilled = 0;
+		silentFrames = INT_MAX;
+	}
+
+	const MultiTapDelayTable* t = table;
+	int channels = num_channels < t->numChannels ? num_channels : t->numChannels;
+	for (int c = channels; c < num_channels; ++c)
+		if (output[c] != input[c])
+			memcpy(output[c], input[c], num_frames * sizeof(float));
+
+	// A silent block whose taps only reach back into silence produces silence.
+	int trailing = num_frames;
+	for (int c = 0; c < channels && trailing > 0; ++c) {
+		int zeros = mtd_trailing_zeros(input[c], num_frames);
+		if (zeros < trailing)
+			trailing = zeros;
+	}
+	bool idle = enabled && trailing == num_frames && silentFrames >= t->historyLength;
+	if (trailing < num_frames)
+		silentFrames = trailing;
+	else
+		silentFrames = silentFrames > INT_MAX - num_frames ? INT_MAX : silentFrames + num_frames;
+	processedFrames.fetch_add(num_frames, std::memory_order_relaxed);
+	if (idle) {
+		idleFrames.fetch_add(num_frames, std::memory_order_relaxed);
+		processIdle(input, output, channels, num_frames);
+		return;
+	}
+
+	float* in[MTD_MAX_CHANNELS];
+	float* out[MTD_MAX_CHANNELS];
+	int offset = 0;
+	while (offset < num_frames) {
+		for (int c = 0; c < channels; ++c) {
+			in[c] = input[c] + offset;
+			out[c] = output[c] + offset;
+		}
+		int frames = num_frames - offset;
+		if (enabled && t->combSpacing > 0) {
+			// the comb reads its own output one spacing back, so a pass can't be longer than that
+			if (frames > MTD_BLOCK_SIZE)
+				frames = MTD_BLOCK_SIZE;
+			if (frames > t->combSpacing)
+				frames = t->combSpacing;
+			processRecursive(in, out, channels, frames);
+			offset += frames;
+			continue;
+		}
+		// the comb state doesn't follow the delay line meanwhile, it starts over next time
+		combFilled = 0;
+		// The block kernel writes the whole block into the delay line before
+		// reading the taps, so all taps must already be filled in. The delay line
+		// keeps MTD_BLOCK_SIZE samples of room behind the longest tap, so the block
+		// never overwrites samples still to be read.
+		if (!enabled || t->taps.empty() || (t->minTap >= 1 && t->maxTap <= delayBufferNumSamples)) {
+			if (frames > MTD_BLOCK_SIZE)
+				frames = MTD_BLOCK_SIZE;
+			processBlock(in, out, channels, frames);
+		}
+		else {
+			// still filling up the delay line, go sample by sample until the longest tap is in
+			if (t->maxTap > delayBufferNumSamples && frames > t->maxTap - delayBufferNumSamples)
+				frames = t->maxTap - delayBufferNumSamples;
+			processScalar(in, out, channels, frames);
+		}
+		offset += frames;
+	}
+}
+
+void MultiTapDelayEffect::processInterleaved(float *input, float *output, int num_channels, int num_frames) {
+	// channels past MTD_MAX_CHANNELS pass through, the stride stays the caller's
+	int channels = num_channels < MTD_MAX_CHANNELS ? num_channels : MTD_MAX_CHANNELS;
+	float* planar[MTD_MAX_CHANNELS];
+	for (int c = 0; c < channels; ++c)
+		planar[c] = interleaveScratch[c];
+	for (int offset = 0; offset < num_frames; offset += MTD_BLOCK_SIZE) {
+		int frames = num_frames - offset < MTD_BLOCK_SIZE ? num_frames - offset : MTD_BLOCK_SIZE;
+		const float* in = input + offset * num_channels;
+		for (int i = 0; i < frames; ++i)
+			for (int c = 0; c < channels; ++c)
+				interleaveScratch[c][i] = in[i * num_channels + c];
+		processPlanar(planar, planar, channels, frames);
+		float* out = output + offset * num_channels;
+		for (int i = 0; i < frames; ++i) {
+			for (int c = 0; c < channels; ++c)
+				out[i * num_channels + c] = interleaveScratch[c][i];
+			for (int c = channels; c < num_channels; ++c)
+				out[i * num_channels + c] = in[i * num_channels + c];
+		}
+	}
+}
+
+void MultiTapDelayEffect::writeDelayLine(float **input, int num_channels, int num_frames) {
+	int head = delayBufferHead;
+	int span = delayBufferCapacity - head;
+	if (span > num_frames)
+		span = num_frames;
+	for (int c = 0; c < num_channels; ++c) {
+		float* ring = delayBuffer + c * delayBufferCapacity;
+		memcpy(ring + head, input[c], span * sizeof(float));
+		memcpy(ring, input[c] + span, (num_frames - span) * sizeof(float));
+	}
+	delayBufferHead = (head + num_frames) & delayBufferMask;
+	delayBufferNumSamples += num_frames;
+	if (delayBufferNumSamples > delayBufferCapacity)
+		delayBufferNumSamples = delayBufferCapacity;
+}
+
+void MultiTapDelayEffect::processIdle(float **input, float **output, int num_channels, int num_frames) {
+	float* in[MTD_MAX_CHANNELS];
+	for (int offset = 0; offset < num_frames; offset += MTD_BLOCK_SIZE) {
+		int frames = num_frames - offset < MTD_BLOCK_SIZE ? num_frames - offset : MTD_BLOCK_SIZE;
+		for (int c = 0; c < num_channels; ++c)
+			in[c] = input[c] + offset;
+		writeDelayLine(in, num_channels, frames);
+	}
+	for (int c = 0; c < num_channels; ++c)
+		memset(output[c], 0, num_frames * sizeof(float));
+	// the comb history decays towards zero without ever reaching it, recompute it when sound comes back
+	combFilled = 0;
+}
+
+void MultiTapDelayEffect::processBlock(float **input, float **output, int num_channels, int num_frames) {
+	// write the input first, every tap is at least one sample behind
+	int head = delayBufferHead;
+	writeDelayLine(input, num_channels, num_frames);
+
+	if (!enabled) {
+		for (int c = 0; c < num_channels; ++c)
+			if (output[c] != input[c])
+				memcpy(output[c], input[c], num_frames * sizeof(float));
+		return;
+	}
+
+	const MultiTapDelayTable* t = table;
+	const std::vector<int>& taps = t->taps;
+	std::size_t tapNumber = taps.size();
+	int tableChannels = t->numChannels;
+	float compensation = tapNumber > 2 && enableCompressor ? 1.0f / (float)(tapNumber - 1) : 1.0f;
+	if (t->blockKernel) {
+		for (int c = 0; c < num_channels; ++c)
+			t->blockKernel(output[c], input[c], delayBuffer + c * delayBufferCapacity, delayBufferCapacity, head,
+							taps.data(), &t->kernelGains[c * tapNumber], compensation, wetMix, 1.0f - wetMix * .5f, num_frames);
+		return;
+	}
+
+	// generic loop for any number of taps
+	float first[MTD_MAX_CHANNELS][MTD_BLOCK_SIZE];
+	float acc[MTD_MAX_CHANNELS][MTD_BLOCK_SIZE];
+	if (tapNumber == 0) {
+		for (int c = 0; c < num_channels; ++c)
+			memset(first[c], 0, num_frames * sizeof(float));
+	}
+	else {
+		// each tap is read as at most two contiguous spans of the ring buffers, the same for every channel
+		for (std::size_t k = 0; k < tapNumber; ++k) {
+			int start = (head - taps[k]) & delayBufferMask;
+			int span = delayBufferCapacity - start;
+			if (span > num_frames)
+				span = num_frames;
+			const float* balance = &t->balance[k * tableChannels];
+			const float* gains = &t->channelGains[k * tableChannels];
+			for (int c = 0; c < num_channels; ++c) {
+				const float* ring = delayBuffer + c * delayBufferCapacity;
+				if (k == 0) {
+					mtd_scale(first[c], ring + start, balance[c], span);
+					mtd_scale(first[c] + span, ring, balance[c], num_frames - span);
+					memset(acc[c], 0, num_frames * sizeof(float));
+				}
+				else {
+					mtd_accumulate(acc[c], ring + start, gains[c], span);
+					mtd_accumulate(acc[c] + span, ring, gains[c], num_frames - span);
+				}
+			}
+		}
+	}
+	for (int c = 0; c < num_channels; ++c)
+		mtd_mix(output[c], first[c], tapNumber > 1 ? acc[c] : NULL, input[c], compensation, wetMix, 1.0f - wetMix * .5f, num_frames);
+}
+
+void MultiTapDelayEffect::readDelayed(float *output, const float *ring, int head, int numSamples, int delay, int num_frames) {
+	// sample i exists once delay <= numSamples + i, what comes before the stream start is silence
+	int missing = delay - numSamples;
+	if (missing < 0)
+		missing = 0;
+	if (missing > num_frames)
+		missing = num_frames;
+	memset(output, 0, missing * sizeof(float));
+	int start = (head - delay + missing) & delayBufferMask;
+	int span = delayBufferCapacity - start;
+	if (span > num_frames - missing)
+		span = num_frames - missing;
+	memcpy(output + missing, ring + start, span * sizeof(float));
+	memcpy(output + missing + span, ring, (num_frames - missing - span) * sizeof(float));
+}
+
+void MultiTapDelayEffect::processRecursive(float **input, float **output, int num_channels, int num_frames) {
+	MultiTapDelayTable* t = table;
+	int spacing = t->combSpacing;
+	int tapNumber = (int)t->taps.size();
+
+	int head = delayBufferHead;
+	int numSamples = delayBufferNumSamples;
+	writeDelayLine(input, num_channels, num_frames);
+
+	float first[MTD_BLOCK_SIZE];
+	float acc[MTD_BLOCK_SIZE];
+	float delayed[MTD_BLOCK_SIZE];
+	double sum[MTD_BLOCK_SIZE];
+	int combMask = t->combMask;
+	// no comb history yet (new table or reset), compute the sum of the taps directly
+	bool priming = combFilled < spacing;
+	float compensation = enableCompressor ? 1.0f / (float)(tapNumber - 1) : 1.0f;
+	for (int c = 0; c < num_channels; ++c) {
+		const float* ring = delayBuffer + c * delayBufferCapacity;
+		double* comb = t->combBuffer.data() + c * (combMask + 1);
+		readDelayed(first, ring, head, numSamples, spacing, num_frames);
+		if (priming) {
+			memset(sum, 0, num_frames * sizeof(double));
+			for (int k = 0; k < tapNumber; ++k) {
+				double gain = t->combGains[k];
+				readDelayed(delayed, ring, head, numSamples, (k + 1) * spacing, num_frames);
+				for (int i = 0; i < num_frames; ++i)
+					sum[i] += gain * delayed[i];
+			}
+		}
+		else {
+			// one recursive comb plus the cancelling tap at (N + 1)d
+			double feedback = t->combFeedback;
+			double cancel = t->combCancelGain;
+			readDelayed(delayed, ring, head, numSamples, (tapNumber + 1) * spacing, num_frames);
+			int i = 0;
+			while (i < num_frames) {
+				// contiguous run up to where the read position wraps around the comb history
+				int read = (combHead + i - spacing) & combMask;
+				int run = combMask + 1 - read;
+				if (run > num_frames - i)
+					run = num_frames - i;
+				const double* past = comb + read;
+				for (int j = 0; j < run; ++j)
+					sum[i + j] = first[i + j] + feedback * past[j] - cancel * delayed[i + j];
+				i += run;
+			}
+		}
+		int span = combMask + 1 - combHead;
+		if (span > num_frames)
+			span = num_frames;
+		memcpy(comb + combHead, sum, span * sizeof(double));
+		memcpy(comb, sum + span, (num_frames - span) * sizeof(double));
+		// everything after the first tap, the pan is the same on all taps and just scales the channel
+		float balance = t->combBalance[c];
+		for (int i = 0; i < num_frames; ++i)
+			acc[i] = (float)(sum[i] - first[i]) * balance;
+		mtd_scale(first, first, balance, num_frames);
+
+		mtd_mix(output[c], first, acc, input[c], compensation, wetMix, 1.0f - wetMix * .5f, num_frames);
+	}
+	combHead = (combHead + num_frames) & combMask;
+	if (priming)
+		combFilled += num_frames;
+}
+
+void MultiTapDelayEffect::processScalar(float **input, float **output, int num_channels, int num_frames) {
+	const MultiTapDelayTable* t = table;
+	const std::vector<int>& taps = t->taps;
+	int tableChannels = t->numChannels;
 	float compressorCompensation = taps.size() > 2 && enableCompressor ? 1.0f / (float)(taps.size() - 1) : 1.0f;
+	float firstSample[MTD_MAX_CHANNELS];
+	float effectSample[MTD_MAX_CHANNELS];
 	// process the input sample by sample
 	for (int i = 0; i < num_frames; ++i) {
-		float effectSample = 0.0f;
+		int tapCount = 0;
+		for (int c = 0; c < num_channels; ++c)
+			firstSample[c] = effectSample[c] = 0.0f;
 		if (enabled) {
-			// Due to time deficiency in this assignment the amplitude
-			// attenuation of each sample is calculated as power of 2
-			// based on the tap index.
-			// It would be better if it's user controlled through a parameter
-			float current_attenuation = 1.0f; // initial attenuation
-			int tapCount = 0;
-			float firstSample = 0.0;
-			for(int tap : taps) {
+			for (std::size_t k = 0; k < taps.size(); ++k) {
 				// do we have enough samples in the buffer
-				if (tap <= delayBufferNumSamples) {
-					int tapBufferIdx = (delayBufferHead + delay_buf_sample_capacity - tap) % delay_buf_sample_capacity;
-					if (tapCount == 0)
-						firstSample = delayBuffer[tapBufferIdx];
-					else
-						effectSample += delayBuffer[tapBufferIdx] * current_attenuation;
+				if (taps[k] <= delayBufferNumSamples) {
+					const float* tapSample = delayBuffer + ((delayBufferHead - taps[k]) & delayBufferMask);
+					if (tapCount == 0) {
+						const float* balance = &t->balance[k * tableChannels];
+						for (int c = 0; c < num_channels; ++c)
+							firstSample[c] = tapSample[c * delayBufferCapacity] * balance[c];
+					}
+					else {
+						const float* gains = &t->channelGains[k * tableChannels];
+						for (int c = 0; c < num_channels; ++c)
+							effectSample[c] += tapSample[c * delayBufferCapacity] * gains[c];
+					}
 					++tapCount;
 				}
-				current_attenuation *= attenuation;
-			}
-			// Normalize the processed sample
-			if (tapCount > 0) {
-				if (tapCount == 1)
-					effectSample = firstSample;
-				else
-					effectSample = firstSample + effectSample * compressorCompensation;
 			}
 		}
-		
+
 		// store the current sample and increment the head
-		delayBuffer[delayBufferHead] = input[i];
-		delayBufferHead = (delayBufferHead + 1) % delay_buf_sample_capacity;
-		if (delayBufferNumSamples < delay_buf_sample_capacity)
+		for (int c = 0; c < num_channels; ++c)
+			delayBuffer[c * delayBufferCapacity + delayBufferHead] = input[c][i];
+		delayBufferHead = (delayBufferHead + 1) & delayBufferMask;
+		if (delayBufferNumSamples < delayBufferCapacity)
 			++delayBufferNumSamples;
-		
-		//prepare the output and mix input with processed signal
-		if (enabled)
-			output[i] = effectSample * wetMix * .5f + input[i] * (1.0f - wetMix * .5f);
-		else
-			output[i] = input[i];
+
+		for (int c = 0; c < num_channels; ++c) {
+			// Normalize the processed sample
+			float effect = effectSample[c];
+			if (tapCount == 1)
+				effect = firstSample[c];
+			else if (tapCount > 1)
+				effect = firstSample[c] + effect * compressorCompensation;
+			//prepare the output and mix input with processed signal
+			if (enabled)
+				output[c][i] = effect * wetMix * .5f + input[c][i] * (1.0f - wetMix * .5f);
+			else
+				output[c][i] = input[c][i];
+		}
 	}
 }
 
 void MultiTapDelayEffect::reset() {
-	delayBufferNumSamples = 0;
+	resetRequested.store(1);
 }
 
 void MultiTapDelayEffect::setFrequency(float newFrequency) {
@@ -87,20 +558,240 @@ void MultiTapDelayEffect::setFrequency(float newFrequency) {
 	recalculateTaps();
 }
 
-// In our specific case parameterBuffer contains a pointer to std::vector of tap
-// delays in millisseconds
-void MultiTapDelayEffect::setParameters(void* parameterBuffer, int buferLength) {
-	if (parameterBuffer && buferLength) {
-		tapDelay = *static_cast<std::vector<float>*>(parameterBuffer);
+void MultiTapDelayEffect::setTapDelays(const std::vector<float>& tapDelay) {
+	this->tapDelay = tapDelay;
+	parameters.beginBatch();
+	updateTapParameters();
+	recalculateTaps();
+	parameters.endBatch();
+}
+
+void MultiTapDelayEffect::updateTapParameters() {
+	std::size_t size = tapDelay.size();
+	if (size > 0) {
+		parameters.write(MultiTapDelayParameterTapNumber, (float)size);
+		parameters.write(MultiTapDelayParameterTotalDelay, tapDelay.back() * (float)(size + 1) / (float)size);
+	}
+}
+
+void MultiTapDelayEffect::parametersChanged(const int* ids, int count) {
+	bool tapsChanged = false;
+	bool tableChanged = false;
+	for (int i = 0; i < count; ++i) {
+		switch (ids[i]) {
+			case MultiTapDelayParameterTapNumber:
+			case MultiTapDelayParameterTotalDelay:
+				tapsChanged = true;
+				break;
+			case MultiTapDelayParameterAttenuation:
+				attenuation = parameters.get(MultiTapDelayParameterAttenuation);
+				tableChanged = true;
+				break;
+			case MultiTapDelayParameterSpread:
+				spread = parameters.get(MultiTapDelayParameterSpread);
+				tapPan.clear();
+				tableChanged = true;
+				break;
+		}
+	}
+	if (tapsChanged) {
+		// evenly spaced, the total delay split in tap number + 1 steps
+		int number = (int)parameters.get(MultiTapDelayParameterTapNumber);
+		float step = parameters.get(MultiTapDelayParameterTotalDelay) / (float)(number + 1);
+		float delay = step;
+		tapDelay.clear();
+		for (int i = 0; i < number; ++i, delay += step)
+			tapDelay.push_back(delay);
 		recalculateTaps();
 	}
+	else if (tableChanged)
+		publishTable();
+}
+
+void MultiTapDelayEffect::setNumChannels(int channels) {
+	numChannels = CLIP(channels, 1, MTD_MAX_CHANNELS);
+	publishTable();
+}
+
+void MultiTapDelayEffect::setTapPan(int tap, float pan) {
+	if (tap >= 0 && tap < (int)taps.size()) {
+		tapPan.resize(taps.size(), 0.0f);
+		tapPan[tap] = CLIP(pan, -1.0f, 1.0f);
+		publishTable();
+	}
+}
+
+float MultiTapDelayEffect::getTapPan(int tap) {
+	return tap >= 0 && tap < (int)tapPan.size() ? tapPan[tap] : 0.0f;
 }
 
 void MultiTapDelayEffect::recalculateTaps() {
 	if (taps.size() != tapDelay.size())
 		taps.resize(tapDelay.size());
 	std::size_t size = tapDelay.size();
+	// Evenly spaced taps (what mt_delay_set_taps produces) are kept exactly evenly
+	// spaced in samples too, otherwise rounding each one on its own breaks the
+	// pattern the comb filter path depends on.
+	bool uniform = size > 0;
+	for (std::size_t i = 0; i < size && uniform; ++i)
+		uniform = fabsf(tapDelay[i] - tapDelay[0] * (float)(i + 1)) <= tapDelay[i] * 1e-4f;
+	int spacing = size > 0 ? (int)(tapDelay[0] * frequency / 1000.0f) : 0;
 	for(std::size_t i = 0; i < size; ++i) {
-		taps[i] = tapDelay[i] * frequency / 1000.0f; // tapDelay is in milliseconds, convert to seconds
+		if (uniform && spacing > 0)
+			taps[i] = spacing * (int)(i + 1);
+		else
+			taps[i] = tapDelay[i] * frequency / 1000.0f; // tapDelay is in milliseconds, convert to seconds
 	}
+	publishTable();
+}
+
+MultiTapDelayTable* MultiTapDelayEffect::buildTable() {
+	MultiTapDelayTable* next = new MultiTapDelayTable();
+	parameters.snapshot(&next->parameters);
+	next->taps = taps;
+	next->gains.resize(taps.size());
+	// Due to time deficiency in this assignment the amplitude
+	// attenuation of each tap is calculated as power of the attenuation
+	// based on the tap index.
+	// It would be better if it's user controlled through a parameter
+	float current_attenuation = 1.0f;
+	for (std::size_t i = 0; i < taps.size(); ++i, current_attenuation *= attenuation)
+		next->gains[i] = current_attenuation;
+	next->minTap = next->maxTap = taps.empty() ? 0 : taps[0];
+	for (int tap : taps) {
+		if (tap < next->minTap)
+			next->minTap = tap;
+		if (tap > next->maxTap)
+			next->maxTap = tap;
+	}
+	next->historyLength = next->maxTap;
+
+	// taps added since the pans were set follow the spread, first one to the left
+	for (std::size_t k = tapPan.size(); k < taps.size(); ++k)
+		tapPan.push_back(k % 2 ? spread : -spread);
+	tapPan.resize(taps.size());
+	int channels = numChannels;
+	next->numChannels = channels;
+	next->balance.resize(taps.size() * channels);
+	next->channelGains.resize(taps.size() * channels);
+	for (std::size_t k = 0; k < taps.size(); ++k) {
+		for (int c = 0; c < channels; ++c) {
+			// linear balance law, only stereo is panned
+			float balance = 1.0f;
+			if (channels == 2 && c == 0 && tapPan[k] > 0.0f)
+				balance = 1.0f - tapPan[k];
+			else if (channels == 2 && c == 1 && tapPan[k] < 0.0f)
+				balance = 1.0f + tapPan[k];
+			next->balance[k * channels + c] = balance;
+			next->channelGains[k * channels + c] = next->gains[k] * balance;
+		}
+	}
+	if (taps.size() <= MTD_MAX_UNROLLED_TAPS) {
+		next->blockKernel = mtd_block_kernels[taps.size()];
+		next->kernelGains.resize(taps.size() * channels);
+		for (int c = 0; c < channels; ++c)
+			for (std::size_t k = 0; k < taps.size(); ++k)
+				next->kernelGains[c * taps.size() + k] = k == 0 ? next->balance[c] : next->channelGains[k * channels + c];
+	}
+
+	// taps at d, 2d, 3d ... go through the comb filter, the cost doesn't grow with their number
+	int tapNumber = (int)taps.size();
+	bool uniform = tapNumber >= MTD_RECURSIVE_MIN_TAPS && taps[0] >= 1;
+	for (int i = 1; i < tapNumber && uniform; ++i)
+		uniform = taps[i] == taps[0] * (i + 1);
+	for (int i = 1; i < tapNumber && uniform; ++i)
+		for (int c = 0; c < channels && uniform; ++c)
+			uniform = next->balance[i * channels + c] == next->balance[c];
+	if (uniform) {
+		int spacing = taps[0];
+		next->combSpacing = spacing;
+		next->combFeedback = attenuation;
+		next->combGains.resize(tapNumber);
+		double gain = 1.0;
+		for (int i = 0; i < tapNumber; ++i, gain *= next->combFeedback)
+			next->combGains[i] = gain;
+		next->combCancelGain = gain;
+		next->historyLength = (tapNumber + 1) * spacing;
+		int combCapacity = MTD_MIN_DELAY_BUFFER_SAMPLES;
+		while (combCapacity < spacing + MTD_BLOCK_SIZE)
+			combCapacity <<= 1;
+		next->combBalance.assign(next->balance.begin(), next->balance.begin() + channels);
+		next->combBuffer.resize(combCapacity * channels);
+		next->combMask = combCapacity - 1;
+	}
+	publishedCombCapacity = (int)next->combBuffer.size();
+
+	// A table the render thread has not picked up yet is replaced, but a new
+	// delay line it carries may still be needed by this one.
+	MultiTapDelayTable* unconsumed = tableExchange.reclaim();
+	// the longest delay plus one block of room for the block kernel, rounded up to a power of 2
+	int required = next->historyLength + MTD_BLOCK_SIZE;
+	int capacity = MTD_MIN_DELAY_BUFFER_SAMPLES;
+	while (capacity < required)
+		capacity <<= 1;
+	if (capacity != publishedBufferCapacity || channels != publishedChannels) {
+		next->delayBuffer = new float[capacity * channels]();
+		next->delayBufferCapacity = capacity;
+		publishedBufferCapacity = capacity;
+		publishedChannels = channels;
+	}
+	else if (unconsumed && unconsumed->delayBuffer) {
+		next->delayBuffer = unconsumed->delayBuffer;
+		next->delayBufferCapacity = unconsumed->delayBufferCapacity;
+		unconsumed->delayBuffer = NULL;
+	}
+	delete unconsumed;
+	return next;
+}
+
+void MultiTapDelayEffect::publishTable() {
+	tableExchange.publish(buildTable());
+}
+
+void MultiTapDelayEffect::adoptTable(MultiTapDelayTable* next) {
+	MultiTapDelayTable* previous = table;
+	if (next->delayBuffer) {
+		// move to the new delay line, keeping as much of the history as fits
+		float* buffer = next->delayBuffer;
+		int capacity = next->delayBufferCapacity;
+		int keep = delayBufferNumSamples < capacity ? delayBufferNumSamples : capacity;
+		// channels the old line didn't have start silent
+		int channels = delayBufferChannels < next->numChannels ? delayBufferChannels : next->numChannels;
+		for (int c = 0; c < channels; ++c) {
+			float* ring = buffer + c * capacity;
+			const float* oldRing = delayBuffer + c * delayBufferCapacity;
+			for (int i = 0; i < keep; ++i)
+				ring[keep - 1 - i] = oldRing[(delayBufferHead - 1 - i) & delayBufferMask];
+		}
+		next->delayBuffer = NULL;
+		// the old line goes away with the retired table
+		if (previous) {
+			previous->delayBuffer = delayBuffer;
+			previous->delayBufferCapacity = delayBufferCapacity;
+		}
+		else
+			delete[] delayBuffer;
+		delayBuffer = buffer;
+		delayBufferCapacity = capacity;
+		delayBufferChannels = next->numChannels;
+		delayBufferMask = capacity - 1;
+		delayBufferHead = keep & delayBufferMask;
+		delayBufferNumSamples = keep;
+	}
+	table = next;
+	// the comb history belongs to the table, start it over
+	combHead = 0;
+	combFilled = 0;
+	if (previous)
+		tableExchange.retire(previous);
+}
+
+void MultiTapDelayEffect::resetFrameCounters() {
+	processedFrames.store(0, std::memory_order_relaxed);
+	idleFrames.store(0, std::memory_order_relaxed);
+}
+
+std::size_t MultiTapDelayEffect::getMemoryFootprint() {
+	return sizeof(*this) + publishedBufferCapacity * publishedChannels * sizeof(float) + publishedCombCapacity * sizeof(double) +
+			tapDelay.capacity() * sizeof(float) + taps.capacity() * sizeof(int) + tapPan.capacity() * sizeof(float);
 }
@@ -13,16 +13,77 @@
 #define MTapDelayEffect_hpp
 
 #include <vector>
+#include <atomic>
+#include <stdint.h>
 #include "Effect.hpp"
+#include "SnapshotExchange.hpp"
 
 // put some constraints, 5 second delay should be Ok
 #define MAX_TAP_DELAY_SECONDS				5
 #define MAX_TAP_DELAY_MILLISECONDS			(MAX_TAP_DELAY_SECONDS * 1000)
 #define MAX_FREQUENCY						96000
+// range of the tap number parameter
+#define MTD_MAX_TAP_NUMBER					256
+// number of frames the vector kernel processes in one pass
+#define MTD_BLOCK_SIZE						256
+// the delay line never goes below this, it is always a power of 2
+#define MTD_MIN_DELAY_BUFFER_SAMPLES		1024
+// channels of a planar stream the delay line keeps apart
+#define MTD_MAX_CHANNELS					8
+// evenly spaced taps from this number on run through the recursive comb filter,
+// below it the vectorized direct form is faster
+#define MTD_RECURSIVE_MIN_TAPS				10
+// up to this number of taps the block path runs a kernel unrolled for the exact tap count
+#define MTD_MAX_UNROLLED_TAPS				16
 
-static const int delay_buf_sample_capacity =(MAX_TAP_DELAY_SECONDS * MAX_FREQUENCY);
-static const int delay_buf_size =			(delay_buf_sample_capacity * sizeof(float));
+// Block kernel for a fixed number of taps, see mtd_block_kernel in the .cpp.
+// Runs one channel: reads the taps from the ring, which already holds the block,
+// and mixes them into output. gains holds the balance of the first tap followed
+// by the channel gains of the others.
+typedef void (*MultiTapDelayKernel)(float* output, const float* input, const float* ring, int capacity, int head,
+									const int* taps, const float* gains, float compensation, float wet, float dry, int num_frames);
 
+// Tap table built on the control thread whenever taps, frequency or attenuation
+// change, and handed to the render thread as a whole at a block boundary.
+struct MultiTapDelayTable {
+	MultiTapDelayTable() : numChannels(1), blockKernel(NULL), minTap(0), maxTap(0), historyLength(0), combSpacing(0), combFeedback(0.0),
+							combCancelGain(0.0), combMask(0), delayBuffer(NULL), delayBufferCapacity(0) {}
+	~MultiTapDelayTable() { delete[] delayBuffer; }
+
+	EffectParameterSnapshot		parameters;		// the values the table was built from
+	std::vector<int>			taps;			// tap delay in number of samples
+	std::vector<float>			gains;			// progressive attenuation of each tap
+	int							numChannels;
+	// per tap and channel, tap k of channel c at k * numChannels + c
+	std::vector<float>			balance;		// pan of each tap, weighs the first tap
+	std::vector<float>			channelGains;	// gains times balance, weighs the taps after the first
+	// kernel unrolled for the number of taps, NULL runs the generic loop
+	MultiTapDelayKernel			blockKernel;
+	std::vector<float>			kernelGains;	// per channel, balance then channelGains, tap k of channel c at c * taps + k
+	int							minTap;			// shortest and longest tap in samples
+	int							maxTap;
+	int							historyLength;	// longest delay read from the delay line
+	// Taps at d, 2d, ... Nd weighted by a^k are a truncated feedback comb:
+	//   S[n] = x[n - d] + a * S[n - d] - a^N * x[n - (N + 1)d]
+	// combSpacing is d when the table runs that way, 0 for the direct form.
+	// Every tap must have the same pan then, so it only scales a channel.
+	int							combSpacing;
+	double						combFeedback;	// a
+	double						combCancelGain;	// a^N
+	std::vector<double>			combGains;		// a^k, to compute S directly while the comb state fills in
+	std::vector<float>			combBalance;	// pan of the taps, per channel
+	std::vector<double>			combBuffer;		// S history of each channel, render thread scratch
+	int							combMask;
+	// New delay line, allocated only when the current one can't hold maxTap
+	// or the number of channels changes. It has numChannels rings of
+	// delayBufferCapacity samples one after the other.
+	// The render thread moves the history into it and leaves the old line
+	// here instead, so it is freed together with the retired table.
+	float*						delayBuffer;
+	int							delayBufferCapacity;
+};
+
+// All setters run on the control thread, process() runs on the render thread.
 class MultiTapDelayEffect : public BaseEffect {
 public:
 	MultiTapDelayEffect();
@@ -31,32 +92,106 @@ public:
 	MultiTapDelayEffect(std::vector<int> tapSampleOffset);
 	// This is added as a more natural specification for taps as delay in milliseconds
 	MultiTapDelayEffect(std::vector<float>& tapDelay);
-	// Nothing to be done here
-	~MultiTapDelayEffect() {}
+	~MultiTapDelayEffect();
+	// owns the delay line
+	MultiTapDelayEffect(const MultiTapDelayEffect&) = delete;
+	MultiTapDelayEffect& operator=(const MultiTapDelayEffect&) = delete;
 	
 	void 			process(float *input, float *output, int num_frames);
+	// channels past getNumChannels() are passed through
+	void			processPlanar(float **input, float **output, int num_channels, int num_frames);
+	// num_frames frames of num_channels interleaved samples
+	void			processInterleaved(float *input, float *output, int num_channels, int num_frames);
+	// the delay line is cleared at the start of the next processed block
 	void 			reset();
 
 	void 			setFrequency(float newFrequency);
 	
-	void 			setParameters(void* parameterBuffer, int buferLength);
+	// any tap delays in milliseconds, the MultiTapDelayParameterTapNumber and
+	// MultiTapDelayParameterTotalDelay parameters set evenly spaced ones
+	void			setTapDelays(const std::vector<float>& tapDelay);
 	float			getMaxTapDelayInMilliseconds() {return MAX_TAP_DELAY_MILLISECONDS;}
 	int				getTapNumber() {return (int)tapDelay.size();}
-	void			setAttenuation(float atntn) {attenuation = CLIP(atntn, 0.25f, 1.0f);}
-	float 			getAttenuation() {return attenuation;}
-	void			setEnableCompressor(int enable) {enableCompressor = enable;}
-	int				isCompressorEnabled() {return enableCompressor;}
+	// the setters and getters below go through the parameters
+	void			setAttenuation(float atntn) {setParameter(MultiTapDelayParameterAttenuation, atntn);}
+	float 			getAttenuation() {return getParameter(MultiTapDelayParameterAttenuation);}
+	void			setEnableCompressor(int enable) {setParameter(MultiTapDelayParameterCompressor, enable ? 1.0f : 0.0f);}
+	int				isCompressorEnabled() {return getParameter(MultiTapDelayParameterCompressor) != 0.0f;}
+	// channels the delay line keeps apart, from 1 to MTD_MAX_CHANNELS
+	void			setNumChannels(int channels);
+	int				getNumChannels() {return numChannels;}
+	// Stereo placement of a tap from -1 (left) to 1 (right). It follows a linear
+	// balance law: the far channel fades out, the near one stays at unity.
+	void			setTapPan(int tap, float pan);
+	float			getTapPan(int tap);
+	// pans the taps alternately left and right, from 0 (center) to 1
+	void			setSpread(float spread) {setParameter(MultiTapDelayParameterSpread, spread);}
+	float			getSpread() {return getParameter(MultiTapDelayParameterSpread);}
+	// bytes used by this instance, including the delay line
+	std::size_t		getMemoryFootprint();
+	int				getDelayBufferCapacity() {return publishedBufferCapacity;}
+	// Once the input has been silent for longer than the longest delay, the output
+	// is silent too and a block only moves the delay line along. These count the
+	// frames processed and the ones that went through that idle path.
+	int64_t			getProcessedFrames() {return processedFrames.load(std::memory_order_relaxed);}
+	int64_t			getIdleFrames() {return idleFrames.load(std::memory_order_relaxed);}
+	void			resetFrameCounters();
+protected:
+	void			parametersChanged(const int* ids, int count);
 private:
+	// keeps the tap number and total delay parameters in line with tapDelay
+	void			updateTapParameters();
 	void			recalculateTaps();
+	// builds a tap table from taps and attenuation
+	MultiTapDelayTable*	buildTable();
+	// hands a new tap table to the render thread
+	void			publishTable();
+	// render thread, switches to a newly published table
+	void			adoptTable(MultiTapDelayTable* next);
+	// The paths below handle all channels in one walk over the tap table,
+	// num_channels must not exceed the channels of the table.
+	// sample by sample path, used while the delay line is still filling up
+	void			processScalar(float **input, float **output, int num_channels, int num_frames);
+	// vectorized path, all taps must be available in the delay line
+	void			processBlock(float **input, float **output, int num_channels, int num_frames);
+	// comb filter path for evenly spaced taps, num_frames must not exceed the tap spacing
+	void			processRecursive(float **input, float **output, int num_channels, int num_frames);
+	// appends num_frames samples of each channel to the delay line
+	void			writeDelayLine(float **input, int num_channels, int num_frames);
+	// copies num_frames samples of a channel ring written delay samples before the head, missing history reads as 0
+	void			readDelayed(float *output, const float *ring, int head, int numSamples, int delay, int num_frames);
+	// silent input with silent history, copies the input into the delay line and clears the output
+	void			processIdle(float **input, float **output, int num_channels, int num_frames);
 private:
+	// control thread state
 	std::vector<float> 			tapDelay;		// tap delay in milliseconds
-	std::vector<int> 			taps;			// tap delay in number of samples used for efficiency in process
-	float 						attenuation;	// progressive attenuation of tap amplitudes from 0.25 to 1
-	//  This is our sample buffer
+	std::vector<int> 			taps;			// tap delay in number of samples
+	float 						attenuation;	// progressive attenuation of tap amplitudes from 0.25 to 1, follows the parameter
+	std::vector<float>			tapPan;			// -1 left to 1 right
+	float						spread;			// follows the parameter
+	int							publishedBufferCapacity;	// delay line size once the last published table is in
+	int							publishedChannels;
+	int							publishedCombCapacity;		// comb history size of the last published table
+	// render thread state
+	MultiTapDelayTable*			table;
+	//  This is our sample buffer, a ring of delayBufferCapacity (power of 2) samples
 	int							delayBufferNumSamples;
 	int							delayBufferHead;
-	float						delayBuffer[delay_buf_size];
-	int 						enableCompressor;
+	int							delayBufferCapacity;
+	int							delayBufferMask;
+	float*						delayBuffer;
+	int							delayBufferChannels;
+	int							combHead;		// write position in table->combBuffer
+	int							combFilled;		// how much of the comb history is valid
+	int							silentFrames;	// trailing zero frames of the input, missing history counts as silent
+	float						interleaveScratch[MTD_MAX_CHANNELS][MTD_BLOCK_SIZE];
+	// shared
+	SnapshotExchange<MultiTapDelayTable> tableExchange;
+	std::atomic<int>			resetRequested;
+	std::atomic<int>			numChannels;	// read by processInterleaved callers on the render thread
+	std::atomic<int64_t>		processedFrames;
+	std::atomic<int64_t>		idleFrames;
+	int 						enableCompressor;	// render thread copy of the parameter
 };
 
 
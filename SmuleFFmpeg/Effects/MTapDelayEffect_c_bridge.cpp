@@ -28,13 +28,9 @@ void mt_delay_set_frequency(void* mt_handle, float new_frequency) {
 void mt_delay_set_taps(void* mt_handle, int number_of_taps, float total_delay_ms) {
 	MultiTapDelayEffect* effect = static_cast<MultiTapDelayEffect*>(mt_handle);
 	if (total_delay_ms <= effect->getMaxTapDelayInMilliseconds() && number_of_taps > 0 && total_delay_ms > 0.0f) {
-		std::vector<float> taps;
-		float inter_delay = total_delay_ms / (float)(number_of_taps + 1);
-		float delay = inter_delay;
-		for (int i = 0; i < number_of_taps; ++i, delay += inter_delay)
-			taps.push_back(delay);
-		effect->setParameters(&taps, 1 /* this is just a hack, indicating there is data
-										setParameters needs to be reworked*/);
+		int ids[] = {MultiTapDelayParameterTapNumber, MultiTapDelayParameterTotalDelay};
+		float values[] = {(float)number_of_taps, total_delay_ms};
+		effect->setParameters(ids, values, 2);
 	}
 }
 
@@ -87,18 +83,113 @@ int mt_delay_is_compressor_enabled(void* mt_handle) {
 	return effect->isCompressorEnabled();
 }
 
+size_t mt_delay_get_memory_footprint(void* mt_handle) {
+	MultiTapDelayEffect* effect = static_cast<MultiTapDelayEffect*>(mt_handle);
+	return effect->getMemoryFootprint();
+}
+
+void mt_delay_set_channels(void* mt_handle, int num_channels) {
+	MultiTapDelayEffect* effect = static_cast<MultiTapDelayEffect*>(mt_handle);
+	effect->setNumChannels(num_channels);
+}
+
+int mt_delay_get_channels(void* mt_handle) {
+	MultiTapDelayEffect* effect = static_cast<MultiTapDelayEffect*>(mt_handle);
+	return effect->getNumChannels();
+}
+
+void mt_delay_set_tap_pan(void* mt_handle, int tap, float pan) {
+	MultiTapDelayEffect* effect = static_cast<MultiTapDelayEffect*>(mt_handle);
+	effect->setTapPan(tap, pan);
+}
+
+float mt_delay_get_tap_pan(void* mt_handle, int tap) {
+	MultiTapDelayEffect* effect = static_cast<MultiTapDelayEffect*>(mt_handle);
+	return effect->getTapPan(tap);
+}
+
+void mt_delay_set_spread(void* mt_handle, float spread) {
+	MultiTapDelayEffect* effect = static_cast<MultiTapDelayEffect*>(mt_handle);
+	effect->setSpread(spread);
+}
+
+float mt_delay_get_spread(void* mt_handle) {
+	MultiTapDelayEffect* effect = static_cast<MultiTapDelayEffect*>(mt_handle);
+	return effect->getSpread();
+}
+
 void mt_delay_process(void* mt_handle, float *input, float *output, int num_frames) {
 	MultiTapDelayEffect* effect = static_cast<MultiTapDelayEffect*>(mt_handle);
 	effect->process(input, output, num_frames);
 }
 
+void mt_delay_process_planar(void* mt_handle, float **input, float **output, int num_channels, int num_frames) {
+	MultiTapDelayEffect* effect = static_cast<MultiTapDelayEffect*>(mt_handle);
+	effect->processPlanar(input, output, num_channels, num_frames);
+}
+
+void mt_delay_process_interleaved(void* mt_handle, float *input, float *output, int num_samples) {
+	MultiTapDelayEffect* effect = static_cast<MultiTapDelayEffect*>(mt_handle);
+	int channels = effect->getNumChannels();
+	effect->processInterleaved(input, output, channels, num_samples / channels);
+}
+
+int64_t mt_delay_get_processed_frames(void* mt_handle) {
+	MultiTapDelayEffect* effect = static_cast<MultiTapDelayEffect*>(mt_handle);
+	return effect->getProcessedFrames();
+}
+
+int64_t mt_delay_get_idle_frames(void* mt_handle) {
+	MultiTapDelayEffect* effect = static_cast<MultiTapDelayEffect*>(mt_handle);
+	return effect->getIdleFrames();
+}
+
+void mt_delay_reset_frame_counters(void* mt_handle) {
+	MultiTapDelayEffect* effect = static_cast<MultiTapDelayEffect*>(mt_handle);
+	effect->resetFrameCounters();
+}
+
+int mt_delay_set_parameters(void* mt_handle, const int *ids, const float *values, int count) {
+	MultiTapDelayEffect* effect = static_cast<MultiTapDelayEffect*>(mt_handle);
+	return ids && values && count > 0 ? effect->setParameters(ids, values, count) : 0;
+}
+
+int mt_delay_set_parameter(void* mt_handle, int id, float value) {
+	MultiTapDelayEffect* effect = static_cast<MultiTapDelayEffect*>(mt_handle);
+	return effect->setParameter(id, value);
+}
+
+float mt_delay_get_parameter(void* mt_handle, int id) {
+	MultiTapDelayEffect* effect = static_cast<MultiTapDelayEffect*>(mt_handle);
+	return effect->getParameter(id);
+}
+
+int mt_delay_get_parameter_count(void* mt_handle) {
+	MultiTapDelayEffect* effect = static_cast<MultiTapDelayEffect*>(mt_handle);
+	return effect->getParameterRegistry().size();
+}
+
+int mt_delay_get_parameter_info(void* mt_handle, int index, EffectParameterInfo *info) {
+	MultiTapDelayEffect* effect = static_cast<MultiTapDelayEffect*>(mt_handle);
+	const EffectParameterInfo* parameter = effect->getParameterRegistry().infoAt(index);
+	if (!parameter || !info)
+		return -1;
+	*info = *parameter;
+	return 0;
+}
+
 void mt_delay_reset(void* mt_handle) {
 	MultiTapDelayEffect* effect = static_cast<MultiTapDelayEffect*>(mt_handle);
 	effect->reset();
 }
 
+void* mt_delay_get_effect(void* mt_handle) {
+	MultiTapDelayEffect* effect = static_cast<MultiTapDelayEffect*>(mt_handle);
+	return static_cast<BaseEffect*>(effect);
+}
+
 void* mt_delay_get_audio_file_filter_callback() {
-	return (void*)mt_delay_process;
+	return (void*)mt_delay_process_interleaved;
 }
 
 void* null_pointer() {
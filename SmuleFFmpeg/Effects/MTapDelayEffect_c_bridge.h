@@ -10,6 +10,10 @@
 #ifndef MTapDelayEffect_c_bridge_h
 #define MTapDelayEffect_c_bridge_h
 
+#include <stddef.h>
+#include <stdint.h>
+#include "EffectParameter.h"
+
 #ifdef __cplusplus
 extern "C" {
 #endif
@@ -31,6 +35,33 @@ void			mt_delay_set_attenuation(void* mt_handle, float attenuation); // 0.25 to
 float			mt_delay_get_attenuation(void* mt_handle);
 void			mt_delay_set_enable_compressor(void* mt_handle, int enable);
 int				mt_delay_is_compressor_enabled(void* mt_handle);
+size_t			mt_delay_get_memory_footprint(void* mt_handle); // in bytes, including the delay line
+void			mt_delay_set_channels(void* mt_handle, int num_channels);
+int				mt_delay_get_channels(void* mt_handle);
+void			mt_delay_set_tap_pan(void* mt_handle, int tap, float pan); // -1.0 left to 1.0 right
+float			mt_delay_get_tap_pan(void* mt_handle, int tap);
+void			mt_delay_set_spread(void* mt_handle, float spread); // 0.0 to 1.0, taps alternate left and right
+float			mt_delay_get_spread(void* mt_handle);
+// input[c] and output[c] hold num_frames samples of channel c
+void 			mt_delay_process_planar(void* mt_handle, float **input, float **output, int num_channels, int num_frames);
+// interleaved samples of the channels set with mt_delay_set_channels, this is the audio file filter
+void 			mt_delay_process_interleaved(void* mt_handle, float *input, float *output, int num_samples);
+// frames processed and frames that skipped the taps because input and history were silent
+int64_t			mt_delay_get_processed_frames(void* mt_handle);
+int64_t			mt_delay_get_idle_frames(void* mt_handle);
+void			mt_delay_reset_frame_counters(void* mt_handle);
+// Parameters by ID, MultiTapDelayParameter* and EffectParameter* in EffectParameter.h.
+// A batch reaches the render thread as a whole, at the start of a block.
+// Unknown IDs are skipped, returns the number of values taken.
+int				mt_delay_set_parameters(void* mt_handle, const int *ids, const float *values, int count);
+int				mt_delay_set_parameter(void* mt_handle, int id, float value);
+float			mt_delay_get_parameter(void* mt_handle, int id);
+int				mt_delay_get_parameter_count(void* mt_handle);
+// description of the parameter at index, 0 to count - 1. Returns 0 on success, -1 past the end
+int				mt_delay_get_parameter_info(void* mt_handle, int index, EffectParameterInfo *info);
+
+// handle of the effect for effect_chain_add, the chain owns the effect then
+void*			mt_delay_get_effect(void* mt_handle);
 
 // this returns NULL to make Swift compiler happy
 void*			null_pointer();
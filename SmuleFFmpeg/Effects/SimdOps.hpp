@@ -0,0 +1,211 @@
+//
+//  SimdOps.hpp
+//  SmuleFFmpeg
+//
+//  Minimal wrapper over the vector unit available at compile time
+//  (AVX2, SSE2 or NEON, with a scalar fallback), so the effect kernels
+//  are written once and stay readable.
+//
+//  Only plain multiply, add and subtract are exposed. There is deliberately
+//  no fused multiply-add, the vector kernels must round exactly like the
+//  scalar code.
+//
+//  The sample format converters also load 16 and 32 bit integers as floats
+//  and store floats as 16 bit integers, truncated toward zero like a C cast
+//  or rounded to nearest, and as 32 bit integers truncated and saturated.
+//  The values stored as 16 bit must already be in the 16 bit range.
+//
+//  simd_uint holds one xorshift32 generator per lane, for dither noise.
+//
+
+#ifndef SimdOps_hpp
+#define SimdOps_hpp
+
+#include <stdint.h>
+#include <math.h>
+#include <string.h>
+
+#if defined(__AVX2__)
+
+#include <immintrin.h>
+
+#define SIMD_WIDTH				8
+typedef __m256					simd_float;
+
+static inline simd_float	simd_load(const float* p) 				{ return _mm256_loadu_ps(p); }
+static inline void			simd_store(float* p, simd_float v) 		{ _mm256_storeu_ps(p, v); }
+static inline simd_float	simd_set1(float x) 						{ return _mm256_set1_ps(x); }
+static inline simd_float	simd_zero() 							{ return _mm256_setzero_ps(); }
+static inline simd_float	simd_add(simd_float a, simd_float b) 	{ return _mm256_add_ps(a, b); }
+static inline simd_float	simd_sub(simd_float a, simd_float b) 	{ return _mm256_sub_ps(a, b); }
+static inline simd_float	simd_mul(simd_float a, simd_float b) 	{ return _mm256_mul_ps(a, b); }
+static inline simd_float	simd_min(simd_float a, simd_float b) 	{ return _mm256_min_ps(a, b); }
+static inline simd_float	simd_max(simd_float a, simd_float b) 	{ return _mm256_max_ps(a, b); }
+static inline simd_float	simd_load_s16(const int16_t* p)			{ return _mm256_cvtepi32_ps(_mm256_cvtepi16_epi32(_mm_loadu_si128((const __m128i*)p))); }
+static inline simd_float	simd_load_s32(const int32_t* p)			{ return _mm256_cvtepi32_ps(_mm256_loadu_si256((const __m256i*)p)); }
+static inline void			simd_store_s16(int16_t* p, simd_float v) {
+	__m256i i = _mm256_cvttps_epi32(v);
+	_mm_storeu_si128((__m128i*)p, _mm_packs_epi32(_mm256_castsi256_si128(i), _mm256_extracti128_si256(i, 1)));
+}
+static inline void			simd_store_s16_rounded(int16_t* p, simd_float v) {
+	__m256i i = _mm256_cvtps_epi32(v);
+	_mm_storeu_si128((__m128i*)p, _mm_packs_epi32(_mm256_castsi256_si128(i), _mm256_extracti128_si256(i, 1)));
+}
+// out of range converts to 0x80000000, flipped to 0x7fffffff where that was positive
+static inline void			simd_store_s32(int32_t* p, simd_float v) {
+	v = _mm256_max_ps(v, _mm256_set1_ps(-2147483648.0f));
+	__m256i i = _mm256_cvttps_epi32(v);
+	_mm256_storeu_si256((__m256i*)p, _mm256_xor_si256(i, _mm256_castps_si256(_mm256_cmp_ps(v, _mm256_set1_ps(2147483648.0f), _CMP_GE_OQ))));
+}
+
+typedef __m256i					simd_uint;
+
+static inline simd_uint		simd_uint_load(const uint32_t* p)		{ return _mm256_loadu_si256((const __m256i*)p); }
+static inline void			simd_uint_store(uint32_t* p, simd_uint v) { _mm256_storeu_si256((__m256i*)p, v); }
+static inline simd_uint		simd_xorshift(simd_uint x) {
+	x = _mm256_xor_si256(x, _mm256_slli_epi32(x, 13));
+	x = _mm256_xor_si256(x, _mm256_srli_epi32(x, 17));
+	return _mm256_xor_si256(x, _mm256_slli_epi32(x, 5));
+}
+// the top 23 bits as a float in [0, 1)
+static inline simd_float	simd_uniform(simd_uint x) {
+	return _mm256_sub_ps(_mm256_castsi256_ps(_mm256_or_si256(_mm256_srli_epi32(x, 9), _mm256_set1_epi32(0x3f800000))), _mm256_set1_ps(1.0f));
+}
+
+#elif defined(__SSE2__)
+
+#include <emmintrin.h>
+
+#define SIMD_WIDTH				4
+typedef __m128					simd_float;
+
+static inline simd_float	simd_load(const float* p) 				{ return _mm_loadu_ps(p); }
+static inline void			simd_store(float* p, simd_float v) 		{ _mm_storeu_ps(p, v); }
+static inline simd_float	simd_set1(float x) 						{ return _mm_set1_ps(x); }
+static inline simd_float	simd_zero() 							{ return _mm_setzero_ps(); }
+static inline simd_float	simd_add(simd_float a, simd_float b) 	{ return _mm_add_ps(a, b); }
+static inline simd_float	simd_sub(simd_float a, simd_float b) 	{ return _mm_sub_ps(a, b); }
+static inline simd_float	simd_mul(simd_float a, simd_float b) 	{ return _mm_mul_ps(a, b); }
+static inline simd_float	simd_min(simd_float a, simd_float b) 	{ return _mm_min_ps(a, b); }
+static inline simd_float	simd_max(simd_float a, simd_float b) 	{ return _mm_max_ps(a, b); }
+static inline simd_float	simd_load_s16(const int16_t* p) {
+	__m128i x = _mm_loadl_epi64((const __m128i*)p);
+	return _mm_cvtepi32_ps(_mm_srai_epi32(_mm_unpacklo_epi16(x, x), 16));
+}
+static inline simd_float	simd_load_s32(const int32_t* p)			{ return _mm_cvtepi32_ps(_mm_loadu_si128((const __m128i*)p)); }
+static inline void			simd_store_s16(int16_t* p, simd_float v) {
+	__m128i i = _mm_cvttps_epi32(v);
+	_mm_storel_epi64((__m128i*)p, _mm_packs_epi32(i, i));
+}
+static inline void			simd_store_s16_rounded(int16_t* p, simd_float v) {
+	__m128i i = _mm_cvtps_epi32(v);
+	_mm_storel_epi64((__m128i*)p, _mm_packs_epi32(i, i));
+}
+// out of range converts to 0x80000000, flipped to 0x7fffffff where that was positive
+static inline void			simd_store_s32(int32_t* p, simd_float v) {
+	v = _mm_max_ps(v, _mm_set1_ps(-2147483648.0f));
+	__m128i i = _mm_cvttps_epi32(v);
+	_mm_storeu_si128((__m128i*)p, _mm_xor_si128(i, _mm_castps_si128(_mm_cmpge_ps(v, _mm_set1_ps(2147483648.0f)))));
+}
+
+typedef __m128i					simd_uint;
+
+static inline simd_uint		simd_uint_load(const uint32_t* p)		{ return _mm_loadu_si128((const __m128i*)p); }
+static inline void			simd_uint_store(uint32_t* p, simd_uint v) { _mm_storeu_si128((__m128i*)p, v); }
+static inline simd_uint		simd_xorshift(simd_uint x) {
+	x = _mm_xor_si128(x, _mm_slli_epi32(x, 13));
+	x = _mm_xor_si128(x, _mm_srli_epi32(x, 17));
+	return _mm_xor_si128(x, _mm_slli_epi32(x, 5));
+}
+// the top 23 bits as a float in [0, 1)
+static inline simd_float	simd_uniform(simd_uint x) {
+	return _mm_sub_ps(_mm_castsi128_ps(_mm_or_si128(_mm_srli_epi32(x, 9), _mm_set1_epi32(0x3f800000))), _mm_set1_ps(1.0f));
+}
+
+#elif defined(__ARM_NEON) || defined(__ARM_NEON__)
+
+#include <arm_neon.h>
+
+#define SIMD_WIDTH				4
+typedef float32x4_t				simd_float;
+
+static inline simd_float	simd_load(const float* p) 				{ return vld1q_f32(p); }
+static inline void			simd_store(float* p, simd_float v) 		{ vst1q_f32(p, v); }
+static inline simd_float	simd_set1(float x) 						{ return vdupq_n_f32(x); }
+static inline simd_float	simd_zero() 							{ return vdupq_n_f32(0.0f); }
+static inline simd_float	simd_add(simd_float a, simd_float b) 	{ return vaddq_f32(a, b); }
+static inline simd_float	simd_sub(simd_float a, simd_float b) 	{ return vsubq_f32(a, b); }
+static inline simd_float	simd_mul(simd_float a, simd_float b) 	{ return vmulq_f32(a, b); }
+static inline simd_float	simd_min(simd_float a, simd_float b) 	{ return vminq_f32(a, b); }
+static inline simd_float	simd_max(simd_float a, simd_float b) 	{ return vmaxq_f32(a, b); }
+static inline simd_float	simd_load_s16(const int16_t* p)			{ return vcvtq_f32_s32(vmovl_s16(vld1_s16(p))); }
+static inline simd_float	simd_load_s32(const int32_t* p)			{ return vcvtq_f32_s32(vld1q_s32(p)); }
+static inline void			simd_store_s16(int16_t* p, simd_float v) { vst1_s16(p, vmovn_s32(vcvtq_s32_f32(v))); }
+#if defined(__aarch64__)
+static inline void			simd_store_s16_rounded(int16_t* p, simd_float v) { vst1_s16(p, vmovn_s32(vcvtnq_s32_f32(v))); }
+#else
+// no round to nearest conversion, halves round away from zero
+static inline void			simd_store_s16_rounded(int16_t* p, simd_float v) {
+	float32x4_t half = vbslq_f32(vdupq_n_u32(0x80000000), v, vdupq_n_f32(0.5f));
+	vst1_s16(p, vmovn_s32(vcvtq_s32_f32(vaddq_f32(v, half))));
+}
+#endif
+// the conversion saturates
+static inline void			simd_store_s32(int32_t* p, simd_float v) { vst1q_s32(p, vcvtq_s32_f32(v)); }
+
+typedef uint32x4_t				simd_uint;
+
+static inline simd_uint		simd_uint_load(const uint32_t* p)		{ return vld1q_u32(p); }
+static inline void			simd_uint_store(uint32_t* p, simd_uint v) { vst1q_u32(p, v); }
+static inline simd_uint		simd_xorshift(simd_uint x) {
+	x = veorq_u32(x, vshlq_n_u32(x, 13));
+	x = veorq_u32(x, vshrq_n_u32(x, 17));
+	return veorq_u32(x, vshlq_n_u32(x, 5));
+}
+// the top 23 bits as a float in [0, 1)
+static inline simd_float	simd_uniform(simd_uint x) {
+	return vsubq_f32(vreinterpretq_f32_u32(vorrq_u32(vshrq_n_u32(x, 9), vdupq_n_u32(0x3f800000))), vdupq_n_f32(1.0f));
+}
+
+#else
+
+#define SIMD_WIDTH				1
+typedef float					simd_float;
+
+static inline simd_float	simd_load(const float* p) 				{ return *p; }
+static inline void			simd_store(float* p, simd_float v) 		{ *p = v; }
+static inline simd_float	simd_set1(float x) 						{ return x; }
+static inline simd_float	simd_zero() 							{ return 0.0f; }
+static inline simd_float	simd_add(simd_float a, simd_float b) 	{ return a + b; }
+static inline simd_float	simd_sub(simd_float a, simd_float b) 	{ return a - b; }
+static inline simd_float	simd_mul(simd_float a, simd_float b) 	{ return a * b; }
+static inline simd_float	simd_min(simd_float a, simd_float b) 	{ return a < b ? a : b; }
+static inline simd_float	simd_max(simd_float a, simd_float b) 	{ return a > b ? a : b; }
+static inline simd_float	simd_load_s16(const int16_t* p)			{ return (float)*p; }
+static inline simd_float	simd_load_s32(const int32_t* p)			{ return (float)*p; }
+static inline void			simd_store_s16(int16_t* p, simd_float v) { *p = (int16_t)v; }
+static inline void			simd_store_s16_rounded(int16_t* p, simd_float v) { *p = (int16_t)lrintf(v); }
+static inline void			simd_store_s32(int32_t* p, simd_float v) {
+	*p = v >= 2147483648.0f ? INT32_MAX : v <= -2147483648.0f ? INT32_MIN : (int32_t)v;
+}
+
+typedef uint32_t				simd_uint;
+
+static inline simd_uint		simd_uint_load(const uint32_t* p)		{ return *p; }
+static inline void			simd_uint_store(uint32_t* p, simd_uint v) { *p = v; }
+static inline simd_uint		simd_xorshift(simd_uint x) {
+	x ^= x << 13;
+	x ^= x >> 17;
+	return x ^ (x << 5);
+}
+// the top 23 bits as a float in [0, 1)
+static inline simd_float	simd_uniform(simd_uint x) {
+	uint32_t bits = (x >> 9) | 0x3f800000;
+	float f;
+	memcpy(&f, &bits, sizeof(f));
+	return f - 1.0f;
+}
+
+#endif
+
+#endif /* SimdOps_hpp */
@@ -0,0 +1,76 @@
+//
+//  SnapshotExchange.hpp
+//  SmuleFFmpeg
+//
+//  Lock-free hand-off of immutable snapshots from the control (UI) thread
+//  to the render thread.
+//
+//  The control thread builds a snapshot, allocating whatever it needs, and
+//  publishes it. The render thread takes it at the next block boundary and
+//  retires the one it was using. The retired snapshot is deleted later on the
+//  control thread, so the render thread never locks and never touches the heap.
+//
+//  There must be only one control thread and one render thread.
+//
+
+#ifndef SnapshotExchange_hpp
+#define SnapshotExchange_hpp
+
+#include <atomic>
+
+template <class T>
+class SnapshotExchange {
+public:
+	SnapshotExchange() : pending(nullptr), retired(nullptr) {}
+	~SnapshotExchange() {
+		delete pending.load();
+		delete retired.load();
+	}
+	SnapshotExchange(const SnapshotExchange&) = delete;
+	SnapshotExchange& operator=(const SnapshotExchange&) = delete;
+
+	// Control thread: makes the snapshot available to the render thread.
+	// Returns the previously published snapshot if the render thread has not
+	// taken it yet (the caller owns it), or NULL.
+	T* publish(T* snapshot) {
+		collect();
+		return pending.exchange(snapshot, std::memory_order_acq_rel);
+	}
+
+	// Control thread: takes back the published snapshot if the render thread
+	// has not taken it yet (the caller owns it), or NULL.
+	T* reclaim() {
+		return pending.exchange(nullptr, std::memory_order_acq_rel);
+	}
+
+	// Control thread: deletes the snapshot retired by the render thread.
+	void collect() {
+		delete retired.exchange(nullptr, std::memory_order_acquire);
+	}
+
+	// Render thread: returns the newly published snapshot or NULL. Nothing is
+	// taken while the previously retired snapshot is still waiting to be
+	// collected, so it is never lost.
+	T* take() {
+		if (retired.load(std::memory_order_acquire) != nullptr)
+			return nullptr;
+		return pending.exchange(nullptr, std::memory_order_acq_rel);
+	}
+
+	// Render thread: whether a snapshot waits to be taken, e.g. after take()
+	// returned NULL because the retired one is still there.
+	bool hasPending() const {
+		return pending.load(std::memory_order_acquire) != nullptr;
+	}
+
+	// Render thread: hands the replaced snapshot back for deletion, must follow a successful take().
+	void retire(T* snapshot) {
+		retired.store(snapshot, std::memory_order_release);
+	}
+
+private:
+	std::atomic<T*>		pending;
+	std::atomic<T*>		retired;
+};
+
+#endif /* SnapshotExchange_hpp */
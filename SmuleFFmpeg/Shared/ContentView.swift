@@ -12,6 +12,7 @@ struct ContentView: View {
 	@ObservedObject var defaultParams = UserDefaultParameters.defaults
 	let audioPlayer = audio_file_player_init()
 	let multiTapEffect = mt_delay_init()
+	let effectChain = effect_chain_init()
 	var body: some View {
 		NavigationView {
 			Form {
@@ -24,7 +25,10 @@ struct ContentView: View {
 					if (!defaultParams.selectedSoundDecoded) {
 						Button("Decode", action: {
 							if var d = FileDescriptor.getFileDescriptor(name: defaultParams.selectedSound) {
-								decompressAudioFile(d.url.path);
+								// decoded to memory and played from there, no WAV file in between
+								guard DecodedSounds.shared.decode(name: d.name, url: d.url) != nil else {
+									return
+								}
 								d.decoded = true;
 								FileDescriptor.setDescriptor(name: defaultParams.selectedSound, descriptor: d)
 								defaultParams.selectedSoundDecoded = true;
@@ -34,10 +38,26 @@ struct ContentView: View {
 					else {
 						Button("Play", action: {
 							if let d = FileDescriptor.getFileDescriptor(name: defaultParams.selectedSound) {
-								let wavPath = (d.url.path as NSString).deletingPathExtension + ".wav"
-								let success = audio_file_player_open(audioPlayer, wavPath) == 0
+								var success = false
+								// while playing, the player opens the new sound only once it has stopped,
+								// so the channels are taken from the sound itself
+								var channels: Int32 = 0
+								// decoded in an earlier run: mapped from the cache
+								if let buffer = DecodedSounds.shared.buffer(name: d.name) ?? DecodedSounds.shared.decode(name: d.name, url: d.url) {
+									success = audio_file_player_open_buffer(audioPlayer, buffer) == 0
+									channels = pcm_buffer_get_num_channels(buffer)
+								}
+								else {
+									let wavPath = (d.url.path as NSString).deletingPathExtension + ".wav"
+									success = audio_file_player_open(audioPlayer, wavPath) == 0
+									if let wav = read_wave_file_init(wavPath) {
+										channels = Int32(read_wave_file_get_num_channels(wav))
+										read_wave_file_destroy(wav)
+									}
+								}
 								if success {
-									mt_delay_reset(multiTapEffect)
+									effect_chain_set_channels(effectChain, channels)
+									effect_chain_reset(effectChain)
 									audio_file_player_start(audioPlayer)
 									defaultParams.totalDelayMilliseconds = defaultParams.totalDelayMilliseconds == 0.0 ?
 										defaultParams.totalDelayMilliseconds + 1 : defaultParams.totalDelayMilliseconds - 1;
@@ -113,8 +133,10 @@ struct ContentView: View {
 		}
 	}
 	init() {
-		let audioFilterCallback = mt_delay_get_audio_file_filter_callback()
-		audio_file_player_register_filter(audioPlayer, audioFilterCallback, multiTapEffect)
+		// the chain owns the delay from here on
+		effect_chain_add(effectChain, mt_delay_get_effect(multiTapEffect))
+		let audioFilterCallback = effect_chain_get_audio_file_filter_callback()
+		audio_file_player_register_filter(audioPlayer, audioFilterCallback, effectChain)
 		if (defaultParams.numberOfTaps == 0) { // the first time initialization
 			defaultParams.numberOfTaps = Float(mt_delay_get_tap_number(multiTapEffect))
 			defaultParams.wetDry = mt_delay_get_wet(multiTapEffect)
@@ -126,9 +148,14 @@ struct ContentView: View {
 			defaultParams.attenuation = 0.5
 		}
 
-		mt_delay_set_enabled(multiTapEffect, defaultParams.effectEnabled ? 1 : 0)
-		mt_delay_set_taps(multiTapEffect, CInt(defaultParams.numberOfTaps), defaultParams.totalDelayMilliseconds)
-		mt_delay_set_wet(multiTapEffect, defaultParams.wetDry)
+		// the whole stored preset in one batch
+		let ids: [CInt] = [CInt(EffectParameterEnabled), CInt(EffectParameterWet),
+						   CInt(MultiTapDelayParameterTapNumber), CInt(MultiTapDelayParameterTotalDelay),
+						   CInt(MultiTapDelayParameterAttenuation), CInt(MultiTapDelayParameterCompressor)]
+		let values: [Float] = [defaultParams.effectEnabled ? 1 : 0, defaultParams.wetDry,
+							   defaultParams.numberOfTaps, defaultParams.totalDelayMilliseconds,
+							   defaultParams.attenuation, defaultParams.compressorEnabled ? 1 : 0]
+		mt_delay_set_parameters(multiTapEffect, ids, values, CInt(ids.count))
 	}
 }
 
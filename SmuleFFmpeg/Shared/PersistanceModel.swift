@@ -22,6 +22,38 @@ struct FileDescriptor: Identifiable {
 	}
 }
 
+// Sounds decoded to memory, each buffer holds one reference until replaced.
+// Decoding goes through an on-disk cache, so a sound decoded before, also in
+// an earlier run, is mapped from there instead of decoded again.
+final class DecodedSounds {
+	static let shared = DecodedSounds()
+	private static let cacheBytes: Int64 = 1 << 30
+	private var buffers: [String:OpaquePointer] = [:]
+	private let cache: OpaquePointer?
+	private init() {
+		let caches = FileManager.default.urls(for: .cachesDirectory, in: .userDomainMask)[0]
+		cache = pcm_cache_open(caches.appendingPathComponent("pcm").path, DecodedSounds.cacheBytes)
+		// open for the life of the app
+		decompressorSetCache(cache)
+	}
+	func decode(name: String, url: URL) -> OpaquePointer? {
+		guard let buffer = decompressAudioFileToMemory(url.path, 0, 0, 0, 0, nil) else {
+			return nil
+		}
+		set(name: name, buffer: buffer)
+		return buffer
+	}
+	func buffer(name: String) -> OpaquePointer? {
+		return buffers[name]
+	}
+	func set(name: String, buffer: OpaquePointer) {
+		if let old = buffers[name] {
+			pcm_buffer_release(old)
+		}
+		buffers[name] = buffer
+	}
+}
+
 private var _fileDescriptorArray :[FileDescriptor]?
 private var _fileDescriptorDictionary :[String:FileDescriptor]?
 
@@ -13,7 +13,13 @@
 
 typedef struct AudioFilePlayer_t {
 	H_READ_WAVE_FILE			wave_file;
+	// played instead of wave_file when set, the player holds a reference
+	H_PCM_BUFFER				pcm;
+	int64_t						pcm_position;	// frames
+	H_PCM_BUFFER				pending_pcm;	// opened once the queue has stopped
 	H_AUDIO_QUEUE_PLAYER		queue_player;
+	float						queue_sample_rate;
+	int							queue_channels;
 	int							destroy_state_active;
 	int 						playing;
 	int 						paused;
@@ -33,13 +39,24 @@ static void _audio_file_player_real_destroy(H_AUDIO_FILE_PLAYER pPlayer) {
 		read_wave_file_destroy(pPlayer->wave_file);
 		pPlayer->wave_file = 0;
 	}
+	pcm_buffer_release(pPlayer->pcm);
+	pcm_buffer_release(pPlayer->pending_pcm);
 	free(pPlayer);
 }
 
+// reads up to max_num_samples interleaved samples from the buffer
+static int _audio_file_player_read_buffer(H_AUDIO_FILE_PLAYER pPlayer, float* outBuffer, int max_num_samples) {
+	int channels = pcm_buffer_get_num_channels(pPlayer->pcm);
+	int frames = pcm_buffer_read_interleaved(pPlayer->pcm, pPlayer->pcm_position, outBuffer, max_num_samples / channels);
+	pPlayer->pcm_position += frames;
+	return frames * channels;
+}
+
 static void _audio_file_player_callback(void* user_data, float* outBuffer, int bufferLen) {
 	H_AUDIO_FILE_PLAYER pPlayer = (H_AUDIO_FILE_PLAYER)user_data;
 	if (pPlayer && pPlayer->playing) {
-		int bytes_read = read_wave_file_read(pPlayer->wave_file, outBuffer, bufferLen);
+		int bytes_read = pPlayer->pcm ? _audio_file_player_read_buffer(pPlayer, outBuffer, bufferLen)
+									  : read_wave_file_read(pPlayer->wave_file, outBuffer, bufferLen);
 		if (pPlayer->filter != 0 && bytes_read > 0)
 			pPlayer->filter(pPlayer->filter_user_data, outBuffer, outBuffer, bytes_read);
 		if (bytes_read < bufferLen) {
@@ -51,7 +68,8 @@ static void _audio_file_player_callback(void* user_data, float* outBuffer, int b
 
 static void audio_queue_player_stopped_callback(void* user_data);
 
-static int _real_audio_file_player_open(H_AUDIO_FILE_PLAYER pPlayer, const char* filePath) {
+// Opens the buffer if pcm is set, the file otherwise.
+static int _real_audio_file_player_open(H_AUDIO_FILE_PLAYER pPlayer, const char* filePath, H_PCM_BUFFER pcm) {
 	int error = 0;
 
 	pPlayer->destroy_state_active = 0;
@@ -61,13 +79,31 @@ static int _real_audio_file_player_open(H_AUDIO_FILE_PLAYER pPlayer, const char*
 	
 	if (pPlayer->wave_file)
 		read_wave_file_destroy(pPlayer->wave_file);
-	pPlayer->wave_file = read_wave_file_init(filePath);
-	if (pPlayer->wave_file == 0)
-		error = -1;
-	if (!error && pPlayer->queue_player == 0) {
-		float sample_rate = read_wave_file_get_sample_rate(pPlayer->wave_file);
-		pPlayer->queue_player = audio_queue_player_init(sample_rate, AUDIO_FILE_PLAYER_BUFFER_SIZE, _audio_file_player_callback, pPlayer);
+	pPlayer->wave_file = 0;
+	pcm_buffer_release(pPlayer->pcm);
+	pPlayer->pcm = pcm_buffer_retain(pcm);
+	pPlayer->pcm_position = 0;
+	if (pcm == 0) {
+		pPlayer->wave_file = read_wave_file_init(filePath);
+		if (pPlayer->wave_file == 0)
+			error = -1;
+		else	// the callback reads without allocating
+			read_wave_file_reserve(pPlayer->wave_file, AUDIO_FILE_PLAYER_BUFFER_SIZE * read_wave_file_get_num_channels(pPlayer->wave_file));
+	}
+	if (error)
+		return error;
+	float sample_rate = pcm ? pcm_buffer_get_sample_rate(pcm) : read_wave_file_get_sample_rate(pPlayer->wave_file);
+	int channels = pcm ? pcm_buffer_get_num_channels(pcm) : read_wave_file_get_num_channels(pPlayer->wave_file);
+	if (pPlayer->queue_player && (pPlayer->queue_sample_rate != sample_rate || pPlayer->queue_channels != channels)) {
+		// stopped, the queue is set up again for the new format
+		audio_queue_player_destroy(pPlayer->queue_player);
+		pPlayer->queue_player = 0;
+	}
+	if (pPlayer->queue_player == 0) {
+		pPlayer->queue_player = audio_queue_player_init(sample_rate, channels, AUDIO_FILE_PLAYER_BUFFER_SIZE, _audio_file_player_callback, pPlayer);
 		audio_queue_player_register_stopped_callback(pPlayer->queue_player, audio_queue_player_stopped_callback, pPlayer);
+		pPlayer->queue_sample_rate = sample_rate;
+		pPlayer->queue_channels = channels;
 	}
 	return error;
 }
@@ -77,7 +113,9 @@ static void audio_queue_player_stopped_callback(void* user_data) {
 	if (pPlayer && pPlayer->destroy_state_active)
 		_audio_file_player_real_destroy(pPlayer);
 	else if (pPlayer->start_new) {
-		_real_audio_file_player_open(pPlayer, pPlayer->file_path);
+		_real_audio_file_player_open(pPlayer, pPlayer->file_path, pPlayer->pending_pcm);
+		pcm_buffer_release(pPlayer->pending_pcm);
+		pPlayer->pending_pcm = 0;
 	}
 }
 
@@ -92,10 +130,28 @@ int audio_file_player_open(H_AUDIO_FILE_PLAYER pPlayer, const char* filePath) {
 	if (pPlayer->queue_player && audio_queue_player_is_playing(pPlayer->queue_player)) {
 		pPlayer->start_new = 1;
 		strcpy(pPlayer->file_path, filePath);
+		pcm_buffer_release(pPlayer->pending_pcm);
+		pPlayer->pending_pcm = 0;
+		audio_queue_player_stop(pPlayer->queue_player);
+	}
+	else
+		error = _real_audio_file_player_open(pPlayer, filePath, 0);
+
+	return error;
+}
+
+int audio_file_player_open_buffer(H_AUDIO_FILE_PLAYER pPlayer, H_PCM_BUFFER buffer) {
+	int error = 0;
+	if (buffer == 0)
+		return -1;
+	if (pPlayer->queue_player && audio_queue_player_is_playing(pPlayer->queue_player)) {
+		pPlayer->start_new = 1;
+		pcm_buffer_release(pPlayer->pending_pcm);
+		pPlayer->pending_pcm = pcm_buffer_retain(buffer);
 		audio_queue_player_stop(pPlayer->queue_player);
 	}
 	else
-		error = _real_audio_file_player_open(pPlayer, filePath);
+		error = _real_audio_file_player_open(pPlayer, 0, buffer);
 
 	return error;
 }
@@ -142,6 +198,12 @@ void audio_file_player_pause(H_AUDIO_FILE_PLAYER pPlayer) {
 	}
 }
 
+int audio_file_player_get_num_channels(H_AUDIO_FILE_PLAYER pPlayer) {
+	if (pPlayer->pcm)
+		return pcm_buffer_get_num_channels(pPlayer->pcm);
+	return pPlayer->wave_file ? read_wave_file_get_num_channels(pPlayer->wave_file) : 0;
+}
+
 void audio_file_player_register_filter(H_AUDIO_FILE_PLAYER pPlayer, audio_file_filter_callback filter, void* user_data) {
 	pPlayer->filter = filter;
 	pPlayer->filter_user_data = user_data;
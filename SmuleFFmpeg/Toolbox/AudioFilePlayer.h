@@ -9,11 +9,13 @@
 #define AudioFilePlayer_h
 
 #include "AudioQueuePlayer.h"
+#include "PcmBuffer.h"
 
 struct AudioFilePlayer_t;
 
 typedef struct AudioFilePlayer_t*		H_AUDIO_FILE_PLAYER;
 
+// num_samples counts the samples of all channels, they are interleaved
 typedef void (*audio_file_filter_callback)(void* user_data, float *input, float *output, int num_samples);
 
 #ifdef __cplusplus
@@ -22,11 +24,16 @@ extern "C" {
 
 H_AUDIO_FILE_PLAYER 	audio_file_player_init(void);
 int						audio_file_player_open(H_AUDIO_FILE_PLAYER h, const char* filePath);
+// Plays decoded samples from memory instead of a file. The player keeps a
+// reference to the buffer until another one or a file is opened.
+int						audio_file_player_open_buffer(H_AUDIO_FILE_PLAYER h, H_PCM_BUFFER buffer);
 void					audio_file_player_destroy(H_AUDIO_FILE_PLAYER h);
 void					audio_file_player_start(H_AUDIO_FILE_PLAYER h);
 void					audio_file_player_stop(H_AUDIO_FILE_PLAYER h);
 void					audio_file_player_pause(H_AUDIO_FILE_PLAYER h);
 void					audio_file_player_resume(H_AUDIO_FILE_PLAYER h);
+// channels of the opened file, 0 if none is open
+int						audio_file_player_get_num_channels(H_AUDIO_FILE_PLAYER h);
 void					audio_file_player_register_filter(H_AUDIO_FILE_PLAYER h, audio_file_filter_callback filter, void* user_data);
 
 #ifdef __cplusplus
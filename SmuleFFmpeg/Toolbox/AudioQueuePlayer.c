@@ -38,7 +38,7 @@ static void _audio_queue_player_callback(void* userData, AudioQueueRef autoQueue
 	}
 }
 
-H_AUDIO_QUEUE_PLAYER audio_queue_player_init(float sample_rate, int buffer_size,
+H_AUDIO_QUEUE_PLAYER audio_queue_player_init(float sample_rate, int num_channels, int buffer_size,
 											 audio_queue_player_callback_t callback, void* user_data) {
 	H_AUDIO_QUEUE_PLAYER h = (H_AUDIO_QUEUE_PLAYER)malloc(sizeof(AudioQueuePlayer));
 	
@@ -48,9 +48,9 @@ H_AUDIO_QUEUE_PLAYER audio_queue_player_init(float sample_rate, int buffer_size,
 	h->stoppedCallback = 0;
 	
 	h->dataFormat.mBitsPerChannel = 32;
-	h->dataFormat.mBytesPerFrame = 4;
-	h->dataFormat.mBytesPerPacket = 4;
-	h->dataFormat.mChannelsPerFrame = 1;
+	h->dataFormat.mBytesPerFrame = 4 * num_channels;
+	h->dataFormat.mBytesPerPacket = 4 * num_channels;
+	h->dataFormat.mChannelsPerFrame = num_channels;
 	h->dataFormat.mFormatFlags = kAudioFormatFlagsNativeFloatPacked;
 	h->dataFormat.mFormatID = kAudioFormatLinearPCM;
 	h->dataFormat.mFramesPerPacket = 1;
@@ -60,7 +60,7 @@ H_AUDIO_QUEUE_PLAYER audio_queue_player_init(float sample_rate, int buffer_size,
 	OSStatus error = AudioQueueNewOutput(&h->dataFormat, _audio_queue_player_callback, h, NULL, NULL, 0, &h->queue);
 	if (error == noErr) {
 		for (int i = 0; i < AUDIO_QUEUE_PLAYER_NUM_BUFFERS && error == noErr; ++i) {
-			error = AudioQueueAllocateBuffer(h->queue, buffer_size * sizeof(float), &h->buffers[i]);
+			error = AudioQueueAllocateBuffer(h->queue, buffer_size * num_channels * sizeof(float), &h->buffers[i]);
 			if (error == noErr)
 				memset(h->buffers[i]->mAudioData, 0, h->buffers[i]->mAudioDataBytesCapacity);
 		}
@@ -24,9 +24,11 @@ struct AudioQueuePlayer_t;
 typedef void (*AudioQueuePlayerHasStoppedCallback)(void* user_data);
 
 typedef struct AudioQueuePlayer_t*		H_AUDIO_QUEUE_PLAYER;
+// out_buffer_length is in samples, the channels are interleaved
 typedef void (*audio_queue_player_callback_t)(void* user_data, float* out_buffer, int out_buffer_length);
 
-H_AUDIO_QUEUE_PLAYER 	audio_queue_player_init(float sample_rate, int buffer_size,
+// buffer_size is in frames
+H_AUDIO_QUEUE_PLAYER 	audio_queue_player_init(float sample_rate, int num_channels, int buffer_size,
 												audio_queue_player_callback_t callback, void* user_data);
 void					audio_queue_player_destroy(H_AUDIO_QUEUE_PLAYER h);
 
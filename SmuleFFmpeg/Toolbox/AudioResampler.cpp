@@ -0,0 +1,128 @@
+//
+//  AudioResampler.cpp
+//  SmuleFFmpeg
+//
+
+#include "AudioResampler.h"
+#include <stdlib.h>
+#include <string.h>
+
+extern "C" {
+	#include <libavutil/channel_layout.h>
+	#include <libavutil/frame.h>
+	#include <libavutil/samplefmt.h>
+	#include <libswresample/swresample.h>
+}
+
+typedef struct AudioResampler_t {
+	SwrContext*			swr;
+	int					outSampleRate;
+	int					outChannels;
+	enum AVSampleFormat	outFormat;
+	int64_t				outLayout;
+	// input the context is set up for
+	int					inSampleRate;
+	int					inFormat;
+	int64_t				inLayout;
+	uint8_t*			buffer;			// interleaved output
+	int					capacity;		// in frames
+} AudioResampler;
+
+static int64_t ar_frame_layout(const AVFrame* frame) {
+	if (frame->channel_layout && av_get_channel_layout_nb_channels(frame->channel_layout) == frame->channels)
+		return (int64_t)frame->channel_layout;
+	return av_get_default_channel_layout(frame->channels);
+}
+
+static int ar_reserve(H_AUDIO_RESAMPLER h, int frames) {
+	if (frames <= h->capacity)
+		return 0;
+	av_freep(&h->buffer);
+	h->capacity = 0;
+	if (av_samples_alloc(&h->buffer, NULL, h->outChannels, frames, h->outFormat, 0) < 0)
+		return AVERROR(ENOMEM);
+	h->capacity = frames;
+	return 0;
+}
+
+static int ar_setup(H_AUDIO_RESAMPLER h, const AVFrame* frame) {
+	int64_t layout = ar_frame_layout(frame);
+	if (h->swr && frame->sample_rate == h->inSampleRate && frame->format == h->inFormat && layout == h->inLayout)
+		return 0;
+	swr_free(&h->swr);
+	h->swr = swr_alloc_set_opts(NULL, h->outLayout, h->outFormat, h->outSampleRate,
+								layout, (enum AVSampleFormat)frame->format, frame->sample_rate, 0, NULL);
+	if (h->swr == NULL)
+		return AVERROR(ENOMEM);
+	int err = swr_init(h->swr);
+	if (err < 0) {
+		swr_free(&h->swr);
+		return err;
+	}
+	h->inSampleRate = frame->sample_rate;
+	h->inFormat = frame->format;
+	h->inLayout = layout;
+	return 0;
+}
+
+H_AUDIO_RESAMPLER audio_resampler_init(int out_sample_rate, int out_channels, int out_format) {
+	if (out_sample_rate <= 0 || out_channels < 1 || out_format < 0 || out_format >= AV_SAMPLE_FMT_NB ||
+		av_sample_fmt_is_planar((enum AVSampleFormat)out_format))
+		return NULL;
+	H_AUDIO_RESAMPLER h = (H_AUDIO_RESAMPLER)malloc(sizeof(AudioResampler));
+	memset(h, 0, sizeof(AudioResampler));
+	h->outSampleRate = out_sample_rate;
+	h->outChannels = out_channels;
+	h->outFormat = (enum AVSampleFormat)out_format;
+	h->outLayout = av_get_default_channel_layout(out_channels);
+	h->inFormat = AV_SAMPLE_FMT_NONE;
+	if (ar_reserve(h, AUDIO_RESAMPLER_DEFAULT_FRAMES) < 0) {
+		free(h);
+		return NULL;
+	}
+	return h;
+}
+
+void audio_resampler_destroy(H_AUDIO_RESAMPLER h) {
+	if (h) {
+		swr_free(&h->swr);
+		av_freep(&h->buffer);
+		free(h);
+	}
+}
+
+int audio_resampler_convert(H_AUDIO_RESAMPLER h, const AVFrame* frame, const uint8_t** out) {
+	*out = h->buffer;
+	int err;
+	if (frame) {
+		if ((err = ar_setup(h, frame)) < 0)
+			return err;
+	}
+	else if (h->swr == NULL) {
+		// nothing was converted, nothing is kept back
+		return 0;
+	}
+	int in_frames = frame ? frame->nb_samples : 0;
+	// an upper bound, including the samples kept back
+	int frames = swr_get_out_samples(h->swr, in_frames);
+	if (frames < 0)
+		return frames;
+	if ((err = ar_reserve(h, frames)) < 0)
+		return err;
+	*out = h->buffer;
+	return swr_convert(h->swr, &h->buffer, h->capacity, frame ? (const uint8_t**)frame->extended_data : NULL, in_frames);
+}
+
+void audio_resampler_reset(H_AUDIO_RESAMPLER h) {
+	// set up again with the next frame, with nothing kept back
+	swr_free(&h->swr);
+	h->inFormat = AV_SAMPLE_FMT_NONE;
+}
+
+int audio_resampler_get_sample_rate(H_AUDIO_RESAMPLER h) {
+	return h->outSampleRate;
+}
+
+int audio_resampler_get_num_channels(H_AUDIO_RESAMPLER h) {
+	return h->outChannels;
+}
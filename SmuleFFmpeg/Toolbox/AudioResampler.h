@@ -0,0 +1,49 @@
+//
+//  AudioResampler.h
+//  SmuleFFmpeg
+//
+//  Converts decoded frames of any sample rate, format and channel layout to
+//  interleaved samples of a fixed rate, format and channel count, in one
+//  libswresample pass per frame.
+//
+//  The output buffer is allocated up front and only grows when a frame needs
+//  more room. The resampler keeps some samples back, they are returned by a
+//  flush at the end of the stream.
+//
+
+#ifndef AudioResampler_h
+#define AudioResampler_h
+
+#include <stdint.h>
+
+struct AudioResampler_t;
+struct AVFrame;
+
+typedef struct AudioResampler_t*		H_AUDIO_RESAMPLER;
+
+// frames of output the buffer holds when the resampler is created
+#define AUDIO_RESAMPLER_DEFAULT_FRAMES		4096
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+// out_format is a packed AVSampleFormat. The input is set up by the frames and
+// again whenever their rate, format or layout changes, which drops the samples
+// kept back. Returns NULL for an invalid output.
+H_AUDIO_RESAMPLER	audio_resampler_init(int out_sample_rate, int out_channels, int out_format);
+void				audio_resampler_destroy(H_AUDIO_RESAMPLER h);
+// Converts the frame, frame NULL flushes the samples kept back at the end of
+// the stream. Returns the number of frames of output, which stay in *out until
+// the next call, or a negative AVERROR code.
+int					audio_resampler_convert(H_AUDIO_RESAMPLER h, const struct AVFrame* frame, const uint8_t** out);
+// drops the samples kept back, e.g. when the stream starts over
+void				audio_resampler_reset(H_AUDIO_RESAMPLER h);
+int					audio_resampler_get_sample_rate(H_AUDIO_RESAMPLER h);
+int					audio_resampler_get_num_channels(H_AUDIO_RESAMPLER h);
+
+#ifdef __cplusplus
+}
+#endif //__cplusplus
+
+#endif /* AudioResampler_h */
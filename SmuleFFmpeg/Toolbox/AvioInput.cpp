@@ -0,0 +1,158 @@
+//
+//  AvioInput.cpp
+//  SmuleFFmpeg
+//
+
+#include "AvioInput.h"
+#include <errno.h>
+#include <fcntl.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <atomic>
+
+extern "C" {
+	#include <libavformat/avformat.h>
+	#include <libavutil/mem.h>
+}
+
+struct AvioInput_t {
+	const uint8_t*		data;
+	int64_t				size;
+	int64_t				position;
+	void*				map;		// set if data is a mapped file
+	size_t				map_size;
+	AVIOContext*		pb;
+};
+
+static std::atomic<int> ioBufferSize(AVIO_INPUT_DEFAULT_BUFFER_SIZE);
+
+void avio_input_set_buffer_size(int buffer_size) {
+	ioBufferSize.store(buffer_size > 0 ? buffer_size : AVIO_INPUT_DEFAULT_BUFFER_SIZE);
+}
+
+int avio_input_get_buffer_size(void) {
+	return ioBufferSize.load();
+}
+
+static H_AVIO_INPUT create(const void* data, int64_t size) {
+	H_AVIO_INPUT h = new AvioInput_t;
+	h->data = (const uint8_t*)data;
+	h->size = size;
+	h->position = 0;
+	h->map = NULL;
+	h->map_size = 0;
+	h->pb = NULL;
+	return h;
+}
+
+H_AVIO_INPUT avio_input_create_file(const char* path) {
+	int fd = open(path, O_RDONLY);
+	if (fd < 0)
+		return NULL;
+	struct stat st;
+	void* map = MAP_FAILED;
+	if (fstat(fd, &st) == 0 && S_ISREG(st.st_mode) && st.st_size > 0)
+		map = mmap(NULL, (size_t)st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+	// the mapping stays valid without the descriptor
+	close(fd);
+	if (map == MAP_FAILED)
+		return NULL;
+	// demuxing mostly reads front to back, let the kernel read ahead
+	madvise(map, (size_t)st.st_size, MADV_SEQUENTIAL);
+	H_AVIO_INPUT h = create(map, st.st_size);
+	h->map = map;
+	h->map_size = (size_t)st.st_size;
+	return h;
+}
+
+H_AVIO_INPUT avio_input_create_memory(const void* data, int64_t size) {
+	if (data == NULL || size < 0)
+		return NULL;
+	return create(data, size);
+}
+
+void avio_input_destroy(H_AVIO_INPUT h) {
+	if (h == NULL)
+		return;
+	if (h->pb) {
+		// the context may have replaced the buffer it was given
+		av_freep(&h->pb->buffer);
+		avio_context_free(&h->pb);
+	}
+	if (h->map)
+		munmap(h->map, h->map_size);
+	delete h;
+}
+
+static int read_packet(void* opaque, uint8_t* buf, int buf_size) {
+	H_AVIO_INPUT h = (H_AVIO_INPUT)opaque;
+	int64_t left = h->size - h->position;
+	if (left <= 0)
+		return AVERROR_EOF;
+	int n = left < buf_size ? (int)left : buf_size;
+	memcpy(buf, h->data + h->position, (size_t)n);
+	h->position += n;
+	return n;
+}
+
+static int64_t seek(void* opaque, int64_t offset, int whence) {
+	H_AVIO_INPUT h = (H_AVIO_INPUT)opaque;
+	int64_t position;
+	switch (whence & ~AVSEEK_FORCE) {
+		case AVSEEK_SIZE:	return h->size;
+		case SEEK_SET:		position = offset; break;
+		case SEEK_CUR:		position = h->position + offset; break;
+		case SEEK_END:		position = h->size + offset; break;
+		default:			return AVERROR(EINVAL);
+	}
+	// past the end reads nothing, like a file
+	if (position < 0)
+		return AVERROR(EINVAL);
+	h->position = position;
+	return position;
+}
+
+int avio_input_open_format(H_AVIO_INPUT h, const char* name, AVFormatContext** formatCtx) {
+	if (h == NULL)
+		return AVERROR(EINVAL);
+	int bufferSize = ioBufferSize.load();
+	uint8_t* buffer = (uint8_t*)av_malloc((size_t)bufferSize);
+	if (buffer)
+		h->pb = avio_alloc_context(buffer, bufferSize, 0, h, read_packet, NULL, seek);
+	AVFormatContext* ctx = h->pb ? avformat_alloc_context() : NULL;
+	if (ctx == NULL) {
+		if (h->pb == NULL)
+			av_free(buffer);
+		avio_input_destroy(h);
+		return AVERROR(ENOMEM);
+	}
+	ctx->pb = h->pb;
+	ctx->flags |= AVFMT_FLAG_CUSTOM_IO;
+	// freed on failure, the input isn't
+	int err = avformat_open_input(&ctx, name ? name : "", NULL, NULL);
+	if (err != 0) {
+		avio_input_destroy(h);
+		return err;
+	}
+	ctx->opaque = h;
+	*formatCtx = ctx;
+	return 0;
+}
+
+int avio_input_open_path(const char* path, AVFormatContext** formatCtx) {
+	H_AVIO_INPUT h = avio_input_create_file(path);
+	if (h)
+		return avio_input_open_format(h, path, formatCtx);
+	*formatCtx = NULL;
+	return avformat_open_input(formatCtx, path, NULL, NULL);
+}
+
+void avio_input_close_format(AVFormatContext** formatCtx) {
+	if (*formatCtx == NULL)
+		return;
+	H_AVIO_INPUT h = (H_AVIO_INPUT)(*formatCtx)->opaque;
+	avformat_close_input(formatCtx);
+	avio_input_destroy(h);
+}
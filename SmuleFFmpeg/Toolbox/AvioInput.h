@@ -0,0 +1,55 @@
+//
+//  AvioInput.h
+//  SmuleFFmpeg
+//
+//  Input for the demuxer from a file mapped into memory, or from bytes the
+//  caller already has in memory, instead of FFmpeg's file protocol.
+//
+//  Reads are copies out of memory into an I/O buffer larger than FFmpeg's
+//  default, so a file is read with page faults the kernel can read ahead
+//  rather than with a read() call every few kilobytes, and an upload held in
+//  RAM is decoded without writing it to disk first.
+//
+
+#ifndef AvioInput_h
+#define AvioInput_h
+
+#include <stdint.h>
+
+struct AvioInput_t;
+struct AVFormatContext;
+
+typedef struct AvioInput_t*		H_AVIO_INPUT;
+
+// bytes of the I/O buffer, unless set otherwise
+#define AVIO_INPUT_DEFAULT_BUFFER_SIZE		(256 * 1024)
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+// The I/O buffer of inputs created from then on, 0 for the default.
+void			avio_input_set_buffer_size(int buffer_size);
+int				avio_input_get_buffer_size(void);
+// The file at path mapped into memory. NULL if it can't be mapped, e.g. an
+// empty file or not a regular file.
+H_AVIO_INPUT	avio_input_create_file(const char* path);
+// size bytes at data, which stay owned by the caller and must outlive the input.
+H_AVIO_INPUT	avio_input_create_memory(const void* data, int64_t size);
+void			avio_input_destroy(H_AVIO_INPUT h);
+
+// Opens a demuxer that reads from the input, which the context owns from then
+// on, also if opening fails. name is only a hint for the format, may be NULL.
+// Returns 0 or an AVERROR code.
+int				avio_input_open_format(H_AVIO_INPUT h, const char* name, struct AVFormatContext** formatCtx);
+// Opens the file at path mapped, or through FFmpeg's own protocols if it
+// can't be mapped, e.g. a URL. Returns 0 or an AVERROR code.
+int				avio_input_open_path(const char* path, struct AVFormatContext** formatCtx);
+// Closes a context opened by either of the above, with its input.
+void			avio_input_close_format(struct AVFormatContext** formatCtx);
+
+#ifdef __cplusplus
+}
+#endif //__cplusplus
+
+#endif /* AvioInput_h */
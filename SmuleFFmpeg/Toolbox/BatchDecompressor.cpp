@@ -0,0 +1,165 @@
+//
+//  BatchDecompressor.cpp
+//  SmuleFFmpeg
+//
+
+#include "BatchDecompressor.h"
+#include <stdio.h>
+#include <string.h>
+#include <strings.h>
+#include <dirent.h>
+#include <sys/stat.h>
+#include <string>
+#include <vector>
+#include <algorithm>
+#include <atomic>
+#include <mutex>
+#include <thread>
+#include <chrono>
+
+struct BatchFile {
+	std::string		inPath;
+	std::string		outPath;
+	off_t			size;
+};
+
+// the input path with its extension replaced by wav
+static std::string batch_wav_path(const std::string& inPath) {
+	size_t slash = inPath.find_last_of('/');
+	size_t dot = inPath.find_last_of('.');
+	if (dot == std::string::npos || (slash != std::string::npos && dot < slash))
+		return inPath + ".wav";
+	return inPath.substr(0, dot) + ".wav";
+}
+
+static void batch_run(std::vector<BatchFile>& files, const BatchDecompressorOptions* options, BatchDecompressorStats* stats) {
+	BatchDecompressorOptions defaults;
+	batch_decompressor_default_options(&defaults);
+	if (options == NULL)
+		options = &defaults;
+
+	// largest first, the last files to finish are the short ones
+	std::stable_sort(files.begin(), files.end(), [](const BatchFile& a, const BatchFile& b) {return a.size > b.size;});
+
+	int numThreads = options->num_threads > 0 ? options->num_threads : (int)std::thread::hardware_concurrency();
+	if (numThreads < 1)
+		numThreads = 1;
+	if (options->max_memory > 0) {
+		size_t fit = options->max_memory / BATCH_DECOMPRESSOR_WORKER_MEMORY;
+		if ((size_t)numThreads > fit)
+			numThreads = fit > 0 ? (int)fit : 1;
+	}
+	// the threads of a segmented decode work on one file
+	int segmentThreads = numThreads;
+	if (options->segmented)
+		numThreads = 1;
+	if (numThreads > (int)files.size())
+		numThreads = files.size() > 0 ? (int)files.size() : 1;
+
+	std::atomic<int> next(0);
+	std::atomic<int> failed(0);
+	std::mutex callbackMutex;
+	double audioSeconds = 0;
+	DecompressorStageTimes stageTimes = {0, 0, 0, 0};
+	std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+
+	auto work = [&]() {
+		int i;
+		while ((i = next++) < (int)files.size()) {
+			double seconds = 0;
+			DecompressorStageTimes times;
+			int err;
+			if (options->segmented)
+				err = decompressAudioFileSegmented(files[i].inPath.c_str(), files[i].outPath.c_str(), options->format,
+												   options->sample_rate, options->channels, segmentThreads, &seconds);
+			else if (options->pipelined)
+				err = decompressAudioFilePipelined(files[i].inPath.c_str(), files[i].outPath.c_str(), options->format,
+												   options->sample_rate, options->channels, &seconds, &times);
+			else
+				err = decompressAudioFileToPath(files[i].inPath.c_str(), files[i].outPath.c_str(), options->format,
+												options->sample_rate, options->channels, &seconds);
+			if (err < 0)
+				++failed;
+			std::lock_guard<std::mutex> lock(callbackMutex);
+			audioSeconds += seconds;
+			if (options->pipelined && !options->segmented) {
+				stageTimes.demux_seconds += times.demux_seconds;
+				stageTimes.decode_seconds += times.decode_seconds;
+				stageTimes.write_seconds += times.write_seconds;
+				stageTimes.wall_seconds += times.wall_seconds;
+			}
+			if (options->callback)
+				options->callback(files[i].inPath.c_str(), files[i].outPath.c_str(), err, seconds, options->user_data);
+		}
+	};
+	// the calling thread is one of the workers
+	std::vector<std::thread> workers;
+	for (int t = 1; t < numThreads; ++t)
+		workers.push_back(std::thread(work));
+	work();
+	for (std::thread& worker : workers)
+		worker.join();
+
+	if (stats) {
+		double wall = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+		stats->num_files = (int)files.size();
+		stats->num_failed = failed;
+		stats->num_threads = numThreads;
+		stats->wall_seconds = wall;
+		stats->audio_seconds = audioSeconds;
+		stats->files_per_second = wall > 0 ? files.size() / wall : 0;
+		stats->realtime_factor = wall > 0 ? audioSeconds / wall : 0;
+		stats->stage_times = stageTimes;
+	}
+}
+
+void batch_decompressor_default_options(BatchDecompressorOptions* options) {
+	memset(options, 0, sizeof(BatchDecompressorOptions));
+	options->format = DecompressorOutputS16;
+}
+
+int batch_decompress_files(const char* const* in_paths, const char* const* out_paths, int num_files,
+						   const BatchDecompressorOptions* options, BatchDecompressorStats* stats) {
+	std::vector<BatchFile> files(num_files > 0 ? num_files : 0);
+	for (int i = 0; i < num_files; ++i) {
+		files[i].inPath = in_paths[i];
+		files[i].outPath = out_paths && out_paths[i] ? std::string(out_paths[i]) : batch_wav_path(in_paths[i]);
+		struct stat st;
+		files[i].size = stat(in_paths[i], &st) == 0 ? st.st_size : 0;
+	}
+	BatchDecompressorStats result;
+	batch_run(files, options, &result);
+	if (stats)
+		*stats = result;
+	return result.num_failed;
+}
+
+int batch_decompress_directory(const char* in_dir, const char* out_dir, const char* extension,
+							   const BatchDecompressorOptions* options, BatchDecompressorStats* stats) {
+	DIR* dir = opendir(in_dir);
+	if (dir == NULL) {
+		fprintf(stderr, "Unable to read the directory \"%s\".\n", in_dir);
+		return -1;
+	}
+	std::vector<BatchFile> files;
+	struct dirent* entry;
+	while ((entry = readdir(dir)) != NULL) {
+		const char* dot = strrchr(entry->d_name, '.');
+		if (dot == NULL || dot == entry->d_name || strcasecmp(dot + 1, extension) != 0)
+			continue;
+		BatchFile file;
+		file.inPath = std::string(in_dir) + "/" + entry->d_name;
+		struct stat st;
+		if (stat(file.inPath.c_str(), &st) != 0 || !S_ISREG(st.st_mode))
+			continue;
+		file.size = st.st_size;
+		file.outPath = batch_wav_path(out_dir ? std::string(out_dir) + "/" + entry->d_name : file.inPath);
+		files.push_back(file);
+	}
+	closedir(dir);
+	BatchDecompressorStats result;
+	batch_run(files, options, &result);
+	if (stats)
+		*stats = result;
+	return result.num_failed;
+}
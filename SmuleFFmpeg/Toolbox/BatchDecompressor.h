@@ -0,0 +1,73 @@
+//
+//  BatchDecompressor.h
+//  SmuleFFmpeg
+//
+//  Decodes many files to WAV files on a pool of worker threads. Each worker
+//  decodes one file at a time with its own demuxer and decoder, and streams
+//  it to disk, so the memory in flight is bounded by the number of workers.
+//  The files are handed out largest first, so that one long file doesn't
+//  keep the batch running on a single core at the end.
+//
+
+#ifndef BatchDecompressor_h
+#define BatchDecompressor_h
+
+#include <stddef.h>
+#include "Decompressor.h"
+
+// memory a worker needs at most: demuxer probing, decoder, frames and file staging
+#define BATCH_DECOMPRESSOR_WORKER_MEMORY		(8 << 20)
+
+// Called once per file when it is done, error is 0 or a negative AVERROR code.
+// The calls come from the workers, one at a time.
+typedef void (*batch_decompressor_file_callback)(const char* in_path, const char* out_path, int error, double seconds, void* user_data);
+
+typedef struct {
+	DecompressorOutputFormat			format;
+	int									sample_rate;	// 0 keeps the rate of each file
+	int									channels;		// 0 keeps the channels of each file
+	int									num_threads;	// 0 for one per core
+	int									pipelined;		// each worker reads, decodes and writes on three threads
+	// The files are decoded one after the other, each in segments on all
+	// num_threads threads. For a few long files rather than many short ones.
+	int									segmented;
+	// Memory the workers may have in flight, fewer workers are started if
+	// needed. 0 for no limit.
+	size_t								max_memory;
+	batch_decompressor_file_callback	callback;		// may be NULL
+	void*								user_data;
+} BatchDecompressorOptions;
+
+typedef struct {
+	int			num_files;
+	int			num_failed;
+	int			num_threads;		// workers started
+	double		wall_seconds;
+	double		audio_seconds;		// decoded by all workers
+	double		files_per_second;
+	double		realtime_factor;	// seconds of audio decoded per second
+	DecompressorStageTimes	stage_times;	// summed over the files, pipelined only
+} BatchDecompressorStats;
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+// 16 bit, rates and channels of the files, one worker per core, no memory limit
+void	batch_decompressor_default_options(BatchDecompressorOptions* options);
+// Decodes in_paths[i] to out_paths[i]. out_paths may be NULL, or hold NULL
+// entries, for a WAV file next to the input. stats may be NULL. Returns the
+// number of files that failed.
+int		batch_decompress_files(const char* const* in_paths, const char* const* out_paths, int num_files,
+							   const BatchDecompressorOptions* options, BatchDecompressorStats* stats);
+// Decodes the files of in_dir with the given extension, e.g. "m4a" (any case),
+// to WAV files of the same name in out_dir, or next to them for out_dir NULL.
+// Returns the number of files that failed, or -1 if in_dir can't be read.
+int		batch_decompress_directory(const char* in_dir, const char* out_dir, const char* extension,
+								   const BatchDecompressorOptions* options, BatchDecompressorStats* stats);
+
+#ifdef __cplusplus
+}
+#endif //__cplusplus
+
+#endif /* BatchDecompressor_h */
@@ -13,15 +13,76 @@ extern "C" {
 	
 	#include <libavformat/avformat.h>
 	#include <libavcodec/avcodec.h>
+	#include <libavutil/channel_layout.h>
 
 #ifdef __cplusplus
 }
 #endif
 
 #include "WavFile.h"
+#include "SampleConverter.h"
+#include "AudioResampler.h"
+#include "PcmBuffer.h"
+#include "PcmCache.h"
+#include "AvioInput.h"
+#include "SpscQueue.hpp"
+#include <vector>
+#include <algorithm>
+#include <stdexcept>
+#include <thread>
+#include <chrono>
+#include <mutex>
+#include <condition_variable>
+#include <atomic>
 
-// #define RAW_OUT_ON_PLANAR false
-#define RAW_OUT_ON_PLANAR 1
+// packets read ahead of the decoder, and decoded frames ahead of the writer
+#define DECOMPRESSOR_PIPELINE_PACKETS		32
+#define DECOMPRESSOR_PIPELINE_FRAMES		8
+// A long file is decoded in segments of this length on several threads.
+// Each segment is decoded from DECOMPRESSOR_SEGMENT_PREROLL samples before
+// its start, at least DECOMPRESSOR_SEGMENT_MIN_PREROLL of them, so the
+// decoder has the state the sequential decode has there (AAC overlap,
+// MP3 bit reservoir) and the samples come out the same.
+#define DECOMPRESSOR_SEGMENT_SECONDS		10
+#define DECOMPRESSOR_SEGMENT_PREROLL		8192
+#define DECOMPRESSOR_SEGMENT_MIN_PREROLL	4096
+// frames a memory buffer has beyond the duration of the stream, so that a
+// slightly longer decode doesn't copy it all to grow
+#define DECOMPRESSOR_PCM_SLACK_FRAMES		8192
+
+// samples read back from the cache are written to the WAV file in blocks of this many
+#define DECOMPRESSOR_CACHE_BLOCK_SAMPLES	65536
+
+static_assert((int)DecompressorOutputS16 == PcmCacheS16 && (int)DecompressorOutputS24 == PcmCacheS24
+			  && (int)DecompressorOutputS32 == PcmCacheS32 && (int)DecompressorOutputFloat == PcmCacheFloat,
+			  "the cache stores the output formats as they are");
+
+static std::atomic<H_PCM_CACHE> decompressorCache(NULL);
+
+// What is decoded: the file at path, or size bytes at data, which path then
+// only names for the demuxer (may be NULL).
+struct DecompressInput {
+	const char*		path;
+	const void*		data;
+	int64_t			size;
+};
+
+static DecompressInput fileInput(const char* path) {
+	DecompressInput input = {path, NULL, 0};
+	return input;
+}
+
+// Speaker positions for a WAV file of more than two channels, the default
+// layout like the resampler's. FFmpeg's layout bits are the WAV mask bits.
+static uint wavChannelMask(int channels) {
+	return channels > 2 ? (uint)(av_get_default_channel_layout(channels) & 0x3ffff) : 0;
+}
+
+enum DecompressMode {
+	DecompressModeSerial,
+	DecompressModePipelined,
+	DecompressModeSegmented
+};
 
 /**
  * Print an error string describing the errorCode to stderr.
@@ -42,100 +103,118 @@ static int printError(const char* prefix, int errorCode) {
 	}
 }
 
-/**
- * Extract a single sample and convert to float.
- */
-static float getSample(const AVCodecContext* codecCtx, uint8_t* buffer, int sampleIndex) {
-	int64_t val = 0;
-	float ret = 0;
-	int sampleSize = av_get_bytes_per_sample(codecCtx->sample_fmt);
-	switch(sampleSize) {
-		case 1:
-			// 8bit samples are always unsigned
-			val = ((uint8_t*)buffer)[sampleIndex];
-			// make signed
-			val -= 127;
-			break;
-
-		case 2:
-			val = ((int16_t*)buffer)[sampleIndex];
-			break;
-
-		case 4:
-			val = ((int32_t*)buffer)[sampleIndex];
-			break;
-
-		case 8:
-			val = ((int64_t*)buffer)[sampleIndex];
-			break;
-
-		default:
-			fprintf(stderr, "Invalid sample size %d.\n", sampleSize);
-			return 0;
-	}
-
-	// Check which data type is in the sample.
-	switch(codecCtx->sample_fmt) {
-		case AV_SAMPLE_FMT_U8:
-		case AV_SAMPLE_FMT_S16:
-		case AV_SAMPLE_FMT_S32:
-		case AV_SAMPLE_FMT_U8P:
-		case AV_SAMPLE_FMT_S16P:
-		case AV_SAMPLE_FMT_S32P:
-			// integer => Scale to [-1, 1] and convert to float.
-			ret = (float)val / (float)((1 << (sampleSize*8-1))-1);
-			break;
+// Converts the decoded frames to the interleaved samples of the WAV file.
+struct FrameWriter {
+	FrameWriter(WavOutFile* file, SampleConverterFormat sampleFormat) : file(file), chunk(NULL), pcm(NULL), cacheWriter(NULL), sampleFormat(sampleFormat), fileChannels(1), framesWritten(0), error(0), resampler(NULL), converter(NULL), format(AV_SAMPLE_FMT_NONE), channels(0) {
+		static const enum AVSampleFormat packed[] = {AV_SAMPLE_FMT_FLT, AV_SAMPLE_FMT_S16, AV_SAMPLE_FMT_S32};
+		passthroughFormat = packed[sampleFormat];
+	}
+	~FrameWriter() {
+		audio_resampler_destroy(resampler);
+		sample_converter_destroy(converter);
+	}
 
-		case AV_SAMPLE_FMT_FLT:
-		case AV_SAMPLE_FMT_FLTP:
-			// float => reinterpret
-			ret = *(float*)&val;
-			break;
+	WavOutFile*					file;
+	std::vector<uint8_t>*		chunk;		// set to collect the samples instead of writing them
+	H_PCM_BUFFER				pcm;		// set to decode to memory, float samples only
+	H_PCM_CACHE_WRITER			cacheWriter;	// gets a copy of what goes to the file
+	SampleConverterFormat		sampleFormat;		// of the samples handed to the file
+	int							fileChannels;
+	int64_t						framesWritten;
+	int							error;		// writing failed, nothing more is written
+	enum AVSampleFormat			passthroughFormat;	// decoded samples in it are written as they are
+	// set if the file has another rate or channel count than the stream
+	H_AUDIO_RESAMPLER			resampler;
+	H_SAMPLE_CONVERTER			converter;
+	int							format;		// of the frames the converter is set up for
+	int							channels;
+	std::vector<uint8_t>		samples;
+};
 
-		case AV_SAMPLE_FMT_DBL:
-		case AV_SAMPLE_FMT_DBLP:
-			// double => reinterpret and then static cast down
-			ret = *(double*)&val;
-			break;
+static int sampleSize(const FrameWriter* writer) {
+	return writer->sampleFormat == SampleConverterS16 ? 2 : 4;
+}
 
-		default:
-			fprintf(stderr, "Invalid sample format %s.\n", av_get_sample_fmt_name(codecCtx->sample_fmt));
-			return 0;
+static void writeSamples(FrameWriter* writer, const void* samples, int num_samples) {
+	if (writer->error)
+		return;
+	if (writer->chunk) {
+		const uint8_t* bytes = (const uint8_t*)samples;
+		writer->chunk->insert(writer->chunk->end(), bytes, bytes + (size_t)num_samples * sampleSize(writer));
+		return;
 	}
-
-	return ret;
+	if (writer->pcm) {
+		if (pcm_buffer_append_interleaved(writer->pcm, (const float*)samples, num_samples / writer->fileChannels) != 0)
+			writer->error = AVERROR(ENOMEM);
+		else
+			writer->framesWritten += num_samples / writer->fileChannels;
+		return;
+	}
+	try {
+		switch (writer->sampleFormat) {
+			case SampleConverterS16:	writer->file->write((const short*)samples, num_samples); break;
+			case SampleConverterS32:	writer->file->write((const int*)samples, num_samples); break;
+			default:					writer->file->write((const float*)samples, num_samples); break;
+		}
+	} catch (const std::exception& e) {
+		fprintf(stderr, "%s\n", e.what());
+		writer->error = AVERROR(EIO);
+		return;
+	}
+	writer->framesWritten += num_samples / writer->fileChannels;
+	// the entry is dropped on commit if this fails, the file is still good
+	if (writer->cacheWriter)
+		pcm_cache_write(writer->cacheWriter, samples, num_samples / writer->fileChannels);
 }
 
 /**
- * Write the frame to an output file.
+ * Write the frame to an output file. NULL writes what the resampler keeps back.
  */
-static void handleFrame(const AVCodecContext* codecCtx, const AVFrame* frame, WavOutFile* outFile) {
-	if(av_sample_fmt_is_planar(codecCtx->sample_fmt) == 1) {
-		// This means that the data of each channel is in its own buffer.
-		// => frame->extended_data[i] contains data for the i-th channel.
-		for(int s = 0; s < frame->nb_samples; ++s) {
-			for(int c = 0; c < codecCtx->channels; ++c) {
-				float sample = getSample(codecCtx, frame->extended_data[c], s);
-				outFile->write(&sample, 1);
-//				fwrite(&sample, sizeof(float), 1, outFile);
-			}
-		}
-	} else {
-		// This means that the data of each channel is in the same buffer.
-		// => frame->extended_data[0] contains data of all channels.
-		if(RAW_OUT_ON_PLANAR) {
-			outFile->write((char*)frame->extended_data[0], frame->linesize[0]);
-//			fwrite(frame->extended_data[0], 1, frame->linesize[0], outFile);
-		} else {
-			for(int s = 0; s < frame->nb_samples; ++s) {
-				for(int c = 0; c < codecCtx->channels; ++c) {
-					float sample = getSample(codecCtx, frame->extended_data[0], s*codecCtx->channels+c);
-					outFile->write(&sample, 1);
-//					fwrite(&sample, sizeof(float), 1, outFile);
-				}
-			}
+static void handleFrame(const AVFrame* frame, FrameWriter* writer) {
+	if (writer->resampler) {
+		const uint8_t* samples;
+		int frames = audio_resampler_convert(writer->resampler, frame, &samples);
+		if (frames < 0)
+			printError("Resample error.", frames);
+		else
+			writeSamples(writer, samples, frames * audio_resampler_get_num_channels(writer->resampler));
+		return;
+	}
+	int num_samples = frame->nb_samples * frame->channels;
+	// planar float, as AAC decodes, goes plane by plane to a planar buffer
+	if (writer->pcm && pcm_buffer_is_planar(writer->pcm) && frame->format == AV_SAMPLE_FMT_FLTP && frame->channels == writer->fileChannels) {
+		if (!writer->error && pcm_buffer_append_planar(writer->pcm, (const float* const*)frame->extended_data, frame->nb_samples) != 0)
+			writer->error = AVERROR(ENOMEM);
+		else if (!writer->error)
+			writer->framesWritten += frame->nb_samples;
+		return;
+	}
+	// Interleaved samples in the format of the file need no conversion. Only
+	// nb_samples count, linesize may include padding.
+	enum AVSampleFormat format = (enum AVSampleFormat)frame->format;
+	if (av_get_packed_sample_fmt(format) == writer->passthroughFormat && (!av_sample_fmt_is_planar(format) || frame->channels == 1)) {
+		writeSamples(writer, frame->extended_data[0], num_samples);
+		return;
+	}
+	// the kernels are picked once per stream, again only if the format changes
+	if (writer->converter == NULL || frame->format != writer->format || frame->channels != writer->channels) {
+		sample_converter_destroy(writer->converter);
+		writer->converter = sample_converter_init(frame->format, frame->channels, writer->sampleFormat, 0);
+		writer->format = frame->format;
+		writer->channels = frame->channels;
+		if (writer->converter == NULL) {
+			fprintf(stderr, "Invalid sample format %s.\n", av_get_sample_fmt_name(format));
+			return;
 		}
 	}
+	if (writer->converter == NULL)
+		return;
+	size_t num_bytes = (size_t)num_samples * sample_converter_get_output_sample_size(writer->converter);
+	if (writer->samples.size() < num_bytes)
+		writer->samples.resize(num_bytes);
+	void* out = writer->samples.data();
+	sample_converter_convert(writer->converter, frame->extended_data, &out, frame->nb_samples);
+	writeSamples(writer, out, num_samples);
 }
 
 /**
@@ -176,34 +255,35 @@ static void printStreamInformation(const AVCodec* codec, const AVCodecContext* c
 	fprintf(stderr, "Sample Size:   %7d\n", av_get_bytes_per_sample(codecCtx->sample_fmt));
 	fprintf(stderr, "Channels:      %7d\n", codecCtx->channels);
 	fprintf(stderr, "Planar:        %7d\n", av_sample_fmt_is_planar(codecCtx->sample_fmt));
-	fprintf(stderr, "Float Output:  %7s\n", !RAW_OUT_ON_PLANAR || av_sample_fmt_is_planar(codecCtx->sample_fmt) ? "yes" : "no");
 }
 
 /**
  * Receive as many frames as available and handle them.
  */
-static int receiveAndHandle(AVCodecContext* codecCtx, AVFrame* frame, WavOutFile* outFile) {
+static int receiveAndHandle(AVCodecContext* codecCtx, AVFrame* frame, FrameWriter* writer) {
 	int err = 0;
 	// Read the packets from the decoder.
 	// NOTE: Each packet may generate more than one frame, depending on the codec.
 	while((err = avcodec_receive_frame(codecCtx, frame)) == 0) {
 		// Let's handle the frame in a function.
-		handleFrame(codecCtx, frame, outFile);
+		handleFrame(frame, writer);
 		// Free any buffers and reset the fields to default values.
 		av_frame_unref(frame);
+		if (writer->error)
+			return writer->error;
 	}
 	return err;
 }
 
 /*
- * Drain any buffered frames.
+ * Drain any buffered frames, and the samples the resampler keeps back.
  */
-static void drainDecoder(AVCodecContext* codecCtx, AVFrame* frame, WavOutFile* outFile) {
+static void drainDecoder(AVCodecContext* codecCtx, AVFrame* frame, FrameWriter* writer) {
 	int err = 0;
 	// Some codecs may buffer frames. Sending NULL activates drain-mode.
 	if((err = avcodec_send_packet(codecCtx, NULL)) == 0) {
 		// Read the remaining packets from the decoder.
-		err = receiveAndHandle(codecCtx, frame, outFile);
+		err = receiveAndHandle(codecCtx, frame, writer);
 		if(err != AVERROR(EAGAIN) && err != AVERROR_EOF) {
 			// Neither EAGAIN nor EOF => Something went wrong.
 			printError("Receive error.", err);
@@ -212,33 +292,27 @@ static void drainDecoder(AVCodecContext* codecCtx, AVFrame* frame, WavOutFile* o
 		// Something went wrong.
 		printError("Send error.", err);
 	}
+	if (writer->resampler)
+		handleFrame(NULL, writer);
 }
 
-void decompressAudioFile(const char* filePath) {
-	// Open the outfile called "<infile>.raw".
-	char outFilename[1024];
-	const char* pExtension = strrchr(filePath, '.');
-	size_t str_len = pExtension - filePath;
-	if (str_len > 1000) {
-		printError("Something's wrong with the filePath.", -1);
-		return;
-	}
-	strcpy(outFilename, filePath);
-	memcpy(outFilename + str_len + 1, "wav\0", 4);
-//	FILE* outFile = fopen(outFilename, "w+");
-//	if(outFile == NULL) {
-//		fprintf(stderr, "Unable to open output file \"%s\".\n", outFilename);
-//	}
-
+/**
+ * Open the file and the decoder of its first audio stream. Returns 0 or an AVERROR code.
+ */
+static int openAudioDecoder(const DecompressInput* input, AVFormatContext** pFormatCtx, AVCodecContext** pCodecCtx, int* pAudioStreamIndex, const AVCodec** pCodec) {
 	// Initialize the libavformat. This registers all muxers, demuxers and protocols.
 //	av_register_all();
 
 	int err = 0;
 	AVFormatContext *formatCtx = NULL;
-	// Open the file and read the header.
-	if ((err = avformat_open_input(&formatCtx, filePath, NULL, 0)) != 0) {
+	// Open the file and read the header. A file is mapped, and read through a large buffer.
+	if (input->data)
+		err = avio_input_open_format(avio_input_create_memory(input->data, input->size), input->path, &formatCtx);
+	else
+		err = avio_input_open_path(input->path, &formatCtx);
+	if (err != 0) {
 		printError("Error opening file.", err);
-		return;
+		return err;
 	}
 
 	// In case the file had no header, read some frames and find out which format and codecs are used.
@@ -250,8 +324,8 @@ void decompressAudioFile(const char* filePath) {
 	if(audioStreamIndex == -1) {
 		// No audio stream was found.
 		fprintf(stderr, "None of the available %d streams are audio streams.\n", formatCtx->nb_streams);
-		avformat_close_input(&formatCtx);
-		return;
+		avio_input_close_format(&formatCtx);
+		return AVERROR_STREAM_NOT_FOUND;
 	}
 
 	// Find the correct decoder for the codec.
@@ -259,17 +333,17 @@ void decompressAudioFile(const char* filePath) {
 	if (codec == NULL) {
 		// Decoder not found.
 		fprintf(stderr, "Decoder not found. The codec is not supported.\n");
-		avformat_close_input(&formatCtx);
-		return;
+		avio_input_close_format(&formatCtx);
+		return AVERROR_DECODER_NOT_FOUND;
 	}
 
 	// Initialize codec context for the decoder.
 	AVCodecContext* codecCtx = avcodec_alloc_context3(codec);
 	if (codecCtx == NULL) {
 		// Something went wrong. Cleaning up...
-		avformat_close_input(&formatCtx);
+		avio_input_close_format(&formatCtx);
 		fprintf(stderr, "Could not allocate a decoding context.\n");
-		return;
+		return AVERROR(ENOMEM);
 	}
 
 	// Fill the codecCtx with the parameters of the codec used in the read file.
@@ -277,9 +351,9 @@ void decompressAudioFile(const char* filePath) {
 		// Something went wrong. Cleaning up...
 		avcodec_close(codecCtx);
 		avcodec_free_context(&codecCtx);
-		avformat_close_input(&formatCtx);
+		avio_input_close_format(&formatCtx);
 		printError("Error setting codec context parameters.", err);
-		return;
+		return err;
 	}
 
 	// Explicitly request non planar data.
@@ -289,32 +363,47 @@ void decompressAudioFile(const char* filePath) {
 	if ((err = avcodec_open2(codecCtx, codec, NULL)) != 0) {
 		avcodec_close(codecCtx);
 		avcodec_free_context(&codecCtx);
-		avformat_close_input(&formatCtx);
-		return;
+		avio_input_close_format(&formatCtx);
+		printError("Error opening the decoder.", err);
+		return err;
 	}
+	*pFormatCtx = formatCtx;
+	*pCodecCtx = codecCtx;
+	*pAudioStreamIndex = audioStreamIndex;
+	if (pCodec)
+		*pCodec = codec;
+	return 0;
+}
 
-	
-	int sample_rate = codecCtx->sample_rate;
-	int channels = codecCtx->channels;
-	WavOutFile outFile(outFilename, sample_rate, 16, channels);
+static void closeAudioDecoder(AVFormatContext** formatCtx, AVCodecContext** codecCtx) {
+	// Close the context and free all data associated to it, but not the context itself.
+	avcodec_close(*codecCtx);
 
-	
-	// Print some intersting file information.
-	printStreamInformation(codec, codecCtx, audioStreamIndex);
+	// Free the context itself.
+	avcodec_free_context(codecCtx);
+
+	// We are done here. Close the input.
+	avio_input_close_format(formatCtx);
+}
 
+/**
+ * Read, decode and write on the calling thread. Returns 0 or an AVERROR code.
+ */
+static int decodeSerial(AVFormatContext* formatCtx, AVCodecContext* codecCtx, int audioStreamIndex, FrameWriter* writer) {
+	int err = 0;
 	AVFrame* frame = NULL;
-	if ((frame = av_frame_alloc()) == NULL) {
-		avcodec_close(codecCtx);
-		avcodec_free_context(&codecCtx);
-		avformat_close_input(&formatCtx);
-		return;
-	}
+	if ((frame = av_frame_alloc()) == NULL)
+		return AVERROR(ENOMEM);
 
 	// Prepare the packet.
 //	AVPacket packet;
 	// Set default values.
 //	av_init_packet(&packet);
 	AVPacket* packet = av_packet_alloc();
+	if (packet == NULL) {
+		av_frame_free(&frame);
+		return AVERROR(ENOMEM);
+	}
 	
 	//replace with av_new_packet(
 	// or av_packet_alloc
@@ -346,30 +435,742 @@ void decompressAudioFile(const char* filePath) {
 
 		// Receive and handle frames.
 		// EAGAIN means we need to send before receiving again. So thats not an error.
-		if((err = receiveAndHandle(codecCtx, frame, &outFile)) != AVERROR(EAGAIN)) {
+		if((err = receiveAndHandle(codecCtx, frame, writer)) != AVERROR(EAGAIN)) {
 			// Not EAGAIN => Something went wrong.
 			printError("Receive error.", err);
 			break; // Don't return, so we can clean up nicely.
 		}
 	}
 
+	// the loop ends at the end of the file or with an error
+	int result = err == AVERROR_EOF ? 0 : err;
+
 	av_packet_free(&packet);
 	// Drain the decoder.
-	drainDecoder(codecCtx, frame, &outFile);
+	drainDecoder(codecCtx, frame, writer);
 
 	// Free all data used by the frame.
 	av_frame_free(&frame);
+	return result;
+}
 
-	// Close the context and free all data associated to it, but not the context itself.
-	avcodec_close(codecCtx);
+// Time a pipeline stage spends working, as opposed to waiting for its neighbours.
+struct StageClock {
+	StageClock() : busy(0) {}
+	void begin() {
+		start = std::chrono::steady_clock::now();
+	}
+	void end() {
+		busy += std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+	}
+	double									busy;
+	std::chrono::steady_clock::time_point	start;
+};
 
-	// Free the context itself.
-	avcodec_free_context(&codecCtx);
+/**
+ * Read on one thread, decode on another and write on the calling thread. The
+ * packets and frames are allocated up front and go back and forth between the
+ * stages through bounded queues. When a stage stops, early or at the end of
+ * the stream, it closes its queues and the others run out. Returns 0 or an
+ * AVERROR code.
+ */
+static int decodePipelined(AVFormatContext* formatCtx, AVCodecContext* codecCtx, int audioStreamIndex, FrameWriter* writer, DecompressorStageTimes* times) {
+	std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+	std::vector<AVPacket*> packets(DECOMPRESSOR_PIPELINE_PACKETS);
+	std::vector<AVFrame*> frames(DECOMPRESSOR_PIPELINE_FRAMES);
+	SpscQueue<AVPacket*> readPackets(DECOMPRESSOR_PIPELINE_PACKETS), freePackets(DECOMPRESSOR_PIPELINE_PACKETS);
+	SpscQueue<AVFrame*> decodedFrames(DECOMPRESSOR_PIPELINE_FRAMES), freeFrames(DECOMPRESSOR_PIPELINE_FRAMES);
+	int result = 0;
+	for (AVPacket*& packet : packets) {
+		if ((packet = av_packet_alloc()) == NULL)
+			result = AVERROR(ENOMEM);
+		freePackets.tryPush(packet);
+	}
+	for (AVFrame*& frame : frames) {
+		if ((frame = av_frame_alloc()) == NULL)
+			result = AVERROR(ENOMEM);
+		freeFrames.tryPush(frame);
+	}
 
-	// We are done here. Close the input.
-	avformat_close_input(&formatCtx);
+	StageClock demuxClock, decodeClock, writeClock;
+	int readError = 0;
+	int decodeError = 0;
+	if (result == 0) {
+		std::thread demuxer([&]() {
+			AVPacket* packet;
+			while (freePackets.pop(packet)) {
+				int err;
+				demuxClock.begin();
+				while ((err = av_read_frame(formatCtx, packet)) == 0 && packet->stream_index != audioStreamIndex)
+					av_packet_unref(packet);
+				demuxClock.end();
+				if (err != 0) {
+					if (err != AVERROR_EOF)
+						readError = printError("Read error.", err);
+					break;
+				}
+				if (!readPackets.push(packet))
+					break;
+			}
+			readPackets.close();
+			freePackets.close();
+		});
+
+		std::thread decoder([&]() {
+			AVFrame* frame = NULL;
+			// Hands the frames the decoder has ready to the writer. Returns
+			// EAGAIN when it needs more input, AVERROR_EOF when it is drained,
+			// AVERROR_EXIT if the writer stopped.
+			auto receive = [&]() {
+				for (;;) {
+					if (frame == NULL && !freeFrames.pop(frame))
+						return AVERROR_EXIT;
+					decodeClock.begin();
+					int err = avcodec_receive_frame(codecCtx, frame);
+					decodeClock.end();
+					if (err != 0)
+						return err;
+					if (!decodedFrames.push(frame))
+						return AVERROR_EXIT;
+					frame = NULL;
+				}
+			};
+			auto send = [&](const AVPacket* packet) {
+				decodeClock.begin();
+				int err = avcodec_send_packet(codecCtx, packet);
+				decodeClock.end();
+				return err;
+			};
+			int err = 0;
+			AVPacket* packet;
+			while (err == 0 && readPackets.pop(packet)) {
+				// a full decoder takes the packet once some frames are out
+				while ((err = send(packet)) == AVERROR(EAGAIN) && (err = receive()) == AVERROR(EAGAIN))
+					;
+				av_packet_unref(packet);
+				freePackets.push(packet);
+				if (err == 0 && (err = receive()) == AVERROR(EAGAIN))
+					err = 0;
+			}
+			// Some codecs may buffer frames. Sending NULL activates drain-mode.
+			if (err == 0 && (err = send(NULL)) == 0)
+				err = receive();
+			if (err != 0 && err != AVERROR_EOF && err != AVERROR_EXIT)
+				decodeError = printError("Decode error.", err);
+			readPackets.close();
+			freePackets.close();
+			decodedFrames.close();
+		});
+
+		AVFrame* frame;
+		while (decodedFrames.pop(frame)) {
+			writeClock.begin();
+			handleFrame(frame, writer);
+			av_frame_unref(frame);
+			writeClock.end();
+			if (writer->error || !freeFrames.push(frame))
+				break;
+		}
+		decodedFrames.close();
+		freeFrames.close();
+		decoder.join();
+		demuxer.join();
+		if (writer->resampler) {
+			writeClock.begin();
+			handleFrame(NULL, writer);
+			writeClock.end();
+		}
+		result = readError ? readError : decodeError;
+	}
+
+	for (AVPacket*& packet : packets)
+		av_packet_free(&packet);
+	for (AVFrame*& frame : frames)
+		av_frame_free(&frame);
+	if (times) {
+		times->demux_seconds = demuxClock.busy;
+		times->decode_seconds = decodeClock.busy;
+		times->write_seconds = writeClock.busy;
+		times->wall_seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+	}
+	return result;
+}
+
+// segment decoding returns it when the seek landed too close to the segment
+#define SEGMENT_SEEK_LATE		1
+
+// A decoder of one thread of the segmented decode, with its own demuxer.
+struct SegmentDecoder {
+	SegmentDecoder(SampleConverterFormat sampleFormat) : formatCtx(NULL), codecCtx(NULL), audioStreamIndex(-1), packet(NULL), frame(NULL), converter(NULL, sampleFormat) {}
+	AVFormatContext*			formatCtx;
+	AVCodecContext*				codecCtx;
+	int							audioStreamIndex;
+	AVPacket*					packet;
+	AVFrame*					frame;
+	FrameWriter					converter;		// collects the converted samples of the segment
+	int64_t						streamStart;	// first sample of the stream
+	AVRational					sampleTimeBase;	// 1 / sample rate
+};
 
-	// Close the outfile.
+// A segment of the file, decoded by one thread and written by the calling thread.
+struct Segment {
+	Segment() : begin(0), end(0), done(0), error(0) {}
+	int64_t						begin;		// first sample, INT64_MIN for the first segment
+	int64_t						end;		// sample after the last, INT64_MAX for the last segment
+	std::vector<uint8_t>		samples;	// for the file
+	int							done;
+	int							error;
+};
+
+/**
+ * Decode the samples [begin, end) of the stream from where the decoder is,
+ * to segment->samples. The position of the samples comes from the time
+ * stamp of the first frame and is counted from there. fromStart is set when
+ * the decoder is at the start of the stream. Returns 0, SEGMENT_SEEK_LATE if
+ * less than DECOMPRESSOR_SEGMENT_MIN_PREROLL samples come before begin, or an
+ * AVERROR code.
+ */
+static int decodeSegmentRange(SegmentDecoder* decoder, Segment* segment, bool fromStart) {
+	AVStream* stream = decoder->formatCtx->streams[decoder->audioStreamIndex];
+	int64_t position = INT64_MIN;
+	int eof = 0;
+	int err = 0;
+	while (!eof) {
+		if ((err = av_read_frame(decoder->formatCtx, decoder->packet)) == AVERROR_EOF) {
+			// Some codecs may buffer frames. Sending NULL activates drain-mode.
+			eof = 1;
+			err = avcodec_send_packet(decoder->codecCtx, NULL);
+		} else if (err != 0) {
+			return printError("Read error.", err);
+		} else if (decoder->packet->stream_index != decoder->audioStreamIndex) {
+			av_packet_unref(decoder->packet);
+			continue;
+		} else {
+			err = avcodec_send_packet(decoder->codecCtx, decoder->packet);
+			av_packet_unref(decoder->packet);
+		}
+		if (err != 0)
+			return printError("Send error.", err);
+
+		while ((err = avcodec_receive_frame(decoder->codecCtx, decoder->frame)) == 0) {
+			AVFrame* frame = decoder->frame;
+			int64_t first = position;
+			if (position == INT64_MIN) {
+				int64_t timestamp = frame->best_effort_timestamp;
+				if (timestamp == AV_NOPTS_VALUE && !fromStart) {
+					av_frame_unref(frame);
+					return SEGMENT_SEEK_LATE;
+				}
+				first = timestamp == AV_NOPTS_VALUE ? decoder->streamStart : av_rescale_q(timestamp, stream->time_base, decoder->sampleTimeBase);
+				if (!fromStart && first > segment->begin - DECOMPRESSOR_SEGMENT_MIN_PREROLL) {
+					av_frame_unref(frame);
+					return SEGMENT_SEEK_LATE;
+				}
+			}
+			int64_t last = first + frame->nb_samples;
+			position = last;
+			// only the samples of the segment are kept
+			if (last > segment->begin && first < segment->end) {
+				size_t before = segment->samples.size();
+				handleFrame(frame, &decoder->converter);
+				size_t frameBytes = (size_t)frame->channels * sampleSize(&decoder->converter);
+				// nothing is added for a frame that can't be converted
+				if (segment->samples.size() - before != (size_t)frame->nb_samples * frameBytes) {
+					av_frame_unref(frame);
+					continue;
+				}
+				if (last > segment->end)
+					segment->samples.resize(segment->samples.size() - (size_t)(last - segment->end) * frameBytes);
+				if (first < segment->begin)
+					segment->samples.erase(segment->samples.begin() + before, segment->samples.begin() + before + (size_t)(segment->begin - first) * frameBytes);
+			}
+			av_frame_unref(frame);
+			if (last >= segment->end)
+				return 0;
+		}
+		if (err != AVERROR(EAGAIN) && err != AVERROR_EOF)
+			return printError("Receive error.", err);
+	}
+	return 0;
+}
+
+/**
+ * Decode a segment. The first one is decoded from the start of the freshly
+ * opened file, the others after a seek ahead of them. If the seek lands too
+ * late, it is tried again further ahead, in the end from the start.
+ */
+static int decodeSegment(SegmentDecoder* decoder, Segment* segment) {
+	if (segment->begin == INT64_MIN)
+		return decodeSegmentRange(decoder, segment, true);
+	AVStream* stream = decoder->formatCtx->streams[decoder->audioStreamIndex];
+	int64_t preroll = DECOMPRESSOR_SEGMENT_PREROLL;
+	for (;;) {
+		int64_t target = segment->begin - preroll;
+		bool fromStart = target <= decoder->streamStart;
+		int64_t timestamp = fromStart ? (stream->start_time != AV_NOPTS_VALUE ? stream->start_time : 0)
+									  : av_rescale_q(target, decoder->sampleTimeBase, stream->time_base);
+		int err = av_seek_frame(decoder->formatCtx, decoder->audioStreamIndex, timestamp, AVSEEK_FLAG_BACKWARD);
+		if (err < 0)
+			return printError("Seek error.", err);
+		avcodec_flush_buffers(decoder->codecCtx);
+		segment->samples.clear();
+		err = decodeSegmentRange(decoder, segment, fromStart);
+		if (err != SEGMENT_SEEK_LATE || fromStart)
+			return err == SEGMENT_SEEK_LATE ? AVERROR_BUG : err;
+		preroll *= 4;
+	}
+}
+
+/**
+ * Decode the file in segments on numThreads threads and write them in order
+ * on the calling thread. The first thread decodes with formatCtx and
+ * codecCtx, the others open the file again. At most numThreads segments
+ * wait to be written, so the memory stays bounded however long the file.
+ * Returns 0 or an AVERROR code.
+ */
+static int decodeSegmented(const DecompressInput* input, AVFormatContext* formatCtx, AVCodecContext* codecCtx, int audioStreamIndex, FrameWriter* writer, int numThreads) {
+	AVStream* stream = formatCtx->streams[audioStreamIndex];
+	AVRational sampleTimeBase = {1, codecCtx->sample_rate};
+	int64_t streamStart = stream->start_time != AV_NOPTS_VALUE ? av_rescale_q(stream->start_time, stream->time_base, sampleTimeBase) : 0;
+	int64_t duration = 0;
+	if (stream->duration != AV_NOPTS_VALUE)
+		duration = av_rescale_q(stream->duration, stream->time_base, sampleTimeBase);
+	else if (formatCtx->duration != AV_NOPTS_VALUE)
+		duration = av_rescale(formatCtx->duration, codecCtx->sample_rate, AV_TIME_BASE);
+	// The estimate only balances the work: the first segment takes all before
+	// the second one, the last one all after its start.
+	int64_t segmentLength = (int64_t)DECOMPRESSOR_SEGMENT_SECONDS * codecCtx->sample_rate;
+	int numSegments = (int)((duration + segmentLength - 1) / segmentLength);
+	if (numThreads <= 0)
+		numThreads = (int)std::thread::hardware_concurrency();
+	if (numThreads > numSegments)
+		numThreads = numSegments;
+	if (numSegments < 2 || numThreads < 2)
+		return decodeSerial(formatCtx, codecCtx, audioStreamIndex, writer);
+
+	std::vector<Segment> segments(numSegments);
+	for (int i = 0; i < numSegments; ++i) {
+		segments[i].begin = i == 0 ? INT64_MIN : streamStart + i * segmentLength;
+		segments[i].end = i == numSegments - 1 ? INT64_MAX : streamStart + (i + 1) * segmentLength;
+	}
+	std::mutex mutex;
+	std::condition_variable changed;
+	int written = 0;
+	int failed = 0;		// the first error, all threads stop
+	std::atomic<int> next(1);
+
+	auto work = [&](int thread) {
+		SegmentDecoder decoder(writer->sampleFormat);
+		if (thread == 0) {
+			decoder.formatCtx = formatCtx;
+			decoder.codecCtx = codecCtx;
+			decoder.audioStreamIndex = audioStreamIndex;
+		}
+		// a thread that can't open the file leaves its segments to the others
+		else if (openAudioDecoder(input, &decoder.formatCtx, &decoder.codecCtx, &decoder.audioStreamIndex, NULL) != 0)
+			return;
+		decoder.streamStart = streamStart;
+		decoder.sampleTimeBase = sampleTimeBase;
+		decoder.converter.fileChannels = codecCtx->channels;
+		decoder.packet = av_packet_alloc();
+		decoder.frame = av_frame_alloc();
+		// the first thread starts with the first segment, on the file as it was opened
+		int i = thread == 0 ? 0 : next++;
+		while (i < numSegments) {
+			{
+				std::unique_lock<std::mutex> lock(mutex);
+				changed.wait(lock, [&]() {return failed || i < written + numThreads;});
+				if (failed)
+					break;
+			}
+			decoder.converter.chunk = &segments[i].samples;
+			int err = decoder.packet && decoder.frame ? decodeSegment(&decoder, &segments[i]) : AVERROR(ENOMEM);
+			{
+				std::lock_guard<std::mutex> lock(mutex);
+				segments[i].error = err;
+				segments[i].done = 1;
+				if (err && !failed)
+					failed = err;
+			}
+			changed.notify_all();
+			if (err)
+				break;
+			i = next++;
+		}
+		av_packet_free(&decoder.packet);
+		av_frame_free(&decoder.frame);
+		if (thread > 0)
+			closeAudioDecoder(&decoder.formatCtx, &decoder.codecCtx);
+	};
+	std::vector<std::thread> threads;
+	for (int t = 0; t < numThreads; ++t)
+		threads.push_back(std::thread(work, t));
+
+	int result = 0;
+	for (int i = 0; i < numSegments && result == 0; ++i) {
+		{
+			std::unique_lock<std::mutex> lock(mutex);
+			changed.wait(lock, [&]() {return failed || segments[i].done;});
+			if (failed) {
+				result = failed;
+				break;
+			}
+		}
+		Segment& segment = segments[i];
+		writeSamples(writer, segment.samples.data(), (int)(segment.samples.size() / sampleSize(writer)));
+		std::vector<uint8_t>().swap(segment.samples);
+		{
+			std::lock_guard<std::mutex> lock(mutex);
+			written = i + 1;
+			if (writer->error)
+				failed = result = writer->error;
+		}
+		changed.notify_all();
+	}
+	for (std::thread& thread : threads)
+		thread.join();
+	return result;
+}
+
+// What decompress() is to do with a file, and what it reports back.
+struct DecompressJob {
+	DecompressJob() : outFilename(NULL), outputFormat(DecompressorOutputS16), outSampleRate(0), outChannels(0), verbose(0), mode(DecompressModeSerial), numThreads(0), toMemory(0), planar(0), seconds(0), pcm(NULL) {
+		memset(&times, 0, sizeof(times));
+	}
+	const char*					outFilename;
+	DecompressorOutputFormat	outputFormat;
+	int							outSampleRate;		// 0 keeps the one of the file
+	int							outChannels;
+	int							verbose;
+	DecompressMode				mode;
+	int							numThreads;			// segmented only
+	int							toMemory;			// float samples to pcm instead of a file
+	int							planar;				// of pcm
+	double						seconds;			// decoded
+	DecompressorStageTimes		times;				// pipelined only
+	H_PCM_BUFFER				pcm;
+};
+
+static int decompress(const DecompressInput* input, DecompressJob* job);
+
+void decompressAudioFile(const char* filePath) {
+	decompressAudioFileEx(filePath, DecompressorOutputS16);
+}
+
+void decompressAudioFileEx(const char* filePath, DecompressorOutputFormat outputFormat) {
+	decompressAudioFileTo(filePath, outputFormat, 0, 0);
+}
+
+void decompressAudioFileTo(const char* filePath, DecompressorOutputFormat outputFormat, int outSampleRate, int outChannels) {
+	// Open the outfile called "<infile>.raw".
+	char outFilename[1024];
+	const char* pExtension = strrchr(filePath, '.');
+	size_t str_len = pExtension - filePath;
+	if (str_len > 1000) {
+		printError("Something's wrong with the filePath.", -1);
+		return;
+	}
+	strcpy(outFilename, filePath);
+	memcpy(outFilename + str_len + 1, "wav\0", 4);
+//	FILE* outFile = fopen(outFilename, "w+");
+//	if(outFile == NULL) {
+//		fprintf(stderr, "Unable to open output file \"%s\".\n", outFilename);
+//	}
+
+	DecompressJob job;
+	job.outFilename = outFilename;
+	job.outputFormat = outputFormat;
+	job.outSampleRate = outSampleRate;
+	job.outChannels = outChannels;
+	job.verbose = 1;
+	DecompressInput input = fileInput(filePath);
+	decompress(&input, &job);
+}
+
+static int decompressToPath(const DecompressInput* input, const char* outPath, DecompressorOutputFormat outputFormat, int outSampleRate, int outChannels, double* seconds) {
+	DecompressJob job;
+	job.outFilename = outPath;
+	job.outputFormat = outputFormat;
+	job.outSampleRate = outSampleRate;
+	job.outChannels = outChannels;
+	int err = decompress(input, &job);
+	if (seconds)
+		*seconds = job.seconds;
+	return err;
+}
+
+int decompressAudioFileToPath(const char* inPath, const char* outPath, DecompressorOutputFormat outputFormat, int outSampleRate, int outChannels, double* seconds) {
+	DecompressInput input = fileInput(inPath);
+	return decompressToPath(&input, outPath, outputFormat, outSampleRate, outChannels, seconds);
+}
+
+int decompressAudioDataToPath(const void* data, int64_t size, const char* outPath, DecompressorOutputFormat outputFormat, int outSampleRate, int outChannels, double* seconds) {
+	DecompressInput input = {NULL, data, size};
+	return decompressToPath(&input, outPath, outputFormat, outSampleRate, outChannels, seconds);
+}
+
+int decompressAudioFilePipelined(const char* inPath, const char* outPath, DecompressorOutputFormat outputFormat, int outSampleRate, int outChannels, double* seconds, DecompressorStageTimes* times) {
+	DecompressJob job;
+	job.outFilename = outPath;
+	job.outputFormat = outputFormat;
+	job.outSampleRate = outSampleRate;
+	job.outChannels = outChannels;
+	job.mode = DecompressModePipelined;
+	DecompressInput input = fileInput(inPath);
+	int err = decompress(&input, &job);
+	if (seconds)
+		*seconds = job.seconds;
+	if (times)
+		*times = job.times;
+	return err;
+}
+
+int decompressAudioFileSegmented(const char* inPath, const char* outPath, DecompressorOutputFormat outputFormat, int outSampleRate, int outChannels, int numThreads, double* seconds) {
+	DecompressJob job;
+	job.outFilename = outPath;
+	job.outputFormat = outputFormat;
+	job.outSampleRate = outSampleRate;
+	job.outChannels = outChannels;
+	job.mode = DecompressModeSegmented;
+	job.numThreads = numThreads;
+	DecompressInput input = fileInput(inPath);
+	int err = decompress(&input, &job);
+	if (seconds)
+		*seconds = job.seconds;
+	return err;
+}
+
+static H_PCM_BUFFER decompressToMemory(const DecompressInput* input, int planar, int outSampleRate, int outChannels, int numThreads, int* error) {
+	DecompressJob job;
+	job.outputFormat = DecompressorOutputFloat;
+	job.outSampleRate = outSampleRate;
+	job.outChannels = outChannels;
+	job.mode = numThreads == 1 ? DecompressModeSerial : DecompressModeSegmented;
+	job.numThreads = numThreads;
+	job.toMemory = 1;
+	job.planar = planar;
+	int err = decompress(input, &job);
+	if (error)
+		*error = err;
+	if (err != 0) {
+		pcm_buffer_release(job.pcm);
+		return NULL;
+	}
+	return job.pcm;
+}
+
+H_PCM_BUFFER decompressAudioFileToMemory(const char* inPath, int planar, int outSampleRate, int outChannels, int numThreads, int* error) {
+	DecompressInput input = fileInput(inPath);
+	return decompressToMemory(&input, planar, outSampleRate, outChannels, numThreads, error);
+}
+
+H_PCM_BUFFER decompressAudioDataToMemory(const void* data, int64_t size, int planar, int outSampleRate, int outChannels, int numThreads, int* error) {
+	DecompressInput input = {NULL, data, size};
+	return decompressToMemory(&input, planar, outSampleRate, outChannels, numThreads, error);
+}
+
+void decompressorSetCache(H_PCM_CACHE cache) {
+	decompressorCache.store(cache);
+}
+
+/**
+ * The cache key of a job: the content of the file and what is made of it.
+ * Returns 0 or -1 if the file can't be read.
+ */
+static int cacheKey(const DecompressInput* input, const DecompressJob* job, PcmCacheKey* key) {
+	if (input->data)
+		pcm_cache_key_for_data(input->data, input->size, key);
+	else if (pcm_cache_key_for_file(input->path, key) != 0)
+		return -1;
+	key->sample_rate = job->outSampleRate > 0 ? job->outSampleRate : 0;
+	key->channels = job->outChannels > 0 ? job->outChannels : 0;
+	// decoding to memory makes the same floats as a float WAV file, they share entries
+	if (job->toMemory)
+		key->format = PcmCacheFloat;
+	else
+		key->format = (unsigned)job->outputFormat > DecompressorOutputNative ? DecompressorOutputS16 : job->outputFormat;
+	key->planar = job->toMemory && job->planar;
+	return 0;
+}
+
+/**
+ * Do the job with the samples of a cache entry instead of decoding: map them
+ * as job->pcm, or write them to the WAV file. Returns 0, or an AVERROR code
+ * to decode after all.
+ */
+static int decompressFromCache(H_PCM_CACHE_ENTRY entry, DecompressJob* job) {
+	int sampleRate = pcm_cache_entry_get_sample_rate(entry);
+	int channels = pcm_cache_entry_get_num_channels(entry);
+	PcmCacheFormat format = pcm_cache_entry_get_format(entry);
+	int64_t frames = pcm_cache_entry_get_num_frames(entry);
+	if (job->toMemory) {
+		if (format != PcmCacheFloat || pcm_cache_entry_is_planar(entry) != (job->planar ? 1 : 0))
+			return AVERROR(EINVAL);
+		job->pcm = pcm_cache_entry_get_buffer(entry);
+		if (job->pcm == NULL)
+			return AVERROR(ENOMEM);
+	}
+	else {
+		if (pcm_cache_entry_is_planar(entry))
+			return AVERROR(EINVAL);
+		static const int bits[] = {16, 24, 32, 32};
+		const char* data = (const char*)pcm_cache_entry_get_data(entry);
+		int size = format == PcmCacheS16 ? 2 : 4;
+		WavOutFile* outFile = NULL;
+		try {
+			outFile = new WavOutFile(job->outFilename, sampleRate, bits[format], channels, format == PcmCacheFloat, wavChannelMask(channels));
+			for (int64_t done = 0, total = frames * channels; done < total; ) {
+				int n = (int)std::min<int64_t>(total - done, DECOMPRESSOR_CACHE_BLOCK_SAMPLES);
+				const char* samples = data + done * size;
+				switch (format) {
+					case PcmCacheS16:	outFile->write((const short*)samples, n); break;
+					case PcmCacheFloat:	outFile->write((const float*)samples, n); break;
+					default:			outFile->write((const int*)samples, n); break;
+				}
+				done += n;
+			}
+			// the last samples and the header are written here
+			outFile->close();
+		} catch (const std::exception& e) {
+			fprintf(stderr, "%s\n", e.what());
+			delete outFile;
+			return AVERROR(EIO);
+		}
+		delete outFile;
+	}
+	job->seconds = (double)frames / sampleRate;
+	return 0;
+}
+
+/**
+ * Decode the input to the WAV file job->outFilename, or to a new job->pcm.
+ * Returns 0 or an AVERROR code.
+ */
+static int decompress(const DecompressInput* input, DecompressJob* job) {
+	DecompressorOutputFormat outputFormat = job->outputFormat;
+
+	int err = 0;
+	// a file decoded the same way before is read from the cache
+	H_PCM_CACHE cache = decompressorCache.load();
+	PcmCacheKey key;
+	if (cache && cacheKey(input, job, &key) != 0)
+		cache = NULL;
+	if (cache) {
+		H_PCM_CACHE_ENTRY entry = pcm_cache_lookup(cache, &key);
+		if (entry) {
+			err = decompressFromCache(entry, job);
+			pcm_cache_entry_release(entry);
+			if (err == 0) {
+				if (job->verbose)
+					fprintf(stderr, "Samples from the cache.\n");
+				return 0;
+			}
+		}
+	}
+
+	AVFormatContext* formatCtx = NULL;
+	AVCodecContext* codecCtx = NULL;
+	const AVCodec* codec = NULL;
+	int audioStreamIndex = -1;
+	if ((err = openAudioDecoder(input, &formatCtx, &codecCtx, &audioStreamIndex, &codec)) != 0)
+		return err;
+
+	int sample_rate = codecCtx->sample_rate;
+	int channels = codecCtx->channels;
+	if ((unsigned)outputFormat > DecompressorOutputNative)
+		outputFormat = DecompressorOutputS16;
+	if (outputFormat == DecompressorOutputNative) {
+		switch (av_get_packed_sample_fmt(codecCtx->sample_fmt)) {
+			case AV_SAMPLE_FMT_S32:	outputFormat = DecompressorOutputS32; break;
+			case AV_SAMPLE_FMT_FLT:
+			case AV_SAMPLE_FMT_DBL:	outputFormat = DecompressorOutputFloat; break;
+			default:				outputFormat = DecompressorOutputS16; break;
+		}
+	}
+	static const int bits[] = {16, 24, 32, 32};
+	static const SampleConverterFormat sampleFormats[] = {SampleConverterS16, SampleConverterS32, SampleConverterS32, SampleConverterFloat};
+	FrameWriter writer(NULL, sampleFormats[outputFormat]);
+	int outSampleRate = job->outSampleRate;
+	int outChannels = job->outChannels;
+	if ((outSampleRate > 0 && outSampleRate != sample_rate) || (outChannels > 0 && outChannels != channels)) {
+		// the stream is converted to the rate and channels of the file in one pass
+		if (outSampleRate > 0)
+			sample_rate = outSampleRate;
+		if (outChannels > 0)
+			channels = outChannels;
+		writer.resampler = audio_resampler_init(sample_rate, channels, writer.passthroughFormat);
+		if (writer.resampler == NULL) {
+			fprintf(stderr, "Unable to convert to %d Hz, %d channels.\n", sample_rate, channels);
+			closeAudioDecoder(&formatCtx, &codecCtx);
+			return AVERROR(EINVAL);
+		}
+	}
+	WavOutFile* outFile = NULL;
+	if (job->toMemory) {
+		// room for the whole stream if its duration is known, it grows otherwise
+		AVStream* stream = formatCtx->streams[audioStreamIndex];
+		AVRational sampleTimeBase = {1, sample_rate};
+		int64_t capacity = stream->duration != AV_NOPTS_VALUE ? av_rescale_q(stream->duration, stream->time_base, sampleTimeBase) : 0;
+		job->pcm = pcm_buffer_create(sample_rate, channels, job->planar, capacity + DECOMPRESSOR_PCM_SLACK_FRAMES);
+		if (job->pcm == NULL) {
+			closeAudioDecoder(&formatCtx, &codecCtx);
+			return AVERROR(ENOMEM);
+		}
+	}
+	else {
+		try {
+			outFile = new WavOutFile(job->outFilename, sample_rate, bits[outputFormat], channels, outputFormat == DecompressorOutputFloat, wavChannelMask(channels));
+		} catch (const std::exception& e) {
+			fprintf(stderr, "%s\n", e.what());
+			closeAudioDecoder(&formatCtx, &codecCtx);
+			return AVERROR(EIO);
+		}
+	}
+	writer.file = outFile;
+	writer.pcm = job->pcm;
+	writer.fileChannels = channels;
+	if (cache && outFile)
+		writer.cacheWriter = pcm_cache_begin(cache, &key, sample_rate, channels, (PcmCacheFormat)outputFormat);
+
+	
+	// Print some intersting file information.
+	if (job->verbose)
+		printStreamInformation(codec, codecCtx, audioStreamIndex);
+
+	int result;
+	if (job->mode == DecompressModePipelined)
+		result = decodePipelined(formatCtx, codecCtx, audioStreamIndex, &writer, &job->times);
+	// segments can't be stitched after the resampler, which carries samples over
+	else if (job->mode == DecompressModeSegmented && writer.resampler == NULL)
+		result = decodeSegmented(input, formatCtx, codecCtx, audioStreamIndex, &writer, job->numThreads);
+	else
+		result = decodeSerial(formatCtx, codecCtx, audioStreamIndex, &writer);
+	if (result == 0)
+		result = writer.error;
+
+	closeAudioDecoder(&formatCtx, &codecCtx);
+
+	// Close the outfile. The last samples and the header are written here, and a
+	// file that didn't make it to the disk mustn't be committed to the cache.
 //	fclose(outFile);
-//	outFile.close();
+	if (outFile) {
+		try {
+			outFile->close();
+		} catch (const std::exception& e) {
+			fprintf(stderr, "%s\n", e.what());
+			if (result == 0)
+				result = AVERROR(EIO);
+		}
+		delete outFile;
+	}
+	if (writer.cacheWriter) {
+		if (result == 0)
+			pcm_cache_commit(writer.cacheWriter);
+		else
+			pcm_cache_abort(writer.cacheWriter);
+	}
+	else if (cache && job->pcm && result == 0)
+		pcm_cache_store_buffer(cache, &key, job->pcm);
+	job->seconds = (double)writer.framesWritten / sample_rate;
+	return result;
 }
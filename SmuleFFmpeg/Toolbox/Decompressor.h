@@ -9,12 +9,68 @@
 #define Decompressor_h
 
 #include <stdio.h>
+#include <stdint.h>
+#include "PcmBuffer.h"
+#include "PcmCache.h"
 
 #ifdef __cplusplus
 extern "C" {
 #endif
 
+typedef enum {
+	DecompressorOutputS16 = 0,
+	DecompressorOutputS24,
+	DecompressorOutputS32,
+	DecompressorOutputFloat,	// 32 bit IEEE float
+	DecompressorOutputNative	// closest to the decoder: 32 bit for 32 bit integers, float for float and double, 16 bit otherwise
+} DecompressorOutputFormat;
+
+// Seconds each stage of a pipelined decode spent working. The stage closest
+// to wall_seconds bounds the file, the others wait for it.
+typedef struct {
+	double	demux_seconds;		// reading packets
+	double	decode_seconds;
+	double	write_seconds;		// converting and writing the samples
+	double	wall_seconds;
+} DecompressorStageTimes;
+
+// Decodes the file to a 16 bit WAV file next to it, with the extension replaced by wav.
 void decompressAudioFile(const char* filePath);
+// Same with the given sample format. Samples the decoder delivers in that
+// format go to the file as they are.
+void decompressAudioFileEx(const char* filePath, DecompressorOutputFormat format);
+// Same, resampled to out_sample_rate and mixed to out_channels. 0 keeps the
+// rate or channels of the file.
+void decompressAudioFileTo(const char* filePath, DecompressorOutputFormat format, int out_sample_rate, int out_channels);
+// Decodes in_path to the WAV file out_path, without printing the stream
+// information. Returns 0 or a negative AVERROR code. seconds, if not NULL,
+// receives the duration of the audio written. Safe to call from several
+// threads at once, each call has its own demuxer and decoder.
+int decompressAudioFileToPath(const char* in_path, const char* out_path, DecompressorOutputFormat format, int out_sample_rate, int out_channels, double* seconds);
+// Same, with reading, decoding and writing on three threads, so that disk
+// I/O and decoding overlap. times may be NULL.
+int decompressAudioFilePipelined(const char* in_path, const char* out_path, DecompressorOutputFormat format, int out_sample_rate, int out_channels, double* seconds, DecompressorStageTimes* times);
+// Same as decompressAudioFileToPath, with the file split into segments of
+// 10 seconds decoded on num_threads threads (0 for one per core), each from a
+// little before its start. The output is the same as the sequential decode,
+// for files with continuous time stamps. Short files, and files that are
+// resampled or mixed, are decoded sequentially.
+int decompressAudioFileSegmented(const char* in_path, const char* out_path, DecompressorOutputFormat format, int out_sample_rate, int out_channels, int num_threads, double* seconds);
+// Decodes in_path to float samples in memory, planar or interleaved, without
+// a file in between. num_threads 1 decodes sequentially, others in segments
+// as above. Returns a buffer with one reference for the caller, or NULL with
+// the AVERROR code in *error (may be NULL).
+H_PCM_BUFFER decompressAudioFileToMemory(const char* in_path, int planar, int out_sample_rate, int out_channels, int num_threads, int* error);
+// The same as decompressAudioFileToPath and decompressAudioFileToMemory for a
+// file already in memory, e.g. an upload, as size bytes at data. The demuxer
+// reads straight from there, the bytes stay owned by the caller.
+int decompressAudioDataToPath(const void* data, int64_t size, const char* out_path, DecompressorOutputFormat format, int out_sample_rate, int out_channels, double* seconds);
+H_PCM_BUFFER decompressAudioDataToMemory(const void* data, int64_t size, int planar, int out_sample_rate, int out_channels, int num_threads, int* error);
+// Sets the cache all the functions above look in before decoding, and store
+// what they decode in. A hit writes the WAV file from the cached samples, or
+// returns a buffer on the mapped entry. NULL, the default, turns it off. The
+// cache stays owned by the caller and open while set.
+void decompressorSetCache(H_PCM_CACHE cache);
 
 #ifdef __cplusplus
 }
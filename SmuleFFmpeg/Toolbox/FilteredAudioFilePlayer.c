@@ -7,6 +7,8 @@
 
 #include "FilteredAudioFilePlayer.h"
 #include "AudioQueuePlayer.h"
+#include "AudioResampler.h"
+#include "AvioInput.h"
 //#include "WavFile.h"
 
 #ifdef __cplusplus
@@ -21,16 +23,16 @@ extern "C" {
 #endif
 
 
-#define RAW_OUT_ON_PLANAR 							  1
 #define FAUDIO_FILE_PLAYER_BUFFER_SIZE				512
-#define FAUDIO_INPUT_FIFO_NUM_SAMPLES				1024
+// holds what is left of a frame after a buffer is filled, and the end of the stream
+#define FAUDIO_INPUT_FIFO_NUM_SAMPLES				16384
 
 typedef struct FilteredAudioFilePlayer_t {
 	H_AUDIO_QUEUE_PLAYER		queue_player;
 	int							destroy_state_active;
 	int 						playing;
 	int 						paused;
-	float						fifo[FAUDIO_INPUT_FIFO_NUM_SAMPLES * 4];
+	float						fifo[FAUDIO_INPUT_FIFO_NUM_SAMPLES];
 	int 						fifo_head;
 	int 						fifo_tail;
 	//FFmpeg
@@ -42,6 +44,13 @@ typedef struct FilteredAudioFilePlayer_t {
 	int 						audioStreamIndex;
 	int 						sample_rate;
 	int 						channels;
+	int							draining;		// the file is read, only the fifo is left
+	// decoded frames as interleaved float at the rate and channels of the queue
+	H_AUDIO_RESAMPLER			resampler;
+	int							out_sample_rate;	// requested, 0 for the one of the file
+	int							out_channels;
+	int							queue_sample_rate;
+	int							queue_channels;
 	// Filter
 	faudio_file_filter_callback	filter;
 	void*						filter_user_data;
@@ -63,70 +72,6 @@ static int printError(const char* prefix, int errorCode) {
 	}
 }
 
-/**
- * Extract a single sample and convert to float.
- */
-static float getSample(const AVCodecContext* codecCtx, uint8_t* buffer, int sampleIndex) {
-	int64_t val = 0;
-	float ret = 0;
-	int sampleSize = av_get_bytes_per_sample(codecCtx->sample_fmt);
-	switch(sampleSize) {
-		case 1:
-			// 8bit samples are always unsigned
-			val = ((uint8_t*)buffer)[sampleIndex];
-			// make signed
-			val -= 127;
-			break;
-
-		case 2:
-			val = ((int16_t*)buffer)[sampleIndex];
-			break;
-
-		case 4:
-			val = ((int32_t*)buffer)[sampleIndex];
-			break;
-
-		case 8:
-			val = ((int64_t*)buffer)[sampleIndex];
-			break;
-
-		default:
-			fprintf(stderr, "Invalid sample size %d.\n", sampleSize);
-			return 0;
-	}
-
-	// Check which data type is in the sample.
-	switch(codecCtx->sample_fmt) {
-		case AV_SAMPLE_FMT_U8:
-		case AV_SAMPLE_FMT_S16:
-		case AV_SAMPLE_FMT_S32:
-		case AV_SAMPLE_FMT_U8P:
-		case AV_SAMPLE_FMT_S16P:
-		case AV_SAMPLE_FMT_S32P:
-			// integer => Scale to [-1, 1] and convert to float.
-			ret = (float)val / (float)((1 << (sampleSize*8-1))-1);
-			break;
-
-		case AV_SAMPLE_FMT_FLT:
-		case AV_SAMPLE_FMT_FLTP:
-			// float => reinterpret
-			ret = *(float*)&val;
-			break;
-
-		case AV_SAMPLE_FMT_DBL:
-		case AV_SAMPLE_FMT_DBLP:
-			// double => reinterpret and then static cast down
-			ret = *(double*)&val;
-			break;
-
-		default:
-			fprintf(stderr, "Invalid sample format %s.\n", av_get_sample_fmt_name(codecCtx->sample_fmt));
-			return 0;
-	}
-
-	return ret;
-}
-
 /**
  * Find the first audio stream and returns its index. If there is no audio stream returns -1.
  */
@@ -165,19 +110,25 @@ static void printStreamInformation(const AVCodec* codec, const AVCodecContext* c
 	fprintf(stderr, "Sample Size:   %7d\n", av_get_bytes_per_sample(codecCtx->sample_fmt));
 	fprintf(stderr, "Channels:      %7d\n", codecCtx->channels);
 	fprintf(stderr, "Planar:        %7d\n", av_sample_fmt_is_planar(codecCtx->sample_fmt));
-	fprintf(stderr, "Float Output:  %7s\n", !RAW_OUT_ON_PLANAR || av_sample_fmt_is_planar(codecCtx->sample_fmt) ? "yes" : "no");
 }
 
-static void output_and_filter(H_FAUDIO_FILE_PLAYER pPlayer, float* input, float* output, int input_num, int output_num) {
+// Fills the output from the fifo, then from the input. The rest of the input,
+// filtered, goes into the fifo. Returns the number of samples output.
+static int output_and_filter(H_FAUDIO_FILE_PLAYER pPlayer, float* input, float* output, int input_num, int output_num) {
+	int output_written = 0;
 	// drain the fifo first
 	while (output_num > 0 && pPlayer->fifo_head != pPlayer->fifo_tail) {
 		int num_to_read = (pPlayer->fifo_head + FAUDIO_INPUT_FIFO_NUM_SAMPLES - pPlayer->fifo_tail) % FAUDIO_INPUT_FIFO_NUM_SAMPLES;
 		int num_max = FAUDIO_INPUT_FIFO_NUM_SAMPLES - pPlayer->fifo_tail;
 		if (num_max < num_to_read)
 			num_to_read = num_max;
+		if (output_num < num_to_read)
+			num_to_read = output_num;
 		memcpy(output, pPlayer->fifo + pPlayer->fifo_tail, num_to_read * sizeof(float));
 		pPlayer->fifo_tail = (pPlayer->fifo_tail + num_to_read) % FAUDIO_INPUT_FIFO_NUM_SAMPLES;
+		output += num_to_read;
 		output_num -= num_to_read;
+		output_written += num_to_read;
 	}
 	if (output_num > 0 && input_num > 0) {
 		int num_samples = output_num < input_num ? output_num : input_num;
@@ -185,8 +136,16 @@ static void output_and_filter(H_FAUDIO_FILE_PLAYER pPlayer, float* input, float*
 			pPlayer->filter(input, output, num_samples, pPlayer->filter_user_data);
 		else
 			memcpy(output, input, num_samples * sizeof(float));
+		input += num_samples;
 		input_num -= num_samples;
 		output_num -= num_samples;
+		output_written += num_samples;
+	}
+	// one sample stays free, a full fifo would look empty
+	int fifo_free = FAUDIO_INPUT_FIFO_NUM_SAMPLES - 1 - (pPlayer->fifo_head + FAUDIO_INPUT_FIFO_NUM_SAMPLES - pPlayer->fifo_tail) % FAUDIO_INPUT_FIFO_NUM_SAMPLES;
+	if (input_num > fifo_free) {
+		fprintf(stderr, "Fifo overflow, %d samples dropped.\n", input_num - fifo_free);
+		input_num = fifo_free;
 	}
 	while (input_num > 0) {
 		int num_to_write = input_num;
@@ -198,58 +157,40 @@ static void output_and_filter(H_FAUDIO_FILE_PLAYER pPlayer, float* input, float*
 		else
 			memcpy(pPlayer->fifo + pPlayer->fifo_head, input, num_to_write * sizeof(float));
 		pPlayer->fifo_head = (pPlayer->fifo_head + num_to_write) % FAUDIO_INPUT_FIFO_NUM_SAMPLES;
-
+		input += num_to_write;
 		input_num -= num_to_write;
 	}
+	return output_written;
+}
+
+/**
+ * Resample the frame to the queue format and output it. NULL outputs the
+ * samples the resampler keeps back.
+ */
+static int handleFrame(H_FAUDIO_FILE_PLAYER pPlayer, const AVFrame* frame, float* outBuffer, int num_samples, int* samples_read) {
+	const uint8_t* samples;
+	int frames = audio_resampler_convert(pPlayer->resampler, frame, &samples);
+	if (frames < 0)
+		return frames;
+	*samples_read += output_and_filter(pPlayer, (float*)samples, outBuffer + *samples_read, frames * pPlayer->queue_channels, num_samples - *samples_read);
+	return 0;
 }
+
 /**
- * Receive as many frames as available and handle them.
+ * Receive as many frames as available and handle them, until the output is
+ * filled. When draining all of them, the rest goes into the fifo.
  */
-static int receiveAndHandle(H_FAUDIO_FILE_PLAYER pPlayer, float* outBuffer, int num_samples) {
+static int receiveAndHandle(H_FAUDIO_FILE_PLAYER pPlayer, float* outBuffer, int num_samples, int* samples_read, int drain) {
 	int err = 0;
-	int samples_read = 0;
 	// Read the packets from the decoder.
 	// NOTE: Each packet may generate more than one frame, depending on the codec.
-	while(samples_read < num_samples && (err = avcodec_receive_frame(pPlayer->codecCtx, pPlayer->frame)) == 0) {
-		// Let's handle the frame
-
-		if(av_sample_fmt_is_planar(pPlayer->codecCtx->sample_fmt) == 1) {
-			// This means that the data of each channel is in its own buffer.
-			// => frame->extended_data[i] contains data for the i-th channel.
-			for(int s = 0; s < pPlayer->frame->nb_samples; ++s) {
-				for(int c = 0; c < pPlayer->codecCtx->channels; ++c) {
-					float sample = getSample(pPlayer->codecCtx, pPlayer->frame->extended_data[c], s);
-					int out_samples = samples_read < num_samples ? 1 : 0;
-					output_and_filter(pPlayer, &sample, outBuffer, 1, out_samples);
-					++samples_read;
-
-				}
-			}
-		} else {
-			// This means that the data of each channel is in the same buffer.
-			// => frame->extended_data[0] contains data of all channels.
-			if(RAW_OUT_ON_PLANAR) {
-				int n = pPlayer->frame->linesize[0] / sizeof(float);
-				int out_samples = samples_read < num_samples ? n : 0;
-				if (out_samples > 0 && num_samples - samples_read < out_samples)
-					out_samples = num_samples - samples_read;
-
-				output_and_filter(pPlayer, (float*)pPlayer->frame->extended_data, outBuffer, n, out_samples);
-				samples_read += n;
-			} else {
-				for(int s = 0; s < pPlayer->frame->nb_samples; ++s) {
-					for(int c = 0; c < pPlayer->codecCtx->channels; ++c) {
-						float sample = getSample(pPlayer->codecCtx, pPlayer->frame->extended_data[0], s * pPlayer->codecCtx->channels+c);
-						int out_samples = samples_read < num_samples ? 1 : 0;
-						output_and_filter(pPlayer, &sample, outBuffer, 1, out_samples);
-						++samples_read;
-					}
-				}
-			}
-		}
-
+	while((drain || *samples_read < num_samples) && (err = avcodec_receive_frame(pPlayer->codecCtx, pPlayer->frame)) == 0) {
+		// Let's handle the frame in a function.
+		err = handleFrame(pPlayer, pPlayer->frame, outBuffer, num_samples, samples_read);
 		// Free any buffers and reset the fields to default values.
 		av_frame_unref(pPlayer->frame);
+		if (err < 0)
+			return err;
 	}
 	return err;
 }
@@ -269,7 +210,9 @@ static void close_ffmpeg_objects(H_FAUDIO_FILE_PLAYER pPlayer) {
 	}
 	// Close the input.
 	if (pPlayer->formatCtx)
-		avformat_close_input(&pPlayer->formatCtx);
+		avio_input_close_format(&pPlayer->formatCtx);
+	audio_resampler_destroy(pPlayer->resampler);
+	pPlayer->resampler = NULL;
 }
 
 static void _faudio_file_player_real_destroy(H_FAUDIO_FILE_PLAYER pPlayer) {
@@ -285,7 +228,13 @@ static void _faudio_file_player_real_destroy(H_FAUDIO_FILE_PLAYER pPlayer) {
 
 static int faudio_file_player_read(H_FAUDIO_FILE_PLAYER pPlayer, float* outBuffer, int num_samples){
 	int err = 0;
-	while ((err = av_read_frame(pPlayer->formatCtx, pPlayer->packet)) != AVERROR_EOF) {
+	// what the last buffer left over comes first
+	int samples_read = output_and_filter(pPlayer, NULL, outBuffer, 0, num_samples);
+	// then the frames the decoder still holds from the last packet
+	if (!pPlayer->draining && (err = receiveAndHandle(pPlayer, outBuffer, num_samples, &samples_read, 0)) != AVERROR(EAGAIN) && err != 0)
+		printError("Receive error.", err);
+	err = 0;
+	while (samples_read < num_samples && !pPlayer->draining && (err = av_read_frame(pPlayer->formatCtx, pPlayer->packet)) != AVERROR_EOF) {
 		if(err != 0) {
 			// Something went wrong.
 			printError("Read error.", err);
@@ -312,12 +261,29 @@ static int faudio_file_player_read(H_FAUDIO_FILE_PLAYER pPlayer, float* outBuffe
 
 		// Receive and handle frames.
 		// EAGAIN means we need to send before receiving again. So thats not an error.
-		if((err = receiveAndHandle(pPlayer, outBuffer, num_samples)) != AVERROR(EAGAIN)) {
+		err = receiveAndHandle(pPlayer, outBuffer, num_samples, &samples_read, 0);
+		if (err != 0 && err != AVERROR(EAGAIN)) {
 			// Not EAGAIN => Something went wrong.
 			printError("Receive error.", err);
 			break; // Don't return, so we can clean up nicely.
 		}
+		err = 0;
+	}
+	if (err == AVERROR_EOF && !pPlayer->draining) {
+		// The decoder and the resampler keep samples back, they are played out of
+		// the fifo. Sending NULL activates drain-mode.
+		pPlayer->draining = 1;
+		if ((err = avcodec_send_packet(pPlayer->codecCtx, NULL)) == 0)
+			err = receiveAndHandle(pPlayer, outBuffer, num_samples, &samples_read, 1);
+		if (err != AVERROR_EOF)
+			printError("Receive error.", err);
+		if ((err = handleFrame(pPlayer, NULL, outBuffer, num_samples, &samples_read)) < 0)
+			printError("Resample error.", err);
 	}
+	if (samples_read < num_samples)
+		memset(outBuffer + samples_read, 0, (num_samples - samples_read) * sizeof(float));
+	if (pPlayer->draining)
+		return samples_read < num_samples ? AVERROR_EOF : 0;
 	return err;
 }
 
@@ -346,7 +312,8 @@ H_FAUDIO_FILE_PLAYER faudio_file_player_init() {
 	return pPlayer;
 }
 
-void faudio_file_player_open(H_FAUDIO_FILE_PLAYER pPlayer, const char* filePath) {
+// the file at filePath, or size bytes at data if not NULL
+static void _faudio_file_player_open(H_FAUDIO_FILE_PLAYER pPlayer, const char* filePath, const void* data, int64_t size) {
 	int err = 0;
 
 	if (pPlayer->queue_player && audio_queue_player_is_playing(pPlayer->queue_player)) {
@@ -356,11 +323,16 @@ void faudio_file_player_open(H_FAUDIO_FILE_PLAYER pPlayer, const char* filePath)
 	pPlayer->playing = 0;
 	pPlayer->paused = 0;
 	pPlayer->fifo_tail = pPlayer->fifo_head;
+	pPlayer->draining = 0;
 	close_ffmpeg_objects(pPlayer);
 	
 	pPlayer->formatCtx = NULL;
-	 // Open the file and read the header.
-	if ((err = avformat_open_input(&pPlayer->formatCtx, filePath, NULL, 0)) != 0) {
+	 // Open the file and read the header. A file is mapped, and read through a large buffer.
+	if (data)
+		err = avio_input_open_format(avio_input_create_memory(data, size), NULL, &pPlayer->formatCtx);
+	else
+		err = avio_input_open_path(filePath, &pPlayer->formatCtx);
+	if (err != 0) {
 		printError("Error opening file.", err);
 		return;
 	}
@@ -416,6 +388,15 @@ void faudio_file_player_open(H_FAUDIO_FILE_PLAYER pPlayer, const char* filePath)
  
 	pPlayer->sample_rate = pPlayer->codecCtx->sample_rate;
 	pPlayer->channels = pPlayer->codecCtx->channels;
+	// the queue plays the requested format, by default the rate of the file, mono or stereo
+	int sample_rate = pPlayer->out_sample_rate > 0 ? pPlayer->out_sample_rate : pPlayer->sample_rate;
+	int channels = pPlayer->out_channels > 0 ? pPlayer->out_channels : (pPlayer->channels > 1 ? 2 : 1);
+	pPlayer->resampler = audio_resampler_init(sample_rate, channels, AV_SAMPLE_FMT_FLT);
+	if (pPlayer->resampler == NULL) {
+		fprintf(stderr, "Unable to convert to %d Hz, %d channels.\n", sample_rate, channels);
+		close_ffmpeg_objects(pPlayer);
+		return;
+	}
 	
 	// Print some intersting file information.
 	printStreamInformation(pPlayer->codec, pPlayer->codecCtx, pPlayer->audioStreamIndex);
@@ -430,12 +411,32 @@ void faudio_file_player_open(H_FAUDIO_FILE_PLAYER pPlayer, const char* filePath)
 	// Set default values.
 	pPlayer->packet = av_packet_alloc();
 	
+	if (pPlayer->queue_player && (pPlayer->queue_sample_rate != sample_rate || pPlayer->queue_channels != channels)) {
+		// stopped above, the queue is set up again for the new format
+		audio_queue_player_destroy(pPlayer->queue_player);
+		pPlayer->queue_player = 0;
+	}
 	if (pPlayer->queue_player == 0) {
-		pPlayer->queue_player = audio_queue_player_init(pPlayer->sample_rate, FAUDIO_FILE_PLAYER_BUFFER_SIZE, _faudio_file_player_callback, pPlayer);
+		pPlayer->queue_player = audio_queue_player_init(sample_rate, channels, FAUDIO_FILE_PLAYER_BUFFER_SIZE, _faudio_file_player_callback, pPlayer);
 		audio_queue_player_register_stopped_callback(pPlayer->queue_player, audio_queue_player_stopped_callback, pPlayer);
+		pPlayer->queue_sample_rate = sample_rate;
+		pPlayer->queue_channels = channels;
 	}
 }
 
+void faudio_file_player_open(H_FAUDIO_FILE_PLAYER pPlayer, const char* filePath) {
+	_faudio_file_player_open(pPlayer, filePath, NULL, 0);
+}
+
+void faudio_file_player_open_memory(H_FAUDIO_FILE_PLAYER pPlayer, const void* data, int64_t size) {
+	_faudio_file_player_open(pPlayer, NULL, data, size);
+}
+
+void faudio_file_player_set_output_format(H_FAUDIO_FILE_PLAYER pPlayer, int sample_rate, int channels) {
+	pPlayer->out_sample_rate = sample_rate;
+	pPlayer->out_channels = channels;
+}
+
 void faudio_file_player_destroy(H_FAUDIO_FILE_PLAYER pPlayer) {
 	if (audio_queue_player_is_playing(pPlayer->queue_player)) {
 		audio_queue_player_stop(pPlayer->queue_player);
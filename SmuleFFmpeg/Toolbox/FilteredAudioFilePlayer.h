@@ -8,12 +8,14 @@
 #ifndef FilteredAudioFilePlayer_h
 #define FilteredAudioFilePlayer_h
 
+#include <stdint.h>
 #include "AudioQueuePlayer.h"
 
 struct FilteredAudioFilePlayer_t;
 
 typedef struct FilteredAudioFilePlayer_t*		H_FAUDIO_FILE_PLAYER;
 
+// num_samples interleaved samples of the channels the player plays
 typedef void (*faudio_file_filter_callback)(float *input, float *output, int num_samples, void* user_data);
 
 #ifdef __cplusplus
@@ -22,11 +24,18 @@ extern "C" {
 
 H_FAUDIO_FILE_PLAYER 	faudio_file_player_init(void);
 void					faudio_file_player_open(H_FAUDIO_FILE_PLAYER h, const char* filePath);
+// Plays a file held in memory, size bytes at data, which must stay there
+// until the next file is opened or the player is destroyed.
+void					faudio_file_player_open_memory(H_FAUDIO_FILE_PLAYER h, const void* data, int64_t size);
 void					faudio_file_player_destroy(H_FAUDIO_FILE_PLAYER h);
 void					faudio_file_player_start(H_FAUDIO_FILE_PLAYER h);
 void					faudio_file_player_stop(H_FAUDIO_FILE_PLAYER h);
 void					faudio_file_player_pause(H_FAUDIO_FILE_PLAYER h);
 void					faudio_file_player_resume(H_FAUDIO_FILE_PLAYER h);
+// The rate and channels to play at, e.g. those of the device. The files are
+// converted to it. 0 keeps the rate of the file, or plays mono or stereo like
+// the file. Takes effect with the next file opened.
+void					faudio_file_player_set_output_format(H_FAUDIO_FILE_PLAYER h, int sample_rate, int channels);
 
 void					faudio_file_player_register_filter(H_FAUDIO_FILE_PLAYER h, faudio_file_filter_callback filter, void* user_data);
 
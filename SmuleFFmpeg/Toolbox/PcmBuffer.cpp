@@ -0,0 +1,215 @@
+//
+//  PcmBuffer.cpp
+//  SmuleFFmpeg
+//
+
+#include "PcmBuffer.h"
+#include <stdlib.h>
+#include <string.h>
+#include <atomic>
+
+struct PcmBuffer_t {
+	std::atomic<int>	references;
+	int					sample_rate;
+	int					channels;
+	int					planar;
+	int64_t				num_frames;
+	int64_t				capacity;		// frames
+	// Floats from one plane to the next, capacity rounded up to the
+	// alignment. 0 for interleaved samples.
+	int64_t				plane_stride;
+	float*				data;
+	// set for wrapped samples, which are given back instead of freed
+	void				(*free_data)(void* context);
+	void*				free_context;
+};
+
+static const int64_t kAlignFloats = PCM_BUFFER_ALIGNMENT / sizeof(float);
+
+static int64_t plane_stride(int64_t capacity) {
+	return (capacity + kAlignFloats - 1) / kAlignFloats * kAlignFloats;
+}
+
+static float* alloc_aligned(int64_t num_floats) {
+	void* p = NULL;
+	if (num_floats <= 0)
+		num_floats = kAlignFloats;
+	if (posix_memalign(&p, PCM_BUFFER_ALIGNMENT, (size_t)num_floats * sizeof(float)) != 0)
+		return NULL;
+	return (float*)p;
+}
+
+H_PCM_BUFFER pcm_buffer_create(int sample_rate, int channels, int planar, int64_t capacity) {
+	if (channels <= 0 || sample_rate <= 0 || capacity < 0)
+		return NULL;
+	H_PCM_BUFFER h = new PcmBuffer_t;
+	h->references = 1;
+	h->sample_rate = sample_rate;
+	h->channels = channels;
+	h->planar = planar ? 1 : 0;
+	h->num_frames = 0;
+	h->capacity = 0;
+	h->plane_stride = 0;
+	h->data = NULL;
+	h->free_data = NULL;
+	h->free_context = NULL;
+	if (pcm_buffer_reserve(h, capacity) != 0) {
+		delete h;
+		return NULL;
+	}
+	return h;
+}
+
+H_PCM_BUFFER pcm_buffer_wrap(int sample_rate, int channels, int planar, int64_t num_frames, int64_t plane_stride,
+							 float* data, void (*free_data)(void* context), void* context) {
+	if (channels <= 0 || sample_rate <= 0 || num_frames < 0 || data == NULL || free_data == NULL)
+		return NULL;
+	if (planar && channels > 1 && plane_stride < num_frames)
+		return NULL;
+	H_PCM_BUFFER h = new PcmBuffer_t;
+	h->references = 1;
+	h->sample_rate = sample_rate;
+	h->channels = channels;
+	h->planar = planar ? 1 : 0;
+	h->num_frames = num_frames;
+	h->capacity = num_frames;
+	h->plane_stride = planar ? plane_stride : 0;
+	h->data = data;
+	h->free_data = free_data;
+	h->free_context = context;
+	return h;
+}
+
+H_PCM_BUFFER pcm_buffer_retain(H_PCM_BUFFER h) {
+	if (h)
+		h->references.fetch_add(1, std::memory_order_relaxed);
+	return h;
+}
+
+void pcm_buffer_release(H_PCM_BUFFER h) {
+	if (h && h->references.fetch_sub(1, std::memory_order_acq_rel) == 1) {
+		if (h->free_data)
+			h->free_data(h->free_context);
+		else
+			free(h->data);
+		delete h;
+	}
+}
+
+int pcm_buffer_get_sample_rate(H_PCM_BUFFER h) {
+	return h->sample_rate;
+}
+
+int pcm_buffer_get_num_channels(H_PCM_BUFFER h) {
+	return h->channels;
+}
+
+int pcm_buffer_is_planar(H_PCM_BUFFER h) {
+	return h->planar;
+}
+
+int64_t pcm_buffer_get_num_frames(H_PCM_BUFFER h) {
+	return h->num_frames;
+}
+
+double pcm_buffer_get_duration(H_PCM_BUFFER h) {
+	return (double)h->num_frames / h->sample_rate;
+}
+
+float* pcm_buffer_get_channel_data(H_PCM_BUFFER h, int channel) {
+	if (channel < 0 || channel >= h->channels)
+		return NULL;
+	return h->planar ? h->data + channel * h->plane_stride : h->data + channel;
+}
+
+int pcm_buffer_read_interleaved(H_PCM_BUFFER h, int64_t position, float* out, int num_frames) {
+	if (position < 0 || position >= h->num_frames || num_frames <= 0)
+		return 0;
+	if (num_frames > h->num_frames - position)
+		num_frames = (int)(h->num_frames - position);
+	int channels = h->channels;
+	if (!h->planar) {
+		memcpy(out, h->data + position * channels, (size_t)num_frames * channels * sizeof(float));
+		return num_frames;
+	}
+	for (int c = 0; c < channels; ++c) {
+		const float* plane = h->data + c * h->plane_stride + position;
+		for (int i = 0; i < num_frames; ++i)
+			out[i * channels + c] = plane[i];
+	}
+	return num_frames;
+}
+
+int pcm_buffer_reserve(H_PCM_BUFFER h, int64_t num_frames) {
+	if (num_frames <= h->capacity && h->data)
+		return 0;
+	if (h->free_data)
+		return -1;
+	if (num_frames < h->capacity)
+		num_frames = h->capacity;
+	int64_t stride = h->planar ? plane_stride(num_frames) : 0;
+	float* data = alloc_aligned(h->planar ? stride * h->channels : num_frames * h->channels);
+	if (data == NULL)
+		return -1;
+	if (h->data && h->num_frames > 0) {
+		if (h->planar) {
+			for (int c = 0; c < h->channels; ++c)
+				memcpy(data + c * stride, h->data + c * h->plane_stride, (size_t)h->num_frames * sizeof(float));
+		}
+		else
+			memcpy(data, h->data, (size_t)h->num_frames * h->channels * sizeof(float));
+	}
+	free(h->data);
+	h->data = data;
+	h->capacity = num_frames;
+	h->plane_stride = stride;
+	return 0;
+}
+
+// room for num_frames more, growing by half so appending stays linear
+static int pcm_buffer_grow(H_PCM_BUFFER h, int num_frames) {
+	int64_t needed = h->num_frames + num_frames;
+	if (needed <= h->capacity)
+		return 0;
+	int64_t capacity = h->capacity + h->capacity / 2;
+	return pcm_buffer_reserve(h, capacity > needed ? capacity : needed);
+}
+
+int pcm_buffer_append_interleaved(H_PCM_BUFFER h, const float* samples, int num_frames) {
+	if (num_frames <= 0)
+		return 0;
+	if (pcm_buffer_grow(h, num_frames) != 0)
+		return -1;
+	int channels = h->channels;
+	if (!h->planar)
+		memcpy(h->data + h->num_frames * channels, samples, (size_t)num_frames * channels * sizeof(float));
+	else {
+		for (int c = 0; c < channels; ++c) {
+			float* plane = h->data + c * h->plane_stride + h->num_frames;
+			for (int i = 0; i < num_frames; ++i)
+				plane[i] = samples[i * channels + c];
+		}
+	}
+	h->num_frames += num_frames;
+	return 0;
+}
+
+int pcm_buffer_append_planar(H_PCM_BUFFER h, const float* const* planes, int num_frames) {
+	if (num_frames <= 0)
+		return 0;
+	if (pcm_buffer_grow(h, num_frames) != 0)
+		return -1;
+	int channels = h->channels;
+	if (h->planar) {
+		for (int c = 0; c < channels; ++c)
+			memcpy(h->data + c * h->plane_stride + h->num_frames, planes[c], (size_t)num_frames * sizeof(float));
+	}
+	else {
+		float* out = h->data + h->num_frames * channels;
+		for (int c = 0; c < channels; ++c)
+			for (int i = 0; i < num_frames; ++i)
+				out[i * channels + c] = planes[c][i];
+	}
+	h->num_frames += num_frames;
+	return 0;
+}
@@ -0,0 +1,67 @@
+//
+//  PcmBuffer.h
+//  SmuleFFmpeg
+//
+//  Decoded float samples in memory, shared by reference count between the
+//  decoder, players and whoever else holds on to them.
+//
+//  The samples are either interleaved, or planar with one plane per channel.
+//  The data, and each plane, starts on a PCM_BUFFER_ALIGNMENT byte boundary
+//  so vector code can load it directly.
+//
+
+#ifndef PcmBuffer_h
+#define PcmBuffer_h
+
+#include <stdint.h>
+
+struct PcmBuffer_t;
+
+typedef struct PcmBuffer_t*		H_PCM_BUFFER;
+
+#define PCM_BUFFER_ALIGNMENT		64
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+// An empty buffer with room for capacity frames, with a reference count of 1.
+// Returns NULL if the memory can't be allocated.
+H_PCM_BUFFER	pcm_buffer_create(int sample_rate, int channels, int planar, int64_t capacity);
+// A full buffer on num_frames frames of samples owned by someone else, e.g. a
+// mapped file, which free_data(context) gives back with the last reference.
+// plane_stride is the floats from one plane to the next, 0 if interleaved.
+// The buffer can't grow.
+H_PCM_BUFFER	pcm_buffer_wrap(int sample_rate, int channels, int planar, int64_t num_frames, int64_t plane_stride,
+								float* data, void (*free_data)(void* context), void* context);
+H_PCM_BUFFER	pcm_buffer_retain(H_PCM_BUFFER h);
+// the buffer is freed with the last reference
+void			pcm_buffer_release(H_PCM_BUFFER h);
+
+int				pcm_buffer_get_sample_rate(H_PCM_BUFFER h);
+int				pcm_buffer_get_num_channels(H_PCM_BUFFER h);
+int				pcm_buffer_is_planar(H_PCM_BUFFER h);
+int64_t			pcm_buffer_get_num_frames(H_PCM_BUFFER h);
+double			pcm_buffer_get_duration(H_PCM_BUFFER h);
+// Planar: the plane of the channel. Interleaved: the first sample of the
+// channel, the next one is get_num_channels() floats further.
+float*			pcm_buffer_get_channel_data(H_PCM_BUFFER h, int channel);
+// Copies up to num_frames frames from frame position on as interleaved samples.
+// Returns the number of frames copied, 0 at the end.
+int				pcm_buffer_read_interleaved(H_PCM_BUFFER h, int64_t position, float* out, int num_frames);
+
+// For the producer, before the buffer is shared:
+// Makes room for num_frames frames in all. Returns 0 or -1 if out of memory
+// or the buffer is wrapped.
+int				pcm_buffer_reserve(H_PCM_BUFFER h, int64_t num_frames);
+// Appends num_frames interleaved frames, growing the buffer as needed.
+// Returns 0 or -1 if out of memory.
+int				pcm_buffer_append_interleaved(H_PCM_BUFFER h, const float* samples, int num_frames);
+// Appends num_frames frames given as one plane per channel.
+int				pcm_buffer_append_planar(H_PCM_BUFFER h, const float* const* planes, int num_frames);
+
+#ifdef __cplusplus
+}
+#endif //__cplusplus
+
+#endif /* PcmBuffer_h */
@@ -0,0 +1,439 @@
+//
+//  PcmCache.cpp
+//  SmuleFFmpeg
+//
+
+#include "PcmCache.h"
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <dirent.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <algorithm>
+#include <atomic>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <functional>
+#include <vector>
+
+// the samples start on the page after the header, so a mapping keeps them aligned
+#define PCM_CACHE_DATA_OFFSET		4096
+#define PCM_CACHE_VERSION			1
+// temporary files left behind by a crash are removed after a day
+#define PCM_CACHE_STALE_SECONDS		(24 * 60 * 60)
+
+static const char kMagic[8] = {'S', 'M', 'P', 'C', 'M', 'C', 'H', 'E'};
+
+struct PcmCacheHeader {
+	char		magic[8];
+	int32_t		version;
+	int32_t		data_offset;
+	int32_t		sample_rate;
+	int32_t		channels;
+	int32_t		format;				// PcmCacheFormat
+	int32_t		planar;
+	int64_t		num_frames;
+	int64_t		plane_stride;		// frames, 0 if interleaved
+	uint64_t	content_hash;		// of the source, to tell a clash of names
+};
+
+struct PcmCache_t {
+	std::string		dir;
+	int64_t			max_bytes;
+	std::mutex		evict_lock;		// one eviction scan at a time in this process
+};
+
+struct PcmCacheEntry_t {
+	std::atomic<int>	references;
+	void*				map;
+	size_t				map_size;
+	PcmCacheHeader		header;
+};
+
+struct PcmCacheWriter_t {
+	H_PCM_CACHE		cache;
+	std::string		path;
+	std::string		temp_path;
+	int				fd;
+	int				failed;
+	PcmCacheHeader	header;
+};
+
+static int sample_size(int format) {
+	return format == PcmCacheS16 ? 2 : 4;
+}
+
+static std::string entry_path(H_PCM_CACHE h, const PcmCacheKey* key) {
+	char name[128];
+	snprintf(name, sizeof(name), "%016llx-%llx-%d-%d-%d-%d.pcm",
+			 (unsigned long long)key->content_hash, (unsigned long long)key->content_size,
+			 key->sample_rate, key->channels, key->format, key->planar ? 1 : 0);
+	return h->dir + "/" + name;
+}
+
+static bool ends_with(const char* s, const char* suffix) {
+	size_t n = strlen(s), m = strlen(suffix);
+	return n >= m && memcmp(s + n - m, suffix, m) == 0;
+}
+
+static int write_all(int fd, const void* data, size_t size) {
+	const char* p = (const char*)data;
+	while (size > 0) {
+		ssize_t n = write(fd, p, size);
+		if (n < 0) {
+			if (errno == EINTR)
+				continue;
+			return -1;
+		}
+		p += n;
+		size -= (size_t)n;
+	}
+	return 0;
+}
+
+H_PCM_CACHE pcm_cache_open(const char* dir, int64_t max_bytes) {
+	if (dir == NULL || *dir == 0)
+		return NULL;
+	if (mkdir(dir, 0755) != 0 && errno != EEXIST)
+		return NULL;
+	H_PCM_CACHE h = new PcmCache_t;
+	h->dir = dir;
+	h->max_bytes = max_bytes > 0 ? max_bytes : 0;
+	return h;
+}
+
+void pcm_cache_close(H_PCM_CACHE h) {
+	delete h;
+}
+
+// 64 bit hash of the bytes, four words at a time in independent lanes so it
+// runs at the speed of the disk rather than of one multiply chain
+struct ContentHash {
+	static const uint64_t kPrime1 = 0x9E3779B185EBCA87ULL;
+	static const uint64_t kPrime2 = 0xC2B2AE3D27D4EB4FULL;
+
+	uint64_t	lanes[4] = {kPrime1, kPrime2, ~kPrime1, ~kPrime2};
+	uint64_t	length = 0;
+
+	static uint64_t round(uint64_t lane, uint64_t word) {
+		lane += word * kPrime2;
+		lane = (lane << 31) | (lane >> 33);
+		return lane * kPrime1;
+	}
+
+	// all but the last call with a multiple of 32 bytes
+	void update(const unsigned char* p, size_t size) {
+		length += size;
+		for (; size >= 32; p += 32, size -= 32) {
+			uint64_t w[4];
+			memcpy(w, p, 32);
+			for (int i = 0; i < 4; ++i)
+				lanes[i] = round(lanes[i], w[i]);
+		}
+		for (size_t i = 0; i < size; ++i)
+			lanes[i & 3] = round(lanes[i & 3], p[i]);
+	}
+
+	uint64_t final() const {
+		uint64_t h = length * kPrime1;
+		for (int i = 0; i < 4; ++i)
+			h = round(h ^ lanes[i], (uint64_t)i);
+		h ^= h >> 33;
+		h *= kPrime2;
+		h ^= h >> 29;
+		return h;
+	}
+};
+
+int pcm_cache_key_for_file(const char* path, PcmCacheKey* key) {
+	int fd = open(path, O_RDONLY);
+	if (fd < 0)
+		return -1;
+	std::vector<unsigned char> block(1 << 20);
+	ContentHash hash;
+	int result = 0;
+	for (;;) {
+		ssize_t n = read(fd, block.data(), block.size());
+		if (n < 0 && errno == EINTR)
+			continue;
+		if (n < 0)
+			result = -1;
+		if (n <= 0)
+			break;
+		// reads come back whole for regular files, short only at the end
+		hash.update(block.data(), (size_t)n);
+	}
+	close(fd);
+	if (result == 0) {
+		key->content_hash = hash.final();
+		key->content_size = (int64_t)hash.length;
+	}
+	return result;
+}
+
+void pcm_cache_key_for_data(const void* data, int64_t size, PcmCacheKey* key) {
+	ContentHash hash;
+	hash.update((const unsigned char*)data, (size_t)size);
+	key->content_hash = hash.final();
+	key->content_size = size;
+}
+
+static bool valid_header(const PcmCacheHeader& header, const PcmCacheKey* key, size_t file_size) {
+	if (memcmp(header.magic, kMagic, sizeof(kMagic)) != 0 || header.version != PCM_CACHE_VERSION)
+		return false;
+	if (header.content_hash != key->content_hash || header.data_offset != PCM_CACHE_DATA_OFFSET)
+		return false;
+	if (header.sample_rate <= 0 || header.channels <= 0 || header.num_frames < 0
+		|| header.format < PcmCacheS16 || header.format > PcmCacheFloat)
+		return false;
+	int64_t samples = header.planar ? header.plane_stride * header.channels : header.num_frames * header.channels;
+	if (header.planar && header.plane_stride < header.num_frames)
+		return false;
+	return (int64_t)file_size >= header.data_offset + samples * sample_size(header.format);
+}
+
+H_PCM_CACHE_ENTRY pcm_cache_lookup(H_PCM_CACHE h, const PcmCacheKey* key) {
+	if (h == NULL)
+		return NULL;
+	int fd = open(entry_path(h, key).c_str(), O_RDONLY);
+	if (fd < 0)
+		return NULL;
+	struct stat st;
+	void* map = MAP_FAILED;
+	if (fstat(fd, &st) == 0 && st.st_size >= PCM_CACHE_DATA_OFFSET)
+		map = mmap(NULL, (size_t)st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+	if (map == MAP_FAILED) {
+		close(fd);
+		return NULL;
+	}
+	PcmCacheHeader header;
+	memcpy(&header, map, sizeof(header));
+	if (!valid_header(header, key, (size_t)st.st_size)) {
+		munmap(map, (size_t)st.st_size);
+		close(fd);
+		return NULL;
+	}
+	// the modification time orders the entries for eviction
+	futimens(fd, NULL);
+	close(fd);
+	H_PCM_CACHE_ENTRY entry = new PcmCacheEntry_t;
+	entry->references = 1;
+	entry->map = map;
+	entry->map_size = (size_t)st.st_size;
+	entry->header = header;
+	return entry;
+}
+
+void pcm_cache_entry_release(H_PCM_CACHE_ENTRY entry) {
+	if (entry && entry->references.fetch_sub(1, std::memory_order_acq_rel) == 1) {
+		munmap(entry->map, entry->map_size);
+		delete entry;
+	}
+}
+
+int pcm_cache_entry_get_sample_rate(H_PCM_CACHE_ENTRY entry) {
+	return entry->header.sample_rate;
+}
+
+int pcm_cache_entry_get_num_channels(H_PCM_CACHE_ENTRY entry) {
+	return entry->header.channels;
+}
+
+PcmCacheFormat pcm_cache_entry_get_format(H_PCM_CACHE_ENTRY entry) {
+	return (PcmCacheFormat)entry->header.format;
+}
+
+int pcm_cache_entry_is_planar(H_PCM_CACHE_ENTRY entry) {
+	return entry->header.planar;
+}
+
+int64_t pcm_cache_entry_get_num_frames(H_PCM_CACHE_ENTRY entry) {
+	return entry->header.num_frames;
+}
+
+const void* pcm_cache_entry_get_data(H_PCM_CACHE_ENTRY entry) {
+	return (const char*)entry->map + entry->header.data_offset;
+}
+
+int64_t pcm_cache_entry_get_plane_stride(H_PCM_CACHE_ENTRY entry) {
+	return entry->header.plane_stride;
+}
+
+static void release_entry(void* context) {
+	pcm_cache_entry_release((H_PCM_CACHE_ENTRY)context);
+}
+
+H_PCM_BUFFER pcm_cache_entry_get_buffer(H_PCM_CACHE_ENTRY entry) {
+	const PcmCacheHeader& header = entry->header;
+	if (header.format != PcmCacheFloat)
+		return NULL;
+	entry->references.fetch_add(1, std::memory_order_relaxed);
+	// read only mapping, the buffer is full and never written to
+	H_PCM_BUFFER buffer = pcm_buffer_wrap(header.sample_rate, header.channels, header.planar, header.num_frames,
+										  header.plane_stride, (float*)pcm_cache_entry_get_data(entry), release_entry, entry);
+	if (buffer == NULL)
+		pcm_cache_entry_release(entry);
+	return buffer;
+}
+
+// Removes the least recently used entries until the cache is within its size.
+static void evict(H_PCM_CACHE h) {
+	if (h->max_bytes == 0)
+		return;
+	std::lock_guard<std::mutex> lock(h->evict_lock);
+	DIR* dir = opendir(h->dir.c_str());
+	if (dir == NULL)
+		return;
+	struct File {
+		std::string		path;
+		int64_t			size;
+		struct timespec	used;
+	};
+	std::vector<File> files;
+	int64_t total = 0;
+	time_t now = time(NULL);
+	while (struct dirent* e = readdir(dir)) {
+		bool temp = ends_with(e->d_name, ".tmp");
+		if (!temp && !ends_with(e->d_name, ".pcm"))
+			continue;
+		std::string path = h->dir + "/" + e->d_name;
+		struct stat st;
+		if (stat(path.c_str(), &st) != 0)
+			continue;
+		if (temp) {
+			if (now - st.st_mtime > PCM_CACHE_STALE_SECONDS)
+				unlink(path.c_str());
+			continue;
+		}
+#ifdef __APPLE__
+		files.push_back({path, (int64_t)st.st_size, st.st_mtimespec});
+#else
+		files.push_back({path, (int64_t)st.st_size, st.st_mtim});
+#endif
+		total += st.st_size;
+	}
+	closedir(dir);
+	if (total <= h->max_bytes)
+		return;
+	std::sort(files.begin(), files.end(), [](const File& a, const File& b) {
+		return a.used.tv_sec != b.used.tv_sec ? a.used.tv_sec < b.used.tv_sec : a.used.tv_nsec < b.used.tv_nsec;
+	});
+	// mapped entries stay readable after the unlink, until they are released
+	for (size_t i = 0; i < files.size() && total > h->max_bytes; ++i) {
+		if (unlink(files[i].path.c_str()) == 0)
+			total -= files[i].size;
+	}
+}
+
+static H_PCM_CACHE_WRITER begin(H_PCM_CACHE h, const PcmCacheKey* key, int sample_rate, int channels,
+								PcmCacheFormat format, int planar, int64_t plane_stride) {
+	if (h == NULL || sample_rate <= 0 || channels <= 0)
+		return NULL;
+	H_PCM_CACHE_WRITER w = new PcmCacheWriter_t;
+	w->cache = h;
+	w->path = entry_path(h, key);
+	// unique among processes and threads, so writers of the same entry don't mix
+	char suffix[64];
+	snprintf(suffix, sizeof(suffix), ".%d.%zx.tmp", (int)getpid(), std::hash<std::thread::id>()(std::this_thread::get_id()));
+	w->temp_path = w->path + suffix;
+	w->fd = open(w->temp_path.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+	w->failed = w->fd < 0;
+	memset(&w->header, 0, sizeof(w->header));
+	memcpy(w->header.magic, kMagic, sizeof(kMagic));
+	w->header.version = PCM_CACHE_VERSION;
+	w->header.data_offset = PCM_CACHE_DATA_OFFSET;
+	w->header.sample_rate = sample_rate;
+	w->header.channels = channels;
+	w->header.format = format;
+	w->header.planar = planar;
+	w->header.plane_stride = plane_stride;
+	w->header.content_hash = key->content_hash;
+	// the header goes in with the frame count on commit
+	if (!w->failed && lseek(w->fd, PCM_CACHE_DATA_OFFSET, SEEK_SET) < 0)
+		w->failed = 1;
+	if (w->failed) {
+		pcm_cache_abort(w);
+		return NULL;
+	}
+	return w;
+}
+
+H_PCM_CACHE_WRITER pcm_cache_begin(H_PCM_CACHE h, const PcmCacheKey* key, int sample_rate, int channels, PcmCacheFormat format) {
+	return begin(h, key, sample_rate, channels, format, 0, 0);
+}
+
+static int write_samples(H_PCM_CACHE_WRITER w, const void* samples, int64_t num_samples) {
+	if (w->failed)
+		return -1;
+	if (num_samples > 0 && write_all(w->fd, samples, (size_t)num_samples * sample_size(w->header.format)) != 0) {
+		w->failed = 1;
+		return -1;
+	}
+	return 0;
+}
+
+int pcm_cache_write(H_PCM_CACHE_WRITER w, const void* samples, int num_frames) {
+	if (num_frames <= 0)
+		return w->failed ? -1 : 0;
+	if (write_samples(w, samples, (int64_t)num_frames * w->header.channels) != 0)
+		return -1;
+	w->header.num_frames += num_frames;
+	return 0;
+}
+
+int pcm_cache_commit(H_PCM_CACHE_WRITER w) {
+	int result = w->failed ? -1 : 0;
+	if (result == 0 && (lseek(w->fd, 0, SEEK_SET) < 0 || write_all(w->fd, &w->header, sizeof(w->header)) != 0))
+		result = -1;
+	// the samples are on disk before the name makes them visible
+	if (result == 0 && fsync(w->fd) != 0)
+		result = -1;
+	if (close(w->fd) != 0)
+		result = -1;
+	w->fd = -1;
+	if (result == 0 && rename(w->temp_path.c_str(), w->path.c_str()) != 0)
+		result = -1;
+	if (result != 0)
+		unlink(w->temp_path.c_str());
+	else
+		evict(w->cache);
+	delete w;
+	return result;
+}
+
+void pcm_cache_abort(H_PCM_CACHE_WRITER w) {
+	if (w == NULL)
+		return;
+	if (w->fd >= 0)
+		close(w->fd);
+	unlink(w->temp_path.c_str());
+	delete w;
+}
+
+int pcm_cache_store_buffer(H_PCM_CACHE h, const PcmCacheKey* key, H_PCM_BUFFER buffer) {
+	int channels = pcm_buffer_get_num_channels(buffer);
+	int planar = pcm_buffer_is_planar(buffer);
+	int64_t frames = pcm_buffer_get_num_frames(buffer);
+	// planes padded to the alignment of the buffer, which the mapping keeps
+	const int64_t align = PCM_BUFFER_ALIGNMENT / sizeof(float);
+	int64_t stride = planar ? (frames + align - 1) / align * align : 0;
+	H_PCM_CACHE_WRITER w = begin(h, key, pcm_buffer_get_sample_rate(buffer), channels, PcmCacheFloat, planar, stride);
+	if (w == NULL)
+		return -1;
+	if (!planar)
+		write_samples(w, pcm_buffer_get_channel_data(buffer, 0), frames * channels);
+	else {
+		std::vector<float> padding((size_t)(stride - frames));
+		for (int c = 0; c < channels; ++c) {
+			write_samples(w, pcm_buffer_get_channel_data(buffer, c), frames);
+			write_samples(w, padding.data(), (int64_t)padding.size());
+		}
+	}
+	w->header.num_frames = frames;
+	return pcm_cache_commit(w);
+}
@@ -0,0 +1,94 @@
+//
+//  PcmCache.h
+//  SmuleFFmpeg
+//
+//  On-disk cache of decoded samples, so that a file decoded before is mapped
+//  into memory instead of decoded again.
+//
+//  An entry is keyed by a hash of the content of the source file and the
+//  parameters of the decode, so a renamed or copied file still hits and an
+//  edited one misses. Each entry is one file: a header page, then the samples
+//  from the next page on, ready to be mapped. Entries are written to a
+//  temporary file and renamed into place, so a reader never sees half of
+//  one, and the least recently used ones are removed when the cache grows
+//  past its size.
+//
+//  The functions are safe to call from several threads, and several
+//  processes may share a directory.
+//
+
+#ifndef PcmCache_h
+#define PcmCache_h
+
+#include <stdint.h>
+#include "PcmBuffer.h"
+
+struct PcmCache_t;
+struct PcmCacheEntry_t;
+struct PcmCacheWriter_t;
+
+typedef struct PcmCache_t*			H_PCM_CACHE;
+typedef struct PcmCacheEntry_t*		H_PCM_CACHE_ENTRY;
+typedef struct PcmCacheWriter_t*	H_PCM_CACHE_WRITER;
+
+// the samples of an entry, in the sample formats of the decompressor
+typedef enum {
+	PcmCacheS16 = 0,
+	PcmCacheS24,		// stored as 32 bit, the upper 24 bits count
+	PcmCacheS32,
+	PcmCacheFloat
+} PcmCacheFormat;
+
+typedef struct {
+	uint64_t		content_hash;
+	int64_t			content_size;
+	// what was asked of the decode, 0 for the rate or channels of the file
+	int				sample_rate;
+	int				channels;
+	int				format;			// PcmCacheFormat, or any other code of the caller
+	int				planar;
+} PcmCacheKey;
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+// Opens the cache in dir, which is created if needed. max_bytes 0 for no limit.
+H_PCM_CACHE			pcm_cache_open(const char* dir, int64_t max_bytes);
+void				pcm_cache_close(H_PCM_CACHE h);
+// Hashes the content of the file at path into the key, the other fields are
+// left to the caller. Returns 0 or -1 if the file can't be read.
+int					pcm_cache_key_for_file(const char* path, PcmCacheKey* key);
+// Same for size bytes at data, the same key as for a file of those bytes.
+void				pcm_cache_key_for_data(const void* data, int64_t size, PcmCacheKey* key);
+
+// The entry of key mapped into memory, or NULL.
+H_PCM_CACHE_ENTRY	pcm_cache_lookup(H_PCM_CACHE h, const PcmCacheKey* key);
+void				pcm_cache_entry_release(H_PCM_CACHE_ENTRY entry);
+int					pcm_cache_entry_get_sample_rate(H_PCM_CACHE_ENTRY entry);
+int					pcm_cache_entry_get_num_channels(H_PCM_CACHE_ENTRY entry);
+PcmCacheFormat		pcm_cache_entry_get_format(H_PCM_CACHE_ENTRY entry);
+int					pcm_cache_entry_is_planar(H_PCM_CACHE_ENTRY entry);
+int64_t				pcm_cache_entry_get_num_frames(H_PCM_CACHE_ENTRY entry);
+// Interleaved samples, or the first plane, the next one plane_stride frames on.
+const void*			pcm_cache_entry_get_data(H_PCM_CACHE_ENTRY entry);
+int64_t				pcm_cache_entry_get_plane_stride(H_PCM_CACHE_ENTRY entry);
+// A float entry as a buffer on the mapped samples, NULL for other formats.
+// The buffer keeps the mapping, the entry can be released.
+H_PCM_BUFFER		pcm_cache_entry_get_buffer(H_PCM_CACHE_ENTRY entry);
+
+// Writes interleaved samples for key as they come, to be published by commit.
+H_PCM_CACHE_WRITER	pcm_cache_begin(H_PCM_CACHE h, const PcmCacheKey* key, int sample_rate, int channels, PcmCacheFormat format);
+// Returns 0 or -1 if writing fails, commit then fails too.
+int					pcm_cache_write(H_PCM_CACHE_WRITER w, const void* samples, int num_frames);
+// Publishes the entry and evicts what is over the size. Returns 0 or -1.
+int					pcm_cache_commit(H_PCM_CACHE_WRITER w);
+void				pcm_cache_abort(H_PCM_CACHE_WRITER w);
+// Stores a whole buffer, planar or interleaved, as a float entry. Returns 0 or -1.
+int					pcm_cache_store_buffer(H_PCM_CACHE h, const PcmCacheKey* key, H_PCM_BUFFER buffer);
+
+#ifdef __cplusplus
+}
+#endif //__cplusplus
+
+#endif /* PcmCache_h */
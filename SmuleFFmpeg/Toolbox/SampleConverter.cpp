@@ -0,0 +1,412 @@
+//
+//  SampleConverter.cpp
+//  SmuleFFmpeg
+//
+
+#include "SampleConverter.h"
+#include "SimdOps.hpp"
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+
+extern "C" {
+	#include <libavutil/samplefmt.h>
+}
+
+// frames converted through the scratch in one pass when the layout changes
+#define SAMPLE_CONVERTER_BLOCK_FRAMES		256
+#define SAMPLE_CONVERTER_MAX_CHANNELS		64
+
+// converts n contiguous samples
+typedef void (*sc_convert_kernel)(const void* in, void* out, int n);
+// move n frames between planes and an interleaved buffer
+typedef void (*sc_interleave_kernel)(const void* const* planes, void* interleaved, int channels, int n);
+typedef void (*sc_deinterleave_kernel)(const void* interleaved, void* const* planes, int channels, int n);
+
+typedef struct SampleConverter_t {
+	int					channels;
+	int					inPlanar;
+	int					outPlanar;
+	int					inSampleSize;
+	int					outSampleSize;
+	sc_convert_kernel	convert;
+	int					sameFormat;		// convert only copies, a layout change works on the input directly
+	// planar input to interleaved output, or the other way round
+	sc_interleave_kernel	interleave;
+	sc_deinterleave_kernel	deinterleave;
+	void*				scratch;		// SAMPLE_CONVERTER_BLOCK_FRAMES output samples per channel
+} SampleConverter;
+
+// to float
+
+static void sc_u8_to_float(const void* in, void* out, int n) {
+	const uint8_t* src = (const uint8_t*)in;
+	float* dst = (float*)out;
+	for (int i = 0; i < n; ++i)
+		dst[i] = (float)((int)src[i] - 128) * (1.0f / 128.0f);
+}
+
+static void sc_s16_to_float(const void* in, void* out, int n) {
+	const int16_t* src = (const int16_t*)in;
+	float* dst = (float*)out;
+	simd_float scale = simd_set1(1.0f / 32768.0f);
+	int i = 0;
+	for (; i + SIMD_WIDTH <= n; i += SIMD_WIDTH)
+		simd_store(dst + i, simd_mul(simd_load_s16(src + i), scale));
+	for (; i < n; ++i)
+		dst[i] = (float)src[i] * (1.0f / 32768.0f);
+}
+
+static void sc_s32_to_float(const void* in, void* out, int n) {
+	const int32_t* src = (const int32_t*)in;
+	float* dst = (float*)out;
+	simd_float scale = simd_set1(1.0f / 2147483648.0f);
+	int i = 0;
+	for (; i + SIMD_WIDTH <= n; i += SIMD_WIDTH)
+		simd_store(dst + i, simd_mul(simd_load_s32(src + i), scale));
+	for (; i < n; ++i)
+		dst[i] = (float)src[i] * (1.0f / 2147483648.0f);
+}
+
+static void sc_float_to_float(const void* in, void* out, int n) {
+	memcpy(out, in, n * sizeof(float));
+}
+
+static void sc_double_to_float(const void* in, void* out, int n) {
+	const double* src = (const double*)in;
+	float* dst = (float*)out;
+	for (int i = 0; i < n; ++i)
+		dst[i] = (float)src[i];
+}
+
+// to 16 bit
+
+static void sc_u8_to_s16(const void* in, void* out, int n) {
+	const uint8_t* src = (const uint8_t*)in;
+	int16_t* dst = (int16_t*)out;
+	for (int i = 0; i < n; ++i)
+		dst[i] = (int16_t)(((int)src[i] - 128) * 256);
+}
+
+static void sc_s16_to_s16(const void* in, void* out, int n) {
+	memcpy(out, in, n * sizeof(int16_t));
+}
+
+static void sc_s32_to_s16(const void* in, void* out, int n) {
+	const int32_t* src = (const int32_t*)in;
+	int16_t* dst = (int16_t*)out;
+	for (int i = 0; i < n; ++i)
+		dst[i] = (int16_t)(src[i] >> 16);
+}
+
+static inline int16_t sc_float_sample_to_s16(float x) {
+	float scaled = 32768.0f * x;
+	if (scaled < -32768.0f)
+		scaled = -32768.0f;
+	if (scaled > 32767.0f)
+		scaled = 32767.0f;
+	return (int16_t)scaled;
+}
+
+static void sc_float_to_s16(const void* in, void* out, int n) {
+	const float* src = (const float*)in;
+	int16_t* dst = (int16_t*)out;
+	simd_float scale = simd_set1(32768.0f);
+	simd_float low = simd_set1(-32768.0f);
+	simd_float high = simd_set1(32767.0f);
+	int i = 0;
+	for (; i + SIMD_WIDTH <= n; i += SIMD_WIDTH)
+		simd_store_s16(dst + i, simd_min(simd_max(simd_mul(simd_load(src + i), scale), low), high));
+	for (; i < n; ++i)
+		dst[i] = sc_float_sample_to_s16(src[i]);
+}
+
+static void sc_double_to_s16(const void* in, void* out, int n) {
+	const double* src = (const double*)in;
+	int16_t* dst = (int16_t*)out;
+	for (int i = 0; i < n; ++i)
+		dst[i] = sc_float_sample_to_s16((float)src[i]);
+}
+
+// to 32 bit
+
+static void sc_u8_to_s32(const void* in, void* out, int n) {
+	const uint8_t* src = (const uint8_t*)in;
+	int32_t* dst = (int32_t*)out;
+	for (int i = 0; i < n; ++i)
+		dst[i] = (int32_t)((uint32_t)((int)src[i] - 128) << 24);
+}
+
+static void sc_s16_to_s32(const void* in, void* out, int n) {
+	const int16_t* src = (const int16_t*)in;
+	int32_t* dst = (int32_t*)out;
+	for (int i = 0; i < n; ++i)
+		dst[i] = (int32_t)((uint32_t)(int32_t)src[i] << 16);
+}
+
+static void sc_s32_to_s32(const void* in, void* out, int n) {
+	memcpy(out, in, n * sizeof(int32_t));
+}
+
+// in double, a float can't hold the 32 bit limits
+static inline int32_t sc_double_sample_to_s32(double x) {
+	double scaled = 2147483648.0 * x;
+	if (scaled < -2147483648.0)
+		scaled = -2147483648.0;
+	if (scaled > 2147483647.0)
+		scaled = 2147483647.0;
+	return (int32_t)scaled;
+}
+
+// Scaling by 2^31 is exact in float, and the store saturates like the
+// double path does.
+static void sc_float_to_s32(const void* in, void* out, int n) {
+	const float* src = (const float*)in;
+	int32_t* dst = (int32_t*)out;
+	simd_float scale = simd_set1(2147483648.0f);
+	int i = 0;
+	for (; i + SIMD_WIDTH <= n; i += SIMD_WIDTH)
+		simd_store_s32(dst + i, simd_mul(simd_load(src + i), scale));
+	for (; i < n; ++i)
+		dst[i] = sc_double_sample_to_s32(src[i]);
+}
+
+static void sc_double_to_s32(const void* in, void* out, int n) {
+	const double* src = (const double*)in;
+	int32_t* dst = (int32_t*)out;
+	for (int i = 0; i < n; ++i)
+		dst[i] = sc_double_sample_to_s32(src[i]);
+}
+
+// Layout changes, with a stereo special case.
+
+template <class T>
+static void sc_interleave(const void* const* planes, void* interleaved, int channels, int n) {
+	T* dst = (T*)interleaved;
+	for (int c = 0; c < channels; ++c) {
+		const T* src = (const T*)planes[c];
+		for (int i = 0; i < n; ++i)
+			dst[i * channels + c] = src[i];
+	}
+}
+
+template <class T>
+static void sc_interleave_stereo(const void* const* planes, void* interleaved, int /*channels*/, int n) {
+	const T* left = (const T*)planes[0];
+	const T* right = (const T*)planes[1];
+	T* dst = (T*)interleaved;
+	for (int i = 0; i < n; ++i) {
+		dst[2 * i] = left[i];
+		dst[2 * i + 1] = right[i];
+	}
+}
+
+template <class T>
+static void sc_deinterleave(const void* interleaved, void* const* planes, int channels, int n) {
+	const T* src = (const T*)interleaved;
+	for (int c = 0; c < channels; ++c) {
+		T* dst = (T*)planes[c];
+		for (int i = 0; i < n; ++i)
+			dst[i] = src[i * channels + c];
+	}
+}
+
+template <class T>
+static void sc_deinterleave_stereo(const void* interleaved, void* const* planes, int /*channels*/, int n) {
+	const T* src = (const T*)interleaved;
+	T* left = (T*)planes[0];
+	T* right = (T*)planes[1];
+	for (int i = 0; i < n; ++i) {
+		left[i] = src[2 * i];
+		right[i] = src[2 * i + 1];
+	}
+}
+
+H_SAMPLE_CONVERTER sample_converter_init(int in_format, int channels, SampleConverterFormat out_format, int out_planar) {
+	if (channels < 1 || channels > SAMPLE_CONVERTER_MAX_CHANNELS)
+		return NULL;
+	static const sc_convert_kernel toFloat[] = {sc_u8_to_float, sc_s16_to_float, sc_s32_to_float, sc_float_to_float, sc_double_to_float};
+	static const sc_convert_kernel toS16[] = {sc_u8_to_s16, sc_s16_to_s16, sc_s32_to_s16, sc_float_to_s16, sc_double_to_s16};
+	static const sc_convert_kernel toS32[] = {sc_u8_to_s32, sc_s16_to_s32, sc_s32_to_s32, sc_float_to_s32, sc_double_to_s32};
+	int kind;
+	switch (av_get_packed_sample_fmt((enum AVSampleFormat)in_format)) {
+		case AV_SAMPLE_FMT_U8:	kind = 0; break;
+		case AV_SAMPLE_FMT_S16:	kind = 1; break;
+		case AV_SAMPLE_FMT_S32:	kind = 2; break;
+		case AV_SAMPLE_FMT_FLT:	kind = 3; break;
+		case AV_SAMPLE_FMT_DBL:	kind = 4; break;
+		default:
+			return NULL;
+	}
+	H_SAMPLE_CONVERTER h = (H_SAMPLE_CONVERTER)malloc(sizeof(SampleConverter));
+	memset(h, 0, sizeof(SampleConverter));
+	h->channels = channels;
+	h->inPlanar = av_sample_fmt_is_planar((enum AVSampleFormat)in_format);
+	h->outPlanar = out_planar ? 1 : 0;
+	h->inSampleSize = av_get_bytes_per_sample((enum AVSampleFormat)in_format);
+	h->sameFormat = (out_format == SampleConverterS16 && kind == 1) || (out_format == SampleConverterS32 && kind == 2) || (out_format == SampleConverterFloat && kind == 3);
+	if (out_format == SampleConverterS16) {
+		h->outSampleSize = sizeof(int16_t);
+		h->convert = toS16[kind];
+		h->interleave = channels == 2 ? sc_interleave_stereo<int16_t> : sc_interleave<int16_t>;
+		h->deinterleave = channels == 2 ? sc_deinterleave_stereo<int16_t> : sc_deinterleave<int16_t>;
+	}
+	else if (out_format == SampleConverterS32) {
+		h->outSampleSize = sizeof(int32_t);
+		h->convert = toS32[kind];
+		h->interleave = channels == 2 ? sc_interleave_stereo<int32_t> : sc_interleave<int32_t>;
+		h->deinterleave = channels == 2 ? sc_deinterleave_stereo<int32_t> : sc_deinterleave<int32_t>;
+	}
+	else {
+		h->outSampleSize = sizeof(float);
+		h->convert = toFloat[kind];
+		h->interleave = channels == 2 ? sc_interleave_stereo<float> : sc_interleave<float>;
+		h->deinterleave = channels == 2 ? sc_deinterleave_stereo<float> : sc_deinterleave<float>;
+	}
+	// a single channel is laid out the same both ways
+	if (channels == 1)
+		h->inPlanar = h->outPlanar;
+	if (h->inPlanar != h->outPlanar && !h->sameFormat)
+		h->scratch = malloc(channels * SAMPLE_CONVERTER_BLOCK_FRAMES * h->outSampleSize);
+	return h;
+}
+
+void sample_converter_destroy(H_SAMPLE_CONVERTER h) {
+	if (h) {
+		free(h->scratch);
+		free(h);
+	}
+}
+
+int sample_converter_convert(H_SAMPLE_CONVERTER h, const uint8_t* const* in, void* const* out, int num_frames) {
+	int channels = h->channels;
+	if (h->inPlanar == h->outPlanar) {
+		// no layout change, the samples convert in one run per plane
+		if (h->inPlanar)
+			for (int c = 0; c < channels; ++c)
+				h->convert(in[c], out[c], num_frames);
+		else
+			h->convert(in[0], out[0], num_frames * channels);
+		return num_frames;
+	}
+	if (h->sameFormat) {
+		if (h->inPlanar)
+			h->interleave((const void* const*)in, out[0], channels, num_frames);
+		else
+			h->deinterleave(in[0], out, channels, num_frames);
+		return num_frames;
+	}
+	// Convert a block into the scratch, where the samples are contiguous
+	// like in the input, then change the layout.
+	uint8_t* scratch = (uint8_t*)h->scratch;
+	const void* scratchPlanes[SAMPLE_CONVERTER_MAX_CHANNELS];
+	void* outPlanes[SAMPLE_CONVERTER_MAX_CHANNELS];
+	for (int c = 0; c < channels; ++c)
+		scratchPlanes[c] = scratch + c * SAMPLE_CONVERTER_BLOCK_FRAMES * h->outSampleSize;
+	for (int offset = 0; offset < num_frames; offset += SAMPLE_CONVERTER_BLOCK_FRAMES) {
+		int frames = num_frames - offset < SAMPLE_CONVERTER_BLOCK_FRAMES ? num_frames - offset : SAMPLE_CONVERTER_BLOCK_FRAMES;
+		if (h->inPlanar) {
+			for (int c = 0; c < channels; ++c)
+				h->convert(in[c] + offset * h->inSampleSize, scratch + c * SAMPLE_CONVERTER_BLOCK_FRAMES * h->outSampleSize, frames);
+			h->interleave(scratchPlanes, (uint8_t*)out[0] + offset * channels * h->outSampleSize, channels, frames);
+		}
+		else {
+			h->convert(in[0] + offset * channels * h->inSampleSize, scratch, frames * channels);
+			for (int c = 0; c < channels; ++c)
+				outPlanes[c] = (uint8_t*)out[c] + offset * h->outSampleSize;
+			h->deinterleave(scratch, outPlanes, channels, frames);
+		}
+	}
+	return num_frames;
+}
+
+int sample_converter_get_output_sample_size(H_SAMPLE_CONVERTER h) {
+	return h->outSampleSize;
+}
+
+int sample_converter_get_num_channels(H_SAMPLE_CONVERTER h) {
+	return h->channels;
+}
+
+static inline uint32_t sc_xorshift32(uint32_t x) {
+	x ^= x << 13;
+	x ^= x >> 17;
+	return x ^ (x << 5);
+}
+
+void sample_dither_init(SampleDither* dither, uint32_t seed) {
+	// splitmix32 spreads the seed over the lanes, xorshift must not start at 0
+	for (int i = 0; i < 16; ++i) {
+		uint32_t z = (seed += 0x9e3779b9);
+		z = (z ^ (z >> 16)) * 0x85ebca6b;
+		z = (z ^ (z >> 13)) * 0xc2b2ae35;
+		z ^= z >> 16;
+		dither->state[i] = z ? z : 1;
+	}
+}
+
+void sample_convert_s16_to_float(const int16_t* in, float* out, int n) {
+	sc_s16_to_float(in, out, n);
+}
+
+void sample_convert_s24_to_float(const uint8_t* in, float* out, int n) {
+	int32_t block[SAMPLE_CONVERTER_BLOCK_FRAMES];
+	simd_float scale = simd_set1(1.0f / 8388608.0f);
+	for (int offset = 0; offset < n; offset += SAMPLE_CONVERTER_BLOCK_FRAMES) {
+		int count = n - offset < SAMPLE_CONVERTER_BLOCK_FRAMES ? n - offset : SAMPLE_CONVERTER_BLOCK_FRAMES;
+		// widened in the scratch, sign extended from the top byte
+		const uint8_t* src = in + 3 * offset;
+		for (int i = 0; i < count; ++i)
+			block[i] = (int32_t)((uint32_t)src[3 * i] << 8 | (uint32_t)src[3 * i + 1] << 16 | (uint32_t)src[3 * i + 2] << 24) >> 8;
+		float* dst = out + offset;
+		int i = 0;
+		for (; i + SIMD_WIDTH <= count; i += SIMD_WIDTH)
+			simd_store(dst + i, simd_mul(simd_load_s32(block + i), scale));
+		for (; i < count; ++i)
+			dst[i] = (float)block[i] * (1.0f / 8388608.0f);
+	}
+}
+
+void sample_convert_s32_to_float(const int32_t* in, float* out, int n) {
+	sc_s32_to_float(in, out, n);
+}
+
+void sample_convert_float_to_s16(const float* in, int16_t* out, int n, SampleDither* dither) {
+	if (dither == NULL) {
+		sc_float_to_s16(in, out, n);
+		return;
+	}
+	// The difference of two uniform draws is triangular in (-1, 1). They come
+	// from separate generators, which step in parallel.
+	simd_float scale = simd_set1(32768.0f);
+	simd_float low = simd_set1(-32768.0f);
+	simd_float high = simd_set1(32767.0f);
+	simd_uint a = simd_uint_load(dither->state);
+	simd_uint b = simd_uint_load(dither->state + 8);
+	int i = 0;
+	for (; i + SIMD_WIDTH <= n; i += SIMD_WIDTH) {
+		a = simd_xorshift(a);
+		b = simd_xorshift(b);
+		simd_float noise = simd_sub(simd_uniform(a), simd_uniform(b));
+		simd_float x = simd_add(simd_mul(simd_load(in + i), scale), noise);
+		simd_store_s16_rounded(out + i, simd_min(simd_max(x, low), high));
+	}
+	simd_uint_store(dither->state, a);
+	simd_uint_store(dither->state + 8, b);
+	// the rest draws from the first lanes, one at a time
+	for (int lane = 0; i < n; ++i, ++lane) {
+		uint32_t a = dither->state[lane] = sc_xorshift32(dither->state[lane]);
+		uint32_t b = dither->state[8 + lane] = sc_xorshift32(dither->state[8 + lane]);
+		float noise = (float)(a >> 9) * (1.0f / 8388608.0f) - (float)(b >> 9) * (1.0f / 8388608.0f);
+		float x = 32768.0f * in[i] + noise;
+		if (x < -32768.0f)
+			x = -32768.0f;
+		if (x > 32767.0f)
+			x = 32767.0f;
+		out[i] = (int16_t)lrintf(x);
+	}
+}
+
+void sample_convert_float_to_s32(const float* in, int32_t* out, int n) {
+	sc_float_to_s32(in, out, n);
+}
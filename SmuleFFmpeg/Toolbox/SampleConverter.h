@@ -0,0 +1,73 @@
+//
+//  SampleConverter.h
+//  SmuleFFmpeg
+//
+//  Converts decoded audio to float, 16 or 32 bit samples, planar or interleaved.
+//  The kernel for the stream is picked once, when the converter is created,
+//  and converts whole frames with the vector unit.
+//
+//  Integers scale by their full range (s16 / 32768, u8 is offset by 128),
+//  so 16 bit samples go through float and back unchanged. Floats convert to
+//  16 bit scaled by 32768, saturated and truncated toward zero, and to 32 bit
+//  scaled by 2^31.
+//
+//  The sample_convert_ functions are the same kernels for contiguous runs of
+//  samples, e.g. for WavFile. Floats to 16 bit can take TPDF dither instead:
+//  noise of +-1 LSB with a triangular distribution is added before rounding
+//  to nearest, so the rounding error is noise rather than distortion that
+//  follows the signal.
+//
+
+#ifndef SampleConverter_h
+#define SampleConverter_h
+
+#include <stdint.h>
+
+struct SampleConverter_t;
+
+typedef struct SampleConverter_t*		H_SAMPLE_CONVERTER;
+
+// State of the dither noise, two generators per vector lane.
+typedef struct {
+	uint32_t	state[16];
+} SampleDither;
+
+typedef enum {
+	SampleConverterFloat = 0,	// 32 bit float, -1 to 1
+	SampleConverterS16,			// 16 bit signed integer
+	SampleConverterS32			// 32 bit signed integer
+} SampleConverterFormat;
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+// in_format is an AVSampleFormat: u8, s16, s32, flt or dbl, planar or packed.
+// Returns NULL for any other format or more than 64 channels.
+H_SAMPLE_CONVERTER	sample_converter_init(int in_format, int channels, SampleConverterFormat out_format, int out_planar);
+void				sample_converter_destroy(H_SAMPLE_CONVERTER h);
+// Converts num_frames frames. in holds a plane per channel for a planar input
+// format and one plane otherwise, like AVFrame::extended_data. out holds a
+// plane per channel if out_planar, one plane otherwise. Returns num_frames.
+int					sample_converter_convert(H_SAMPLE_CONVERTER h, const uint8_t* const* in, void* const* out, int num_frames);
+// bytes of one output sample of one channel
+int					sample_converter_get_output_sample_size(H_SAMPLE_CONVERTER h);
+int					sample_converter_get_num_channels(H_SAMPLE_CONVERTER h);
+
+// Seeds the noise. The same seed gives the same noise, on the same CPU.
+void				sample_dither_init(SampleDither* dither, uint32_t seed);
+
+// n samples from in to out, which must not overlap.
+void				sample_convert_s16_to_float(const int16_t* in, float* out, int n);
+// 24 bit little endian samples, 3 bytes each
+void				sample_convert_s24_to_float(const uint8_t* in, float* out, int n);
+void				sample_convert_s32_to_float(const int32_t* in, float* out, int n);
+// dither may be NULL to truncate, like the converter does
+void				sample_convert_float_to_s16(const float* in, int16_t* out, int n, SampleDither* dither);
+void				sample_convert_float_to_s32(const float* in, int32_t* out, int n);
+
+#ifdef __cplusplus
+}
+#endif //__cplusplus
+
+#endif /* SampleConverter_h */
@@ -0,0 +1,144 @@
+//
+//  SpscQueue.hpp
+//  SmuleFFmpeg
+//
+//  Bounded lock-free queue between one producer thread and one consumer
+//  thread, e.g. two stages of a decoding pipeline.
+//
+//  Pushing and popping are a load and a store on a ring of slots. A thread
+//  that finds the queue full (or empty) spins for a short while and then
+//  sleeps until the other side moves, so a stage waiting for a slow one does
+//  not burn a core.
+//
+//  Either side can close the queue. After that push() fails, and pop() fails
+//  once the queue is empty, which is how a stage tells its neighbours that
+//  the stream ended or that it gave up.
+//
+
+#ifndef SpscQueue_hpp
+#define SpscQueue_hpp
+
+#include <stddef.h>
+#include <atomic>
+#include <mutex>
+#include <condition_variable>
+#include <thread>
+#include <vector>
+
+template <class T>
+class SpscQueue {
+public:
+	// capacity is rounded up to a power of two
+	explicit SpscQueue(size_t capacity) : head(0), tail(0), closed(false), sleepers(0) {
+		size_t size = 2;
+		while (size < capacity)
+			size <<= 1;
+		slots.resize(size);
+		mask = size - 1;
+	}
+	SpscQueue(const SpscQueue&) = delete;
+	SpscQueue& operator=(const SpscQueue&) = delete;
+
+	// Producer: false if the queue is full.
+	bool tryPush(const T& value) {
+		if (!put(value))
+			return false;
+		wake();
+		return true;
+	}
+
+	// Consumer: false if the queue is empty.
+	bool tryPop(T& value) {
+		if (!take(value))
+			return false;
+		wake();
+		return true;
+	}
+
+	// Producer: waits for a free slot. false if the queue is closed.
+	bool push(const T& value) {
+		bool pushed = false;
+		wait([&]() {return closed.load(std::memory_order_acquire) || (pushed = put(value));});
+		if (pushed)
+			wake();
+		return pushed;
+	}
+
+	// Consumer: waits for a value. false if the queue is closed and empty.
+	bool pop(T& value) {
+		bool popped = false;
+		wait([&]() {return (popped = take(value)) || closed.load(std::memory_order_acquire);});
+		// values pushed before the close are still delivered
+		if (!popped && !take(value))
+			return false;
+		wake();
+		return true;
+	}
+
+	// Either side: no more values go in, waiting threads return.
+	void close() {
+		closed.store(true, std::memory_order_release);
+		std::lock_guard<std::mutex> lock(mutex);
+		wakeup.notify_all();
+	}
+
+	bool isClosed() const {
+		return closed.load(std::memory_order_acquire);
+	}
+
+private:
+	enum {SPIN_COUNT = 64};
+
+	bool put(const T& value) {
+		size_t t = tail.load(std::memory_order_relaxed);
+		if (t - head.load(std::memory_order_acquire) > mask)
+			return false;
+		slots[t & mask] = value;
+		tail.store(t + 1, std::memory_order_release);
+		return true;
+	}
+
+	bool take(T& value) {
+		size_t h = head.load(std::memory_order_relaxed);
+		if (h == tail.load(std::memory_order_acquire))
+			return false;
+		value = slots[h & mask];
+		head.store(h + 1, std::memory_order_release);
+		return true;
+	}
+
+	template <class Ready>
+	void wait(Ready ready) {
+		for (int i = 0; i < SPIN_COUNT; ++i) {
+			if (ready())
+				return;
+			std::this_thread::yield();
+		}
+		std::unique_lock<std::mutex> lock(mutex);
+		sleepers.fetch_add(1, std::memory_order_relaxed);
+		// checked again after announcing the sleep, so a wake() in between is not lost
+		std::atomic_thread_fence(std::memory_order_seq_cst);
+		while (!ready())
+			wakeup.wait(lock);
+		sleepers.fetch_sub(1, std::memory_order_relaxed);
+	}
+
+	void wake() {
+		std::atomic_thread_fence(std::memory_order_seq_cst);
+		if (sleepers.load(std::memory_order_relaxed) > 0) {
+			std::lock_guard<std::mutex> lock(mutex);
+			wakeup.notify_all();
+		}
+	}
+
+	std::vector<T>				slots;
+	size_t						mask;
+	std::atomic<size_t>			head;		// next slot to pop, written by the consumer
+	std::atomic<size_t>			tail;		// next slot to push, written by the producer
+	std::atomic<bool>			closed;
+	std::atomic<int>			sleepers;
+	std::mutex					mutex;
+	std::condition_variable		wakeup;
+};
+
+#endif /* SpscQueue_hpp */
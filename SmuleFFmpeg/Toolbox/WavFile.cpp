@@ -46,12 +46,22 @@
 ////////////////////////////////////////////////////////////////////////////////
 
 #include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
 #include <stdexcept>
 #include <string>
+#include <vector>
+#include <thread>
+#include <atomic>
 #include <assert.h>
 #include <limits.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
 
 #include "WavFile.h"
+#include "SpscQueue.hpp"
 
 using namespace std;
 
@@ -59,6 +69,25 @@ const static char riffStr[] = "RIFF";
 const static char waveStr[] = "WAVE";
 const static char fmtStr[]  = "fmt ";
 const static char dataStr[] = "data";
+const static char rf64Str[] = "RF64";
+const static char bw64Str[] = "BW64";
+const static char ds64Str[] = "ds64";
+const static char junkStr[] = "JUNK";
+
+/// WAV format tags
+#define WAV_FORMAT_PCM          1
+#define WAV_FORMAT_IEEE_FLOAT   3
+#define WAV_FORMAT_EXTENSIBLE   0xFFFE
+
+/// Length of a 'fmt ' chunk with the WAVE_FORMAT_EXTENSIBLE fields
+#define WAV_FORMAT_EXTENSIBLE_LEN   40
+
+/// Length of a 'ds64' chunk without a table, which WavOutFile reserves
+#define WAV_DS64_LEN            28
+
+/// The sub format GUID of WAVE_FORMAT_EXTENSIBLE after its first two bytes, which
+/// hold the format tag
+const static unsigned char subFormatGuid[14] = {0x00, 0x00, 0x00, 0x00, 0x10, 0x00, 0x80, 0x00, 0x00, 0xAA, 0x00, 0x38, 0x9B, 0x71};
 
 
 //////////////////////////////////////////////////////////////////////////////
@@ -108,6 +137,17 @@ const static char dataStr[] = "data";
         }
     }
 
+    // helper-function to swap byte-order of buffer of 32bit integers
+    static inline void _swap32Buffer(unsigned int *pData, unsigned int dwNumWords)
+    {
+        unsigned long i;
+
+        for (i = 0; i < dwNumWords; i ++)
+        {
+            _swap32(pData[i]);
+        }
+    }
+
 #else   // BIG_ENDIAN
     // little-endian CPU, WAV file is ok as such
 
@@ -129,27 +169,89 @@ const static char dataStr[] = "data";
         // do nothing
     }
 
+    // dummy helper-function
+    static inline void _swap32Buffer(unsigned int *pData, unsigned int dwNumWords)
+    {
+        // do nothing
+    }
+
 #endif  // BIG_ENDIAN
 
 
+// Little-endian header fields, whatever the CPU
+
+static inline uint readLE16(const unsigned char *p)
+{
+    return p[0] | p[1] << 8;
+}
+
+static inline uint readLE32(const unsigned char *p)
+{
+    return p[0] | p[1] << 8 | p[2] << 16 | (uint)p[3] << 24;
+}
+
+static inline uint64_t readLE64(const unsigned char *p)
+{
+    return readLE32(p) | (uint64_t)readLE32(p + 4) << 32;
+}
+
+static inline void writeLE16(unsigned char *p, uint value)
+{
+    p[0] = (unsigned char)value;
+    p[1] = (unsigned char)(value >> 8);
+}
+
+static inline void writeLE32(unsigned char *p, uint value)
+{
+    writeLE16(p, value);
+    writeLE16(p + 2, value >> 16);
+}
+
+static inline void writeLE64(unsigned char *p, uint64_t value)
+{
+    writeLE32(p, (uint)value);
+    writeLE32(p + 4, (uint)(value >> 32));
+}
+
+
 //////////////////////////////////////////////////////////////////////////////
 //
 // Class WavInFile
 //
 WavInFile::WavInFile() {
 	fptr = NULL;
+    mapData = NULL;
+    mapSize = 0;
+    mapSamples = NULL;
+    mapReleased = 0;
     dataRead = 0;
+    dataLen = 0;
+    rf64DataLen = 0;
+    channelMask = 0;
+    scratch = NULL;
+    scratchSize = 0;
 }
 
 WavInFile::WavInFile(const char *fileName)
 {
 	fptr = NULL;
+    mapData = NULL;
+    mapSize = 0;
+    mapSamples = NULL;
+    mapReleased = 0;
+    dataRead = 0;
+    dataLen = 0;
+    rf64DataLen = 0;
+    channelMask = 0;
+    scratch = NULL;
+    scratchSize = 0;
 	open(fileName);
 }
 
 WavInFile::~WavInFile()
 {
     close();
+    delete[] scratch;
 }
 
 void WavInFile::open(const char *fileName) {
@@ -180,7 +282,7 @@ void WavInFile::open(const char *fileName) {
         throw runtime_error(msg);
     }
 
-    if (header.format.fixed != 1)
+    if (checkEncoding() != 0)
     {
         string msg = "File \"";
         msg += fileName;
@@ -189,16 +291,103 @@ void WavInFile::open(const char *fileName) {
     }
 
     dataRead = 0;
+    reserve(WAV_IN_SCRATCH_ELEMS);
+}
+
+void WavInFile::openMapped(const char *fileName)
+{
+    int fd;
+    struct stat st;
+    void *map = MAP_FAILED;
+
+    if (isOpen())
+        close();
+
+#ifdef _BIG_ENDIAN_
+    // the samples are used as they are in the file
+    open(fileName);
+    return;
+#endif
+    fd = ::open(fileName, O_RDONLY);
+    if (fd >= 0)
+    {
+        if (fstat(fd, &st) == 0 && S_ISREG(st.st_mode) && st.st_size > 0)
+        {
+            map = mmap(NULL, (size_t)st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+        }
+        ::close(fd);
+    }
+    if (map == MAP_FAILED)
+    {
+        // e.g. a pipe, read as a stream
+        open(fileName);
+        return;
+    }
+    mapData = (const char *)map;
+    mapSize = (size_t)st.st_size;
+
+    if (parseMappedHeaders() != 0)
+    {
+        close();
+        string msg = "File \"";
+        msg += fileName;
+        msg += "\" is corrupt or not a WAV file";
+        throw runtime_error(msg);
+    }
+    if (checkEncoding() != 0)
+    {
+        close();
+        string msg = "File \"";
+        msg += fileName;
+        msg += "\" uses unsupported encoding.";
+        throw runtime_error(msg);
+    }
+    // the samples are read front to back
+    madvise(map, mapSize, MADV_SEQUENTIAL);
+    dataRead = 0;
+    mapReleased = 0;
 }
 
 int WavInFile::isOpen() {
-	return fptr != NULL;
+	return fptr != NULL || mapData != NULL;
+}
+
+int WavInFile::isMapped() const
+{
+    return mapData != NULL;
+}
+
+int WavInFile::isFloat() const
+{
+    return header.format.fixed == WAV_FORMAT_IEEE_FLOAT;
+}
+
+int WavInFile::isRF64() const
+{
+    return memcmp(rf64Str, header.riff.riff_char, 4) == 0 || memcmp(bw64Str, header.riff.riff_char, 4) == 0;
+}
+
+int WavInFile::checkEncoding() const
+{
+    int bits = header.format.bits_per_sample;
+
+    // every sample takes bits / 8 bytes
+    if (bits % 8 != 0 || header.format.byte_per_sample != header.format.channel_number * bits / 8) return -1;
+    if (header.format.fixed == WAV_FORMAT_PCM && (bits == 8 || bits == 16 || bits == 24 || bits == 32)) return 0;
+    if (header.format.fixed == WAV_FORMAT_IEEE_FLOAT && bits == 32) return 0;
+    return -1;
 }
 
 void WavInFile::rewind()
 {
     int hdrsOk;
 
+    if (mapData)
+    {
+        dataRead = 0;
+        mapReleased = 0;
+        return;
+    }
     fseek(fptr, 0, SEEK_SET);
     hdrsOk = readWavHeaders();
     assert(hdrsOk == 0);
@@ -217,10 +406,27 @@ int WavInFile::checkCharTags()
 }
 
 
+int WavInFile::readRaw(char *buffer, int maxElems, int sampleSize)
+{
+    uint64_t numElems;
+    size_t numBytes;
+
+    // Don't read more samples than are marked available in header
+    numElems = (dataLen - dataRead) / sampleSize;
+    if (maxElems < 0) maxElems = 0;
+    if (numElems > (uint64_t)maxElems) numElems = maxElems;
+
+    numBytes = fread(buffer, 1, (size_t)numElems * sampleSize, fptr);
+    dataRead += numBytes;
+    // a sample cut short at the end of the file is dropped
+    return (int)(numBytes / sampleSize);
+}
+
+
 int WavInFile::read(char *buffer, int maxElems)
 {
-    int numBytes;
-    uint afterDataRead;
+    const char *span;
+    int numElems;
 
     // ensure it's 8 bit format
     if (header.format.bits_per_sample != 8)
@@ -229,61 +435,56 @@ int WavInFile::read(char *buffer, int maxElems)
     }
     assert(sizeof(char) == 1);
 
-    numBytes = maxElems;
-    afterDataRead = dataRead + numBytes;
-    if (afterDataRead > header.data.data_len) 
+    if (mapData)
     {
-        // Don't read more samples than are marked available in header
-        numBytes = header.data.data_len - dataRead;
-        assert(numBytes >= 0);
+        numElems = takeSpan(span, maxElems, 1);
+        memcpy(buffer, span, numElems);
+        return numElems;
     }
-
-    numBytes = fread(buffer, 1, numBytes, fptr);
-    dataRead += numBytes;
-
-    return numBytes;
+    return readRaw(buffer, maxElems, 1);
 }
 
 
 int WavInFile::read(short *buffer, int maxElems)
 {
-    unsigned int afterDataRead;
-    int numBytes;
+    const char *span;
     int numElems;
+    int i;
 
-    if (header.format.bits_per_sample == 8)
+    if (isFloat() || (header.format.bits_per_sample != 8 && header.format.bits_per_sample != 16))
     {
-        // 8 bit format
-        char *temp = new char[maxElems];
-        int i;
+        throw runtime_error("Error: WavInFile::read(short*, int) works only with 8 and 16 bit samples.");
+    }
 
-        numElems = read(temp, maxElems);
-        // convert from 8 to 16 bit
+    if (header.format.bits_per_sample == 8)
+    {
+        if (mapData)
+        {
+            numElems = takeSpan(span, maxElems, 1);
+        }
+        else
+        {
+            char *temp = getScratch(maxElems);
+            numElems = readRaw(temp, maxElems, 1);
+            span = temp;
+        }
+        // convert from 8 to 16 bit, 8 bit samples are unsigned
         for (i = 0; i < numElems; i ++)
         {
-            buffer[i] = temp[i] << 8;
+            buffer[i] = (short)(((int)(unsigned char)span[i] - 128) * 256);
         }
-        delete[] temp;
+    }
+    else if (mapData)
+    {
+        numElems = takeSpan(span, maxElems, 2);
+        memcpy(buffer, span, numElems * 2);
     }
     else
     {
         // 16 bit format
-        assert(header.format.bits_per_sample == 16);
         assert(sizeof(short) == 2);
 
-        numBytes = maxElems * 2;
-        afterDataRead = dataRead + numBytes;
-        if (afterDataRead > header.data.data_len) 
-        {
-            // Don't read more samples than are marked available in header
-            numBytes = header.data.data_len - dataRead;
-            assert(numBytes >= 0);
-        }
-
-        numBytes = fread(buffer, 1, numBytes, fptr);
-        dataRead += numBytes;
-        numElems = numBytes / 2;
-
+        numElems = readRaw((char *)buffer, maxElems, 2);
         // 16bit samples, swap byte order if necessary
         _swap16Buffer((unsigned short *)buffer, numElems);
     }
@@ -295,37 +496,171 @@ int WavInFile::read(short *buffer, int maxElems)
 
 int WavInFile::read(float *buffer, int maxElems)
 {
-    short *temp = new short[maxElems];
+    const char *span;
+    int sampleSize = header.format.bits_per_sample / 8;
     int num;
     int i;
-    double fscale;
 
-    num = read(temp, maxElems);
+    if (mapData)
+    {
+        // converted straight from the mapping
+        num = takeSpan(span, maxElems, sampleSize);
+    }
+    else
+    {
+        char *temp = getScratch(maxElems * sampleSize);
+        num = readRaw(temp, maxElems, sampleSize);
+        // swap byte order in the scratch if necessary, 24 bit converts from bytes
+        if (sampleSize == 2) _swap16Buffer((unsigned short *)temp, num);
+        if (sampleSize == 4) _swap32Buffer((unsigned int *)temp, num);
+        span = temp;
+    }
 
-    fscale = 1.0 / 32768.0;
+    if (isFloat())
+    {
+        memcpy(buffer, span, num * sizeof(float));
+        return num;
+    }
     // convert to floats, scale to range [-1..+1[
-    for (i = 0; i < num; i ++)
+    switch (sampleSize)
     {
-        buffer[i] = (float)(fscale * (double)temp[i]);
+        case 1:
+            for (i = 0; i < num; i ++)
+            {
+                buffer[i] = (float)((int)(unsigned char)span[i] - 128) * (1.0f / 128.0f);
+            }
+            break;
+        case 2:
+            // the data chunk starts on an even offset
+            sample_convert_s16_to_float((const int16_t *)span, buffer, num);
+            break;
+        case 3:
+            sample_convert_s24_to_float((const uint8_t *)span, buffer, num);
+            break;
+        default:
+            if (((size_t)span & 3) == 0)
+            {
+                sample_convert_s32_to_float((const int32_t *)span, buffer, num);
+                break;
+            }
+            // after an odd sized chunk, aligned a block at a time
+            for (i = 0; i < num; i += 256)
+            {
+                int32_t block[256];
+                int count = num - i < 256 ? num - i : 256;
+                memcpy(block, span + 4 * i, count * 4);
+                sample_convert_s32_to_float(block, buffer + i, count);
+            }
+            break;
     }
+    return num;
+}
+
+
+char *WavInFile::getScratch(int bytes)
+{
+    if (bytes > scratchSize)
+    {
+        delete[] scratch;
+        scratch = new char[bytes];
+        scratchSize = bytes;
+    }
+    return scratch;
+}
 
-    delete[] temp;
 
+void WavInFile::reserve(int maxElems)
+{
+    // 32 bit samples read for float are the largest
+    getScratch(maxElems * 4);
+}
+
+
+int WavInFile::readSpan(const short *&span, int maxElems)
+{
+    const char *p;
+    int num;
+
+    if (mapData == NULL || isFloat() || header.format.bits_per_sample != 16)
+    {
+        throw runtime_error("Error: WavInFile::readSpan(const short*&, int) works only with mapped 16bit files.");
+    }
+    num = takeSpan(p, maxElems, 2);
+    span = (const short *)p;
     return num;
 }
 
 
+int WavInFile::readSpan(const float *&span, int maxElems)
+{
+    const char *p;
+    int num;
+
+    // the data chunk starts on an even offset, floats need a multiple of 4
+    if (mapData == NULL || !isFloat() || ((size_t)(mapSamples - mapData) & 3) != 0)
+    {
+        throw runtime_error("Error: WavInFile::readSpan(const float*&, int) works only with mapped, aligned float files.");
+    }
+    num = takeSpan(p, maxElems, 4);
+    span = (const float *)p;
+    return num;
+}
+
+
+int WavInFile::takeSpan(const char *&span, int maxElems, int sampleSize)
+{
+    uint64_t numElems;
+
+    numElems = (dataLen - dataRead) / sampleSize;
+    if (maxElems < 0) maxElems = 0;
+    if (numElems > (uint64_t)maxElems) numElems = maxElems;
+    span = mapSamples + dataRead;
+    dataRead += numElems * sampleSize;
+    if (dataRead - mapReleased >= WAV_IN_RELEASE_BYTES)
+    {
+        releaseMappedPages();
+    }
+    return (int)numElems;
+}
+
+
+void WavInFile::releaseMappedPages()
+{
+    static const size_t pageSize = (size_t)sysconf(_SC_PAGESIZE);
+    size_t offset = (size_t)(mapSamples - mapData) + dataRead;
+
+    // whole pages before the read position; they are read in again if touched,
+    // so spans handed out stay valid
+    offset -= offset % pageSize;
+    if (offset > 0)
+    {
+        madvise((void *)mapData, offset, MADV_DONTNEED);
+    }
+    mapReleased = dataRead;
+}
+
+
 int WavInFile::eof() const
 {
     // return true if all data has been read or file eof has reached
-    return (dataRead == header.data.data_len || feof(fptr));
+    return (dataRead == dataLen || (fptr && feof(fptr)));
 }
 
 
 void WavInFile::close()
 {
-    fclose(fptr);
-    fptr = NULL;
+    if (fptr)
+    {
+        fclose(fptr);
+        fptr = NULL;
+    }
+    if (mapData)
+    {
+        munmap((void *)mapData, mapSize);
+        mapData = NULL;
+        mapSamples = NULL;
+        mapSize = 0;
+    }
 }
 
 
@@ -356,13 +691,19 @@ static int isAlphaStr(char *str)
 
 int WavInFile::readRIFFBlock()
 {
-    fread(&(header.riff), sizeof(WavRiff), 1, fptr);
+    if (fread(&(header.riff), sizeof(WavRiff), 1, fptr) != 1) return -1;
+    return checkRIFFBlock();
+}
+
 
+int WavInFile::checkRIFFBlock()
+{
     // swap 32bit data byte order if necessary
     _swap32((unsigned int &)header.riff.package_len);
 
-    // header.riff.riff_char should equal to 'RIFF');
-    if (memcmp(riffStr, header.riff.riff_char, 4) != 0) return -1;
+    // header.riff.riff_char should equal to 'RIFF', or 'RF64' for a file with
+    // 64 bit sizes in a 'ds64' block
+    if (memcmp(riffStr, header.riff.riff_char, 4) != 0 && !isRF64()) return -1;
     // header.riff.wave should equal to 'WAVE'
     if (memcmp(waveStr, header.riff.wave, 4) != 0) return -1;
 
@@ -370,88 +711,120 @@ int WavInFile::readRIFFBlock()
 }
 
 
-
-
 int WavInFile::readHeaderBlock()
 {
+    unsigned char chunk[8];
+    unsigned char body[WAV_FORMAT_EXTENSIBLE_LEN];
     char label[5];
-    string sLabel;
+    uint len;
+    uint n;
 
-    // lead label string
-    fread(label, 1, 4, fptr);
+    // lead label string and the length of the block
+    if (fread(chunk, 1, 8, fptr) != 8) return -1;
+    memcpy(label, chunk, 4);
     label[4] = 0;
+    len = readLE32(chunk + 4);
 
     if (isAlphaStr(label) == 0) return -1;    // not a valid label
 
-    // Decode blocks according to their label
-    if (strcmp(label, fmtStr) == 0)
+    if (strcmp(label, dataStr) == 0)
     {
-        int nLen, nDump;
-
-        // 'fmt ' block 
-        memcpy(header.format.fmt, fmtStr, 4);
+        // 'data' block
+        memcpy(header.data.data_field, dataStr, 4);
+        header.data.data_len = len;
+        dataLen = (len == 0xFFFFFFFF && isRF64()) ? rf64DataLen : len;
+        return 1;
+    }
 
-        // read length of the format field
-        fread(&nLen, sizeof(int), 1, fptr);
-        // swap byte order if necessary
-        _swap32((unsigned int &)nLen); // int format_len;
-        header.format.format_len = nLen;
+    // read the fields of the blocks we know, skip the rest padded to an even length
+    n = 0;
+    if (strcmp(label, fmtStr) == 0 || strcmp(label, ds64Str) == 0)
+    {
+        n = len < sizeof(body) ? len : (uint)sizeof(body);
+        if (fread(body, 1, n, fptr) != n) return -1;
+        if (parseBlock(label, body, n) != 0) return -1;
+    }
+    if (fseek(fptr, (long)(len - n) + (len & 1), SEEK_CUR) != 0) return -1;
+    return 0;
+}
 
-        // calculate how much length differs from expected
-        nDump = nLen - (sizeof(header.format) - 8);
 
-        // if format_len is larger than expected, read only as much data as we've space for
-        if (nDump > 0)
+int WavInFile::parseBlock(const char *label, const unsigned char *body, uint len)
+{
+    if (memcmp(label, ds64Str, 4) == 0)
+    {
+        // 64 bit sizes of the RIFF and the 'data' block, then ones we don't need
+        if (len < 16) return -1;
+        rf64DataLen = readLE64(body + 8);
+        return 0;
+    }
+    if (memcmp(label, fmtStr, 4) != 0) return 0;
+
+    // 'fmt ' block
+    if (len < 16) return -1;
+    memcpy(header.format.fmt, fmtStr, 4);
+    header.format.format_len = len;
+    header.format.fixed = (short)readLE16(body);
+    header.format.channel_number = (short)readLE16(body + 2);
+    header.format.sample_rate = (int)readLE32(body + 4);
+    header.format.byte_rate = (int)readLE32(body + 8);
+    header.format.byte_per_sample = (short)readLE16(body + 12);
+    header.format.bits_per_sample = (short)readLE16(body + 14);
+    channelMask = 0;
+
+    if ((unsigned short)header.format.fixed == WAV_FORMAT_EXTENSIBLE)
+    {
+        // the speaker positions, and the real format tag at the start of the sub
+        // format GUID; bits_per_sample is the container, valid bits are left aligned
+        if (len < WAV_FORMAT_EXTENSIBLE_LEN || readLE16(body + 16) < 22) return -1;
+        channelMask = readLE32(body + 20);
+        if (memcmp(body + 26, subFormatGuid, sizeof(subFormatGuid)) == 0)
         {
-            nLen = sizeof(header.format) - 8;
+            header.format.fixed = (short)readLE16(body + 24);
         }
+    }
+    return 0;
+}
 
-        // read data
-        fread(&(header.format.fixed), nLen, 1, fptr);
-
-        // swap byte order if necessary
-        _swap16((unsigned short &)header.format.fixed);            // short int fixed;
-        _swap16((unsigned short &)header.format.channel_number);   // short int channel_number;
-        _swap32((unsigned int   &)header.format.sample_rate);      // int sample_rate;
-        _swap32((unsigned int   &)header.format.byte_rate);        // int byte_rate;
-        _swap16((unsigned short &)header.format.byte_per_sample);  // short int byte_per_sample;
-        _swap16((unsigned short &)header.format.bits_per_sample);  // short int bits_per_sample;
 
-        // if format_len is larger than expected, skip the extra data
-        if (nDump > 0)
-        {
-            fseek(fptr, nDump, SEEK_CUR);
-        }
+int WavInFile::parseMappedHeaders()
+{
+    size_t pos;
+    uint len;
 
-        return 0;
-    }
-    else if (strcmp(label, dataStr) == 0)
-    {
-        // 'data' block
-        memcpy(header.data.data_field, dataStr, 4);
-        fread(&(header.data.data_len), sizeof(uint), 1, fptr);
+    memset(&header, 0, sizeof(header));
+    dataLen = 0;
+    rf64DataLen = 0;
+    channelMask = 0;
+    if (mapSize < sizeof(WavRiff)) return 1;
 
-        // swap byte order if necessary
-        _swap32((unsigned int &)header.data.data_len);
+    memcpy(&header.riff, mapData, sizeof(WavRiff));
+    if (checkRIFFBlock() != 0) return 1;
 
-        return 1;
-    }
-    else
+    // walk the chunks, each a label and a length, padded to an even length
+    pos = sizeof(WavRiff);
+    while (pos + 8 <= mapSize)
     {
-        uint len, i;
-        uint temp;
-        // unknown block
+        const char *chunk = mapData + pos;
+        size_t body = pos + 8;
 
-        // read length
-        fread(&len, sizeof(len), 1, fptr);
-        // scan through the block
-        for (i = 0; i < len; i ++)
+        len = readLE32((const unsigned char *)chunk + 4);
+        if (memcmp(chunk, dataStr, 4) == 0)
         {
-            fread(&temp, 1, 1, fptr);
-            if (feof(fptr)) return -1;   // unexpected eof
+            memcpy(header.data.data_field, dataStr, 4);
+            header.data.data_len = len;
+            dataLen = (len == 0xFFFFFFFF && isRF64()) ? rf64DataLen : len;
+            // a file cut short is read as far as it goes
+            if (dataLen > mapSize - body) dataLen = mapSize - body;
+            mapSamples = mapData + body;
+            if (header.format.byte_per_sample <= 0) return 1;
+            return checkCharTags();
         }
+        if (len > mapSize - body) return 1;
+        if (parseBlock(chunk, (const unsigned char *)mapData + body, len < WAV_FORMAT_EXTENSIBLE_LEN ? len : WAV_FORMAT_EXTENSIBLE_LEN) != 0) return 1;
+        pos = body + len + (len & 1);
     }
-    return 0;
+    return 1;
 }
 
 
@@ -460,6 +833,9 @@ int WavInFile::readWavHeaders()
     int res;
 
     memset(&header, 0, sizeof(header));
+    dataLen = 0;
+    rf64DataLen = 0;
+    channelMask = 0;
 
     res = readRIFFBlock();
     if (res) return 1;
@@ -470,6 +846,7 @@ int WavInFile::readWavHeaders()
         res = readHeaderBlock();
         if (res < 0) return 1;  // error in file structure
     } while (res == 0);
+    if (header.format.byte_per_sample <= 0) return 1;
     // check that all required tags are legal
     return checkCharTags();
 }
@@ -500,28 +877,33 @@ uint WavInFile::getSampleRate() const
 
 
 
-uint WavInFile::getDataSizeInBytes() const
+uint64_t WavInFile::getDataSizeInBytes() const
 {
-    return header.data.data_len;
+    return dataLen;
 }
 
 
-uint WavInFile::getNumSamples() const
+uint64_t WavInFile::getNumSamples() const
 {
-    return header.data.data_len / header.format.byte_per_sample;
+    return dataLen / header.format.byte_per_sample;
+}
+
+
+uint WavInFile::getChannelMask() const
+{
+    return channelMask;
 }
 
 
 uint WavInFile::getLengthMS() const
 {
-   uint numSamples;
+   uint64_t numSamples;
    uint sampleRate;
 
    numSamples = getNumSamples();
    sampleRate = getSampleRate();
 
-   assert(numSamples < UINT_MAX / 1000);
-   return (1000 * numSamples / sampleRate);
+   return (uint)(1000 * numSamples / sampleRate);
 }
 
 
@@ -530,9 +912,62 @@ uint WavInFile::getLengthMS() const
 // Class WavOutFile
 //
 
-WavOutFile::WavOutFile(const char *fileName, int sampleRate, int bits, int channels)
+/// Staged bytes handed to the writer thread.
+struct WavOutBlock
+{
+    char *data;
+    int bytes;
+};
+
+struct WavOutAsync
+{
+    /// Blocks to write, and blocks written that can be staged into again.
+    SpscQueue<WavOutBlock> filled;
+    SpscQueue<char *> empty;
+
+    /// All blocks of the ring, the first one being the staging buffer of the file.
+    vector<char *> blocks;
+
+    thread writer;
+
+    /// Set by the writer thread when a write fails.
+    atomic<bool> failed;
+
+    /// Blocks handed to the writer thread, and blocks it has written.
+    int handed;
+    atomic<int> written;
+
+    atomic<int> highWater;
+    atomic<int> stalls;
+
+    WavOutAsync(int numBlocks) : filled(numBlocks), empty(numBlocks), failed(false), handed(0), written(0), highWater(0), stalls(0) {}
+};
+
+
+/// Allocates a staging block aligned to a page, so the writes from it are too.
+static char *allocBlock()
+{
+    void *block = NULL;
+    if (posix_memalign(&block, 4096, WAV_OUT_STAGING_BYTES) != 0)
+    {
+        throw bad_alloc();
+    }
+    return (char *)block;
+}
+
+
+WavOutFile::WavOutFile(const char *fileName, int sampleRate, int bits, int channels, bool isFloat, uint channelMask)
 {
     bytesWritten = 0;
+    stagingUsed = 0;
+    staging = NULL;
+    async = NULL;
+    dither = true;
+    sample_dither_init(&ditherState, 0);
+    if ((bits != 8 && bits != 16 && bits != 24 && bits != 32) || (isFloat && bits != 32))
+    {
+        throw runtime_error("Error : Unsupported sample format for writing a wav file.");
+    }
     fptr = fopen(fileName, "wb");
     if (fptr == NULL) 
     {
@@ -543,20 +978,41 @@ WavOutFile::WavOutFile(const char *fileName, int sampleRate, int bits, int chann
         throw runtime_error(msg);
     }
 
-    fillInHeader(sampleRate, bits, channels);
+    fillInHeader(sampleRate, bits, channels, isFloat, channelMask);
     writeHeader();
+    stagingLimit = WAV_OUT_STAGING_BYTES - (int)ftell(fptr);
+    staging = allocBlock();
 }
 
 
 
 WavOutFile::~WavOutFile()
 {
-    close();
+    // a destructor can't throw, call close() to know if the file was written
+    try
+    {
+        close();
+    }
+    catch (const exception &)
+    {
+    }
+    if (async)
+    {
+        for (size_t i = 0; i < async->blocks.size(); ++i)
+        {
+            free(async->blocks[i]);
+        }
+        delete async;
+    }
+    else
+    {
+        free(staging);
+    }
 }
 
 
 
-void WavOutFile::fillInHeader(uint sampleRate, uint bits, uint channels)
+void WavOutFile::fillInHeader(uint sampleRate, uint bits, uint channels, bool isFloat, uint channelMask)
 {
     // fill in the 'riff' part..
 
@@ -573,8 +1029,11 @@ void WavOutFile::fillInHeader(uint sampleRate, uint bits, uint channels)
     // copy string 'fmt ' to fmt
     memcpy(&(header.format.fmt), fmtStr, 4);
 
-    header.format.format_len = 0x10;
-    header.format.fixed = 1;
+    // more than stereo, or speaker positions, need WAVE_FORMAT_EXTENSIBLE
+    this->channelMask = channelMask;
+    header.format.format_len = (channels > 2 || channelMask != 0) ? WAV_FORMAT_EXTENSIBLE_LEN : 0x10;
+    // 1 = PCM, 3 = IEEE float
+    header.format.fixed = isFloat ? 3 : 1;
     header.format.channel_number = (short)channels;
     header.format.sample_rate = sampleRate;
     header.format.bits_per_sample = (short)bits;
@@ -593,10 +1052,11 @@ void WavOutFile::fillInHeader(uint sampleRate, uint bits, uint channels)
 
 void WavOutFile::finishHeader()
 {
-    // supplement the file length into the header structure
-    header.riff.package_len = bytesWritten + 36;
-    header.data.data_len = bytesWritten;
-
+    // the data block is padded to an even length
+    if (bytesWritten & 1)
+    {
+        fputc(0, fptr);
+    }
     writeHeader();
 }
 
@@ -604,23 +1064,61 @@ void WavOutFile::finishHeader()
 
 void WavOutFile::writeHeader()
 {
-    WavHeader hdrTemp;
+    unsigned char hdr[12 + 8 + WAV_DS64_LEN + 8 + WAV_FORMAT_EXTENSIBLE_LEN + 8];
+    unsigned char *p = hdr;
+    uint formatLen = header.format.format_len;
+    uint64_t riffLen = sizeof(hdr) - WAV_FORMAT_EXTENSIBLE_LEN + formatLen - 8 + bytesWritten + (bytesWritten & 1);
+    // sizes beyond 32 bits go to the 'ds64' block of an RF64 file
+    bool rf64 = riffLen > 0xFFFFFFFF;
+
+    header.riff.package_len = rf64 ? 0xFFFFFFFF : (int)riffLen;
+    header.data.data_len = rf64 ? 0xFFFFFFFF : (uint)bytesWritten;
+
+    memcpy(p, rf64 ? rf64Str : riffStr, 4);
+    writeLE32(p + 4, (uint)header.riff.package_len);
+    memcpy(p + 8, waveStr, 4);
+    p += 12;
+
+    // The 'ds64' block, or a 'JUNK' block readers skip that holds its place
+    // until the file grows past 4 GB.
+    memcpy(p, rf64 ? ds64Str : junkStr, 4);
+    writeLE32(p + 4, WAV_DS64_LEN);
+    memset(p + 8, 0, WAV_DS64_LEN);
+    if (rf64)
+    {
+        writeLE64(p + 8, riffLen);
+        writeLE64(p + 16, bytesWritten);
+        writeLE64(p + 24, bytesWritten / header.format.byte_per_sample);
+        // no table of other block sizes
+    }
+    p += 8 + WAV_DS64_LEN;
+
+    memcpy(p, fmtStr, 4);
+    writeLE32(p + 4, formatLen);
+    writeLE16(p + 8, formatLen == WAV_FORMAT_EXTENSIBLE_LEN ? WAV_FORMAT_EXTENSIBLE : header.format.fixed);
+    writeLE16(p + 10, header.format.channel_number);
+    writeLE32(p + 12, header.format.sample_rate);
+    writeLE32(p + 16, header.format.byte_rate);
+    writeLE16(p + 20, header.format.byte_per_sample);
+    writeLE16(p + 22, header.format.bits_per_sample);
+    if (formatLen == WAV_FORMAT_EXTENSIBLE_LEN)
+    {
+        // all bits valid, the speakers, and the format tag in the sub format GUID
+        writeLE16(p + 24, 22);
+        writeLE16(p + 26, header.format.bits_per_sample);
+        writeLE32(p + 28, channelMask);
+        writeLE16(p + 32, header.format.fixed);
+        memcpy(p + 34, subFormatGuid, sizeof(subFormatGuid));
+    }
+    p += 8 + formatLen;
 
-    // swap byte order if necessary
-    hdrTemp = header;
-    _swap32((unsigned int   &)hdrTemp.riff.package_len);
-    _swap32((unsigned int   &)hdrTemp.format.format_len);
-    _swap16((unsigned short &)hdrTemp.format.fixed);
-    _swap16((unsigned short &)hdrTemp.format.channel_number);
-    _swap32((unsigned int   &)hdrTemp.format.sample_rate);
-    _swap32((unsigned int   &)hdrTemp.format.byte_rate);
-    _swap16((unsigned short &)hdrTemp.format.byte_per_sample);
-    _swap16((unsigned short &)hdrTemp.format.bits_per_sample);
-    _swap32((unsigned int   &)hdrTemp.data.data_len);
+    memcpy(p, dataStr, 4);
+    writeLE32(p + 4, header.data.data_len);
+    p += 8;
 
     // write the supplemented header in the beginning of the file
     fseek(fptr, 0, SEEK_SET);
-    fwrite(&hdrTemp, sizeof(hdrTemp), 1, fptr);
+    fwrite(hdr, 1, p - hdr, fptr);
     // jump back to the end of the file
     fseek(fptr, 0, SEEK_END);
 }
@@ -629,104 +1127,346 @@ void WavOutFile::writeHeader()
 
 void WavOutFile::close()
 {
+    if (fptr == NULL) return;   // already closed
+
+    bool ok = true;
+    if (async)
+    {
+        // the last block, then the thread writes what is left and ends
+        if (stagingUsed > 0)
+        {
+            WavOutBlock block = {staging, stagingUsed};
+            bool queued = async->filled.tryPush(block);
+            assert(queued);
+            (void)queued;
+            stagingUsed = 0;
+        }
+        async->filled.close();
+        async->writer.join();
+        // a failed write of the last blocks fails the close, like in sync mode
+        ok = !async->failed.load(memory_order_acquire);
+    }
+    else
+    {
+        ok = flush();
+    }
     finishHeader();
-    fclose(fptr);
+    ok = !ferror(fptr) && ok;
+    // closing writes what stdio still buffers
+    ok = (fclose(fptr) == 0) && ok;
     fptr = NULL;
+    if (!ok)
+    {
+        throw runtime_error("Error while writing to a wav file.");
+    }
 }
 
 
-void WavOutFile::write(const char *buffer, int numElems)
+char *WavOutFile::stage(int &numElems, int sampleSize)
+{
+    if (stagingLimit - stagingUsed < sampleSize)
+    {
+        if (!flush())
+        {
+            throw runtime_error("Error while writing to a wav file.");
+        }
+    }
+    int room = (stagingLimit - stagingUsed) / sampleSize;
+    if (numElems > room) numElems = room;
+
+    char *dest = staging + stagingUsed;
+    stagingUsed += numElems * sampleSize;
+    return dest;
+}
+
+
+bool WavOutFile::flush()
 {
     int res;
 
+    if (stagingUsed == 0) return true;
+
+    stagingLimit = WAV_OUT_STAGING_BYTES;
+    if (async)
+    {
+        // the ring has a slot for every block, so this doesn't fail
+        WavOutBlock block = {staging, stagingUsed};
+        bool queued = async->filled.tryPush(block);
+        assert(queued);
+        (void)queued;
+        stagingUsed = 0;
+        int waiting = ++async->handed - async->written.load(memory_order_acquire);
+        if (waiting > async->highWater.load(memory_order_relaxed))
+        {
+            async->highWater.store(waiting, memory_order_relaxed);
+        }
+        if (!async->empty.tryPop(staging))
+        {
+            async->stalls.fetch_add(1, memory_order_relaxed);
+            async->empty.pop(staging);
+        }
+        return !async->failed.load(memory_order_acquire);
+    }
+
+    // only what reached the file counts in the header
+    res = (int)fwrite(staging, 1, stagingUsed, fptr);
+    bytesWritten += res;
+    bool ok = (res == stagingUsed);
+    stagingUsed = 0;
+    return ok;
+}
+
+
+void WavOutFile::writeBlocks()
+{
+    WavOutBlock block;
+
+    while (async->filled.pop(block))
+    {
+        int res = (int)fwrite(block.data, 1, block.bytes, fptr);
+        bytesWritten += res;
+        if (res != block.bytes)
+        {
+            async->failed.store(true, memory_order_release);
+        }
+        async->written.fetch_add(1, memory_order_release);
+        bool returned = async->empty.tryPush(block.data);
+        assert(returned);
+        (void)returned;
+    }
+}
+
+
+void WavOutFile::startAsync(int numBlocks)
+{
+    if (async || fptr == NULL) return;
+
+    // staging goes on in the current buffer, the others wait in the ring
+    if (numBlocks < 2) numBlocks = 2;
+    WavOutAsync *ring = new WavOutAsync(numBlocks);
+    ring->blocks.push_back(staging);
+    try
+    {
+        for (int i = 1; i < numBlocks; ++i)
+        {
+            ring->blocks.push_back(allocBlock());
+            bool queued = ring->empty.tryPush(ring->blocks.back());
+            assert(queued);
+            (void)queued;
+        }
+        async = ring;
+        ring->writer = thread(&WavOutFile::writeBlocks, this);
+    }
+    catch (...)
+    {
+        for (size_t i = 1; i < ring->blocks.size(); ++i)
+        {
+            free(ring->blocks[i]);
+        }
+        delete ring;
+        async = NULL;
+        throw;
+    }
+}
+
+
+int WavOutFile::getRingHighWater() const
+{
+    return async ? async->highWater.load(memory_order_relaxed) : 0;
+}
+
+
+int WavOutFile::getStallCount() const
+{
+    return async ? async->stalls.load(memory_order_relaxed) : 0;
+}
+
+
+void WavOutFile::write(const char *buffer, int numElems)
+{
     if (header.format.bits_per_sample != 8)
     {
         throw runtime_error("Error: WavOutFile::write(const char*, int) accepts only 8bit samples.");
     }
     assert(sizeof(char) == 1);
 
-    res = fwrite(buffer, 1, numElems, fptr);
-    if (res != numElems) 
+    while (numElems > 0)
     {
-        throw runtime_error("Error while writing to a wav file.");
+        int count = numElems;
+        char *dest = stage(count, 1);
+        memcpy(dest, buffer, count);
+        buffer += count;
+        numElems -= count;
     }
+}
+
+
+void WavOutFile::writeWords(const void *buffer, int numElems)
+{
+    const unsigned int *source = (const unsigned int *)buffer;
+
+    while (numElems > 0)
+    {
+        int count = numElems;
+
+        if (header.format.bits_per_sample == 24)
+        {
+            // upper 24 bits, little-endian whatever the CPU
+            unsigned char *dest = (unsigned char *)stage(count, 3);
+            for (int i = 0; i < count; i ++)
+            {
+                dest[3 * i]     = (unsigned char)(source[i] >> 8);
+                dest[3 * i + 1] = (unsigned char)(source[i] >> 16);
+                dest[3 * i + 2] = (unsigned char)(source[i] >> 24);
+            }
+        }
+        else
+        {
+            assert(header.format.bits_per_sample == 32);
 
-    bytesWritten += numElems;
+            // swap byte order in the staging buffer if necessary
+            unsigned int *dest = (unsigned int *)stage(count, 4);
+            memcpy(dest, source, count * 4);
+            _swap32Buffer(dest, count);
+        }
+        source += count;
+        numElems -= count;
+    }
 }
 
 
 void WavOutFile::write(const short *buffer, int numElems)
 {
-    int res;
+    int temp[256];
 
     // 16 bit samples
-    if (numElems < 1) return;   // nothing to do
-
-    if (header.format.bits_per_sample == 8)
+    while (numElems > 0)
     {
-        int i;
-        char *temp = new char[numElems];
-        // convert from 16bit format to 8bit format
-        for (i = 0; i < numElems; i ++)
+        int count = numElems;
+
+        if (header.format.bits_per_sample == 8)
+        {
+            // convert from 16bit format to 8bit format, 8 bit samples are unsigned
+            unsigned char *dest = (unsigned char *)stage(count, 1);
+            for (int i = 0; i < count; i ++)
+            {
+                dest[i] = (unsigned char)((buffer[i] >> 8) + 128);
+            }
+        }
+        else if (header.format.bits_per_sample == 16)
+        {
+            // swap byte order in the staging buffer if necessary
+            unsigned short *dest = (unsigned short *)stage(count, 2);
+            memcpy(dest, buffer, count * 2);
+            _swap16Buffer(dest, count);
+        }
+        else
         {
-            temp[i] = buffer[i] >> 8;
+            // widen to 32 bits a block at a time
+            if (count > 256) count = 256;
+            if (header.format.fixed == 3)
+            {
+                sample_convert_s16_to_float(buffer, (float *)temp, count);
+            }
+            else
+            {
+                for (int i = 0; i < count; i ++)
+                {
+                    temp[i] = buffer[i] * 65536;
+                }
+            }
+            writeWords(temp, count);
         }
-        // write in 8bit format
-        write(temp, numElems);
-        delete[] temp;
+        buffer += count;
+        numElems -= count;
     }
-    else
-    {
-        // 16bit format
-        unsigned short *pTemp = new unsigned short[numElems];
-
-        assert(header.format.bits_per_sample == 16);
+}
 
-        // allocate temp buffer to swap byte order if necessary
-        memcpy(pTemp, buffer, numElems * 2);
-        _swap16Buffer(pTemp, numElems);
 
-        res = fwrite(pTemp, 2, numElems, fptr);
+void WavOutFile::write(const int *buffer, int numElems)
+{
+    if (header.format.bits_per_sample >= 24 && header.format.fixed != 3)
+    {
+        writeWords(buffer, numElems);
+        return;
+    }
 
-        delete[] pTemp;
+    float fTemp[256];
+    short sTemp[256];
 
-        if (res != numElems) 
+    // convert a block at a time
+    while (numElems > 0)
+    {
+        int count = numElems < 256 ? numElems : 256;
+        if (header.format.fixed == 3)
         {
-            throw runtime_error("Error while writing to a wav file.");
+            sample_convert_s32_to_float(buffer, fTemp, count);
+            writeWords(fTemp, count);
+        }
+        else
+        {
+            for (int i = 0; i < count; i ++)
+            {
+                sTemp[i] = (short)(buffer[i] >> 16);
+            }
+            write(sTemp, count);
         }
-        bytesWritten += 2 * numElems;
+        buffer += count;
+        numElems -= count;
     }
 }
 
 
 void WavOutFile::write(const float *buffer, int numElems)
 {
-    int i;
-    short *temp = new short[numElems];
-    int iTemp;
-
-    // convert to 16 bit integer
-    for (i = 0; i < numElems; i ++)
+    if (header.format.fixed == 3)
     {
-        // convert to integer
-        iTemp = (int)(32768.0f * buffer[i]);
-
-        // saturate
-        if (iTemp < -32768) iTemp = -32768;
-        if (iTemp > 32767)  iTemp = 32767;
-        temp[i] = (short)iTemp;
+        writeWords(buffer, numElems);
+        return;
     }
 
-    write(temp, numElems);
+    short temp[256];
+    int iTemp[256];
+
+    // convert to integer a block at a time
+    while (numElems > 0)
+    {
+        int count = numElems < 256 ? numElems : 256;
+        if (header.format.bits_per_sample >= 24)
+        {
+            // scale & saturate
+            sample_convert_float_to_s32(buffer, (int32_t *)iTemp, count);
+            writeWords(iTemp, count);
+        }
+        else
+        {
+            // dithered only where the file is 16 bit, 8 bit takes the upper byte
+            bool dithered = dither && header.format.bits_per_sample == 16;
+            sample_convert_float_to_s16(buffer, temp, count, dithered ? &ditherState : NULL);
+            write(temp, count);
+        }
+        buffer += count;
+        numElems -= count;
+    }
+}
 
-    delete[] temp;
+void WavOutFile::setDither(bool enable)
+{
+    dither = enable;
 }
 
 //typedef WavInFile*	H_READ_WAVE_FILE;
 
 
 H_READ_WAVE_FILE read_wave_file_init(const char *file_path) {
-	WavInFile* file = new WavInFile(file_path);
+	// mapped, so the player reads the samples without copies or reads on its thread
+	WavInFile* file = new WavInFile();
+	try {
+		file->openMapped(file_path);
+	} catch (const std::exception& e) {
+		fprintf(stderr, "%s\n", e.what());
+		file->close();
+	}
 	if (!file->isOpen()) {
 		delete file;
 		file = 0;
@@ -734,6 +1474,10 @@ H_READ_WAVE_FILE read_wave_file_init(const char *file_path) {
 	return file;
 }
 
+void read_wave_file_reserve(H_READ_WAVE_FILE h, int max_num_samples) {
+	((WavInFile*)h)->reserve(max_num_samples);
+}
+
 void read_wave_file_destroy(H_READ_WAVE_FILE h) {
 	delete (WavInFile*)h;
 }
@@ -746,6 +1490,10 @@ uint read_wave_file_get_num_bits(H_READ_WAVE_FILE h) {
 	return ((WavInFile*)h)->getNumBits();
 }
 
+uint read_wave_file_get_num_channels(H_READ_WAVE_FILE h) {
+	return ((WavInFile*)h)->getNumChannels();
+}
+
 int read_wave_file_read(H_READ_WAVE_FILE h, float* buffer, int max_num_samples) {
 	return ((WavInFile*)h)->read(buffer, max_num_samples);
 }
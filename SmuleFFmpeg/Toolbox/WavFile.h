@@ -48,11 +48,28 @@
 #define WAVFILE_H
 
 #include <stdio.h>
+#include <stddef.h>
+#include "SampleConverter.h"
 
 #ifndef uint
 typedef unsigned int uint;
 #endif           
 
+/// Size of the block in which WavOutFile writes its samples.
+#define WAV_OUT_STAGING_BYTES   65536
+
+/// Blocks of WAV_OUT_STAGING_BYTES in the ring of a WavOutFile written by a
+/// writer thread, by default. 16 blocks hold over 5 seconds of 16 bit stereo.
+#define WAV_OUT_ASYNC_BLOCKS    16
+
+/// Samples the scratch of a WavInFile read through a file pointer holds from
+/// open() on, more than an audio callback asks for at a time.
+#define WAV_IN_SCRATCH_ELEMS    4096
+
+/// A mapped WavInFile gives the pages of samples it has read back to the
+/// system in steps of this many bytes, so that a long file doesn't stay resident.
+#define WAV_IN_RELEASE_BYTES    (4 * 1024 * 1024)
+
 
 /// WAV audio file 'riff' section header
 typedef struct 
@@ -99,8 +116,36 @@ private:
     /// File pointer.
     FILE *fptr;
 
+    /// The whole file when opened with openMapped, NULL otherwise.
+    const char *mapData;
+
+    /// Size of the mapping in bytes.
+    size_t mapSize;
+
+    /// Start of the sample data within the mapping.
+    const char *mapSamples;
+
+    /// Bytes of sample data whose pages were given back to the system.
+    uint64_t mapReleased;
+
     /// Counter of how many bytes of sample data have been read from the file.
-    uint dataRead;
+    uint64_t dataRead;
+
+    /// Bytes of sample data, from the 'data' block or the 'ds64' block of an RF64
+    /// file, where the 32 bit size in the header doesn't hold it.
+    uint64_t dataLen;
+    uint64_t rf64DataLen;
+
+    /// Speaker positions of a WAVE_FORMAT_EXTENSIBLE file, 0 otherwise.
+    uint channelMask;
+
+    /// Scratch of scratchSize bytes that 8 bit and float reads convert through.
+    /// Only grows, so reads no larger than before don't allocate.
+    char *scratch;
+    int scratchSize;
+
+    /// Returns the scratch with room for at least the given bytes.
+    char *getScratch(int bytes);
 
     /// WAV header information
     WavHeader header;
@@ -120,6 +165,37 @@ private:
     /// Reads WAV file 'riff' block
     int readRIFFBlock();
 
+    /// Checks the 'riff' block read into the header.
+    int checkRIFFBlock();
+
+    /// Takes the fields of a 'fmt ' or 'ds64' block, of which len bytes are at body.
+    /// A WAVE_FORMAT_EXTENSIBLE format gets the tag of its sub format.
+    /// \return zero if all ok, nonzero if the block is invalid.
+    int parseBlock(const char *label, const unsigned char *body, uint len);
+
+    /// Reads up to maxElems samples of sampleSize bytes from the file pointer.
+    /// \return Number of whole samples read.
+    int readRaw(char *buffer, int maxElems, int sampleSize);
+
+    /// Nonzero if the file is an RF64 file.
+    int isRF64() const;
+
+    /// Checks that the samples are 8, 16, 24 or 32 bit integers or 32 bit floats.
+    /// \return zero if all ok, nonzero if the encoding is unsupported.
+    int checkEncoding() const;
+
+    /// Parses the chunk table of the mapped file in one pass.
+    /// \return zero if all ok, nonzero if file format is invalid.
+    int parseMappedHeaders();
+
+    /// Points 'span' to up to maxElems samples of sampleSize bytes from the read
+    /// position on and advances past them.
+    /// \return Number of samples in the span.
+    int takeSpan(const char *&span, int maxElems, int sampleSize);
+
+    /// Gives the pages of the samples read so far back to the system.
+    void releaseMappedPages();
+
 public:
     /// Constructor: Opens the given WAV file. If the file can't be opened,
     /// throws 'runtime_error' exception.
@@ -130,7 +206,27 @@ public:
     ~WavInFile();
 
     void open(const char *filename);
+
+    /// Opens the given WAV file mapped into memory instead of read through a file
+    /// pointer. The chunk table is parsed in one pass over the mapping, the samples
+    /// are read without a temporary copy and can be taken as spans of the file with
+    /// readSpan(). Falls back to open() if the file can't be mapped. If the file is
+    /// invalid, throws 'runtime_error' exception.
+    ///
+    /// Both open() and openMapped() read 8, 16, 24 and 32 bit PCM and 32 bit float
+    /// files, with WAVE_FORMAT_EXTENSIBLE headers, and RF64 files over 4 GB.
+    void openMapped(const char *filename);
 	int  isOpen();
+
+    /// Nonzero if the file is read from a mapping.
+    int isMapped() const;
+
+    /// Nonzero if the samples are 32 bit floats.
+    int isFloat() const;
+
+    /// Grows the scratch so that reads of up to maxElems samples don't allocate,
+    /// e.g. before reading on an audio thread. A mapped file reads without it.
+    void reserve(int maxElems);
     /// Close the file. Notice that file is automatically closed also when the
     /// class instance is deleted.
     void close();
@@ -141,15 +237,19 @@ public:
     /// Get sample rate.
     uint getSampleRate() const;
 
-    /// Get number of bits per sample, i.e. 8 or 16.
+    /// Get number of bits per sample, i.e. 8, 16, 24 or 32.
     uint getNumBits() const;
 
     /// Get sample data size in bytes. Ahem, this should return same information as 
     /// 'getBytesPerSample'...
-    uint getDataSizeInBytes() const;
+    uint64_t getDataSizeInBytes() const;
 
     /// Get total number of samples in file.
-    uint getNumSamples() const;
+    uint64_t getNumSamples() const;
+
+    /// Get the speaker positions of a WAVE_FORMAT_EXTENSIBLE file, a
+    /// SPEAKER_FRONT_LEFT etc. bit for each channel, 0 if the file has none.
+    uint getChannelMask() const;
 
     /// Get number of bytes per audio sample (e.g. 16bit stereo = 4 bytes/sample)
     uint getBytesPerSample() const;
@@ -169,7 +269,7 @@ public:
 
     /// Reads audio samples from the WAV file to 16 bit integer format. Reads given number 
     /// of elements from the file or if end-of-file reached, as many elements as are 
-    /// left in the file.
+    /// left in the file. Works only for 8 and 16 bit samples.
     ///
     /// \return Number of 16-bit integers read from the file.
     int read(short *buffer,     ///< Pointer to buffer where to read data.
@@ -178,13 +278,25 @@ public:
 
     /// Reads audio samples from the WAV file to floating point format, converting 
     /// sample values to range [-1,1[. Reads given number of elements from the file
-    /// or if end-of-file reached, as many elements as are left in the file.
+    /// or if end-of-file reached, as many elements as are left in the file. Float
+    /// files are read as such.
     ///
     /// \return Number of elements read from the file.
     int read(float *buffer,     ///< Pointer to buffer where to read data.
              int maxElems       ///< Size of 'buffer' array (number of array elements).
              );
 
+    /// Mapped files only: points 'span' to up to maxElems 16 bit samples from the
+    /// read position on, as they are in the file, and advances past them. The span
+    /// stays valid until the file is closed. Throws 'runtime_error' exception if
+    /// the file isn't mapped or has other samples.
+    ///
+    /// \return Number of elements in the span, 0 at the end of the data.
+    int readSpan(const short *&span, int maxElems);
+
+    /// Same for 32 bit float samples.
+    int readSpan(const float *&span, int maxElems);
+
     /// Check end-of-file.
     ///
     /// \return Nonzero if end-of-file reached.
@@ -193,6 +305,9 @@ public:
 
 
 
+/// Ring of blocks a WavOutFile hands to its writer thread, see startAsync().
+struct WavOutAsync;
+
 /// Class for writing WAV audio files.
 class WavOutFile
 {
@@ -203,26 +318,70 @@ private:
     /// WAV file header data.
     WavHeader header;
 
-    /// Counter of how many bytes have been written to the file so far.
-    int bytesWritten;
+    /// Counter of how many bytes of samples have reached the file so far, written
+    /// by the writer thread while it runs.
+    uint64_t bytesWritten;
+
+    /// Speaker positions written to a WAVE_FORMAT_EXTENSIBLE header.
+    uint channelMask;
+
+    /// Staging buffer of WAV_OUT_STAGING_BYTES bytes. Samples are converted
+    /// into it and written to the file when it is full, so a file is written
+    /// in large blocks however small the write() calls are.
+    char *staging;
+
+    /// Bytes in the staging buffer not yet written to the file.
+    int stagingUsed;
+
+    /// Bytes the staging buffer takes before it is written. The first block is
+    /// short by the header, so that the blocks after it start at multiples of
+    /// WAV_OUT_STAGING_BYTES in the file.
+    int stagingLimit;
+
+    /// The ring and writer thread after startAsync(), NULL before.
+    WavOutAsync *async;
+
+    /// Whether floats written to a 16 bit file are dithered, and the noise state.
+    bool dither;
+    SampleDither ditherState;
+
+    /// Makes room in the staging buffer for samples of sampleSize bytes, and
+    /// returns where they go. numElems is set to how many of them fit.
+    char *stage(int &numElems, int sampleSize);
+
+    /// Writes the staged bytes to the file, or hands them to the writer thread
+    /// and stages into the next free block of the ring. Returns false if
+    /// writing fails.
+    bool flush();
+
+    /// Writes the blocks of the ring to the file until close(). Writer thread.
+    void writeBlocks();
+
+    /// Stages 32 bit samples as such, or the upper 24 bits of them.
+    void writeWords(const void *buffer, int numElems);
 
     /// Fills in WAV file header information.
-    void fillInHeader(const uint sampleRate, const uint bits, const uint channels);
+    void fillInHeader(const uint sampleRate, const uint bits, const uint channels, const bool isFloat, const uint channelMask);
 
     /// Finishes the WAV file header by supplementing information of amount of
     /// data written to file etc
     void finishHeader();
 
-    /// Writes the WAV file header.
+    /// Writes the WAV file header. It holds the place of a 'ds64' block with a
+    /// 'JUNK' block, and becomes an RF64 header if the file outgrows 4 GB.
     void writeHeader();
 
 public:
     /// Constructor: Creates a new WAV file. Throws a 'runtime_error' exception 
     /// if file creation fails.
+    /// Throws also if the sample format is not supported. Files with more than two
+    /// channels or a channel mask get a WAVE_FORMAT_EXTENSIBLE header.
     WavOutFile(const char *fileName,    ///< Filename
                int sampleRate,          ///< Sample rate (e.g. 44100 etc)
-               int bits,                ///< Bits per sample (8 or 16 bits)
-               int channels             ///< Number of channels (1=mono, 2=stereo)
+               int bits,                ///< Bits per sample (8, 16, 24 or 32 bits)
+               int channels,            ///< Number of channels (1=mono, 2=stereo)
+               bool isFloat = false,    ///< IEEE float samples, 32 bits only
+               uint channelMask = 0     ///< Speaker positions, SPEAKER_FRONT_LEFT etc. bits
                );
 
     /// Destructor: Finalizes & closes the WAV file.
@@ -234,22 +393,53 @@ public:
                int numElems             ///< How many array items are to be written to file.
                );
 
-    /// Write data to WAV file. Throws a 'runtime_error' exception if writing to
-    /// file fails.
+    /// Write data to WAV file, converted to the sample format of the file. Throws a
+    /// 'runtime_error' exception if writing to file fails.
     void write(const short *buffer,     ///< Pointer to sample data buffer.
                int numElems             ///< How many array items are to be written to file.
                );
 
-    /// Write data to WAV file in floating point format, saturating sample values to range
-    /// [-1..+1[. Throws a 'runtime_error' exception if writing to file fails.
+    /// Write 32 bit integer data to WAV file, converted to the sample format of the
+    /// file: a 24 bit file gets the upper 24 bits. Throws a 'runtime_error' exception
+    /// if writing to file fails.
+    void write(const int *buffer,       ///< Pointer to sample data buffer.
+               int numElems             ///< How many array items are to be written to file.
+               );
+
+    /// Write data to WAV file in floating point format. A float file gets the samples
+    /// as such, integer files saturate sample values to range [-1..+1[. A 16 bit file
+    /// gets them with TPDF dither unless setDither(false) was called. Throws a
+    /// 'runtime_error' exception if writing to file fails.
     void write(const float *buffer,     ///< Pointer to sample data buffer.
                int numElems             ///< How many array items are to be written to file.
                );
 
+    /// Enables or disables the dither of floats written to a 16 bit file. Without it
+    /// they are truncated toward zero. The noise is seeded the same for every file,
+    /// so the same samples written in the same calls give the same file.
+    void setDither(bool enable);
+
+    /// Hands the writing of the file to a background thread, so that write() only
+    /// converts samples into a ring of numBlocks blocks allocated here, and doesn't
+    /// wait for the disk as long as the thread keeps up. When every block waits to
+    /// be written, write() waits for the thread and counts a stall. A write that
+    /// failed makes a later write() throw. close() writes the rest, ends the thread
+    /// and finishes the header. Does nothing if the writer thread already runs.
+    void startAsync(int numBlocks = WAV_OUT_ASYNC_BLOCKS);
+
+    /// Most blocks that waited for the writer thread at once. With as many as
+    /// the ring holds, the disk fell behind and a bigger ring may be needed.
+    int getRingHighWater() const;
+
+    /// Times write() waited for the writer thread because the ring was full.
+    int getStallCount() const;
+
     /// Finalize & close the WAV file. Automatically supplements the WAV file header
-    /// information according to written data etc.
+    /// information according to written data etc. Throws a 'runtime_error' exception
+    /// if writing the last samples or the header fails; the file is closed anyway.
     ///
-    /// Notice that file is automatically closed also when the class instance is deleted.
+    /// Notice that file is automatically closed also when the class instance is deleted,
+    /// which doesn't report errors.
     void close();
 };
 
@@ -263,7 +453,10 @@ H_READ_WAVE_FILE 	read_wave_file_init(const char *file_path);
 void				read_wave_file_destroy(H_READ_WAVE_FILE h);
 uint 				read_wave_file_get_sample_rate(H_READ_WAVE_FILE h);
 uint 				read_wave_file_get_num_bits(H_READ_WAVE_FILE h);
+uint 				read_wave_file_get_num_channels(H_READ_WAVE_FILE h);
 int 				read_wave_file_read(H_READ_WAVE_FILE h, float *buffer, int max_num_samples);
+// reads of up to max_num_samples don't allocate from then on
+void				read_wave_file_reserve(H_READ_WAVE_FILE h, int max_num_samples);
 
 #ifdef __cplusplus
 }
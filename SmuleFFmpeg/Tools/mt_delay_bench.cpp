@@ -0,0 +1,97 @@
+//
+//  mt_delay_bench.cpp
+//  SmuleFFmpeg
+//
+//  Throughput of MultiTapDelayEffect per tap count, in millions of samples
+//  per second. Unevenly spaced taps run the block kernel unrolled for the
+//  tap count (the generic loop past MTD_MAX_UNROLLED_TAPS), evenly spaced
+//  ones from MTD_RECURSIVE_MIN_TAPS on run the recursive comb.
+//
+//  mt_delay_bench [-s seconds] [-b block_frames] [-c channels] [-d total_delay_ms] [-r sample_rate]
+//
+
+#include "MTapDelayEffect.hpp"
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <chrono>
+#include <vector>
+
+static void usage(const char* name) {
+	fprintf(stderr, "usage: %s [-s seconds] [-b block_frames] [-c channels] [-d total_delay_ms] [-r sample_rate]\n", name);
+}
+
+// Processes seconds of audio in blocks after one second of warm-up, so every
+// tap reads from a filled delay line. Returns Msamples/s over all channels.
+static double bench_run(const std::vector<float>& delays, float rate, int channels, int block, double seconds) {
+	MultiTapDelayEffect effect;
+	effect.setFrequency(rate);
+	effect.setNumChannels(channels);
+	effect.setTapDelays(delays);
+	std::vector<std::vector<float> > samples(channels, std::vector<float>(block));
+	std::vector<float*> io(channels);
+	for (int c = 0; c < channels; ++c) {
+		io[c] = samples[c].data();
+		for (int i = 0; i < block; ++i)
+			samples[c][i] = (float)((i + c * 31) % 97) / 97.0f - 0.5f;
+	}
+	std::vector<std::vector<float> > output(samples);
+	std::vector<float*> out(channels);
+	for (int c = 0; c < channels; ++c)
+		out[c] = output[c].data();
+	for (int done = 0; done < (int)rate; done += block)
+		effect.processPlanar(io.data(), out.data(), channels, block);
+
+	long long frames = (long long)(seconds * rate);
+	auto start = std::chrono::steady_clock::now();
+	for (long long done = 0; done < frames; done += block)
+		effect.processPlanar(io.data(), out.data(), channels, block);
+	double elapsed = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+	return (double)frames * channels / elapsed / 1e6;
+}
+
+int main(int argc, char* argv[]) {
+	double seconds = 60.0;
+	int block = 512;
+	int channels = 1;
+	float totalDelay = 400.0f;
+	float rate = 44100.0f;
+	int c;
+	while ((c = getopt(argc, argv, "s:b:c:d:r:")) != -1) {
+		switch (c) {
+			case 's': seconds = atof(optarg); break;
+			case 'b': block = atoi(optarg); break;
+			case 'c': channels = atoi(optarg); break;
+			case 'd': totalDelay = (float)atof(optarg); break;
+			case 'r': rate = (float)atof(optarg); break;
+			default:
+				usage(argv[0]);
+				return 2;
+		}
+	}
+	if (seconds <= 0.0 || block < 1 || channels < 1 || channels > MTD_MAX_CHANNELS ||
+		totalDelay <= 0.0f || totalDelay > MAX_TAP_DELAY_MILLISECONDS || rate < 1000.0f || rate > MAX_FREQUENCY) {
+		usage(argv[0]);
+		return 2;
+	}
+
+	printf("%g s of audio, %d frame blocks, %d channels, %g ms, %g Hz, Msamples/s\n",
+		   seconds, block, channels, totalDelay, rate);
+	printf("taps   block kernel   comb\n");
+	const int counts[] = {1, 2, 3, 4, 5, 6, 7, 8, 9, 10, 11, 12, 13, 14, 15, 16, 24, 32};
+	for (int taps : counts) {
+		// even spacing, and the same taps moved off it by a fraction of a millisecond
+		float spacing = totalDelay / (float)taps;
+		std::vector<float> even(taps), uneven(taps);
+		for (int k = 0; k < taps; ++k) {
+			even[k] = spacing * (float)(k + 1);
+			uneven[k] = even[k] - (k % 2 ? 0.37f : 0.0f);
+		}
+		printf("%4d   %12.1f", taps, bench_run(uneven, rate, channels, block, seconds));
+		if (taps >= MTD_RECURSIVE_MIN_TAPS)
+			printf("   %6.1f\n", bench_run(even, rate, channels, block, seconds));
+		else
+			printf("        -\n");
+	}
+	return 0;
+}
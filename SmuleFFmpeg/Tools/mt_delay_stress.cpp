@@ -0,0 +1,118 @@
+//
+//  mt_delay_stress.cpp
+//  SmuleFFmpeg
+//
+//  Stress test for the tap table hand-off of MultiTapDelayEffect: one thread
+//  calls mt_delay_set_taps (and the wet and attenuation setters) as fast as
+//  it can, another processes blocks like the AudioQueue callback does. Every
+//  output sample is checked to be finite and within what the taps can add up
+//  to. Run it built with -fsanitize=thread to catch the races themselves.
+//
+//  mt_delay_stress [-t seconds] [-c channels] [-b block_frames]
+//
+
+#include "MTapDelayEffect_c_bridge.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <math.h>
+#include <unistd.h>
+#include <atomic>
+#include <chrono>
+#include <thread>
+#include <vector>
+
+// most taps mt_delay_set_taps is called with
+#define STRESS_MAX_TAPS		16
+// input samples stay within +-STRESS_INPUT_PEAK
+#define STRESS_INPUT_PEAK	0.5f
+
+static void usage(const char* name) {
+	fprintf(stderr, "usage: %s [-t seconds] [-c channels] [-b block_frames]\n", name);
+}
+
+static unsigned int stress_random(unsigned int& seed) {
+	seed = seed * 1664525u + 1013904223u;
+	return seed >> 8;
+}
+
+int main(int argc, char* argv[]) {
+	double seconds = 5.0;
+	int channels = 2;
+	int block = 512;
+	int c;
+	while ((c = getopt(argc, argv, "t:c:b:")) != -1) {
+		switch (c) {
+			case 't': seconds = atof(optarg); break;
+			case 'c': channels = atoi(optarg); break;
+			case 'b': block = atoi(optarg); break;
+			default:
+				usage(argv[0]);
+				return 2;
+		}
+	}
+	if (seconds <= 0.0 || channels < 1 || block < 1) {
+		usage(argv[0]);
+		return 2;
+	}
+
+	void* h = mt_delay_init();
+	mt_delay_set_frequency(h, 44100.0f);
+	mt_delay_set_channels(h, channels);
+	mt_delay_set_enabled(h, 1);
+	float maxDelay = mt_delay_get_max_delay_in_milliseconds(h);
+
+	std::atomic<bool> done(false);
+	long long blocks = 0, badSamples = 0;
+	float peak = 0.0f;
+	// render thread, the dry signal plus every tap at full gain is the most the output can reach
+	std::thread render([&]() {
+		std::vector<std::vector<float> > samples(channels, std::vector<float>(block));
+		std::vector<float*> io(channels);
+		unsigned int seed = 1;
+		const float limit = STRESS_INPUT_PEAK * (1.0f + STRESS_MAX_TAPS) * channels;
+		while (!done.load(std::memory_order_relaxed)) {
+			for (int ch = 0; ch < channels; ++ch) {
+				io[ch] = samples[ch].data();
+				for (int i = 0; i < block; ++i)
+					samples[ch][i] = ((float)(stress_random(seed) & 0xffff) / 65535.0f - 0.5f) * 2.0f * STRESS_INPUT_PEAK;
+			}
+			mt_delay_process_planar(h, io.data(), io.data(), channels, block);
+			for (int ch = 0; ch < channels; ++ch)
+				for (int i = 0; i < block; ++i) {
+					float y = fabsf(samples[ch][i]);
+					if (!(y <= limit))
+						++badSamples;
+					else if (y > peak)
+						peak = y;
+				}
+			++blocks;
+		}
+	});
+
+	// control thread, what the UI does when the sliders move
+	long long calls = 0;
+	unsigned int seed = 2;
+	auto start = std::chrono::steady_clock::now();
+	while (std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count() < seconds) {
+		int taps = 1 + (int)(stress_random(seed) % STRESS_MAX_TAPS);
+		float delay = 1.0f + (float)(stress_random(seed) % 10000) / 10000.0f * (maxDelay - 1.0f);
+		mt_delay_set_taps(h, taps, delay);
+		if ((calls & 15) == 0) {
+			mt_delay_set_wet(h, (float)(stress_random(seed) % 101) / 100.0f);
+			mt_delay_set_attenuation(h, 0.25f + (float)(stress_random(seed) % 76) / 100.0f);
+		}
+		++calls;
+	}
+	done = true;
+	render.join();
+	mt_delay_destroy(h);
+
+	printf("%lld mt_delay_set_taps calls, %lld blocks of %d frames, %d channels, peak %.3f\n",
+		   calls, blocks, block, channels, peak);
+	if (badSamples > 0) {
+		printf("FAILED: %lld samples out of range or not finite\n", badSamples);
+		return 1;
+	}
+	printf("ok\n");
+	return 0;
+}
@@ -0,0 +1,225 @@
+//
+//  render_alloc_check.cpp
+//  SmuleFFmpeg
+//
+//  Checks that the per-block paths don't touch the heap once they are set up:
+//  WavOutFile writes, WavInFile reads of up to the reserved size, the reads
+//  the file player makes through read_wave_file_read, and an effect chain
+//  rendering blocks across tap table and kernel hand-offs. Allocations are
+//  counted by replacing operator new, and malloc as well with glibc. Prints
+//  the allocations of each path and exits with 1 if any of them made one.
+//
+//  render_alloc_check [-d temp_dir] [-b block_frames]
+//
+
+#include "WavFile.h"
+#include "EffectChain.hpp"
+#include "MTapDelayEffect.hpp"
+#include "ConvolutionEffect.hpp"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <new>
+#include <atomic>
+#include <string>
+#include <vector>
+
+static std::atomic<long> allocations(0);
+
+#ifdef __GLIBC__
+// C allocations too, where the C library lets them be counted
+extern "C" void* __libc_malloc(size_t size);
+extern "C" void* __libc_calloc(size_t count, size_t size);
+extern "C" void* __libc_realloc(void* p, size_t size);
+extern "C" void __libc_free(void* p);
+extern "C" void* malloc(size_t size) {
+	++allocations;
+	return __libc_malloc(size);
+}
+extern "C" void* calloc(size_t count, size_t size) {
+	++allocations;
+	return __libc_calloc(count, size);
+}
+extern "C" void* realloc(void* p, size_t size) {
+	++allocations;
+	return __libc_realloc(p, size);
+}
+static void* heap_allocate(std::size_t size) {
+	return __libc_malloc(size);
+}
+static void heap_release(void* p) {
+	__libc_free(p);
+}
+#else
+static void* heap_allocate(std::size_t size) {
+	return malloc(size);
+}
+static void heap_release(void* p) {
+	free(p);
+}
+#endif
+
+void* operator new(std::size_t size) {
+	++allocations;
+	void* p = heap_allocate(size ? size : 1);
+	if (!p)
+		throw std::bad_alloc();
+	return p;
+}
+void* operator new[](std::size_t size) {
+	return operator new(size);
+}
+void operator delete(void* p) noexcept {
+	heap_release(p);
+}
+void operator delete[](void* p) noexcept {
+	heap_release(p);
+}
+void operator delete(void* p, std::size_t) noexcept {
+	heap_release(p);
+}
+void operator delete[](void* p, std::size_t) noexcept {
+	heap_release(p);
+}
+
+static int failures = 0;
+
+static void report(const char* path, long count) {
+	printf("%-40s %ld allocations\n", path, count);
+	if (count != 0)
+		++failures;
+}
+
+static void usage(const char* name) {
+	fprintf(stderr, "usage: %s [-d temp_dir] [-b block_frames]\n", name);
+}
+
+int main(int argc, char* argv[]) {
+	const char* dir = getenv("TMPDIR") ? getenv("TMPDIR") : "/tmp";
+	int block = 512;
+	int c;
+	while ((c = getopt(argc, argv, "d:b:")) != -1) {
+		switch (c) {
+			case 'd': dir = optarg; break;
+			case 'b': block = atoi(optarg); break;
+			default:
+				usage(argv[0]);
+				return 2;
+		}
+	}
+	if (block < 1) {
+		usage(argv[0]);
+		return 2;
+	}
+	const int channels = 2;
+	const int samples = block * channels;
+	const int numBlocks = 200;
+	std::vector<float> floats(samples);
+	std::vector<short> shorts(samples);
+	std::vector<int> ints(samples);
+	for (int i = 0; i < samples; ++i) {
+		floats[i] = (float)(i % 200 - 100) / 101.0f;
+		shorts[i] = (short)(i * 7);
+		ints[i] = i * 123457;
+	}
+
+	// writes, every block after the file is created
+	const struct { const char* name; int bits; bool isFloat; } formats[] = {
+		{"u8", 8, false}, {"s16", 16, false}, {"s24", 24, false}, {"s32", 32, false}, {"float", 32, true}
+	};
+	std::vector<std::string> paths;
+	try {
+		for (const auto& format : formats) {
+			std::string path = std::string(dir) + "/render_alloc_check_" + format.name + ".wav";
+			paths.push_back(path);
+			WavOutFile out(path.c_str(), 44100, format.bits, channels, format.isFloat);
+			long before = allocations;
+			for (int b = 0; b < numBlocks; ++b) {
+				out.write(floats.data(), samples);
+				out.write(shorts.data(), samples);
+				out.write(ints.data(), samples);
+			}
+			report((std::string("WavOutFile::write ") + format.name).c_str(), allocations - before);
+			out.close();
+		}
+
+		// reads through the file pointer, after reserve()
+		std::vector<float> floatBlock(samples);
+		std::vector<short> shortBlock(samples);
+		for (std::size_t f = 0; f < paths.size(); ++f) {
+			WavInFile in(paths[f].c_str());
+			in.reserve(samples);
+			long before = allocations;
+			int read = 0;
+			while (!in.eof()) {
+				read += in.read(floatBlock.data(), samples);
+				// shorts only come from 8 and 16 bit files
+				if (formats[f].bits <= 16)
+					read += in.read(shortBlock.data(), samples);
+			}
+			report((std::string("WavInFile::read ") + formats[f].name).c_str(), allocations - before);
+			if (read == 0)
+				++failures;
+		}
+	}
+	catch (const std::exception& e) {
+		fprintf(stderr, "%s\n", e.what());
+		return 1;
+	}
+
+	// what the file player does in its audio queue callback
+	H_READ_WAVE_FILE h = read_wave_file_init(paths[1].c_str());
+	if (!h) {
+		fprintf(stderr, "can't open %s\n", paths[1].c_str());
+		return 1;
+	}
+	std::vector<float> playerBlock(samples);
+	read_wave_file_reserve(h, samples);
+	long before = allocations;
+	while (read_wave_file_read(h, playerBlock.data(), samples) > 0)
+		;
+	report("read_wave_file_read", allocations - before);
+	read_wave_file_destroy(h);
+	for (std::size_t f = 0; f < paths.size(); ++f)
+		unlink(paths[f].c_str());
+
+	// The effect chain renders while the control side changes the taps and
+	// the impulse response, so blocks pick up new tables and kernels. Only
+	// the render calls are counted, publishing allocates on the control side.
+	EffectChain chain;
+	chain.setFrequency(44100.0f);
+	chain.setNumChannels(channels);
+	chain.prepare(channels, block);
+	std::vector<float> taps = {120.0f, 250.0f, 380.0f};
+	MultiTapDelayEffect* delay = new MultiTapDelayEffect(taps);
+	ConvolutionEffect* convolution = new ConvolutionEffect();
+	chain.add(delay);
+	chain.add(convolution);
+	convolution->setPreset(ConvolutionPresetSmallRoom);
+	delay->setMix(0.5f);
+	convolution->setMix(0.3f);
+	std::vector<float> left(block), right(block);
+	float* planar[2] = {left.data(), right.data()};
+	long renderAllocations = 0;
+	for (int b = 0; b < numBlocks; ++b) {
+		if (b % 10 == 5) {
+			int ids[] = {MultiTapDelayParameterTapNumber, MultiTapDelayParameterTotalDelay};
+			float values[] = {(float)(1 + b % 16), 100.0f + (float)b};
+			delay->setParameters(ids, values, 2);
+		}
+		if (b % 50 == 25)
+			convolution->setPreset(b % 100 == 25 ? ConvolutionPresetDiffuseEcho : ConvolutionPresetLargeHall);
+		memcpy(left.data(), floats.data(), block * sizeof(float));
+		memcpy(right.data(), floats.data(), block * sizeof(float));
+		memcpy(playerBlock.data(), floats.data(), samples * sizeof(float));
+		before = allocations;
+		chain.processPlanar(planar, planar, channels, block);
+		chain.processInterleaved(playerBlock.data(), playerBlock.data(), channels, block);
+		renderAllocations += allocations - before;
+	}
+	report("EffectChain::processPlanar/Interleaved", renderAllocations);
+
+	printf("%s\n", failures ? "FAILED" : "ok");
+	return failures != 0;
+}
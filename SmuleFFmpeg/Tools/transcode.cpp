@@ -0,0 +1,146 @@
+//
+//  transcode.cpp
+//  SmuleFFmpeg
+//
+//  Command line batch decoder: decodes a directory or a list of files to WAV
+//  files on all cores and reports the throughput.
+//
+//  transcode [-p | -s] [-j threads] [-m max_memory_mb] [-f s16|s24|s32|float|native]
+//            [-r sample_rate] [-c channels] [-e extension] [-o out_dir]
+//            [-k cache_dir [-K cache_mb]] <directory | files...>
+//
+//  -p decodes each file on three threads (read, decode, write), -s decodes
+//  the files one after the other, each in segments on all threads.
+//  -k keeps the decoded samples in cache_dir, so files decoded the same way
+//  before, under any name, are written from there.
+//
+
+#include "BatchDecompressor.h"
+#include "PcmCache.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <sys/stat.h>
+
+extern "C" {
+	#include <libavutil/error.h>
+	#include <libavutil/log.h>
+}
+
+static void usage(const char* name) {
+	fprintf(stderr, "usage: %s [-p | -s] [-j threads] [-m max_memory_mb] [-f s16|s24|s32|float|native]\n"
+					"       [-r sample_rate] [-c channels] [-e extension] [-o out_dir]\n"
+					"       [-k cache_dir [-K cache_mb]] <directory | files...>\n", name);
+}
+
+static void report_file(const char* in_path, const char* /*out_path*/, int error, double /*seconds*/, void* /*user_data*/) {
+	if (error < 0) {
+		char buf[64];
+		if (av_strerror(error, buf, sizeof(buf)) != 0)
+			strcpy(buf, "UNKNOWN_ERROR");
+		fprintf(stderr, "FAILED %s (%d: %s)\n", in_path, error, buf);
+	}
+}
+
+int main(int argc, char* argv[]) {
+	BatchDecompressorOptions options;
+	batch_decompressor_default_options(&options);
+	options.callback = report_file;
+	const char* extension = "m4a";
+	const char* out_dir = NULL;
+	const char* cache_dir = NULL;
+	int64_t cache_bytes = (int64_t)2048 << 20;
+	int c;
+	while ((c = getopt(argc, argv, "psj:m:f:r:c:e:o:k:K:")) != -1) {
+		switch (c) {
+			case 'p': options.pipelined = 1; break;
+			case 's': options.segmented = 1; break;
+			case 'j': options.num_threads = atoi(optarg); break;
+			case 'm': options.max_memory = (size_t)atol(optarg) << 20; break;
+			case 'r': options.sample_rate = atoi(optarg); break;
+			case 'c': options.channels = atoi(optarg); break;
+			case 'e': extension = optarg; break;
+			case 'o': out_dir = optarg; break;
+			case 'k': cache_dir = optarg; break;
+			case 'K': cache_bytes = (int64_t)atol(optarg) << 20; break;
+			case 'f':
+				if (strcmp(optarg, "s16") == 0)			options.format = DecompressorOutputS16;
+				else if (strcmp(optarg, "s24") == 0)	options.format = DecompressorOutputS24;
+				else if (strcmp(optarg, "s32") == 0)	options.format = DecompressorOutputS32;
+				else if (strcmp(optarg, "float") == 0)	options.format = DecompressorOutputFloat;
+				else if (strcmp(optarg, "native") == 0)	options.format = DecompressorOutputNative;
+				else {
+					usage(argv[0]);
+					return 2;
+				}
+				break;
+			default:
+				usage(argv[0]);
+				return 2;
+		}
+	}
+	if (optind >= argc) {
+		usage(argv[0]);
+		return 2;
+	}
+	// only the failures are reported per file
+	av_log_set_level(AV_LOG_ERROR);
+	H_PCM_CACHE cache = NULL;
+	if (cache_dir) {
+		cache = pcm_cache_open(cache_dir, cache_bytes);
+		if (cache == NULL) {
+			fprintf(stderr, "Unable to open the cache in %s.\n", cache_dir);
+			return 1;
+		}
+		decompressorSetCache(cache);
+	}
+
+	BatchDecompressorStats stats;
+	int failed;
+	struct stat st;
+	if (argc - optind == 1 && stat(argv[optind], &st) == 0 && S_ISDIR(st.st_mode)) {
+		failed = batch_decompress_directory(argv[optind], out_dir, extension, &options, &stats);
+		if (failed < 0) {
+			decompressorSetCache(NULL);
+			pcm_cache_close(cache);
+			return 1;
+		}
+	}
+	else {
+		int num_files = argc - optind;
+		const char** out_paths = NULL;
+		char** names = NULL;
+		if (out_dir) {
+			// the name of each file, with wav for its extension, in out_dir
+			out_paths = (const char**)calloc(num_files, sizeof(char*));
+			names = (char**)calloc(num_files, sizeof(char*));
+			for (int i = 0; i < num_files; ++i) {
+				const char* name = strrchr(argv[optind + i], '/');
+				name = name ? name + 1 : argv[optind + i];
+				const char* dot = strrchr(name, '.');
+				int len = dot && dot != name ? (int)(dot - name) : (int)strlen(name);
+				size_t size = strlen(out_dir) + len + 6;
+				names[i] = (char*)malloc(size);
+				snprintf(names[i], size, "%s/%.*s.wav", out_dir, len, name);
+				out_paths[i] = names[i];
+			}
+		}
+		failed = batch_decompress_files((const char* const*)(argv + optind), out_paths, num_files, &options, &stats);
+		for (int i = 0; names && i < num_files; ++i)
+			free(names[i]);
+		free(names);
+		free(out_paths);
+	}
+	printf("%d files, %d failed, %d threads, %.2f s\n", stats.num_files, stats.num_failed, stats.num_threads, stats.wall_seconds);
+	printf("%.2f files/s, %.1f s of audio, %.1fx realtime\n", stats.files_per_second, stats.audio_seconds, stats.realtime_factor);
+	if (options.pipelined && !options.segmented) {
+		// the busiest stage bounds the files
+		const DecompressorStageTimes& t = stats.stage_times;
+		printf("stages: demux %.2f s, decode %.2f s, write %.2f s of %.2f s\n", t.demux_seconds, t.decode_seconds, t.write_seconds, t.wall_seconds);
+	}
+	decompressorSetCache(NULL);
+	pcm_cache_close(cache);
+	return failed > 0 ? 1 : 0;
+}
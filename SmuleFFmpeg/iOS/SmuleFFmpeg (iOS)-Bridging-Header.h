@@ -3,15 +3,25 @@
 //
 
 #include "MTapDelayEffect_c_bridge.h"
-
-void decompressAudioFile(const char* filePath);
+#include "ConvolutionEffect_c_bridge.h"
+#include "EffectChain_c_bridge.h"
+#include "Decompressor.h"
+#include "PcmBuffer.h"
+#include "PcmCache.h"
 
 // Audio File Player
 struct AudioFilePlayer_t* 	audio_file_player_init(void);
 int  audio_file_player_open(struct AudioFilePlayer_t* h, const char* filePath);
+int  audio_file_player_open_buffer(struct AudioFilePlayer_t* h, struct PcmBuffer_t* buffer);
 void audio_file_player_destroy(struct AudioFilePlayer_t* h);
 void audio_file_player_start(struct AudioFilePlayer_t* h);
 void audio_file_player_stop(struct AudioFilePlayer_t* h);
 void audio_file_player_pause(struct AudioFilePlayer_t* h);
 void audio_file_player_resume(struct AudioFilePlayer_t* h);
+int  audio_file_player_get_num_channels(struct AudioFilePlayer_t* h);
 void audio_file_player_register_filter(struct AudioFilePlayer_t* h, void* filter, void* user_data);
+
+// WAV files
+void*	read_wave_file_init(const char* file_path);
+void	read_wave_file_destroy(void* h);
+unsigned int read_wave_file_get_num_channels(void* h);